@@ -1,28 +1,22 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
-#include <cerrno>
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <fcntl.h>
 #include <memory>
-#include <string>
-#include <unistd.h>
-#include <sys/stat.h>
 #include <gromox/element_data.hpp>
 #include <gromox/endian.hpp>
 #include <gromox/ext_buffer.hpp>
-#include <gromox/fileio.h>
 #include <gromox/mapidefs.h>
-#include <gromox/paths.h>
 #include <gromox/proc_common.h>
+#include <gromox/propval.hpp>
 #include <gromox/util.hpp>
 #include "common_util.h"
 #include "emsmdb_interface.h"
 #include "ftstream_producer.h"
 #include "logon_object.h"
 
-using namespace std::string_literals;
 using namespace gromox;
 
 static void ftstream_producer_try_recode_nbp(FTSTREAM_PRODUCER *pstream) try
@@ -81,45 +75,81 @@ static void ftstream_producer_record_wsp(FTSTREAM_PRODUCER *pstream,
 	mlog(LV_WARN, "W-1604: ENOMEM");
 }
 
-static bool fxstream_producer_open(fxstream_producer &p)
-{
-	if (p.fd >= 0)
-		return true; /* already open */
-	auto path = LOCAL_DISK_TMPDIR;
-	p.fd = open_tmpfile(path, &p.path, O_RDWR | O_TRUNC);
-	if (p.fd >= 0)
-		return true;
-	mlog(LV_ERR, "E-1338: open{%s, %s}: %s", path, p.path.c_str(),
-	        strerror(errno));
-	return false;
-}
-
 static BOOL ftstream_producer_write_internal(
 	FTSTREAM_PRODUCER *pstream,
-	const void *pbuff, uint32_t size)
-{	
-	if (size >= FTSTREAM_PRODUCER_BUFFER_LENGTH
-		|| FTSTREAM_PRODUCER_BUFFER_LENGTH -
-		pstream->buffer_offset < size) {
-		if (!fxstream_producer_open(*pstream))
-			return false;
-		auto ret = write(pstream->fd, pstream->buffer, pstream->buffer_offset);
-		if (pstream->buffer_offset != 0 &&
-		    (ret < 0 || static_cast<size_t>(ret) != pstream->buffer_offset))
-			return FALSE;	
-		pstream->buffer_offset = 0;
-		pstream->read_offset = 0;
-	}
-	if (size >= FTSTREAM_PRODUCER_BUFFER_LENGTH) {
-		auto ret = write(pstream->fd, pbuff, size);
-		if (ret < 0 || static_cast<size_t>(ret) != size)
-			return FALSE;
-	} else {
-		memcpy(pstream->buffer + pstream->buffer_offset, pbuff, size);
-		pstream->buffer_offset += size;
+	const void *pbuff, uint32_t size) try
+{
+	auto src = static_cast<const uint8_t *>(pbuff);
+	while (size > 0) {
+		if (pstream->segs.empty() || pstream->segs.back().buf == nullptr ||
+		    pstream->segs.back().size == FTSTREAM_PRODUCER_CHUNK_LENGTH) {
+			fxstream_segment seg;
+			if (pstream->spare_chunk != nullptr)
+				seg.buf = std::move(pstream->spare_chunk);
+			else
+				seg.buf.reset(new uint8_t[FTSTREAM_PRODUCER_CHUNK_LENGTH]);
+			seg.data = seg.buf.get();
+			pstream->segs.push_back(std::move(seg));
+		}
+		auto &seg = pstream->segs.back();
+		auto n = std::min(size, FTSTREAM_PRODUCER_CHUNK_LENGTH - seg.size);
+		memcpy(&seg.buf[seg.size], src, n);
+		seg.size += n;
+		pstream->offset += n;
+		src += n;
+		size -= n;
 	}
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2818: ENOMEM");
+	return FALSE;
+}
+
+/*
+ * Emit @size bytes without copying them; the memory must stay valid until
+ * the stream has been drained (i.e. it belongs to an owned message copy).
+ */
+static BOOL ftstream_producer_write_extern(FTSTREAM_PRODUCER *pstream,
+    const void *pbuff, uint32_t size) try
+{
+	fxstream_segment seg;
+	seg.data = static_cast<const uint8_t *>(pbuff);
+	seg.size = size;
+	pstream->segs.push_back(std::move(seg));
 	pstream->offset += size;
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2829: ENOMEM");
+	return FALSE;
+}
+
+/* Hand out @size bytes from the front, recycling chunks once consumed. */
+static bool ftstream_producer_read_internal(FTSTREAM_PRODUCER *pstream,
+    void *pbuff, uint32_t size)
+{
+	auto dst = static_cast<uint8_t *>(pbuff);
+	while (size > 0) {
+		if (pstream->segs.empty())
+			return false;
+		auto &seg = pstream->segs.front();
+		if (pstream->seg_rd == seg.size) {
+			/* the last chunk may still be appended to */
+			if (pstream->segs.size() == 1)
+				return false;
+			if (seg.buf != nullptr)
+				pstream->spare_chunk = std::move(seg.buf);
+			pstream->segs.pop_front();
+			pstream->seg_rd = 0;
+			continue;
+		}
+		auto n = std::min(size, seg.size - pstream->seg_rd);
+		memcpy(dst, &seg.data[pstream->seg_rd], n);
+		pstream->seg_rd += n;
+		pstream->read_offset += n;
+		dst += n;
+		size -= n;
+	}
+	return true;
 }
 
 static BOOL ftstream_producer_write_uint16(
@@ -132,9 +162,9 @@ static BOOL ftstream_producer_write_uint16(
 	return TRUE;
 }
 
-BOOL ftstream_producer::write_uint32(uint32_t v)
+static BOOL ftstream_producer_write_uint32(
+	FTSTREAM_PRODUCER *pstream, uint32_t v)
 {
-	auto pstream = this;
 	v = cpu_to_le32(v);
 	if (!ftstream_producer_write_internal(pstream, &v, sizeof(v)))
 		return FALSE;
@@ -187,7 +217,7 @@ static BOOL ftstream_producer_write_wstring(
 	} else {
 		len = utf16_len;
 	}
-	if (!pstream->write_uint32(len)) {
+	if (!ftstream_producer_write_uint32(pstream, len)) {
 		free(pbuff);
 		return FALSE;
 	}
@@ -212,7 +242,7 @@ static BOOL ftstream_producer_write_string(
 	uint32_t position;
 	
 	len = strlen(pstr) + 1;
-	if (!pstream->write_uint32(len))
+	if (!ftstream_producer_write_uint32(pstream, len))
 		return FALSE;
 	position = pstream->offset;
 	if (!ftstream_producer_write_internal(pstream, pstr, len))
@@ -240,17 +270,22 @@ static BOOL ftstream_producer_write_guid(
 	return TRUE;
 }
 
-static BOOL ftstream_producer_write_binary(
-	FTSTREAM_PRODUCER *pstream, const BINARY *pbin)
+/* @b_ref: @pbin is part of an owned copy and may be referenced */
+static BOOL ftstream_producer_write_binary(FTSTREAM_PRODUCER *pstream,
+    const BINARY *pbin, bool b_ref = false)
 {
 	uint32_t position;
 	
-	if (!pstream->write_uint32(pbin->cb))
+	if (!ftstream_producer_write_uint32(pstream, pbin->cb))
 		return FALSE;
 	position = pstream->offset;
-	if (pbin->cb != 0 &&
-	    !ftstream_producer_write_internal(pstream, pbin->pb, pbin->cb))
+	if (b_ref && pbin->cb >= FTSTREAM_PRODUCER_CHUNK_LENGTH) {
+		if (!ftstream_producer_write_extern(pstream, pbin->pb, pbin->cb))
+			return FALSE;
+	} else if (pbin->cb != 0 &&
+	    !ftstream_producer_write_internal(pstream, pbin->pb, pbin->cb)) {
 		return FALSE;
+	}
 	if (pbin->cb >= FTSTREAM_PRODUCER_POINT_LENGTH) {
 		ftstream_producer_record_lvp(pstream, position, pbin->cb);
 	} else {
@@ -310,8 +345,8 @@ static int ftstream_producer_write_propdef(FTSTREAM_PRODUCER *pstream,
 	return 0;
 }
 
-static BOOL ftstream_producer_write_propvalue(
-	FTSTREAM_PRODUCER *pstream, TAGGED_PROPVAL *ppropval)
+static BOOL ftstream_producer_write_propvalue(FTSTREAM_PRODUCER *pstream,
+    TAGGED_PROPVAL *ppropval, bool b_ref = false)
 {
 	uint16_t propid;
 	uint16_t proptype;
@@ -380,7 +415,7 @@ static BOOL ftstream_producer_write_propvalue(
 		       *static_cast<uint16_t *>(ppropval->pvalue));
 	case PT_ERROR:
 	case PT_LONG:
-		return pstream->write_uint32(*static_cast<uint32_t *>(ppropval->pvalue));
+		return ftstream_producer_write_uint32(pstream, *static_cast<uint32_t *>(ppropval->pvalue));
 	case PT_FLOAT:
 		return ftstream_producer_write_float(pstream,
 		       *static_cast<float *>(ppropval->pvalue));
@@ -409,10 +444,11 @@ static BOOL ftstream_producer_write_propvalue(
 	*/
 	case PT_OBJECT:
 	case PT_BINARY:
-		return ftstream_producer_write_binary(pstream, static_cast<BINARY *>(ppropval->pvalue));
+		return ftstream_producer_write_binary(pstream,
+		       static_cast<BINARY *>(ppropval->pvalue), b_ref);
 	case PT_MV_SHORT: {
 		auto ar = static_cast<const SHORT_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(ar->count))
+		if (!ftstream_producer_write_uint32(pstream, ar->count))
 			return FALSE;
 		for (uint32_t i = 0; i < ar->count; ++i)
 			if (!ftstream_producer_write_uint16(pstream, ar->ps[i]))
@@ -421,10 +457,10 @@ static BOOL ftstream_producer_write_propvalue(
 	}
 	case PT_MV_LONG: {
 		auto ar = static_cast<const LONG_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(ar->count))
+		if (!ftstream_producer_write_uint32(pstream, ar->count))
 			return FALSE;
 		for (uint32_t i = 0; i < ar->count; ++i)
-			if (!pstream->write_uint32(ar->pl[i]))
+			if (!ftstream_producer_write_uint32(pstream, ar->pl[i]))
 				return FALSE;
 		return TRUE;
 	}
@@ -432,7 +468,7 @@ static BOOL ftstream_producer_write_propvalue(
 	case PT_MV_I8:
 	case PT_MV_SYSTIME: {
 		auto ar = static_cast<const LONGLONG_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(ar->count))
+		if (!ftstream_producer_write_uint32(pstream, ar->count))
 			return FALSE;
 		for (uint32_t i = 0; i < ar->count; ++i)
 			if (!ftstream_producer_write_uint64(pstream, ar->pll[i]))
@@ -441,7 +477,7 @@ static BOOL ftstream_producer_write_propvalue(
 	}
 	case PT_MV_FLOAT: {
 		auto fa = static_cast<FLOAT_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(fa->count))
+		if (!ftstream_producer_write_uint32(pstream, fa->count))
 			return false;
 		for (size_t i = 0; i < fa->count; ++i)
 			if (!ftstream_producer_write_float(pstream, fa->mval[i]))
@@ -451,7 +487,7 @@ static BOOL ftstream_producer_write_propvalue(
 	case PT_MV_DOUBLE:
 	case PT_MV_APPTIME: {
 		auto fa = static_cast<DOUBLE_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(fa->count))
+		if (!ftstream_producer_write_uint32(pstream, fa->count))
 			return false;
 		for (size_t i = 0; i < fa->count; ++i)
 			if (!ftstream_producer_write_double(pstream, fa->mval[i]))
@@ -460,7 +496,7 @@ static BOOL ftstream_producer_write_propvalue(
 	}
 	case PT_MV_STRING8: {
 		auto ar = static_cast<const STRING_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(ar->count))
+		if (!ftstream_producer_write_uint32(pstream, ar->count))
 			return FALSE;
 		for (uint32_t i = 0; i < ar->count; ++i)
 			if (!ftstream_producer_write_string(pstream, ar->ppstr[i]))
@@ -469,7 +505,7 @@ static BOOL ftstream_producer_write_propvalue(
 	}
 	case PT_MV_UNICODE: {
 		auto ar = static_cast<const STRING_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(ar->count))
+		if (!ftstream_producer_write_uint32(pstream, ar->count))
 			return FALSE;
 		for (uint32_t i = 0; i < ar->count; ++i)
 			if (!ftstream_producer_write_wstring(pstream, ar->ppstr[i]))
@@ -478,7 +514,7 @@ static BOOL ftstream_producer_write_propvalue(
 	}
 	case PT_MV_CLSID: {
 		auto ar = static_cast<const GUID_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(ar->count))
+		if (!ftstream_producer_write_uint32(pstream, ar->count))
 			return FALSE;
 		for (uint32_t i = 0; i < ar->count; ++i)
 			if (!ftstream_producer_write_guid(pstream, &ar->pguid[i]))
@@ -487,10 +523,10 @@ static BOOL ftstream_producer_write_propvalue(
 	}
 	case PT_MV_BINARY: {
 		auto ar = static_cast<const BINARY_ARRAY *>(ppropval->pvalue);
-		if (!pstream->write_uint32(ar->count))
+		if (!ftstream_producer_write_uint32(pstream, ar->count))
 			return FALSE;
 		for (uint32_t i = 0; i < ar->count; ++i)
-			if (!ftstream_producer_write_binary(pstream, &ar->pbin[i]))
+			if (!ftstream_producer_write_binary(pstream, &ar->pbin[i], b_ref))
 				return FALSE;
 		return TRUE;
 	}
@@ -498,147 +534,280 @@ static BOOL ftstream_producer_write_propvalue(
 	return FALSE;
 }
 
-BOOL ftstream_producer::write_proplist(const TPROPVAL_ARRAY *pproplist)
+static BOOL ftstream_producer_write_proplist(FTSTREAM_PRODUCER *pstream,
+    const TPROPVAL_ARRAY *pproplist)
 {
-	auto pstream = this;
-	int i;
-	
-	for (i=0; i<pproplist->count; i++) {
+	for (unsigned int i = 0; i < pproplist->count; ++i) {
 		if (!ftstream_producer_write_propvalue(pstream, &pproplist->ppropval[i]))
 			return FALSE;	
 	}
 	return TRUE;
 }
 
-static BOOL ftstream_producer_write_embeddedmessage(
-	FTSTREAM_PRODUCER *pstream, BOOL b_delprop,
-	const MESSAGE_CONTENT *pmessage)
-{
-	if (!pstream->write_uint32(STARTEMBED))
-		return FALSE;	
-	if (!pstream->write_messagecontent(b_delprop, pmessage))
-		return FALSE;	
-	if (!pstream->write_uint32(ENDEMBED))
-		return FALSE;	
-	return TRUE;
-}
-
-BOOL ftstream_producer::write_attachmentcontent(BOOL b_delprop,
-	const ATTACHMENT_CONTENT *pattachment)
-{
-	auto pstream = this;
-	if (!write_proplist(&pattachment->proplist))
-		return FALSE;	
-	if (NULL != pattachment->pembedded) {
-		if (!ftstream_producer_write_embeddedmessage(pstream,
-		    b_delprop, pattachment->pembedded))
-			return FALSE;	
-	}
-	return TRUE;
-}
-
 static BOOL ftstream_producer_write_recipient(
 	FTSTREAM_PRODUCER *pstream, const TPROPVAL_ARRAY *prcpt)
 {
-	if (!pstream->write_uint32(STARTRECIP))
+	if (!ftstream_producer_write_uint32(pstream, STARTRECIP))
 		return FALSE;
-	if (!pstream->write_proplist(prcpt))
+	if (!ftstream_producer_write_proplist(pstream, prcpt))
 		return FALSE;
-	if (!pstream->write_uint32(ENDTORECIP))
+	if (!ftstream_producer_write_uint32(pstream, ENDTORECIP))
 		return FALSE;
 	return TRUE;
 }
 
 static BOOL ftstream_producer_write_attachment(
 	FTSTREAM_PRODUCER *pstream, BOOL b_delprop,
-	const ATTACHMENT_CONTENT *pattachment)
-{
-	if (!pstream->write_uint32(NEWATTACH))
-		return FALSE;
-	if (!pstream->write_attachmentcontent(b_delprop, pattachment))
-		return FALSE;	
-	if (!pstream->write_uint32(ENDATTACH))
-		return FALSE;
-	return TRUE;
-}
+	const ATTACHMENT_CONTENT *pattachment);
 
-static BOOL ftstream_producer_write_messagechildren(
-	FTSTREAM_PRODUCER *pstream, BOOL b_delprop,
-	const MESSAGE_CHILDREN *pchildren)
+static BOOL ftstream_producer_write_messagecontent(FTSTREAM_PRODUCER *pstream,
+    BOOL b_delprop, const MESSAGE_CONTENT *pmessage)
 {
+	if (!ftstream_producer_write_proplist(pstream, &pmessage->proplist))
+		return FALSE;
+	const auto &children = pmessage->children;
 	if (b_delprop) {
-		if (!pstream->write_uint32(MetaTagFXDelProp))
+		if (!ftstream_producer_write_uint32(pstream, MetaTagFXDelProp))
 			return FALSE;
-		if (!pstream->write_uint32(PR_MESSAGE_RECIPIENTS))
+		if (!ftstream_producer_write_uint32(pstream, PR_MESSAGE_RECIPIENTS))
 			return FALSE;
 	}
-	if (NULL != pchildren->prcpts) {
-		for (size_t i = 0; i < pchildren->prcpts->count; ++i) {
+	if (children.prcpts != nullptr) {
+		for (size_t i = 0; i < children.prcpts->count; ++i) {
 			if (!ftstream_producer_write_recipient(pstream,
-			    pchildren->prcpts->pparray[i]))
+			    children.prcpts->pparray[i]))
 				return FALSE;
 		}
 	}
 	if (b_delprop) {
-		if (!pstream->write_uint32(MetaTagFXDelProp))
+		if (!ftstream_producer_write_uint32(pstream, MetaTagFXDelProp))
 			return FALSE;
-		if (!pstream->write_uint32(PR_MESSAGE_ATTACHMENTS))
+		if (!ftstream_producer_write_uint32(pstream, PR_MESSAGE_ATTACHMENTS))
 			return FALSE;
 	}
-	if (pchildren->pattachments == nullptr)
+	if (children.pattachments == nullptr)
 		return TRUE;
-	for (size_t i = 0; i < pchildren->pattachments->count; ++i) {
+	for (size_t i = 0; i < children.pattachments->count; ++i) {
 		if (!ftstream_producer_write_attachment(pstream,
-		    b_delprop, pchildren->pattachments->pplist[i]))
+		    b_delprop, children.pattachments->pplist[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOL ftstream_producer_write_attachment(
+	FTSTREAM_PRODUCER *pstream, BOOL b_delprop,
+	const ATTACHMENT_CONTENT *pattachment)
+{
+	if (!ftstream_producer_write_uint32(pstream, NEWATTACH))
+		return FALSE;
+	if (!ftstream_producer_write_proplist(pstream, &pattachment->proplist))
+		return FALSE;
+	if (pattachment->pembedded != nullptr) {
+		if (!ftstream_producer_write_uint32(pstream, STARTEMBED))
+			return FALSE;
+		if (!ftstream_producer_write_messagecontent(pstream,
+		    b_delprop, pattachment->pembedded))
+			return FALSE;
+		if (!ftstream_producer_write_uint32(pstream, ENDEMBED))
 			return FALSE;
 	}
+	if (!ftstream_producer_write_uint32(pstream, ENDATTACH))
+		return FALSE;
+	return TRUE;
+}
+
+/*
+ * The queue: message and attachment content is copied into the producer
+ * and flattened into a sequence of markers and property pointers, which
+ * read_buffer encodes as the client pulls.
+ */
+static uint32_t ftstream_producer_estimate(const TAGGED_PROPVAL &propval)
+{
+	return 2 * sizeof(uint16_t) +
+	       propval_size(PROP_TYPE(propval.proptag), propval.pvalue);
+}
+
+static void ftstream_producer_queue_tag(FTSTREAM_PRODUCER *pstream,
+    uint32_t tag)
+{
+	pstream->ops.emplace_back(tag, nullptr);
+	pstream->op_length += sizeof(uint32_t);
+}
+
+static void ftstream_producer_queue_proplist(FTSTREAM_PRODUCER *pstream,
+    const TPROPVAL_ARRAY *pproplist)
+{
+	for (unsigned int i = 0; i < pproplist->count; ++i) {
+		pstream->ops.emplace_back(0, &pproplist->ppropval[i]);
+		pstream->op_length += ftstream_producer_estimate(pproplist->ppropval[i]);
+	}
+}
+
+static void ftstream_producer_queue_messagecontent(FTSTREAM_PRODUCER *,
+    BOOL delprop, const MESSAGE_CONTENT *);
+
+static void ftstream_producer_queue_attachmentcontent(FTSTREAM_PRODUCER *pstream,
+    BOOL b_delprop, const ATTACHMENT_CONTENT *pattachment)
+{
+	ftstream_producer_queue_proplist(pstream, &pattachment->proplist);
+	if (pattachment->pembedded == nullptr)
+		return;
+	ftstream_producer_queue_tag(pstream, STARTEMBED);
+	ftstream_producer_queue_messagecontent(pstream, b_delprop,
+		pattachment->pembedded);
+	ftstream_producer_queue_tag(pstream, ENDEMBED);
+}
+
+static void ftstream_producer_queue_messagecontent(FTSTREAM_PRODUCER *pstream,
+    BOOL b_delprop, const MESSAGE_CONTENT *pmessage)
+{
+	const auto &children = pmessage->children;
+	ftstream_producer_queue_proplist(pstream, &pmessage->proplist);
+	if (b_delprop) {
+		ftstream_producer_queue_tag(pstream, MetaTagFXDelProp);
+		ftstream_producer_queue_tag(pstream, PR_MESSAGE_RECIPIENTS);
+	}
+	if (children.prcpts != nullptr) {
+		for (size_t i = 0; i < children.prcpts->count; ++i) {
+			ftstream_producer_queue_tag(pstream, STARTRECIP);
+			ftstream_producer_queue_proplist(pstream, children.prcpts->pparray[i]);
+			ftstream_producer_queue_tag(pstream, ENDTORECIP);
+		}
+	}
+	if (b_delprop) {
+		ftstream_producer_queue_tag(pstream, MetaTagFXDelProp);
+		ftstream_producer_queue_tag(pstream, PR_MESSAGE_ATTACHMENTS);
+	}
+	if (children.pattachments == nullptr)
+		return;
+	for (size_t i = 0; i < children.pattachments->count; ++i) {
+		ftstream_producer_queue_tag(pstream, NEWATTACH);
+		ftstream_producer_queue_attachmentcontent(pstream, b_delprop,
+			children.pattachments->pplist[i]);
+		ftstream_producer_queue_tag(pstream, ENDATTACH);
+	}
+}
+
+static const MESSAGE_CONTENT *ftstream_producer_own(FTSTREAM_PRODUCER *pstream,
+    const MESSAGE_CONTENT *pmessage)
+{
+	std::unique_ptr<MESSAGE_CONTENT, mc_delete> msg(message_content_dup(pmessage));
+	if (msg == nullptr)
+		return nullptr;
+	pstream->owned_msgs.push_back(std::move(msg));
+	return pstream->owned_msgs.back().get();
+}
+
+static BOOL ftstream_producer_encode_op(FTSTREAM_PRODUCER *pstream)
+{
+	auto [tag, ppropval] = pstream->ops.front();
+	pstream->ops.pop_front();
+	if (ppropval == nullptr) {
+		pstream->op_length -= std::min(pstream->op_length,
+		                      static_cast<uint32_t>(sizeof(uint32_t)));
+		return ftstream_producer_write_uint32(pstream, tag);
+	}
+	pstream->op_length -= std::min(pstream->op_length,
+	                      ftstream_producer_estimate(*ppropval));
+	/* string conversion replaces pvalue; keep the owned copy intact */
+	auto propval = *ppropval;
+	return ftstream_producer_write_propvalue(pstream, &propval, true);
+}
+
+/* Encode whatever is still queued, ahead of output the caller owns. */
+static BOOL ftstream_producer_flush(FTSTREAM_PRODUCER *pstream)
+{
+	while (pstream->ops.size() > 0)
+		if (!ftstream_producer_encode_op(pstream))
+			return FALSE;
 	return TRUE;
 }
 
+BOOL ftstream_producer::write_uint32(uint32_t v) try
+{
+	if (ops.empty())
+		return ftstream_producer_write_uint32(this, v);
+	ftstream_producer_queue_tag(this, v);
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2830: ENOMEM");
+	return FALSE;
+}
+
+BOOL ftstream_producer::write_proplist(const TPROPVAL_ARRAY *pproplist)
+{
+	if (!ftstream_producer_flush(this))
+		return FALSE;
+	return ftstream_producer_write_proplist(this, pproplist);
+}
+
+BOOL ftstream_producer::write_attachmentcontent(BOOL b_delprop,
+	const ATTACHMENT_CONTENT *pattachment) try
+{
+	std::unique_ptr<ATTACHMENT_CONTENT, fxstream_attachment_delete>
+		att(attachment_content_dup(deconst(pattachment)));
+	if (att == nullptr)
+		return FALSE;
+	owned_atts.push_back(std::move(att));
+	ftstream_producer_queue_attachmentcontent(this, b_delprop,
+		owned_atts.back().get());
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2831: ENOMEM");
+	return FALSE;
+}
+
 BOOL ftstream_producer::write_messagecontent(BOOL b_delprop,
-	const MESSAGE_CONTENT *pmessage)
+	const MESSAGE_CONTENT *pmessage) try
 {	
-	auto pstream = this;
-	if (!write_proplist(&pmessage->proplist))
-		return FALSE;	
-	return ftstream_producer_write_messagechildren(
-			pstream, b_delprop, &pmessage->children);
+	auto msg = ftstream_producer_own(this, pmessage);
+	if (msg == nullptr)
+		return FALSE;
+	ftstream_producer_queue_messagecontent(this, b_delprop, msg);
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2832: ENOMEM");
+	return FALSE;
 }
 
-BOOL ftstream_producer::write_message(const MESSAGE_CONTENT *pmessage)
+BOOL ftstream_producer::write_message(const MESSAGE_CONTENT *pmessage) try
 {
 	auto pbool = pmessage->proplist.get<uint8_t>(PR_ASSOCIATED);
 	uint32_t marker = pbool == nullptr || *pbool == 0 ? STARTMESSAGE : STARTFAIMSG;
-	if (!write_uint32(marker))
-		return FALSE;
-	if (!write_messagecontent(false, pmessage))
-		return FALSE;	
-	if (!write_uint32(ENDMESSAGE))
+	auto msg = ftstream_producer_own(this, pmessage);
+	if (msg == nullptr)
 		return FALSE;
+	ftstream_producer_queue_tag(this, marker);
+	ftstream_producer_queue_messagecontent(this, false, msg);
+	ftstream_producer_queue_tag(this, ENDMESSAGE);
 	return TRUE;
-}	
-
-static BOOL ftstream_producer_write_messagechangeheader(
-	FTSTREAM_PRODUCER *pstream,	const TPROPVAL_ARRAY *pheader)
-{
-	return pstream->write_proplist(pheader);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2833: ENOMEM");
+	return FALSE;
 }
 
 BOOL ftstream_producer::write_messagechangefull(
 	const TPROPVAL_ARRAY *pchgheader,
-	MESSAGE_CONTENT *pmessage)
+	MESSAGE_CONTENT *pmessage) try
 {
 	auto pstream = this;
-	if (!write_uint32(INCRSYNCCHG))
+	if (!ftstream_producer_flush(pstream))
 		return FALSE;
-	if (!ftstream_producer_write_messagechangeheader(pstream, pchgheader))
-		return FALSE;	
-	if (!write_uint32(INCRSYNCMESSAGE))
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCCHG))
 		return FALSE;
-	if (!write_proplist(&pmessage->proplist))
+	if (!ftstream_producer_write_proplist(pstream, pchgheader))
 		return FALSE;	
-	return ftstream_producer_write_messagechildren(
-				pstream, TRUE, &pmessage->children);
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCMESSAGE))
+		return FALSE;
+	auto msg = ftstream_producer_own(pstream, pmessage);
+	if (msg == nullptr)
+		return FALSE;
+	ftstream_producer_queue_messagecontent(pstream, TRUE, msg);
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2834: ENOMEM");
+	return FALSE;
 }
 
 static BOOL ftstream_producer_write_groupinfo(
@@ -650,10 +819,10 @@ static BOOL ftstream_producer_write_groupinfo(
 	uint32_t name_size;
 	PROPERTY_NAME propname;
 	
-	if (!pstream->write_uint32(INCRSYNCGROUPINFO))
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCGROUPINFO))
 		return FALSE;
 	/* 0x00000102 is the only proptag in proplist */
-	if (!pstream->write_uint32(PT_BINARY) ||
+	if (!ftstream_producer_write_uint32(pstream, PT_BINARY) ||
 	    !ext_push.init(nullptr, 0, EXT_FLAG_UTF16) ||
 	    ext_push.p_uint32(pginfo->group_id) != EXT_ERR_SUCCESS ||
 	    ext_push.p_uint32(pginfo->reserved) != EXT_ERR_SUCCESS ||
@@ -708,20 +877,22 @@ BOOL ftstream_producer::write_messagechangepartial(
 {
 	auto pstream = this;
 	
+	if (!ftstream_producer_flush(pstream))
+		return FALSE;
 	if (!ftstream_producer_write_groupinfo(pstream, pmsg->pgpinfo))
 		return FALSE;
-	if (!write_uint32(MetaTagIncrSyncGroupId))
+	if (!ftstream_producer_write_uint32(pstream, MetaTagIncrSyncGroupId))
 		return FALSE;
-	if (!write_uint32(pmsg->group_id))
+	if (!ftstream_producer_write_uint32(pstream, pmsg->group_id))
 		return FALSE;	
-	if (!write_uint32(INCRSYNCCHGPARTIAL))
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCCHGPARTIAL))
 		return FALSE;
-	if (!ftstream_producer_write_messagechangeheader(pstream, pchgheader))
+	if (!ftstream_producer_write_proplist(pstream, pchgheader))
 		return FALSE;	
 	for (size_t i = 0; i < pmsg->count; ++i) {
-		if (!write_uint32(MetaTagIncrementalSyncMessagePartial))
+		if (!ftstream_producer_write_uint32(pstream, MetaTagIncrementalSyncMessagePartial))
 			return FALSE;
-		if (!write_uint32(pmsg->pchanges[i].index))
+		if (!ftstream_producer_write_uint32(pstream, pmsg->pchanges[i].index))
 			return FALSE;	
 		for (size_t j = 0; j < pmsg->pchanges[i].proplist.count; ++j) {
 			switch(pmsg->pchanges[i].proplist.ppropval[j].proptag) {
@@ -729,9 +900,9 @@ BOOL ftstream_producer::write_messagechangepartial(
 				if (NULL == pmsg->children.prcpts) {
 					break;
 				}
-				if (!write_uint32(MetaTagFXDelProp))
+				if (!ftstream_producer_write_uint32(pstream, MetaTagFXDelProp))
 					return FALSE;
-				if (!write_uint32(PR_MESSAGE_RECIPIENTS))
+				if (!ftstream_producer_write_uint32(pstream, PR_MESSAGE_RECIPIENTS))
 					return FALSE;
 				for (size_t k = 0; k < pmsg->children.prcpts->count; ++k) {
 					if (!ftstream_producer_write_recipient(pstream,
@@ -743,9 +914,9 @@ BOOL ftstream_producer::write_messagechangepartial(
 				if (NULL == pmsg->children.pattachments) {
 					break;
 				}
-				if (!write_uint32(MetaTagFXDelProp))
+				if (!ftstream_producer_write_uint32(pstream, MetaTagFXDelProp))
 					return FALSE;
-				if (!write_uint32(PR_MESSAGE_ATTACHMENTS))
+				if (!ftstream_producer_write_uint32(pstream, PR_MESSAGE_ATTACHMENTS))
 					return FALSE;
 				for (size_t k = 0; k < pmsg->children.pattachments->count; ++k) {
 					if (!ftstream_producer_write_attachment(pstream,
@@ -768,25 +939,31 @@ static BOOL ftstream_producer_write_folderchange(
 	FTSTREAM_PRODUCER *pstream,
 	const TPROPVAL_ARRAY *pproplist)
 {
-	if (!pstream->write_uint32(INCRSYNCCHG))
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCCHG))
 		return FALSE;
-	return pstream->write_proplist(pproplist);
+	return ftstream_producer_write_proplist(pstream, pproplist);
 }
 
 BOOL ftstream_producer::write_deletions(const TPROPVAL_ARRAY *pproplist)
 {
-	if (!write_uint32(INCRSYNCDEL))
+	auto pstream = this;
+	if (!ftstream_producer_flush(pstream))
+		return FALSE;
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCDEL))
 		return FALSE;
-	return write_proplist(pproplist);
+	return ftstream_producer_write_proplist(pstream, pproplist);
 }
 
 BOOL ftstream_producer::write_state(const TPROPVAL_ARRAY *pproplist)
 {
-	if (!write_uint32(INCRSYNCSTATEBEGIN))
+	auto pstream = this;
+	if (!ftstream_producer_flush(pstream))
+		return FALSE;
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCSTATEBEGIN))
 		return FALSE;
-	if (!write_proplist(pproplist))
+	if (!ftstream_producer_write_proplist(pstream, pproplist))
 		return FALSE;
-	if (!write_uint32(INCRSYNCSTATEEND))
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCSTATEEND))
 		return FALSE;
 	return TRUE;
 }
@@ -794,13 +971,15 @@ BOOL ftstream_producer::write_state(const TPROPVAL_ARRAY *pproplist)
 BOOL ftstream_producer::write_progresspermessage(const PROGRESS_MESSAGE *pprogmsg)
 {
 	auto pstream = this;
-	if (!write_uint32(INCRSYNCPROGRESSPERMSG))
+	if (!ftstream_producer_flush(pstream))
+		return FALSE;
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCPROGRESSPERMSG))
 		return FALSE;
-	if (!write_uint32(PT_LONG))
+	if (!ftstream_producer_write_uint32(pstream, PT_LONG))
 		return FALSE;
-	if (!write_uint32(pprogmsg->message_size))
+	if (!ftstream_producer_write_uint32(pstream, pprogmsg->message_size))
 		return FALSE;	
-	if (!write_uint32(PT_BOOLEAN))
+	if (!ftstream_producer_write_uint32(pstream, PT_BOOLEAN))
 		return FALSE;
 	uint16_t b_fai = !!pprogmsg->b_fai;
 	if (!ftstream_producer_write_uint16(pstream, b_fai))
@@ -816,24 +995,26 @@ BOOL ftstream_producer::write_progresstotal(const PROGRESS_INFORMATION *pprogtot
 	 * https://docs.microsoft.com/en-us/outlook/troubleshoot/synchronization/status-bar-never-shows-more-than-3-99-gb
 	 */
 	auto pstream = this;
-	if (!write_uint32(INCRSYNCPROGRESSMODE))
+	if (!ftstream_producer_flush(pstream))
 		return FALSE;
-	if (!write_uint32(PT_BINARY))
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCPROGRESSMODE))
+		return FALSE;
+	if (!ftstream_producer_write_uint32(pstream, PT_BINARY))
 		return FALSE;
 	/* binary length */
-	if (!write_uint32(32))
+	if (!ftstream_producer_write_uint32(pstream, 32))
 		return FALSE;
 	if (!ftstream_producer_write_uint16(pstream, pprogtotal->version))
 		return FALSE;
 	if (!ftstream_producer_write_uint16(pstream, pprogtotal->padding1))
 		return FALSE;
-	if (!write_uint32(pprogtotal->fai_count))
+	if (!ftstream_producer_write_uint32(pstream, pprogtotal->fai_count))
 		return FALSE;
 	if (!ftstream_producer_write_uint64(pstream, pprogtotal->fai_size))
 		return FALSE;
-	if (!write_uint32(pprogtotal->normal_count))
+	if (!ftstream_producer_write_uint32(pstream, pprogtotal->normal_count))
 		return FALSE;
-	if (!write_uint32(pprogtotal->padding2))
+	if (!ftstream_producer_write_uint32(pstream, pprogtotal->padding2))
 		return FALSE;
 	return ftstream_producer_write_uint64(
 			pstream, pprogtotal->normal_size);
@@ -841,9 +1022,12 @@ BOOL ftstream_producer::write_progresstotal(const PROGRESS_INFORMATION *pprogtot
 
 BOOL ftstream_producer::write_readstatechanges(const TPROPVAL_ARRAY *pproplist)
 {
-	if (!write_uint32(INCRSYNCREAD))
+	auto pstream = this;
+	if (!ftstream_producer_flush(pstream))
+		return FALSE;
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCREAD))
 		return FALSE;
-	return write_proplist(pproplist);
+	return ftstream_producer_write_proplist(pstream, pproplist);
 }
 
 BOOL ftstream_producer::write_hierarchysync(
@@ -852,6 +1036,8 @@ BOOL ftstream_producer::write_hierarchysync(
 	const TPROPVAL_ARRAY *pstate)
 {
 	auto pstream = this;
+	if (!ftstream_producer_flush(pstream))
+		return FALSE;
 	for (size_t i = 0; i < pfldchgs->count; ++i) {
 		if (!ftstream_producer_write_folderchange(pstream,
 		    &pfldchgs->pfldchgs[i]))
@@ -861,7 +1047,7 @@ BOOL ftstream_producer::write_hierarchysync(
 		return FALSE;
 	if (!write_state(pstate))
 		return FALSE;
-	if (!write_uint32(INCRSYNCEND))
+	if (!ftstream_producer_write_uint32(pstream, INCRSYNCEND))
 		return FALSE;
 	return TRUE;
 }
@@ -869,11 +1055,6 @@ BOOL ftstream_producer::write_hierarchysync(
 std::unique_ptr<ftstream_producer>
 ftstream_producer::create(logon_object *plogon, uint8_t string_option) try
 {
-	auto path = LOCAL_DISK_TMPDIR;
-	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
-		mlog(LV_ERR, "E-1422: mkdir %s: %s", path, strerror(errno));
-		return nullptr;
-	}
 	std::unique_ptr<ftstream_producer> pstream(new ftstream_producer);
 	pstream->plogon = plogon;
 	pstream->string_option = string_option;
@@ -883,39 +1064,24 @@ ftstream_producer::create(logon_object *plogon, uint8_t string_option) try
 	return nullptr;
 }
 
-fxstream_producer::~fxstream_producer()
-{
-	auto pstream = this;
-	if (pstream->fd < 0)
-		return;
-	close(pstream->fd);
-	if (pstream->path.size() > 0 && remove(pstream->path.c_str()) < 0 &&
-	    errno != ENOENT)
-		mlog(LV_WARN, "W-1371: remove %s: %s", pstream->path.c_str(), strerror(errno));
-}
-
 BOOL ftstream_producer::read_buffer(void *pbuff, uint16_t *plen, BOOL *pb_last)
 {
 	auto pstream = this;
-	uint32_t cur_offset;
 	
-	if (!pstream->b_read) {
-		auto pnode = pstream->bp_list.rbegin();
-		if (pnode == pstream->bp_list.rend() ||
-		    pnode->offset != pstream->offset)
-			ftstream_producer_record_nbp(pstream, pstream->offset);
-		pstream->b_read = TRUE;
-		if (-1 != pstream->fd) {
-			auto ret = write(pstream->fd, pstream->buffer, pstream->buffer_offset);
-			if (pstream->buffer_offset != 0 &&
-			    (ret < 0 || static_cast<size_t>(ret) != pstream->buffer_offset))
-				return FALSE;
-			lseek(pstream->fd, 0, SEEK_SET);
-		}
-		cur_offset = 0;
-	} else {
-		cur_offset = pstream->fd != -1 ? lseek(pstream->fd, 0, SEEK_CUR) : pstream->read_offset;
-	}
+	/*
+	 * Encode just enough of the queue to fill this request. Queue items
+	 * end on property boundaries, so the end of the encoded output is
+	 * always a valid break point.
+	 */
+	while (pstream->ops.size() > 0 &&
+	    pstream->offset - pstream->read_offset <= *plen)
+		if (!ftstream_producer_encode_op(pstream))
+			return FALSE;
+	auto plast = pstream->bp_list.rbegin();
+	if (plast == pstream->bp_list.rend() ||
+	    plast->offset != pstream->offset)
+		ftstream_producer_record_nbp(pstream, pstream->offset);
+	uint32_t cur_offset = pstream->read_offset;
 	for (auto pnode = pstream->bp_list.begin();
 	     pnode != pstream->bp_list.end(); ++pnode) {
 		auto ppoint = &*pnode;
@@ -942,14 +1108,8 @@ BOOL ftstream_producer::read_buffer(void *pbuff, uint16_t *plen, BOOL *pb_last)
 			}
 		}
 		pstream->bp_list.erase(pstream->bp_list.begin(), pnode);
-		if (-1 != pstream->fd) {
-			if (*plen != read(pstream->fd, pbuff, *plen)) {
-				return FALSE;
-			}
-		} else {
-			memcpy(pbuff, pstream->buffer + pstream->read_offset, *plen);
-			pstream->read_offset += *plen;
-		}
+		if (!ftstream_producer_read_internal(pstream, pbuff, *plen))
+			return FALSE;
 		*pb_last = FALSE;
 		return TRUE;
 	}
@@ -961,25 +1121,18 @@ BOOL ftstream_producer::read_buffer(void *pbuff, uint16_t *plen, BOOL *pb_last)
 	}
 	*plen = ppoint->offset - cur_offset;
 	pstream->bp_list.clear();
-	if (-1 != pstream->fd) {
-		if (*plen != read(pstream->fd, pbuff, *plen)) {
-			return FALSE;
-		}
-	} else {
-		memcpy(pbuff, pstream->buffer + pstream->read_offset, *plen);
-		pstream->read_offset += *plen;
-	}
+	if (!ftstream_producer_read_internal(pstream, pbuff, *plen))
+		return FALSE;
 	*pb_last = TRUE;
-	if (-1 != pstream->fd) {
-		close(pstream->fd);
-		pstream->fd = -1;
-		if (remove(pstream->path.c_str()) < 0 && errno != ENOENT)
-			mlog(LV_WARN, "W-1340: remove: %s: %s",
-			        pstream->path.c_str(), strerror(errno));
-	}
+	for (auto &seg : pstream->segs)
+		if (seg.buf != nullptr && pstream->spare_chunk == nullptr)
+			pstream->spare_chunk = std::move(seg.buf);
+	pstream->segs.clear();
+	pstream->seg_rd = 0;
+	pstream->owned_msgs.clear();
+	pstream->owned_atts.clear();
+	pstream->op_length = 0;
 	pstream->offset = 0;
-	pstream->buffer_offset = 0;
 	pstream->read_offset = 0;
-	pstream->b_read = FALSE;
 	return TRUE;
 }
@@ -1,22 +1,22 @@
 #pragma once
 #include <cstdint>
+#include <deque>
 #include <list>
 #include <memory>
-#include <string>
-#include <sys/types.h>
+#include <utility>
+#include <vector>
 #include <gromox/double_list.hpp>
+#include <gromox/element_data.hpp>
 #include <gromox/mapi_types.hpp>
 #define FTSTREAM_PRODUCER_POINT_LENGTH			1024
-#define FTSTREAM_PRODUCER_BUFFER_LENGTH			4*1024*1024
+#define FTSTREAM_PRODUCER_CHUNK_LENGTH			0x10000U
 #define STRING_OPTION_NONE						0x00
 #define STRING_OPTION_UNICODE					0x01
 #define STRING_OPTION_CPID						0x02
 #define STRING_OPTION_FORCE_UNICODE				0x08
 
-struct ATTACHMENT_CONTENT;
 struct FOLDER_CHANGES;
 struct logon_object;
-struct MESSAGE_CONTENT;
 struct MSGCHG_PARTIAL;
 struct PROGRESS_INFORMATION;
 struct PROGRESS_MESSAGE;
@@ -30,15 +30,32 @@ struct point_node {
 	uint32_t offset;
 };
 
+/*
+ * A piece of encoded output: either a chunk owned by the producer, or a
+ * large binary value that is passed through from the owned message copy.
+ */
+struct fxstream_segment {
+	std::unique_ptr<uint8_t[]> buf;
+	const uint8_t *data = nullptr;
+	uint32_t size = 0;
+};
+
+/* marker (when the propval pointer is nullptr) or property to encode */
+using fxstream_op = std::pair<uint32_t, const TAGGED_PROPVAL *>;
+
+struct fxstream_attachment_delete {
+	inline void operator()(ATTACHMENT_CONTENT *x) const { attachment_content_free(x); }
+};
+
 struct fxstream_producer {
 	protected:
 	fxstream_producer() = default;
 	NOMOVE(fxstream_producer);
 
 	public:
-	~fxstream_producer();
 	static std::unique_ptr<fxstream_producer> create(logon_object *, uint8_t string_option);
-	inline int total_length() const { return offset; }
+	/* encoded bytes not yet read, plus an estimate for the queued items */
+	inline int total_length() const { return offset - read_offset + op_length; }
 	BOOL read_buffer(void *buf, uint16_t *len, BOOL *last);
 	BOOL write_uint32(uint32_t);
 	BOOL write_proplist(const TPROPVAL_ARRAY *);
@@ -54,15 +71,25 @@ struct fxstream_producer {
 	BOOL write_state(const TPROPVAL_ARRAY *);
 	BOOL write_hierarchysync(const FOLDER_CHANGES *fldchgs, const TPROPVAL_ARRAY *del, const TPROPVAL_ARRAY *state);
 
-	int type = 0, fd = -1;
-	uint32_t offset = 0;
-	std::string path;
-	uint8_t buffer[FTSTREAM_PRODUCER_BUFFER_LENGTH]{};
-	uint32_t buffer_offset = 0, read_offset = 0;
+	int type = 0;
+	/*
+	 * Messages and attachments are not encoded when written. The
+	 * producer keeps its own copy of the content and a queue of the
+	 * markers and properties still to be emitted (@ops), and read_buffer
+	 * encodes from the front of that queue only as much as one GetBuffer
+	 * request needs. Large binary values are not copied into the output
+	 * chunks at all, but referenced from the owned copy.
+	 */
+	std::deque<fxstream_segment> segs;
+	std::unique_ptr<uint8_t[]> spare_chunk;
+	uint32_t seg_rd = 0;
+	std::deque<fxstream_op> ops;
+	std::vector<std::unique_ptr<MESSAGE_CONTENT, gromox::mc_delete>> owned_msgs;
+	std::vector<std::unique_ptr<ATTACHMENT_CONTENT, fxstream_attachment_delete>> owned_atts;
+	uint32_t op_length = 0, offset = 0, read_offset = 0;
 	uint8_t string_option = 0;
 	logon_object *plogon = nullptr; /* plogon is a protected member */
 	std::list<point_node> bp_list;
-	BOOL b_read = false;
 };
 using FTSTREAM_PRODUCER = fxstream_producer;
 using ftstream_producer = fxstream_producer;
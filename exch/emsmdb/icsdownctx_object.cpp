@@ -38,6 +38,8 @@ enum {
 };
 
 #define MAX_PARTIAL_ON_ROP		100	/* for limit of memory accumulation */
+#define MAX_PREFETCH_MESSAGES	64
+#define PREFETCH_SIZE_LIMIT		(4U << 20) /* by PR_MESSAGE_SIZE */
 
 bool ics_flow_list::record_node(uint8_t func_id, const void *param) try
 {
@@ -876,6 +878,89 @@ static void icsdownctx_object_trim_report_recipients(
 	}
 }
 
+static BOOL icsdownctx_object_pull_prefetched(const std::string &data,
+    MESSAGE_CONTENT **ppmsgctnt)
+{
+	if (data.empty()) {
+		*ppmsgctnt = nullptr;
+		return TRUE;
+	}
+	EXT_PULL ext_pull;
+	auto pmsgctnt = cu_alloc<MESSAGE_CONTENT>();
+	if (pmsgctnt == nullptr)
+		return FALSE;
+	ext_pull.init(data.data(), data.size(), common_util_alloc, EXT_FLAG_WCOUNT);
+	if (ext_pull.g_msgctnt(pmsgctnt) != EXT_ERR_SUCCESS)
+		return FALSE;
+	*ppmsgctnt = pmsgctnt;
+	return TRUE;
+}
+
+/**
+ * Read @message_id. Instead of one exmdb round trip per message, the
+ * message IDs queued directly behind it in flow_list are fetched in the same
+ * read_messages call. Results beyond the first are kept in serialized form,
+ * since everything allocated here only lives until the ROP finishes.
+ */
+static BOOL icsdownctx_object_read_message(icsdownctx_object *pctx,
+    uint64_t message_id, MESSAGE_CONTENT **ppmsgctnt)
+{
+	auto pinfo = emsmdb_interface_get_emsmdb_info();
+	auto dir = pctx->pstream->plogon->get_dir();
+	const char *username = nullptr;
+	if (!pctx->pstream->plogon->is_private())
+		username = get_rpc_info().username;
+	if (!pctx->prefetch.empty()) {
+		if (pctx->prefetch.front().first == message_id) {
+			auto data = std::move(pctx->prefetch.front().second);
+			pctx->prefetch.pop_front();
+			return icsdownctx_object_pull_prefetched(data, ppmsgctnt);
+		}
+		pctx->prefetch.clear();
+	}
+	uint64_t id_buff[MAX_PREFETCH_MESSAGES];
+	EID_ARRAY ids = {0, id_buff};
+	id_buff[ids.count++] = message_id;
+	for (const auto &[func_id, pparam] : pctx->flow_list) {
+		if (ids.count >= MAX_PREFETCH_MESSAGES ||
+		    (func_id != FUNC_ID_UPDATED_MESSAGE &&
+		    func_id != FUNC_ID_NEW_MESSAGE))
+			break;
+		id_buff[ids.count++] = *static_cast<const uint64_t *>(pparam);
+	}
+	uint32_t count = 0;
+	MESSAGE_CONTENT **pmsgctnts = nullptr;
+	if (!pctx->b_prefetch || ids.count == 1)
+		return exmdb_client::read_message(dir, username,
+		       pinfo->cpid, message_id, ppmsgctnt);
+	if (!exmdb_client::read_messages(dir, username, pinfo->cpid, &ids,
+	    PREFETCH_SIZE_LIMIT, &count, &pmsgctnts) || count == 0) {
+		/* e.g. a remote exmdb server predating read_messages */
+		pctx->b_prefetch = false;
+		return exmdb_client::read_message(dir, username,
+		       pinfo->cpid, message_id, ppmsgctnt);
+	}
+	try {
+		for (uint32_t i = 1; i < count; ++i) {
+			std::string data;
+			if (pmsgctnts[i] != nullptr) {
+				EXT_PUSH ext_push;
+				if (!ext_push.init(nullptr, 0, EXT_FLAG_WCOUNT) ||
+				    ext_push.p_msgctnt(*pmsgctnts[i]) != EXT_ERR_SUCCESS)
+					break;
+				data.assign(reinterpret_cast<const char *>(ext_push.m_udata),
+				            ext_push.m_offset);
+			}
+			pctx->prefetch.emplace_back(ids.pids[i], std::move(data));
+		}
+	} catch (const std::bad_alloc &) {
+		/* the queue stays a valid prefix; the rest is read again later */
+		mlog(LV_ERR, "E-2803: ENOMEM");
+	}
+	*ppmsgctnt = pmsgctnts[0];
+	return TRUE;
+}
+
 static BOOL icsdownctx_object_write_message_change(icsdownctx_object *pctx,
 	uint64_t message_id, BOOL b_downloaded, int *ppartial_count)
 {
@@ -894,18 +979,9 @@ static BOOL icsdownctx_object_write_message_change(icsdownctx_object *pctx,
 	static constexpr uint8_t fake_true = 1;
 	static constexpr uint8_t fake_false = 0;
 	
-	auto pinfo = emsmdb_interface_get_emsmdb_info();
 	auto dir = pctx->pstream->plogon->get_dir();
-	if (pctx->pstream->plogon->is_private()) {
-		if (!exmdb_client::read_message(dir,
-		    nullptr, pinfo->cpid, message_id, &pmsgctnt))
-			return FALSE;
-	} else {
-		auto rpc_info = get_rpc_info();
-		if (!exmdb_client::read_message(dir,
-		    rpc_info.username, pinfo->cpid, message_id, &pmsgctnt))
-			return FALSE;
-	}
+	if (!icsdownctx_object_read_message(pctx, message_id, &pmsgctnt))
+		return FALSE;
 	if (NULL == pmsgctnt) {
 		pctx->pstate->pgiven->remove(message_id);
 		if (b_downloaded) {
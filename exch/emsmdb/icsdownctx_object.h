@@ -1,7 +1,10 @@
 #pragma once
 #include <cstdint>
+#include <deque>
 #include <list>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 #include <gromox/element_data.hpp>
 #include <gromox/mapi_types.hpp>
@@ -55,4 +58,7 @@ struct icsdownctx_object final {
 	RESTRICTION *prestriction = nullptr;
 	uint64_t total_steps = 0, progress_steps = 0, next_progress_steps = 0;
 	uint64_t ratio = 0;
+	/* messages read ahead of flow_list, serialized; empty = no longer exists */
+	std::deque<std::pair<uint64_t, std::string>> prefetch;
+	bool b_prefetch = true;
 };
@@ -3043,7 +3043,9 @@ int rop_ext_pull_rop_buffer(EXT_PULL *pext, ROP_BUFFER *r)
 	} else {
 		memcpy(pbuff, pdata, rpc_header_ext.size_actual);
 	}
-	subext.init(pbuff, rpc_header_ext.size_actual, common_util_alloc, EXT_FLAG_UTF16);
+	/* pbuff is on the same allocator as the requests, so they may borrow */
+	subext.init(pbuff, rpc_header_ext.size_actual, common_util_alloc,
+		EXT_FLAG_UTF16 | EXT_FLAG_BORROW);
 	TRY(subext.g_uint16(&size));
 	while (subext.m_offset < size) {
 		pnode = pext->anew<DOUBLE_LIST_NODE>();
@@ -17,8 +17,11 @@
 #include <string>
 #include <unistd.h>
 #include <libHX/string.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <gromox/cryptoutil.hpp>
 #include <gromox/database.h>
 #include <gromox/defs.h>
 #include <gromox/endian.hpp>
@@ -2626,6 +2629,75 @@ static BOOL common_util_set_message_subject(
 	return TRUE;
 }
 
+/*
+ * Single-instance storage: cid files with at least CID_DEDUP_MIN bytes of
+ * content are registered in cid_hashes (schema EV-8/EB-7 onwards), keyed by
+ * SHA-256 over a storage-kind byte and the content, so that a later write of
+ * the same payload just references the existing cid. The property rows are
+ * the references. gromox-cleaner drops the cid_hashes entries of files it
+ * found unreferenced in a short write transaction and recounts references
+ * after that before removing anything. The lookup and the new reference
+ * therefore go into one transaction: if the cleaner commits in between,
+ * writing the reference fails (busy/stale snapshot) instead of pointing at
+ * a removed file.
+ */
+static constexpr size_t CID_DEDUP_MIN = 4096;
+
+static bool cu_cid_digest(sqlite3 *psqlite, char kind, const void *data,
+    size_t len, uint8_t *md)
+{
+	if (len < CID_DEDUP_MIN ||
+	    sqlite3_table_column_metadata(psqlite, nullptr, "cid_hashes",
+	    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr) != SQLITE_OK)
+		return false;
+	std::unique_ptr<EVP_MD_CTX, sslfree> ctx(EVP_MD_CTX_new());
+	return ctx != nullptr &&
+	       EVP_DigestInit(ctx.get(), EVP_sha256()) > 0 &&
+	       EVP_DigestUpdate(ctx.get(), &kind, 1) > 0 &&
+	       EVP_DigestUpdate(ctx.get(), data, len) > 0 &&
+	       EVP_DigestFinal(ctx.get(), md, nullptr) > 0;
+}
+
+/**
+ * Look up an existing cid file by digest. A file that is gone (because
+ * gromox-cleaner got to it) counts as a miss. Its mtime is refreshed so
+ * that the cleaner's age cutoff keeps treating it as recently used.
+ */
+static uint64_t cu_cid_lookup(sqlite3 *psqlite, const char *dir,
+    const uint8_t *md)
+{
+	auto pstmt = gx_sql_prep(psqlite, "SELECT cid FROM cid_hashes WHERE hash=?");
+	if (pstmt == nullptr)
+		return 0;
+	sqlite3_bind_blob(pstmt, 1, md, SHA256_DIGEST_LENGTH, SQLITE_STATIC);
+	if (pstmt.step() != SQLITE_ROW)
+		return 0;
+	uint64_t cid = pstmt.col_uint64(0);
+	pstmt.finalize();
+	for (unsigned int type : {2, 1, 0})
+		if (utimensat(AT_FDCWD, cu_cid_path(dir, cid, type).c_str(),
+		    nullptr, 0) == 0)
+			return cid;
+	/* stale entry; the file went away */
+	pstmt = gx_sql_prep(psqlite, "DELETE FROM cid_hashes WHERE hash=?");
+	if (pstmt != nullptr) {
+		sqlite3_bind_blob(pstmt, 1, md, SHA256_DIGEST_LENGTH, SQLITE_STATIC);
+		pstmt.step();
+	}
+	return 0;
+}
+
+static void cu_cid_remember(sqlite3 *psqlite, const uint8_t *md, uint64_t cid)
+{
+	auto pstmt = gx_sql_prep(psqlite, "REPLACE INTO cid_hashes (hash, cid) VALUES (?,?)");
+	if (pstmt == nullptr)
+		return;
+	sqlite3_bind_blob(pstmt, 1, md, SHA256_DIGEST_LENGTH, SQLITE_STATIC);
+	sqlite3_bind_int64(pstmt, 2, cid);
+	if (pstmt.step() != SQLITE_DONE)
+		mlog(LV_WARN, "W-2190: cannot record digest for cid %llu", LLU{cid});
+}
+
 static BOOL cu_set_msg_body_v0(sqlite3 *, uint64_t, const char *, uint64_t, uint32_t, const char *);
 
 static BOOL cu_set_msg_body_v2(sqlite3 *psqlite, uint64_t message_id,
@@ -2689,14 +2761,31 @@ static BOOL common_util_set_message_body(
 	auto dir = exmdb_server::get_dir();
 	if (dir == nullptr)
 		return FALSE;
+	uint8_t md[SHA256_DIGEST_LENGTH];
+	/* v0 files for PT_UNICODE carry a length prefix, so keep kinds apart */
+	bool b_dedup = cu_cid_digest(psqlite, PROP_TYPE(proptag) == PT_UNICODE ?
+	               'U' : 'A', pvalue, strlen(static_cast<char *>(pvalue)), md);
+	if (b_dedup) {
+		auto xact = gx_sql_begin_trans(psqlite);
+		auto cid = cu_cid_lookup(psqlite, dir, md);
+		if (cid != 0 && !cu_update_object_cid(psqlite,
+		    db_table::msg_props, message_id, proptag, cid))
+			return FALSE;
+		xact.commit();
+		if (cid != 0)
+			return TRUE;
+	}
 	uint64_t cid = 0;
 	if (!common_util_allocate_cid(psqlite, &cid))
 		return FALSE;
-	if (g_cid_compression >= 0)
-		return cu_set_msg_body_v2(psqlite, message_id, dir, cid, proptag,
-		       static_cast<const char *>(pvalue));
-	return cu_set_msg_body_v0(psqlite, message_id, dir, cid, proptag,
-	       static_cast<const char *>(pvalue));
+	auto ret = g_cid_compression >= 0 ?
+	           cu_set_msg_body_v2(psqlite, message_id, dir, cid, proptag,
+	           static_cast<const char *>(pvalue)) :
+	           cu_set_msg_body_v0(psqlite, message_id, dir, cid, proptag,
+	           static_cast<const char *>(pvalue));
+	if (ret && b_dedup)
+		cu_cid_remember(psqlite, md, cid);
+	return ret;
 }
 
 static BOOL cu_set_msg_body_v0(sqlite3 *psqlite, uint64_t message_id,
@@ -2781,14 +2870,30 @@ static BOOL cu_set_object_cid_value(sqlite3 *psqlite, db_table table_type,
 	auto dir = exmdb_server::get_dir();
 	if (dir == nullptr)
 		return FALSE;
+	auto bv = static_cast<const BINARY *>(ppropval->pvalue);
+	uint8_t md[SHA256_DIGEST_LENGTH];
+	bool b_dedup = cu_cid_digest(psqlite, 'B', bv->pv, bv->cb, md);
+	if (b_dedup) {
+		auto xact = gx_sql_begin_trans(psqlite);
+		auto cid = cu_cid_lookup(psqlite, dir, md);
+		if (cid != 0 && !cu_update_object_cid(psqlite, table_type,
+		    message_id, ppropval->proptag, cid))
+			return FALSE;
+		xact.commit();
+		if (cid != 0)
+			return TRUE;
+	}
 	uint64_t cid = 0;
 	if (!common_util_allocate_cid(psqlite, &cid))
 		return FALSE;
-	if (g_cid_compression >= 0)
-		return cu_set_obj_cid_val_v2(psqlite, table_type, message_id,
-		       dir, cid, ppropval);
-	return cu_set_obj_cid_val_v0(psqlite, table_type, message_id, dir, cid,
-	       ppropval);
+	auto ret = g_cid_compression >= 0 ?
+	           cu_set_obj_cid_val_v2(psqlite, table_type, message_id,
+	           dir, cid, ppropval) :
+	           cu_set_obj_cid_val_v0(psqlite, table_type, message_id, dir, cid,
+	           ppropval);
+	if (ret && b_dedup)
+		cu_cid_remember(psqlite, md, cid);
+	return ret;
 }
 
 static BOOL cu_set_obj_cid_val_v0(sqlite3 *psqlite, db_table table_type,
@@ -4322,6 +4427,72 @@ bool cu_eval_folder_restriction(sqlite3 *psqlite,
 	return FALSE;
 }
 
+/**
+ * Matches the value @pvalue (of the type of @rcon->proptag, which must be
+ * PT_BINARY, PT_STRING8 or PT_UNICODE) against a content restriction.
+ */
+bool cu_eval_content(const RESTRICTION_CONTENT *rcon, const void *pvalue)
+{
+	if (PROP_TYPE(rcon->proptag) == PT_BINARY) {
+		auto &dbval = *static_cast<const BINARY *>(pvalue);
+		auto &rsval = *static_cast<const BINARY *>(rcon->propval.pvalue);
+		switch (rcon->fuzzy_level & 0xFFFF) {
+		case FL_FULLSTRING:
+			return dbval.cb == rsval.cb && memcmp(dbval.pv, rsval.pv, rsval.cb) == 0;
+		case FL_SUBSTRING:
+			return HX_memmem(dbval.pv, dbval.cb, rsval.pv, rsval.cb) != nullptr;
+		case FL_PREFIX:
+			return dbval.cb >= rsval.cb && memcmp(dbval.pv, rsval.pv, rsval.cb) == 0;
+		}
+		return false;
+	}
+	auto dbval = static_cast<const char *>(pvalue);
+	auto rsval = static_cast<const char *>(rcon->propval.pvalue);
+	auto icase = rcon->fuzzy_level & (FL_IGNORECASE | FL_LOOSE);
+	switch (rcon->fuzzy_level & 0xFFFF) {
+	case FL_FULLSTRING:
+		return icase ? strcasecmp(dbval, rsval) == 0 :
+		       strcmp(dbval, rsval) == 0;
+	case FL_SUBSTRING:
+		return icase ? strcasestr(dbval, rsval) != nullptr :
+		       strstr(dbval, rsval) != nullptr;
+	case FL_PREFIX: {
+		auto len = strlen(rsval);
+		return icase ? strncasecmp(dbval, rsval, len) == 0 :
+		       strncmp(dbval, rsval, len) == 0;
+	}
+	}
+	return false;
+}
+
+/*
+ * Whether evaluating @pres modifies it (RES_COUNT decrements its counter),
+ * so that callers sharing a restriction need a copy or must serialize.
+ */
+bool cu_restriction_counting(const RESTRICTION *pres)
+{
+	switch (pres->rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < pres->andor->count; ++i)
+			if (cu_restriction_counting(&pres->andor->pres[i]))
+				return true;
+		return false;
+	case RES_NOT:
+		return cu_restriction_counting(&pres->xnot->res);
+	case RES_SUBRESTRICTION:
+		return cu_restriction_counting(&pres->sub->res);
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		return pres->comment->pres != nullptr &&
+		       cu_restriction_counting(pres->comment->pres);
+	case RES_COUNT:
+		return true;
+	default:
+		return false;
+	}
+}
+
 bool cu_eval_msg_restriction(sqlite3 *psqlite,
 	uint32_t cpid, uint64_t message_id, const RESTRICTION *pres)
 {
@@ -4350,47 +4521,15 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 		void *pvalue = nullptr;
 		if (PROP_TYPE(rcon->proptag) != PROP_TYPE(rcon->propval.proptag))
 			return FALSE;
-		if (PROP_TYPE(rcon->proptag) == PT_BINARY) {
-			if (!cu_get_property(db_table::msg_props,
-			    message_id, cpid, psqlite, rcon->proptag, &pvalue) ||
-			    pvalue == nullptr)
-				return FALSE;
-			auto &dbval = *static_cast<const BINARY *>(pvalue);
-			auto &rsval = *static_cast<const BINARY *>(rcon->propval.pvalue);
-			switch (rcon->fuzzy_level & 0xFFFF) {
-			case FL_FULLSTRING:
-				return dbval.cb == rsval.cb && memcmp(dbval.pv, rsval.pv, rsval.cb) == 0;
-			case FL_SUBSTRING:
-				return HX_memmem(dbval.pv, dbval.cb, rsval.pv, rsval.cb) != nullptr;
-			case FL_PREFIX:
-				return dbval.cb >= rsval.cb && memcmp(dbval.pv, rsval.pv, rsval.cb) == 0;
-			}
-			return false;
-		}
-		if (PROP_TYPE(rcon->proptag) != PT_STRING8 &&
+		if (PROP_TYPE(rcon->proptag) != PT_BINARY &&
+		    PROP_TYPE(rcon->proptag) != PT_STRING8 &&
 		    PROP_TYPE(rcon->proptag) != PT_UNICODE)
 			return FALSE;
 		if (!cu_get_property(db_table::msg_props,
 		    message_id, cpid, psqlite, rcon->proptag, &pvalue) ||
 		    pvalue == nullptr)
 			return FALSE;
-		auto dbval = static_cast<const char *>(pvalue);
-		auto rsval = static_cast<const char *>(rcon->propval.pvalue);
-		auto icase = rcon->fuzzy_level & (FL_IGNORECASE | FL_LOOSE);
-		switch (rcon->fuzzy_level & 0xFFFF) {
-		case FL_FULLSTRING:
-			return icase ? strcasecmp(dbval, rsval) == 0 :
-			       strcmp(dbval, rsval) == 0;
-		case FL_SUBSTRING:
-			return icase ? strcasestr(dbval, rsval) != nullptr :
-			       strstr(dbval, rsval) != nullptr;
-		case FL_PREFIX: {
-			auto len = strlen(rsval);
-			return icase ? strncasecmp(dbval, rsval, len) == 0 :
-			       strncmp(dbval, rsval, len) == 0;
-		}
-		}
-		return FALSE;
+		return cu_eval_content(rcon, pvalue);
 	}
 	case RES_PROPERTY: {
 		auto rprop = pres->prop;
@@ -4501,6 +4640,372 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 	return FALSE;
 }
 
+/*
+ * Restriction-to-SQL compiler. Only the subset whose outcome depends on
+ * neither computed properties nor charset conversion is handled; for
+ * anything else, cu_msg_restriction_to_sql fails and the caller should use
+ * cu_eval_msg_restriction instead. Absent properties are treated like in
+ * propval_compare_relop_nullok (they sort before everything else).
+ */
+namespace {
+struct rsql_ctx {
+	msg_res_sql &out;
+	bool b_private = false;
+};
+}
+
+#define RSQL_MAX_DEPTH 64
+
+/* Properties that gp_msgprop synthesizes instead of reading message_properties */
+bool cu_msgprop_is_synthesized(uint32_t proptag)
+{
+	switch (PROP_ID(proptag)) {
+	case PROP_ID(PR_ENTRYID):
+	case PROP_ID(PR_PARENT_ENTRYID):
+	case PROP_ID(PidTagFolderId):
+	case PROP_ID(PidTagParentFolderId):
+	case PROP_ID(PR_INSTANCE_SVREID):
+	case PROP_ID(PR_PARENT_DISPLAY):
+	case PROP_ID(PR_MESSAGE_SIZE):
+	case PROP_ID(PR_ASSOCIATED):
+	case PROP_ID(PidTagChangeNumber):
+	case PROP_ID(PR_READ):
+	case PROP_ID(PR_HAS_NAMED_PROPERTIES):
+	case PROP_ID(PR_HASATTACH):
+	case PROP_ID(PidTagMid):
+	case PROP_ID(PR_MESSAGE_FLAGS):
+	case PROP_ID(PR_SUBJECT):
+	case PROP_ID(PR_DISPLAY_TO):
+	case PROP_ID(PR_DISPLAY_CC):
+	case PROP_ID(PR_DISPLAY_BCC):
+	case PROP_ID(PR_BODY):
+	case PROP_ID(PR_TRANSPORT_MESSAGE_HEADERS):
+	case PROP_ID(PR_HTML):
+	case PROP_ID(PR_RTF_COMPRESSED):
+	case PROP_ID(PidTagMidString):
+	case PROP_ID(PR_STORE_RECORD_KEY):
+	case PROP_ID(PR_ANR):
+		return true;
+	}
+	return false;
+}
+
+/*
+ * SQL expression for those synthesized (and always present) properties
+ * which can be derived from the messages row; empty string if there is none.
+ */
+static std::string rsql_column_expr(const rsql_ctx &ctx, uint32_t proptag)
+{
+	switch (proptag) {
+	case PR_MESSAGE_SIZE:
+		return "(messages.message_size & 4294967295)";
+	case PR_ASSOCIATED:
+		return "(messages.is_associated<>0)";
+	case PR_READ:
+		return ctx.b_private ? "(messages.read_state<>0)" : "";
+	case PR_MESSAGE_FLAGS: {
+		if (!ctx.b_private)
+			return "";
+		/* Mirrors common_util_get_message_flags(b_native=false) */
+		uint32_t keep = ~(MSGFLAG_READ | MSGFLAG_HASATTACH | MSGFLAG_FROMME |
+		                MSGFLAG_ASSOCIATED | MSGFLAG_RN_PENDING | MSGFLAG_NRN_PENDING);
+		auto has = [](uint32_t tag) {
+			return "EXISTS (SELECT 1 FROM message_properties AS mp"
+			       " WHERE mp.message_id=messages.message_id AND mp.proptag=" +
+			       std::to_string(tag) + " AND mp.propval<>0)";
+		};
+		return "((IFNULL((SELECT mp.propval FROM message_properties AS mp"
+		       " WHERE mp.message_id=messages.message_id AND mp.proptag=" +
+		       std::to_string(PR_MESSAGE_FLAGS) + "),0) & " + std::to_string(keep) + ")"
+		       " | (CASE WHEN messages.read_state<>0 THEN " + std::to_string(MSGFLAG_READ) + " ELSE 0 END)"
+		       " | (CASE WHEN EXISTS (SELECT 1 FROM attachments WHERE"
+		       " attachments.message_id=messages.message_id) THEN " + std::to_string(MSGFLAG_HASATTACH) + " ELSE 0 END)"
+		       " | (CASE WHEN messages.is_associated<>0 THEN " + std::to_string(MSGFLAG_ASSOCIATED) + " ELSE 0 END)"
+		       " | (CASE WHEN " + has(PR_READ_RECEIPT_REQUESTED) + " THEN " + std::to_string(MSGFLAG_RN_PENDING) + " ELSE 0 END)"
+		       " | (CASE WHEN " + has(PR_NON_RECEIPT_NOTIFICATION_REQUESTED) + " THEN " + std::to_string(MSGFLAG_NRN_PENDING) + " ELSE 0 END))";
+	}
+	}
+	return "";
+}
+
+static std::string rsql_param(rsql_ctx &ctx, uint16_t type, const void *v)
+{
+	ctx.out.params.emplace_back(type, v);
+	return "?" + std::to_string(ctx.out.params.size());
+}
+
+static const char *rsql_relop(relop r)
+{
+	switch (r) {
+	case RELOP_LT: return "<";
+	case RELOP_LE: return "<=";
+	case RELOP_GT: return ">";
+	case RELOP_GE: return ">=";
+	case RELOP_EQ: return "=";
+	case RELOP_NE: return "<>";
+	default: return nullptr;
+	}
+}
+
+/*
+ * Builds the comparison "@expr <relop> value" for a fixed-size or string
+ * value. Integers are stored as signed 64-bit in SQLite, so unsigned 64-bit
+ * ordering needs to be spelled out.
+ */
+static bool rsql_compare(rsql_ctx &ctx, const std::string &expr, relop r,
+    uint16_t type, const void *v, std::string &pred)
+{
+	auto op = rsql_relop(r);
+	if (op == nullptr)
+		return false;
+	switch (type) {
+	case PT_SHORT:
+		pred = expr + op + std::to_string(*static_cast<const uint16_t *>(v));
+		return true;
+	case PT_LONG:
+		pred = expr + op + std::to_string(*static_cast<const uint32_t *>(v));
+		return true;
+	case PT_BOOLEAN:
+		pred = "(" + expr + "<>0)" + op + (*static_cast<const uint8_t *>(v) ? "1" : "0");
+		return true;
+	case PT_FLOAT:
+	case PT_DOUBLE:
+	case PT_APPTIME:
+		pred = expr + op + rsql_param(ctx, type, v);
+		return true;
+	case PT_CURRENCY:
+	case PT_I8:
+	case PT_SYSTIME: {
+		auto u = *static_cast<const uint64_t *>(v);
+		auto lit = std::to_string(static_cast<int64_t>(u));
+		auto cmp = expr + op + lit;
+		auto high = u > INT64_MAX;
+		switch (r) {
+		case RELOP_GT:
+		case RELOP_GE:
+			pred = "(" + expr + (high ? "<0 AND " : "<0 OR ") + cmp + ")";
+			break;
+		case RELOP_LT:
+		case RELOP_LE:
+			pred = "(" + expr + (high ? ">=0 OR " : ">=0 AND ") + cmp + ")";
+			break;
+		default:
+			pred = std::move(cmp);
+			break;
+		}
+		return true;
+	}
+	case PT_UNICODE:
+		/* propval_compare uses strcasecmp, i.e. ASCII-only folding like NOCASE */
+		pred = expr + op + rsql_param(ctx, type, v) + " COLLATE NOCASE";
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Message ids that have the property (string properties may be stored under
+ * either string type; 8-bit rows are compared without cpid conversion, which
+ * only matters for non-ASCII data written by cpid-less importers).
+ */
+static std::string rsql_prop_rows(uint32_t proptag)
+{
+	auto type = PROP_TYPE(proptag);
+	std::string s = "SELECT mp.message_id FROM message_properties AS mp WHERE ";
+	if (type == PT_UNICODE || type == PT_STRING8)
+		s += "mp.proptag IN (" +
+		     std::to_string(CHANGE_PROP_TYPE(proptag, PT_UNICODE)) + "," +
+		     std::to_string(CHANGE_PROP_TYPE(proptag, PT_STRING8)) + ")";
+	else
+		s += "mp.proptag=" + std::to_string(proptag);
+	return s;
+}
+
+static bool rsql_plain_type(uint16_t type)
+{
+	switch (type) {
+	case PT_SHORT: case PT_LONG: case PT_FLOAT: case PT_DOUBLE:
+	case PT_CURRENCY: case PT_APPTIME: case PT_BOOLEAN: case PT_I8:
+	case PT_SYSTIME: case PT_UNICODE:
+		return true;
+	}
+	return false;
+}
+
+static bool rsql_compile(rsql_ctx &ctx, const RESTRICTION *pres,
+    unsigned int depth, std::string &sql)
+{
+	if (depth > RSQL_MAX_DEPTH)
+		return false;
+	switch (pres->rt) {
+	case RES_AND:
+	case RES_OR: {
+		if (pres->andor->count == 0) {
+			sql = pres->rt == RES_AND ? "1" : "0";
+			return true;
+		}
+		sql = "(";
+		for (size_t i = 0; i < pres->andor->count; ++i) {
+			std::string sub;
+			if (!rsql_compile(ctx, &pres->andor->pres[i], depth + 1, sub))
+				return false;
+			if (i > 0)
+				sql += pres->rt == RES_AND ? " AND " : " OR ";
+			sql += sub;
+		}
+		sql += ")";
+		return true;
+	}
+	case RES_NOT: {
+		std::string sub;
+		if (!rsql_compile(ctx, &pres->xnot->res, depth + 1, sub))
+			return false;
+		sql = "(NOT " + sub + ")";
+		return true;
+	}
+	case RES_CONTENT: {
+		auto rcon = pres->cont;
+		if (PROP_TYPE(rcon->proptag) != PT_UNICODE ||
+		    PROP_TYPE(rcon->propval.proptag) != PT_UNICODE ||
+		    rcon->propval.pvalue == nullptr || cu_msgprop_is_synthesized(rcon->proptag))
+			return false;
+		auto icase = rcon->fuzzy_level & (FL_IGNORECASE | FL_LOOSE);
+		auto p = rsql_param(ctx, PT_UNICODE, rcon->propval.pvalue);
+		std::string pred;
+		switch (rcon->fuzzy_level & 0xFFFF) {
+		case FL_FULLSTRING:
+			pred = icase ? "mp.propval=" + p + " COLLATE NOCASE" :
+			       "mp.propval=" + p;
+			break;
+		case FL_SUBSTRING:
+			pred = icase ? "instr(lower(mp.propval),lower(" + p + "))>0" :
+			       "instr(mp.propval," + p + ")>0";
+			break;
+		case FL_PREFIX:
+			pred = icase ? "lower(substr(mp.propval,1,length(" + p + ")))=lower(" + p + ")" :
+			       "substr(mp.propval,1,length(" + p + "))=" + p;
+			break;
+		default:
+			sql = "0";
+			return true;
+		}
+		sql = "messages.message_id IN (" + rsql_prop_rows(rcon->proptag) +
+		      " AND " + pred + ")";
+		return true;
+	}
+	case RES_PROPERTY: {
+		auto rprop = pres->prop;
+		auto type = PROP_TYPE(rprop->proptag);
+		if (rprop->propval.pvalue == nullptr || !rsql_plain_type(type) ||
+		    PROP_TYPE(rprop->propval.proptag) != type)
+			return false;
+		if (rsql_relop(rprop->relop) == nullptr) {
+			/* RELOP_RE/DL are never satisfied */
+			sql = "0";
+			return true;
+		}
+		auto col = rsql_column_expr(ctx, rprop->proptag);
+		if (!col.empty())
+			return rsql_compare(ctx, col, rprop->relop, type,
+			       rprop->propval.pvalue, sql);
+		if (cu_msgprop_is_synthesized(rprop->proptag))
+			return false;
+		std::string pred;
+		if (!rsql_compare(ctx, "mp.propval", rprop->relop, type,
+		    rprop->propval.pvalue, pred))
+			return false;
+		switch (rprop->relop) {
+		case RELOP_GT:
+		case RELOP_GE:
+		case RELOP_EQ:
+			/* absent properties fail these */
+			sql = "messages.message_id IN (" +
+			      rsql_prop_rows(rprop->proptag) + " AND " + pred + ")";
+			break;
+		default:
+			/* ...and pass these */
+			sql = "messages.message_id NOT IN (" +
+			      rsql_prop_rows(rprop->proptag) + " AND NOT (" + pred + "))";
+			break;
+		}
+		return true;
+	}
+	case RES_BITMASK: {
+		auto rbm = pres->bm;
+		if (PROP_TYPE(rbm->proptag) != PT_LONG)
+			return false;
+		const char *cmp;
+		switch (rbm->bitmask_relop) {
+		case BMR_EQZ: cmp = "=0"; break;
+		case BMR_NEZ: cmp = "<>0"; break;
+		default:
+			sql = "0";
+			return true;
+		}
+		auto mask = std::to_string(rbm->mask);
+		auto col = rsql_column_expr(ctx, rbm->proptag);
+		if (!col.empty()) {
+			sql = "((" + col + " & " + mask + ")" + cmp + ")";
+			return true;
+		}
+		if (cu_msgprop_is_synthesized(rbm->proptag))
+			return false;
+		sql = "messages.message_id IN (" + rsql_prop_rows(rbm->proptag) +
+		      " AND (mp.propval & " + mask + ")" + cmp + ")";
+		return true;
+	}
+	case RES_EXIST: {
+		auto tag = pres->exist->proptag;
+		if (!rsql_plain_type(PROP_TYPE(tag)) && PROP_TYPE(tag) != PT_STRING8)
+			return false;
+		if (!rsql_column_expr(ctx, tag).empty()) {
+			sql = "1";
+			return true;
+		}
+		if (cu_msgprop_is_synthesized(tag))
+			return false;
+		sql = "messages.message_id IN (" + rsql_prop_rows(tag) + ")";
+		return true;
+	}
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (pres->comment->pres == nullptr) {
+			sql = "1";
+			return true;
+		}
+		return rsql_compile(ctx, pres->comment->pres, depth + 1, sql);
+	case RES_NULL:
+		sql = "1";
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool cu_msg_restriction_to_sql(const RESTRICTION *pres, msg_res_sql &out) try
+{
+	out.where.clear();
+	out.params.clear();
+	rsql_ctx ctx{out, exmdb_server::is_private()};
+	if (rsql_compile(ctx, pres, 0, out.where))
+		return true;
+	out.where.clear();
+	out.params.clear();
+	return false;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2807: ENOMEM");
+	return false;
+}
+
+bool msg_res_sql::bind(sqlite3_stmt *stm) const
+{
+	for (size_t i = 0; i < params.size(); ++i)
+		if (!common_util_bind_sqlite_statement(stm, i + 1,
+		    params[i].first, const_cast<void *>(params[i].second)))
+			return false;
+	return true;
+}
+
 BOOL common_util_check_search_result(sqlite3 *psqlite,
 	uint64_t folder_id, uint64_t message_id, BOOL *pb_exist)
 {
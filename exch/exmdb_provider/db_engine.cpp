@@ -1,4 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <csignal>
@@ -101,10 +103,12 @@ static std::vector<pthread_t> g_thread_ids;
 static std::mutex g_list_lock, g_hash_lock, g_cond_mutex;
 static std::condition_variable g_waken_cond;
 static std::unordered_map<std::string, DB_ITEM> g_hash_table;
+static thread_local DB_ITEM *g_batch_db; /* held by this thread's exmdb batch */
 /* List of queued searchcriteria, and list of searchcriteria evaluated right now */
 static std::list<POPULATING_NODE> g_populating_list, g_populating_list_active;
 unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
 unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
+unsigned int g_exmdb_search_parallelism;
 
 static bool remove_from_hash(const decltype(g_hash_table)::value_type &, time_t);
 static void db_engine_notify_content_table_modify_row(db_item_ptr &, uint64_t folder_id, uint64_t message_id);
@@ -197,6 +201,18 @@ static int db_engine_autoupgrade(sqlite3 *db, const char *filedesc)
 	return 0;
 }
 
+void db_engine_enter_batch(db_item_ptr &pdb)
+{
+	g_batch_db = pdb.get();
+	gx_sql_set_batch_db(pdb->psqlite);
+}
+
+void db_engine_leave_batch()
+{
+	g_batch_db = nullptr;
+	gx_sql_set_batch_db(nullptr);
+}
+
 /* query or create DB_ITEM in hash table */
 db_item_ptr db_engine_get_db(const char *path)
 {
@@ -208,6 +224,11 @@ db_item_ptr db_engine_get_db(const char *path)
 	auto it = g_hash_table.find(path);
 	if (it != g_hash_table.end()) {
 		pdb = &it->second;
+		if (pdb == g_batch_db) {
+			/* the batch on this thread already holds giant_lock */
+			++pdb->reference;
+			return db_item_ptr(pdb);
+		}
 		auto refs = pdb->reference.load();
 		if (refs > 0 && static_cast<unsigned int>(refs) > g_mbox_contention_reject) {
 			hhold.unlock();
@@ -281,7 +302,8 @@ db_item_ptr db_engine_get_db(const char *path)
 void db_item_deleter::operator()(DB_ITEM *pdb) const
 {
 	time(&pdb->last_time);
-	pdb->giant_lock.unlock();
+	if (pdb != g_batch_db)
+		pdb->giant_lock.unlock();
 	std::lock_guard hhold(g_hash_lock);
 	pdb->reference --;
 }
@@ -403,9 +425,24 @@ static void *mdpeng_scanwork(void *param)
 	return nullptr;
 }
 
+/* Candidate messages of one folder of a search scope */
+static std::string db_engine_search_query(uint64_t scope_fid,
+    bool b_scope_search, const msg_res_sql *compiled)
+{
+	std::string query = b_scope_search ?
+		"SELECT messages.message_id FROM search_result JOIN messages"
+		" ON messages.message_id=search_result.message_id"
+		" WHERE search_result.folder_id=" + std::to_string(scope_fid) :
+		"SELECT messages.message_id FROM messages"
+		" WHERE messages.parent_fid=" + std::to_string(scope_fid);
+	if (compiled != nullptr)
+		query += " AND (" + compiled->where + ")";
+	return query;
+}
+
 static BOOL db_engine_search_folder(const char *dir,
 	uint32_t cpid, uint64_t search_fid, uint64_t scope_fid,
-	const RESTRICTION *prestriction)
+	const RESTRICTION *prestriction) try
 {
 	char sql_string[128];
 	auto pdb = db_engine_get_db(dir);
@@ -420,19 +457,32 @@ static BOOL db_engine_search_folder(const char *dir,
 	if (SQLITE_ROW != sqlite3_step(pstmt)) {
 		return TRUE;
 	}
-	if (0 == sqlite3_column_int64(pstmt, 0)) {
-		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id FROM"
-		          " messages WHERE parent_fid=%llu",
-		          static_cast<unsigned long long>(scope_fid));
-	} else {
-		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id FROM"
-		          " search_result WHERE folder_id=%llu",
-		          static_cast<unsigned long long>(scope_fid));
-	}
+	bool b_scope_search = sqlite3_column_int64(pstmt, 0) != 0;
 	pstmt.finalize();
-	pstmt = gx_sql_prep(pdb->psqlite, sql_string);
-	if (pstmt == nullptr) {
-		return FALSE;
+	/*
+	 * When the restriction can be expressed in SQL, let SQLite do the
+	 * filtering (using proptag_propval_index) rather than evaluating it
+	 * message by message.
+	 */
+	msg_res_sql compiled;
+	bool b_compiled = cu_msg_restriction_to_sql(prestriction, compiled);
+	if (b_compiled) {
+		pstmt = gx_sql_prep(pdb->psqlite, db_engine_search_query(scope_fid,
+		        b_scope_search, &compiled).c_str());
+		if (pstmt == nullptr || !compiled.bind(pstmt))
+			return FALSE;
+	} else {
+		if (!b_scope_search)
+			snprintf(sql_string, arsizeof(sql_string), "SELECT message_id FROM"
+			          " messages WHERE parent_fid=%llu",
+			          static_cast<unsigned long long>(scope_fid));
+		else
+			snprintf(sql_string, arsizeof(sql_string), "SELECT message_id FROM"
+			          " search_result WHERE folder_id=%llu",
+			          static_cast<unsigned long long>(scope_fid));
+		pstmt = gx_sql_prep(pdb->psqlite, sql_string);
+		if (pstmt == nullptr)
+			return FALSE;
 	}
 	auto pmessage_ids = eid_array_init();
 	if (NULL == pmessage_ids) {
@@ -461,7 +511,7 @@ static BOOL db_engine_search_folder(const char *dir,
 			}
 			count = 0;
 		}
-		if (!cu_eval_msg_restriction(pdb->psqlite,
+		if (!b_compiled && !cu_eval_msg_restriction(pdb->psqlite,
 		    cpid, pmessage_ids->pids[i], prestriction))
 			continue;
 		snprintf(sql_string, arsizeof(sql_string), "REPLACE INTO search_result "
@@ -481,6 +531,197 @@ static BOOL db_engine_search_folder(const char *dir,
 			pmessage_ids->pids[i], 0);
 	}
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2811: ENOMEM");
+	return false;
+}
+
+/*
+ * Parallel population, used in WAL mode: candidates are read and the
+ * restriction is evaluated on private read-only connections, and the
+ * mailbox lock is only taken to commit batches of search_result rows.
+ * (With a rollback journal, a long-lived reader would make the commits
+ * of pdb->psqlite fail with SQLITE_BUSY, so db_engine_search_folder
+ * remains in use there.)
+ */
+static sqlite3 *db_engine_open_reader(const char *dir)
+{
+	char db_path[256];
+	sqlite3 *psqlite = nullptr;
+
+	snprintf(db_path, std::size(db_path), "%s/exmdb/exchange.sqlite3", dir);
+	auto ret = sqlite3_open_v2(db_path, &psqlite, SQLITE_OPEN_READONLY, nullptr);
+	if (ret != SQLITE_OK) {
+		mlog(LV_ERR, "E-2812: sqlite3_open %s: %s", db_path, sqlite3_errstr(ret));
+		sqlite3_close(psqlite);
+		return nullptr;
+	}
+	sqlite3_busy_timeout(psqlite, 60000);
+	if (0 != g_mmap_size) {
+		snprintf(db_path, std::size(db_path), "PRAGMA mmap_size=%llu", LLU{g_mmap_size});
+		gx_sql_exec(psqlite, db_path);
+	}
+	return psqlite;
+}
+
+/* Returns false when the search folder is gone (or on error). */
+static bool db_engine_search_commit(const char *dir, uint32_t cpid,
+    uint64_t search_fid, const std::vector<uint64_t> &mids) try
+{
+	if (mids.empty())
+		return true;
+	auto pdb = db_engine_get_db(dir);
+	if (pdb == nullptr || pdb->psqlite == nullptr)
+		return false;
+	std::vector<uint64_t> added;
+	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+	/* Messages deleted in the meantime simply select no row. */
+	auto pstmt = gx_sql_prep(pdb->psqlite, "REPLACE INTO search_result"
+	             " (folder_id, message_id) SELECT ?, message_id"
+	             " FROM messages WHERE message_id=?");
+	if (pstmt == nullptr)
+		return false;
+	for (auto mid : mids) {
+		sqlite3_reset(pstmt);
+		sqlite3_bind_int64(pstmt, 1, search_fid);
+		sqlite3_bind_int64(pstmt, 2, mid);
+		auto ret = sqlite3_step(pstmt);
+		if ((ret & 0xff) == SQLITE_CONSTRAINT)
+			/* Search folder was deleted, cf. db_engine_search_folder */
+			return false;
+		if (ret == SQLITE_DONE && sqlite3_changes(pdb->psqlite) > 0)
+			added.push_back(mid);
+	}
+	pstmt.finalize();
+	sql_transact.commit();
+	for (auto mid : added)
+		db_engine_proc_dynamic_event(pdb, cpid,
+			DYNAMIC_EVENT_NEW_MESSAGE, search_fid, mid, 0);
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2813: ENOMEM");
+	return false;
+}
+
+static void db_engine_search_worker(const POPULATING_NODE &search,
+    const std::vector<uint64_t> &cand, std::atomic<size_t> &cursor,
+    gromox::atomic_bool &b_stop, bool b_own_env) try
+{
+	auto dir = search.dir.c_str();
+	size_t chunk = std::max(g_exmdb_search_pacing, 1U);
+	if (b_own_env) {
+		nice(g_exmdb_search_nice);
+		exmdb_server::build_env(EM_PRIVATE, dir);
+	}
+	auto cl_0 = make_scope_exit([&]() {
+		if (b_own_env)
+			exmdb_server::free_env();
+	});
+	auto psqlite = db_engine_open_reader(dir);
+	if (psqlite == nullptr) {
+		b_stop = true;
+		return;
+	}
+	auto cl_1 = make_scope_exit([&]() { sqlite3_close(psqlite); });
+	std::vector<uint64_t> hits;
+	while (!b_stop && !g_notify_stop) {
+		auto start = cursor.fetch_add(chunk);
+		if (start >= cand.size())
+			break;
+		auto end = std::min(start + chunk, cand.size());
+		hits.clear();
+		for (auto i = start; i < end; ++i)
+			if (cu_eval_msg_restriction(psqlite, search.cpid,
+			    cand[i], search.prestriction))
+				hits.push_back(cand[i]);
+		if (!db_engine_search_commit(dir, search.cpid,
+		    search.folder_id, hits)) {
+			b_stop = true;
+			break;
+		}
+		/* drop what the evaluation has put into the alloc context */
+		exmdb_server::free_env();
+		exmdb_server::build_env(EM_PRIVATE, dir);
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2814: ENOMEM");
+	b_stop = true;
+}
+
+static bool db_engine_search_parallel(const POPULATING_NODE &search,
+    const EID_ARRAY *pfolder_ids) try
+{
+	auto dir = search.dir.c_str();
+	size_t chunk = std::max(g_exmdb_search_pacing, 1U);
+	msg_res_sql compiled;
+	bool b_compiled = cu_msg_restriction_to_sql(search.prestriction, compiled);
+	auto psqlite = db_engine_open_reader(dir);
+	if (psqlite == nullptr)
+		return false;
+	auto cl_0 = make_scope_exit([&]() { sqlite3_close(psqlite); });
+	/*
+	 * Collect the candidates of all scope folders first. A compiled
+	 * restriction has already done the filtering, so its results go
+	 * straight to the writer.
+	 */
+	std::vector<uint64_t> cand;
+	for (size_t i = 0; i < pfolder_ids->count; ++i) {
+		if (g_notify_stop)
+			return true;
+		char sql_string[128];
+		snprintf(sql_string, std::size(sql_string), "SELECT is_search "
+		         "FROM folders WHERE folder_id=%llu", LLU{pfolder_ids->pids[i]});
+		auto pstmt = gx_sql_prep(psqlite, sql_string);
+		if (pstmt == nullptr)
+			return false;
+		if (pstmt.step() != SQLITE_ROW)
+			continue;
+		bool b_scope_search = sqlite3_column_int64(pstmt, 0) != 0;
+		pstmt = gx_sql_prep(psqlite, db_engine_search_query(pfolder_ids->pids[i],
+		        b_scope_search, b_compiled ? &compiled : nullptr).c_str());
+		if (pstmt == nullptr || (b_compiled && !compiled.bind(pstmt)))
+			return false;
+		while (pstmt.step() == SQLITE_ROW) {
+			cand.push_back(sqlite3_column_int64(pstmt, 0));
+			if (!b_compiled || cand.size() < chunk)
+				continue;
+			if (!db_engine_search_commit(dir, search.cpid,
+			    search.folder_id, cand))
+				return false;
+			cand.clear();
+		}
+	}
+	if (b_compiled)
+		return db_engine_search_commit(dir, search.cpid,
+		       search.folder_id, cand);
+	/*
+	 * Evaluate the remaining restriction in chunks on the worker pool.
+	 * RES_COUNT is a counter shared by all candidates (the first n
+	 * matches), which the evaluation decrements; such a tree is
+	 * evaluated by this thread alone.
+	 */
+	std::atomic<size_t> cursor{0};
+	gromox::atomic_bool b_stop{false};
+	size_t nthr = cu_restriction_counting(search.prestriction) ? 1 :
+	              std::min(static_cast<size_t>(std::max(g_exmdb_search_parallelism, 1U)),
+	              (cand.size() + chunk - 1) / chunk);
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < nthr; ++i) {
+		try {
+			workers.emplace_back(db_engine_search_worker, std::cref(search),
+				std::cref(cand), std::ref(cursor), std::ref(b_stop), true);
+		} catch (const std::system_error &e) {
+			mlog(LV_WARN, "W-2191: search worker: %s", e.what());
+			break;
+		}
+	}
+	db_engine_search_worker(search, cand, cursor, b_stop, false);
+	for (auto &t : workers)
+		t.join();
+	return !b_stop;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2815: ENOMEM");
+	return false;
 }
 
 static BOOL db_engine_load_folder_descendant(const char *dir,
@@ -648,7 +889,9 @@ static void *mdpeng_thrwork(void *param)
 			    psearch->b_recursive, psearch->folder_ids.pll[i], pfolder_ids))
 				goto NEXT_SEARCH;
 		}
-		for (size_t i = 0; i < pfolder_ids->count; ++i) {
+		if (g_wal)
+			db_engine_search_parallel(*psearch, pfolder_ids);
+		else for (size_t i = 0; i < pfolder_ids->count; ++i) {
 			if (g_notify_stop)
 				break;
 			if (!db_engine_search_folder(psearch->dir.c_str(),
@@ -3087,6 +3330,21 @@ static void db_engine_notify_content_table_modify_row(db_item_ptr &pdb,
 	
 	pmodified_row = NULL;
 	double_list_init(&tmp_list);
+	if (pdb->tables.b_batch) {
+		/*
+		 * A modification can move the row, or make it enter or leave a
+		 * restricted view; leave all of it to the reload at commit.
+		 */
+		for (pnode = double_list_get_head(&pdb->tables.table_list);
+		     pnode != nullptr;
+		     pnode = double_list_get_after(&pdb->tables.table_list, pnode)) {
+			auto ptable = static_cast<TABLE_NODE *>(pnode->pdata);
+			if (ptable->type == TABLE_TYPE_CONTENT &&
+			    ptable->folder_id == folder_id)
+				ptable->b_hint = TRUE;
+		}
+		return;
+	}
 	for (pnode=double_list_get_head(&pdb->tables.table_list); NULL!=pnode;
 		pnode=double_list_get_after(&pdb->tables.table_list, pnode)) {
 		auto ptable = static_cast<const TABLE_NODE *>(pnode->pdata);
@@ -3676,6 +3934,12 @@ void db_engine_notify_message_modification(db_item_ptr &pdb, uint64_t folder_id,
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
 
+	/* extended rules are FAI messages */
+	auto rc = pdb->rule_cache.find(folder_id);
+	if (rc != pdb->rule_cache.end() &&
+	    std::binary_search(rc->second->fai_ids.cbegin(),
+	    rc->second->fai_ids.cend(), message_id))
+		pdb->rule_cache.erase(rc);
 	auto tmp_list = collect_nsub(pdb, NOTIFICATION_TYPE_OBJECTMODIFIED,
 	                folder_id, message_id);
 	if (tmp_list.size() > 0) {
@@ -3890,6 +4154,11 @@ void db_engine_notify_folder_modification(db_item_ptr &pdb, uint64_t parent_id,
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
 
+	if (pdb->tables.b_batch) {
+		/* one notification per folder when the batch commits */
+		pdb->tables.batch_fldmod[folder_id] = parent_id;
+		return;
+	}
 	auto tmp_list = collect_nsub(pdb, NOTIFICATION_TYPE_OBJECTMODIFIED,
 	                folder_id, 0);
 	if (tmp_list.size() > 0) {
@@ -4079,6 +4348,7 @@ void db_engine_notify_content_table_reload(db_item_ptr &pdb, uint32_t table_id)
 
 void db_engine_begin_batch_mode(db_item_ptr &pdb)
 {
+	++pdb->tables.batch_depth;
 	pdb->tables.b_batch = TRUE;
 }
 
@@ -4087,6 +4357,16 @@ void db_engine_commit_batch_mode(db_item_ptr &&pdb)
 	int table_num;
 	DOUBLE_LIST_NODE *pnode;
 	
+	/* an enclosing batch will do the reloads */
+	if (pdb->tables.batch_depth > 0 && --pdb->tables.batch_depth > 0) {
+		pdb.reset();
+		return;
+	}
+	pdb->tables.b_batch = FALSE;
+	auto fldmod = std::move(pdb->tables.batch_fldmod);
+	pdb->tables.batch_fldmod.clear();
+	for (const auto &[folder_id, parent_id] : fldmod)
+		db_engine_notify_folder_modification(pdb, parent_id, folder_id);
 	table_num = double_list_get_nodes_num(&pdb->tables.table_list);
 	auto ptable_ids = table_num > 0 ? cu_alloc<uint32_t>(table_num) : nullptr;
 	table_num = 0;
@@ -4100,7 +4380,6 @@ void db_engine_commit_batch_mode(db_item_ptr &&pdb)
 			ptable->b_hint = FALSE;
 		}
 	}
-	pdb->tables.b_batch = FALSE;
 	pdb.reset();
 	auto dir = exmdb_server::get_dir();
 	while (0 != table_num) {
@@ -4113,10 +4392,15 @@ void db_engine_cancel_batch_mode(db_item_ptr &pdb)
 {
 	DOUBLE_LIST_NODE *pnode;
 	
+	if (pdb->tables.batch_depth > 0 && --pdb->tables.batch_depth > 0)
+		return;
 	for (pnode=double_list_get_head(&pdb->tables.table_list); NULL!=pnode;
 		pnode=double_list_get_after(&pdb->tables.table_list, pnode)) {
 		auto ptable = static_cast<TABLE_NODE *>(pnode->pdata);
 		ptable->b_hint = FALSE;
 	}
+	pdb->tables.batch_fldmod.clear();
 	pdb->tables.b_batch = FALSE;
+	/* rules may have been (re)loaded from state that is now rolled back */
+	pdb->rule_cache.clear();
 }
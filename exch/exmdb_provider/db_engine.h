@@ -5,6 +5,8 @@
 #include <mutex>
 #include <sqlite3.h>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <gromox/double_list.hpp>
 #include <gromox/element_data.hpp>
 #include <gromox/mapi_types.hpp>
@@ -91,6 +93,30 @@ struct instance_node {
 };
 using INSTANCE_NODE = instance_node;
 
+/* A folder rule with its condition parsed, as used by delivery (message.cpp) */
+struct rule_node {
+	uint32_t sequence = 0, state = 0;
+	uint64_t id = 0;
+	std::string provider;
+	std::shared_ptr<RESTRICTION> cond; /* nullptr: never matches */
+	std::shared_ptr<RULE_ACTIONS> actions; /* standard rules only */
+	bool b_counting = false; /* cond contains RES_COUNT, which is stateful */
+	/*
+	 * Set when a delivery disables the rule (ST_ERROR in the database).
+	 * The folder's cache entry is dropped once that delivery is through,
+	 * so the database state, committed or not, is what gets reloaded.
+	 */
+	mutable bool b_disabled = false;
+};
+
+struct folder_rules {
+	bool b_oof = false; /* ST_ONLY_WHEN_OOF rules were included */
+	std::vector<rule_node> rules, ext_rules;
+	/* state of the folder's FAI messages when ext_rules was loaded */
+	uint64_t fai_count = 0, fai_max_cn = 0, fai_deleted = 0;
+	std::vector<uint64_t> fai_ids; /* sorted */
+};
+
 struct DB_ITEM {
 	DB_ITEM() = default;
 	~DB_ITEM();
@@ -104,11 +130,16 @@ struct DB_ITEM {
 	DOUBLE_LIST dynamic_list{};	/* dynamic search list */
 	std::vector<nsub_node> nsub_list;
 	std::vector<instance_node> instance_list;
+	/* parsed rules per folder_id; dropped on rule or FAI changes */
+	std::unordered_map<uint64_t, std::shared_ptr<const folder_rules>> rule_cache;
 
 	/* memory database for holding rop table objects instance */
 	struct {
 		uint32_t last_id = 0;
 		BOOL b_batch = false; /* message database is in batch-mode */
+		unsigned int batch_depth = 0;
+		/* folder_id -> parent_id of folders modified during the batch */
+		std::unordered_map<uint64_t, uint64_t> batch_fldmod;
 		DOUBLE_LIST table_list{};
 		sqlite3 *psqlite = nullptr;
 	} tables;
@@ -153,6 +184,10 @@ extern void db_engine_begin_batch_mode(db_item_ptr &);
 /* pdb will also be put */
 extern void db_engine_commit_batch_mode(db_item_ptr &&);
 extern void db_engine_cancel_batch_mode(db_item_ptr &);
+/* let the calls of an exmdb batch on this thread reuse pdb's lock */
+extern void db_engine_enter_batch(db_item_ptr &);
+extern void db_engine_leave_batch();
 
 extern unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
 extern unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
+extern unsigned int g_exmdb_search_parallelism;
@@ -9,6 +9,7 @@
 #include <gromox/exmdb_provider_client.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/exmdb_server.hpp>
+#include "exmdb_parser.h"
 
 using namespace gromox;
 
@@ -57,3 +58,39 @@ BOOL exmdb_client_relay_delivery(const char *dir,
 	*presult = r.result;
 	return TRUE;
 }
+
+/**
+ * Like exmdb_client_remote::batch, but a store served by this process is
+ * handed straight to the batch dispatcher. The responses are copied into
+ * the caller's objects and live in the caller's allocation context.
+ */
+BOOL exmdb_client_local::batch(const char *dir, uint32_t count,
+    exreq *const *reqs, exresp *const *resps)
+{
+	BOOL b_private;
+
+	if (!exmdb_client_check_local(dir, &b_private))
+		return exmdb_client_remote::batch(dir, count, reqs, resps);
+	exreq_batch q{};
+	q.call_id = exmdb_callid::batch;
+	q.dir = deconst(dir);
+	q.count = count;
+	q.preqs = deconst(reqs);
+	for (size_t i = 0; i < count; ++i) {
+		reqs[i]->dir = deconst(dir);
+		resps[i]->call_id = reqs[i]->call_id;
+	}
+	exresp *r0 = nullptr;
+	exmdb_server::build_env(EM_LOCAL | (b_private ? EM_PRIVATE : 0), dir);
+	auto b_result = exmdb_parser_dispatch_batch(q, r0);
+	exmdb_server::free_env();
+	if (!b_result)
+		return FALSE;
+	auto &r = *static_cast<exresp_batch *>(r0);
+	if (r.count != count)
+		return FALSE;
+	for (size_t i = 0; i < count; ++i)
+		if (exmdb_ext_copy_response(r.presps[i], resps[i]) != EXT_ERR_SUCCESS)
+			return FALSE;
+	return TRUE;
+}
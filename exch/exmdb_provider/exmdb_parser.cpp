@@ -19,6 +19,7 @@
 #include <libHX/string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <gromox/database.h>
 #include <gromox/defs.h>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_ext.hpp>
@@ -26,8 +27,10 @@
 #include <gromox/exmdb_server.hpp>
 #include <gromox/list_file.hpp>
 #include <gromox/mapi_types.hpp>
+#include <gromox/scope.hpp>
 #include <gromox/socket.h>
 #include <gromox/util.hpp>
+#include "db_engine.h"
 #include "exmdb_parser.h"
 #include "notification_agent.h"
 
@@ -90,6 +93,85 @@ static BOOL exmdb_parser_dispatch3(const exreq *q0, exresp *&r0)
 	}
 }
 
+static BOOL exmdb_parser_dispatch2(const exreq *, exresp *&);
+
+BOOL exmdb_parser_dispatch_batch(const exreq_batch &q, exresp *&r0)
+{
+	auto r1 = cu_alloc<exresp_batch>();
+	r0 = r1;
+	if (r1 == nullptr)
+		return false;
+	auto &r = *r1;
+	r.count = q.count;
+	r.presps = nullptr;
+	if (q.count == 0)
+		return TRUE;
+	r.presps = cu_alloc<exresp *>(q.count);
+	if (r.presps == nullptr)
+		return false;
+	for (size_t i = 0; i < q.count; ++i) {
+		auto sub = q.preqs[i];
+		switch (sub->call_id) {
+		case exmdb_callid::connect:
+		case exmdb_callid::listen_notification:
+		case exmdb_callid::batch:
+		case exmdb_callid::vacuum:
+		case exmdb_callid::unload_store:
+		/* these drop the store lock for their long-running part */
+		case exmdb_callid::get_content_sync:
+		case exmdb_callid::get_hierarchy_sync:
+			mlog(LV_ERR, "E-2804: exmdb rpc %s cannot be batched",
+			        exmdb_rpc_idtoname(sub->call_id));
+			return false;
+		default:
+			break;
+		}
+		if (strcmp(sub->dir, q.dir) != 0) {
+			mlog(LV_ERR, "E-2805: batched exmdb rpc %s for %s inside batch for %s",
+			        exmdb_rpc_idtoname(sub->call_id), sub->dir, q.dir);
+			return false;
+		}
+	}
+	auto pdb = db_engine_get_db(q.dir);
+	if (pdb == nullptr || pdb->psqlite == nullptr)
+		return false;
+	/*
+	 * While entered, the handlers' own db_engine_get_db calls on this
+	 * thread reuse the lock held here, and their gx_sql_begin_trans calls
+	 * turn into savepoints, so they run unmodified inside the batch.
+	 */
+	db_engine_enter_batch(pdb);
+	db_engine_begin_batch_mode(pdb);
+	/*
+	 * Object notifications are not covered by batch mode; hold them
+	 * back until commit so a rollback does not announce phantoms.
+	 */
+	notification_agent_hold();
+	auto cl_0 = make_scope_exit([&]() {
+		if (pdb == nullptr)
+			return;
+		db_engine_leave_batch();
+		notification_agent_release(false);
+		db_engine_cancel_batch_mode(pdb);
+	});
+	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+	for (size_t i = 0; i < q.count; ++i) {
+		auto sub = q.preqs[i];
+		if (!exmdb_parser_dispatch2(sub, r.presps[i])) {
+			if (g_exrpc_debug != 0)
+				mlog(LV_DEBUG, "EXRPC batch aborted at #%zu (%s)", i,
+				        exmdb_rpc_idtoname(sub->call_id));
+			return false;
+		}
+		r.presps[i]->call_id = sub->call_id;
+	}
+	sql_transact.commit();
+	db_engine_leave_batch();
+	notification_agent_release(true);
+	db_engine_commit_batch_mode(std::move(pdb));
+	return TRUE;
+}
+
 static BOOL exmdb_parser_dispatch2(const exreq *prequest, exresp *&r0)
 {
 	/*
@@ -133,6 +215,8 @@ static BOOL exmdb_parser_dispatch2(const exreq *prequest, exresp *&r0)
 		delete q.pseen;
 		return b_return;
 	}
+	case exmdb_callid::batch:
+		return exmdb_parser_dispatch_batch(*static_cast<const exreq_batch *>(prequest), r0);
 	default:
 		return exmdb_parser_dispatch3(prequest, r0);
 	}
@@ -241,10 +325,11 @@ static void *mdpps_thrwork(void *pparam)
 		exmdb_server::build_env(b_private ? EM_PRIVATE : 0, nullptr);
 		tmp_bin.pv = pbuff;
 		tmp_bin.cb = buff_len;
+		/* with exmdb_rpc_borrow, the request points into this buffer */
+		std::unique_ptr<void, stdlib_delete> req_buf(pbuff);
+		pbuff = NULL;
 		exreq *request = nullptr;
 		auto status = exmdb_ext_pull_request(&tmp_bin, request);
-		free(pbuff);
-		pbuff = NULL;
 		exmdb_response tmp_byte;
 		exresp *response = nullptr;
 		if (EXT_ERR_SUCCESS != status) {
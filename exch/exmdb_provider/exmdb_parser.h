@@ -9,6 +9,9 @@
 #include <gromox/common_types.hpp>
 #include <gromox/double_list.hpp>
 
+struct exreq_batch;
+struct exresp;
+
 class EXMDB_CONNECTION : public std::enable_shared_from_this<EXMDB_CONNECTION> {
 	public:
 	EXMDB_CONNECTION() = default;
@@ -44,6 +47,7 @@ void exmdb_parser_put_connection(std::shared_ptr<EXMDB_CONNECTION> &&);
 extern std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_get_router(const char *remote_id);
 extern void exmdb_parser_put_router(std::shared_ptr<ROUTER_CONNECTION> &&);
 extern BOOL exmdb_parser_remove_router(const std::shared_ptr<ROUTER_CONNECTION> &);
+extern BOOL exmdb_parser_dispatch_batch(const exreq_batch &, exresp *&);
 
 extern unsigned int g_exrpc_debug, g_enable_dam;
 extern unsigned int g_mbox_contention_warning, g_mbox_contention_reject;
@@ -6,6 +6,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <vector>
 #include <libHX/string.h>
 #include <gromox/database.h>
 #include <gromox/exmdb_common_util.hpp>
@@ -213,13 +214,98 @@ BOOL exmdb_server::check_folder_id(const char *dir,
 	       rop_util_get_gc_value(folder_id), pb_exist);
 }
 
+/*
+ * Builds the midb view of one message from a statement positioned on
+ * (message_id, read_state, mid_string); @pstmt1 looks up message_properties.
+ */
+static TPROPVAL_ARRAY *qfm_make_row(sqlite3_stmt *pstmt, sqlite3_stmt *pstmt1)
+{
+	auto ppropvals = cu_alloc<TPROPVAL_ARRAY>();
+	if (NULL == ppropvals) {
+		return nullptr;
+	}
+	ppropvals->count = 0;
+	ppropvals->ppropval = cu_alloc<TAGGED_PROPVAL>(5);
+	if (NULL == ppropvals->ppropval) {
+		return nullptr;
+	}
+	uint64_t message_id = sqlite3_column_int64(pstmt, 0);
+	auto *pv = &ppropvals->ppropval[ppropvals->count];
+	pv->proptag = PidTagMid;
+	auto uv = cu_alloc<uint64_t>();
+	pv->pvalue = uv;
+	if (pv->pvalue == nullptr) {
+		return nullptr;
+	}
+	*uv = rop_util_make_eid_ex(1, message_id);
+	ppropvals->count ++;
+	++pv;
+	if (SQLITE_NULL != sqlite3_column_type(pstmt, 2)) {
+		pv->proptag = PidTagMidString;
+		pv->pvalue = common_util_dup(reinterpret_cast<const char *>(sqlite3_column_text(pstmt, 2)));
+		if (pv->pvalue == nullptr) {
+			return nullptr;
+		}
+		ppropvals->count ++;
+		++pv;
+	}
+	sqlite3_reset(pstmt1);
+	sqlite3_bind_int64(pstmt1, 1, message_id);
+	sqlite3_bind_int64(pstmt1, 2, PR_MESSAGE_FLAGS);
+	if (SQLITE_ROW == sqlite3_step(pstmt1)) {
+		uint32_t message_flags = sqlite3_column_int64(pstmt1, 0);
+		message_flags &= ~(MSGFLAG_READ | MSGFLAG_HASATTACH |
+		                 MSGFLAG_FROMME | MSGFLAG_ASSOCIATED |
+		                 MSGFLAG_RN_PENDING | MSGFLAG_NRN_PENDING);
+		if (0 != sqlite3_column_int64(pstmt, 1)) {
+			message_flags |= MSGFLAG_READ;
+		}
+		pv->proptag = PR_MESSAGE_FLAGS;
+		auto iv = cu_alloc<uint32_t>();
+		pv->pvalue = iv;
+		if (pv->pvalue == nullptr) {
+			return nullptr;
+		}
+		*iv = message_flags;
+		ppropvals->count ++;
+		++pv;
+	}
+	sqlite3_reset(pstmt1);
+	sqlite3_bind_int64(pstmt1, 1, message_id);
+	sqlite3_bind_int64(pstmt1, 2, PR_LAST_MODIFICATION_TIME);
+	if (SQLITE_ROW == sqlite3_step(pstmt1)) {
+		pv->proptag = PR_LAST_MODIFICATION_TIME;
+		uv = cu_alloc<uint64_t>();
+		pv->pvalue = uv;
+		if (pv->pvalue == nullptr) {
+			return nullptr;
+		}
+		*uv = sqlite3_column_int64(pstmt1, 0);
+		ppropvals->count ++;
+		++pv;
+	}
+	sqlite3_reset(pstmt1);
+	sqlite3_bind_int64(pstmt1, 1, message_id);
+	sqlite3_bind_int64(pstmt1, 2, PR_LAST_MODIFICATION_TIME);
+	if (SQLITE_ROW == sqlite3_step(pstmt1)) {
+		pv->proptag = PR_MESSAGE_DELIVERY_TIME;
+		uv = cu_alloc<uint64_t>();
+		pv->pvalue = uv;
+		if (pv->pvalue == nullptr) {
+			return nullptr;
+		}
+		*uv = sqlite3_column_int64(pstmt1, 0);
+		ppropvals->count ++;
+		++pv;
+	}
+	return ppropvals;
+}
+
 /* this function is only used by midb for query */
 BOOL exmdb_server::query_folder_messages(const char *dir,
 	uint64_t folder_id, TARRAY_SET *pset)
 {
-	uint64_t message_id;
 	char sql_string[256];
-	uint32_t message_flags;
 	
 	if (!exmdb_server::is_private())
 		return FALSE;
@@ -268,87 +354,95 @@ BOOL exmdb_server::query_folder_messages(const char *dir,
 		if (SQLITE_ROW != sqlite3_step(pstmt)) {
 			return FALSE;
 		}
-		auto ppropvals = cu_alloc<TPROPVAL_ARRAY>();
-		if (NULL == ppropvals) {
+		pset->pparray[i] = qfm_make_row(pstmt, pstmt1);
+		if (pset->pparray[i] == nullptr)
 			return FALSE;
-		}
-		pset->pparray[i] = ppropvals;
-		ppropvals->count = 0;
-		ppropvals->ppropval = cu_alloc<TAGGED_PROPVAL>(5);
-		if (NULL == ppropvals->ppropval) {
-			return FALSE;
-		}
-		message_id = sqlite3_column_int64(pstmt, 0);
-		auto *pv = &ppropvals->ppropval[ppropvals->count];
-		pv->proptag = PidTagMid;
-		auto uv = cu_alloc<uint64_t>();
-		pv->pvalue = uv;
-		if (pv->pvalue == nullptr) {
+	}
+	return TRUE;
+}
+
+/*
+ * Incremental counterpart of query_folder_messages for midb. Returns the
+ * messages whose change_number or read_cn is above @since_cn, the store's
+ * last allocated change number, the number of normal messages now in the
+ * folder, and those of @pgiven which are no longer in it. Private store
+ * messages are deleted outright, so there are no tombstones to report;
+ * the caller supplies the IDs it knows about instead.
+ */
+BOOL exmdb_server::query_folder_changes(const char *dir, uint64_t folder_id,
+    uint64_t since_cn, const EID_ARRAY *pgiven, uint64_t *plast_cn,
+    uint32_t *ptotal, TARRAY_SET *pset, EID_ARRAY *pdeleted) try
+{
+	char sql_string[256];
+
+	if (!exmdb_server::is_private())
+		return FALSE;
+	auto pdb = db_engine_get_db(dir);
+	if (pdb == nullptr || pdb->psqlite == nullptr)
+		return FALSE;
+	auto fid_val = rop_util_get_gc_value(folder_id);
+	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+	snprintf(sql_string, arsizeof(sql_string), "SELECT config_value "
+	         "FROM configurations WHERE config_id=%u",
+	         CONFIG_ID_LAST_CHANGE_NUMBER);
+	auto pstmt = gx_sql_prep(pdb->psqlite, sql_string);
+	if (pstmt == nullptr)
+		return FALSE;
+	*plast_cn = sqlite3_step(pstmt) == SQLITE_ROW ?
+	            sqlite3_column_int64(pstmt, 0) : 0;
+	snprintf(sql_string, arsizeof(sql_string), "SELECT count(message_id) FROM"
+	         " messages WHERE parent_fid=%llu AND is_associated=0",
+	         LLU{fid_val});
+	pstmt = gx_sql_prep(pdb->psqlite, sql_string);
+	if (pstmt == nullptr || sqlite3_step(pstmt) != SQLITE_ROW)
+		return FALSE;
+	*ptotal = sqlite3_column_int64(pstmt, 0);
+
+	snprintf(sql_string, arsizeof(sql_string), "SELECT message_id, read_state,"
+	         " mid_string FROM messages WHERE parent_fid=%llu AND "
+	         "is_associated=0 AND (change_number>%llu OR read_cn>%llu)",
+	         LLU{fid_val}, LLU{since_cn}, LLU{since_cn});
+	pstmt = gx_sql_prep(pdb->psqlite, sql_string);
+	if (pstmt == nullptr)
+		return FALSE;
+	auto pstmt1 = gx_sql_prep(pdb->psqlite, "SELECT propval "
+	              "FROM message_properties WHERE message_id=?"
+	              " AND proptag=?");
+	if (pstmt1 == nullptr)
+		return FALSE;
+	std::vector<TPROPVAL_ARRAY *> rows;
+	while (sqlite3_step(pstmt) == SQLITE_ROW) {
+		auto row = qfm_make_row(pstmt, pstmt1);
+		if (row == nullptr)
 			return FALSE;
-		}
-		*uv = rop_util_make_eid_ex(1, message_id);
-		ppropvals->count ++;
-		++pv;
-		if (SQLITE_NULL != sqlite3_column_type(pstmt, 2)) {
-			pv->proptag = PidTagMidString;
-			pv->pvalue = common_util_dup(reinterpret_cast<const char *>(sqlite3_column_text(pstmt, 2)));
-			if (pv->pvalue == nullptr) {
-				return FALSE;
-			}
-			ppropvals->count ++;
-			++pv;
-		}
-		sqlite3_reset(pstmt1);
-		sqlite3_bind_int64(pstmt1, 1, message_id);
-		sqlite3_bind_int64(pstmt1, 2, PR_MESSAGE_FLAGS);
-		if (SQLITE_ROW == sqlite3_step(pstmt1)) {
-			message_flags = sqlite3_column_int64(pstmt1, 0);
-			message_flags &= ~(MSGFLAG_READ | MSGFLAG_HASATTACH |
-			                 MSGFLAG_FROMME | MSGFLAG_ASSOCIATED |
-			                 MSGFLAG_RN_PENDING | MSGFLAG_NRN_PENDING);
-			if (0 != sqlite3_column_int64(pstmt, 1)) {
-				message_flags |= MSGFLAG_READ;
-			}
-			pv->proptag = PR_MESSAGE_FLAGS;
-			auto iv = cu_alloc<uint32_t>();
-			pv->pvalue = iv;
-			if (pv->pvalue == nullptr) {
-				return FALSE;
-			}
-			*iv = message_flags;
-			ppropvals->count ++;
-			++pv;
-		}
-		sqlite3_reset(pstmt1);
-		sqlite3_bind_int64(pstmt1, 1, message_id);
-		sqlite3_bind_int64(pstmt1, 2, PR_LAST_MODIFICATION_TIME);
-		if (SQLITE_ROW == sqlite3_step(pstmt1)) {
-			pv->proptag = PR_LAST_MODIFICATION_TIME;
-			uv = cu_alloc<uint64_t>();
-			pv->pvalue = uv;
-			if (pv->pvalue == nullptr) {
-				return FALSE;
-			}
-			*uv = sqlite3_column_int64(pstmt1, 0);
-			ppropvals->count ++;
-			++pv;
-		}
-		sqlite3_reset(pstmt1);
-		sqlite3_bind_int64(pstmt1, 1, message_id);
-		sqlite3_bind_int64(pstmt1, 2, PR_LAST_MODIFICATION_TIME);
-		if (SQLITE_ROW == sqlite3_step(pstmt1)) {
-			pv->proptag = PR_MESSAGE_DELIVERY_TIME;
-			uv = cu_alloc<uint64_t>();
-			pv->pvalue = uv;
-			if (pv->pvalue == nullptr) {
-				return FALSE;
-			}
-			*uv = sqlite3_column_int64(pstmt1, 0);
-			ppropvals->count ++;
-			++pv;
-		}
+		rows.push_back(row);
+	}
+	pset->count = 0;
+	pset->pparray = cu_alloc<TPROPVAL_ARRAY *>(rows.size());
+	if (pset->pparray == nullptr)
+		return FALSE;
+	std::copy(rows.cbegin(), rows.cend(), pset->pparray);
+	pset->count = rows.size();
+
+	pdeleted->count = 0;
+	pdeleted->pids = cu_alloc<uint64_t>(pgiven->count);
+	if (pdeleted->pids == nullptr)
+		return FALSE;
+	pstmt = gx_sql_prep(pdb->psqlite, "SELECT parent_fid "
+	        "FROM messages WHERE message_id=?");
+	if (pstmt == nullptr)
+		return FALSE;
+	for (size_t i = 0; i < pgiven->count; ++i) {
+		sqlite3_reset(pstmt);
+		sqlite3_bind_int64(pstmt, 1, rop_util_get_gc_value(pgiven->pids[i]));
+		if (sqlite3_step(pstmt) != SQLITE_ROW ||
+		    gx_sql_col_uint64(pstmt, 0) != fid_val)
+			pdeleted->pids[pdeleted->count++] = pgiven->pids[i];
 	}
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2817: ENOMEM");
+	return false;
 }
 
 BOOL exmdb_server::check_folder_deleted(const char *dir,
@@ -2428,6 +2522,7 @@ BOOL exmdb_server::empty_folder_rule(const char *dir, uint64_t folder_id)
 	auto pdb = db_engine_get_db(dir);
 	if (pdb == nullptr || pdb->psqlite == nullptr)
 		return FALSE;
+	pdb->rule_cache.erase(rop_util_get_gc_value(folder_id));
 	snprintf(sql_string, 1024, "DELETE FROM rules WHERE "
 	         "folder_id=%llu", LLU{rop_util_get_gc_value(folder_id)});
 	if (gx_sql_exec(pdb->psqlite, sql_string) != SQLITE_OK)
@@ -2451,6 +2546,7 @@ BOOL exmdb_server::update_folder_rule(const char *dir,
 	if (pdb == nullptr || pdb->psqlite == nullptr)
 		return FALSE;
 	fid_val = rop_util_get_gc_value(folder_id);
+	pdb->rule_cache.erase(fid_val);
 	snprintf(sql_string, arsizeof(sql_string), "SELECT count(*) "
 	          "FROM rules WHERE folder_id=%llu", LLU{fid_val});
 	auto pstmt = gx_sql_prep(pdb->psqlite, sql_string);
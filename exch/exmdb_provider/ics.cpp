@@ -1,8 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2020–2021 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <iterator>
+#include <utility>
+#include <vector>
 #include <gromox/database.h>
 #include <gromox/eid_array.hpp>
 #include <gromox/exmdb_common_util.hpp>
@@ -12,7 +16,6 @@
 #include <gromox/scope.hpp>
 #include <gromox/util.hpp>
 #include "db_engine.h"
-#define IDSET_CACHE_MIN_RANGE				10
 
 using namespace gromox;
 
@@ -25,44 +28,39 @@ struct ENUM_PARAM {
 	BOOL b_result;
 };
 
+struct CONTENT_ENUM_PARAM {
+	const std::vector<uint64_t> *pexist;
+	xstmt stm_msg;
+	EID_ARRAY *pdeleted_eids;
+	EID_ARRAY *pnolonger_mids;
+	BOOL b_result;
+};
+
+struct content_chg {
+	uint64_t mid_val, dtime, mtime;
+};
+
 struct REPLID_ARRAY {
 	unsigned int count;
 	uint16_t replids[1024];
 };
 
+/*
+ * Membership oracle for the client-supplied "given" idset. The ranges of
+ * replid 1 are kept as a sorted, coalesced interval list; hint() is a
+ * binary search over it, so large sparse idsets are never expanded.
+ */
 struct IDSET_CACHE {
-	IDSET_CACHE() = default;
-	~IDSET_CACHE();
-	NOMOVE(IDSET_CACHE);
 	BOOL init(const IDSET *);
-	BOOL hint(uint64_t);
+	BOOL hint(uint64_t) const;
 
-	sqlite3 *psqlite = nullptr;
-	xstmt pstmt;
 	std::vector<range_node> range_list;
 };
 
 }
 
-IDSET_CACHE::~IDSET_CACHE()
-{
-	pstmt.finalize();
-	if (psqlite != nullptr)
-		sqlite3_close(psqlite);
-}
-
 BOOL IDSET_CACHE::init(const IDSET *pset)
 {
-	auto pcache = this;
-	
-	if (SQLITE_OK != sqlite3_open_v2(":memory:", &pcache->psqlite,
-		SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL)) {
-		return FALSE;
-	}
-	if (gx_sql_exec(pcache->psqlite, "CREATE TABLE id_vals "
-	    "(id_val INTEGER PRIMARY KEY)") != SQLITE_OK)
-		return FALSE;
-	pcache->pstmt = NULL;
 	const std::vector<range_node> *prange_list = nullptr;
 	for (const auto &repl_node : pset->get_repl_list()) {
 		if (repl_node.replid == 1) {
@@ -70,62 +68,53 @@ BOOL IDSET_CACHE::init(const IDSET *pset)
 			break;
 		}
 	}
-	if (NULL == prange_list) {
+	range_list.clear();
+	if (prange_list == nullptr)
 		return TRUE;
+	try {
+		range_list = *prange_list;
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1623: ENOMEM");
+		return false;
 	}
-	auto stmt = gx_sql_prep(pcache->psqlite, "INSERT INTO id_vals VALUES (?)");
-	if (stmt == nullptr)
-		return FALSE;
-	for (const auto &range_node : *prange_list) {
-		if (range_node.high_value - range_node.low_value >= IDSET_CACHE_MIN_RANGE) try {
-			pcache->range_list.push_back(range_node);
-			continue;
-		} catch (const std::bad_alloc &) {
-			mlog(LV_ERR, "E-1623: ENOMEM");
-			return false;
-		}
-		for (auto ival = range_node.low_value;
-		     ival <= range_node.high_value; ++ival) {
-			sqlite3_reset(stmt);
-			sqlite3_bind_int64(stmt, 1, ival);
-			if (sqlite3_step(stmt) != SQLITE_DONE)
-				return FALSE;
-		}
-	}
+	/* Wire-supplied idsets are not guaranteed to be sorted or disjoint. */
+	std::sort(range_list.begin(), range_list.end(),
+		[](const range_node &a, const range_node &b) {
+			return a.low_value < b.low_value;
+		});
+	if (range_list.empty())
+		return TRUE;
+	auto out = range_list.begin();
+	for (auto it = std::next(out); it != range_list.end(); ++it) {
+		if (out->high_value == UINT64_MAX ||
+		    it->low_value <= out->high_value + 1)
+			out->high_value = std::max(out->high_value, it->high_value);
+		else
+			*++out = *it;
+	}
+	range_list.erase(std::next(out), range_list.end());
 	return TRUE;
 }
 
-BOOL IDSET_CACHE::hint(uint64_t id_val)
+BOOL IDSET_CACHE::hint(uint64_t id_val) const
 {
-	auto pcache = this;
-	
-	if (NULL == pcache->pstmt) {
-		pcache->pstmt = gx_sql_prep(pcache->psqlite, "SELECT id_val FROM id_vals WHERE id_val=?");
-		if (pcache->pstmt == nullptr)
-			return FALSE;
-	}
-	sqlite3_reset(pcache->pstmt);
-	sqlite3_bind_int64(pcache->pstmt, 1, id_val);
-	if (SQLITE_ROW == sqlite3_step(pcache->pstmt)) {
-		return TRUE;
-	}
-	for (const auto &range_node : pcache->range_list)
-		if (range_node.contains(id_val))
-			return TRUE;	
-	return FALSE;
+	auto it = std::upper_bound(range_list.cbegin(), range_list.cend(), id_val,
+	          [](uint64_t v, const range_node &r) { return v < r.low_value; });
+	if (it == range_list.cbegin())
+		return FALSE;
+	return std::prev(it)->contains(id_val) ? TRUE : FALSE;
 }
 
 static void ics_enum_content_idset(void *vparam, uint64_t message_id)
 {
-	auto pparam = static_cast<ENUM_PARAM *>(vparam);
+	auto pparam = static_cast<CONTENT_ENUM_PARAM *>(vparam);
 	uint64_t mid_val;
 	
 	if (!pparam->b_result)
 		return;
 	mid_val = rop_util_get_gc_value(message_id);
-	sqlite3_reset(pparam->stm_exist);
-	sqlite3_bind_int64(pparam->stm_exist, 1, mid_val);
-	if (sqlite3_step(pparam->stm_exist) == SQLITE_ROW)
+	if (std::binary_search(pparam->pexist->cbegin(),
+	    pparam->pexist->cend(), mid_val))
 		return;
 	sqlite3_reset(pparam->stm_msg);
 	sqlite3_bind_int64(pparam->stm_msg, 1, mid_val);
@@ -150,41 +139,21 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	EID_ARRAY *pnolonger_mids, EID_ARRAY *pread_mids,
 	EID_ARRAY *punread_mids, uint64_t *plast_readcn)
 {
-	sqlite3 *psqlite;
-	
 	*pfai_count = 0;
 	*pfai_total = 0;
 	*pnormal_count = 0;
 	*pnormal_total = 0;
 	auto b_private = exmdb_server::is_private();
 
-	/* Setup of scratch space db */
-	if (SQLITE_OK != sqlite3_open_v2(":memory:", &psqlite,
-		SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL)) {
-		return FALSE;
-	}
-	auto cl_0 = make_scope_exit([&]() { sqlite3_close(psqlite); });
-	if (gx_sql_exec(psqlite, "CREATE TABLE existence "
-	    "(message_id INTEGER PRIMARY KEY)") != SQLITE_OK)
-		return FALSE;
-	if (pread != nullptr &&
-	    gx_sql_exec(psqlite, "CREATE TABLE reads "
-	    "(message_id INTEGER PRIMARY KEY, read_state INTEGER)") != SQLITE_OK)
-		return FALSE;
-	if (b_ordered) {
-		if (gx_sql_exec(psqlite, "CREATE TABLE changes"
-		    " (message_id INTEGER PRIMARY KEY, "
-		    "delivery_time INTEGER, mod_time INTEGER)") != SQLITE_OK)
-			return FALSE;
-		if (gx_sql_exec(psqlite, "CREATE INDEX idx_dtime ON changes (delivery_time)") != SQLITE_OK)
-			return FALSE;
-		if (gx_sql_exec(psqlite, "CREATE INDEX idx_mtime ON changes (mod_time)") != SQLITE_OK)
-			return FALSE;
-	} else {
-		if (gx_sql_exec(psqlite, "CREATE TABLE changes "
-		    "(message_id INTEGER PRIMARY KEY)") != SQLITE_OK)
-			return FALSE;
-	}
+	/*
+	 * Scratch space: the folder is scanned once and the set of present
+	 * messages, the changes to be sent and the read-state updates are
+	 * kept in plain vectors; everything downstream is a sort plus a
+	 * binary search/merge against these.
+	 */
+	std::vector<uint64_t> existence;
+	std::vector<content_chg> changes;
+	std::vector<std::pair<uint64_t, bool>> reads;
 	IDSET_CACHE cache;
 	if (!cache.init(pgiven))
 		return FALSE;
@@ -195,7 +164,6 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 
 	/* Query section 1 */
 	{
-	auto transact1 = gx_sql_begin_trans(psqlite);
 	xtransaction transact2;
 	if (NULL != prestriction) {
 		transact2 = gx_sql_begin_trans(pdb->psqlite);
@@ -214,28 +182,15 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	auto stm_select_msg = gx_sql_prep(pdb->psqlite, sql_string);
 	if (stm_select_msg == nullptr)
 		return false;
-	auto stm_insert_chg = gx_sql_prep(psqlite, b_ordered ?
-	                      "INSERT INTO changes VALUES (?, ?, ?)" :
-	                      "INSERT INTO changes VALUES (?)");
-	if (stm_insert_chg == nullptr)
-		return false;
-	auto stm_insert_exist = gx_sql_prep(psqlite, "INSERT INTO existence VALUES (?)");
-	if (stm_insert_exist == nullptr)
-		return false;
-	xstmt stm_insert_reads, stm_select_rcn, stm_select_rst;
-	if (NULL != pread) {
-		if (!b_private) {
-			stm_select_rcn = gx_sql_prep(pdb->psqlite, "SELECT read_cn FROM "
-			                 "read_cns WHERE message_id=? AND username=?");
-			if (stm_select_rcn == nullptr)
-				return false;
-			stm_select_rst = gx_sql_prep(pdb->psqlite, "SELECT message_id FROM "
-			                 "read_states WHERE message_id=? AND username=?");
-			if (stm_select_rst == nullptr)
-				return false;
-		}
-		stm_insert_reads = gx_sql_prep(psqlite, "INSERT INTO reads VALUES (?, ?)");
-		if (stm_insert_reads == nullptr)
+	xstmt stm_select_rcn, stm_select_rst;
+	if (NULL != pread && !b_private) {
+		stm_select_rcn = gx_sql_prep(pdb->psqlite, "SELECT read_cn FROM "
+		                 "read_cns WHERE message_id=? AND username=?");
+		if (stm_select_rcn == nullptr)
+			return false;
+		stm_select_rst = gx_sql_prep(pdb->psqlite, "SELECT message_id FROM "
+		                 "read_states WHERE message_id=? AND username=?");
+		if (stm_select_rst == nullptr)
 			return false;
 	}
 	xstmt stm_select_mp;
@@ -247,6 +202,7 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	}
 	*plast_cn = 0;
 	*plast_readcn = 0;
+	try {
 	while (sqlite3_step(stm_select_msg) == SQLITE_ROW) {
 		uint64_t mid_val = sqlite3_column_int64(stm_select_msg, 0);
 		uint64_t change_num = sqlite3_column_int64(stm_select_msg, 1);
@@ -265,10 +221,7 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		    !cu_eval_msg_restriction(pdb->psqlite,
 		    cpid, mid_val, prestriction))
 			continue;	
-		sqlite3_reset(stm_insert_exist);
-		sqlite3_bind_int64(stm_insert_exist, 1, mid_val);
-		if (sqlite3_step(stm_insert_exist) != SQLITE_DONE)
-			return false;
+		existence.push_back(mid_val);
 		if (change_num > *plast_cn) {
 			*plast_cn = change_num;
 		}
@@ -276,13 +229,15 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		if (b_private) {
 			read_cn = sqlite3_column_type(stm_select_msg, 5) == SQLITE_NULL ? 0 :
 			          sqlite3_column_int64(stm_select_msg, 5);
-		} else {
+		} else if (NULL != pread) {
 			sqlite3_reset(stm_select_rcn);
 			sqlite3_bind_int64(stm_select_rcn, 1, mid_val);
 			sqlite3_bind_text(stm_select_rcn, 2,
 				username, -1, SQLITE_STATIC);
 			read_cn = sqlite3_step(stm_select_rcn) != SQLITE_ROW ? 0 :
 			          sqlite3_column_int64(stm_select_rcn, 0);
+		} else {
+			read_cn = 0;
 		}
 		if (read_cn > *plast_readcn) {
 			*plast_readcn = read_cn;
@@ -300,9 +255,9 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 			    const_cast<IDSET *>(pread)->hint(rop_util_make_eid_ex(1, read_cn))) {
 				continue;
 			}
-			int read_state;
+			bool read_state;
 			if (b_private) {
-				read_state = sqlite3_column_int64(stm_select_msg, 4);
+				read_state = sqlite3_column_int64(stm_select_msg, 4) != 0;
 			} else {
 				sqlite3_reset(stm_select_rst);
 				sqlite3_bind_int64(stm_select_rst, 1, mid_val);
@@ -310,11 +265,7 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 					username, -1 , SQLITE_STATIC);
 				read_state = sqlite3_step(stm_select_rst) == SQLITE_ROW;
 			}
-			sqlite3_reset(stm_insert_reads);
-			sqlite3_bind_int64(stm_insert_reads, 1, mid_val);
-			sqlite3_bind_int64(stm_insert_reads, 2, read_state);
-			if (sqlite3_step(stm_insert_reads) != SQLITE_DONE)
-				return false;
+			reads.emplace_back(mid_val, read_state);
 			continue;
 		}
 		uint64_t dtime = 0, mtime = 0;
@@ -337,19 +288,13 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 			(*pnormal_count) ++;
 			*pnormal_total += message_size;
 		}
-		sqlite3_reset(stm_insert_chg);
-		sqlite3_bind_int64(stm_insert_chg, 1, mid_val);
-		if (b_ordered) {
-			sqlite3_bind_int64(stm_insert_chg, 2, dtime);
-			sqlite3_bind_int64(stm_insert_chg, 3, mtime);
-		}
-		if (sqlite3_step(stm_insert_chg) != SQLITE_DONE)
-			return false;
+		changes.push_back(content_chg{mid_val, dtime, mtime});
+	}
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-2806: ENOMEM");
+		return false;
 	}
 	stm_select_msg.finalize();
-	stm_insert_chg.finalize();
-	stm_insert_exist.finalize();
-	stm_insert_reads.finalize();
 	stm_select_rcn.finalize();
 	stm_select_rst.finalize();
 	stm_select_mp.finalize();
@@ -359,24 +304,35 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	if (0 != *plast_readcn) {
 		*plast_readcn = rop_util_make_eid_ex(1, *plast_readcn);
 	}
-	transact1.commit();
 	transact2.commit();
 	} /* section 1 */
 
-	/* Query section 2a */
-	{
-	ssize_t count;
+	/*
+	 * The scan follows the parent_fid index, which need not be in
+	 * message_id order. Establish the orders the client expects (and
+	 * that section 3's lookups need).
+	 */
+	std::sort(existence.begin(), existence.end());
+	std::sort(reads.begin(), reads.end());
+	std::sort(changes.begin(), changes.end(),
+		[](const content_chg &a, const content_chg &b) {
+			return a.mid_val < b.mid_val;
+		});
+	if (b_ordered)
+		std::stable_sort(changes.begin(), changes.end(),
+			[](const content_chg &a, const content_chg &b) {
+				if (a.dtime != b.dtime)
+					return a.dtime > b.dtime;
+				return a.mtime > b.mtime;
+			});
+
+	/* Query section 2 */
 	{
-	auto stm_select_chg = gx_sql_prep(psqlite, "SELECT count(*) FROM changes");
-	if (stm_select_chg == nullptr || sqlite3_step(stm_select_chg) != SQLITE_ROW)
-		return FALSE;
-	count = sqlite3_column_int64(stm_select_chg, 0);
-	stm_select_chg.finalize();
 	pchg_mids->count = 0;
 	pupdated_mids->count = 0;
-	if (count > 0) {
-		pupdated_mids->pids = cu_alloc<uint64_t>(count);
-		pchg_mids->pids = cu_alloc<uint64_t>(count);
+	if (changes.size() > 0) {
+		pupdated_mids->pids = cu_alloc<uint64_t>(changes.size());
+		pchg_mids->pids = cu_alloc<uint64_t>(changes.size());
 		if (NULL == pupdated_mids->pids || NULL == pchg_mids->pids) {
 			return FALSE;
 		}
@@ -384,33 +340,17 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		pupdated_mids->pids = NULL;
 		pchg_mids->pids = NULL;
 	}
-	} /* section 2a */
-
-	/* Query section 2b */
-	{
-	auto stm_select_chg = gx_sql_prep(psqlite, b_ordered ?
-	                      "SELECT message_id FROM changes ORDER BY delivery_time DESC, mod_time DESC" :
-	                      "SELECT message_id FROM changes");
-	if (stm_select_chg == nullptr)
-		return FALSE;
-	for (ssize_t i = 0; i < count; ++i) {
-		if (sqlite3_step(stm_select_chg) != SQLITE_ROW)
-			return FALSE;
-		uint64_t mid_val = sqlite3_column_int64(stm_select_chg, 0);
-		pchg_mids->pids[pchg_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-		if (cache.hint(mid_val))
-			pupdated_mids->pids[pupdated_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-	}
-	} /* section 2b */
+	for (const auto &chg : changes) {
+		pchg_mids->pids[pchg_mids->count++] = rop_util_make_eid_ex(1, chg.mid_val);
+		if (cache.hint(chg.mid_val))
+			pupdated_mids->pids[pupdated_mids->count++] = rop_util_make_eid_ex(1, chg.mid_val);
 	}
+	} /* section 2 */
 
 	/* Query section 3 */
 	{
-	ENUM_PARAM enum_param;
-	enum_param.stm_exist = gx_sql_prep(psqlite,
-	                       "SELECT message_id FROM existence WHERE message_id=?");
-	if (enum_param.stm_exist == nullptr)
-		return FALSE;
+	CONTENT_ENUM_PARAM enum_param;
+	enum_param.pexist = &existence;
 	enum_param.stm_msg = gx_sql_prep(pdb->psqlite,
 	                     "SELECT message_id FROM messages WHERE message_id=?");
 	if (enum_param.stm_msg == nullptr)
@@ -431,7 +371,6 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		eid_array_free(enum_param.pnolonger_mids);
 		return FALSE;	
 	}
-	enum_param.stm_exist.finalize();
 	enum_param.stm_msg.finalize();
 	pdeleted_mids->count = enum_param.pdeleted_eids->count;
 	if (0 != enum_param.pdeleted_eids->count) {
@@ -469,80 +408,40 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	pdb.reset();
 
 	/* Query section 4 */
-	{
-	auto stm_select_exist = gx_sql_prep(psqlite, "SELECT count(*) FROM existence");
-	if (stm_select_exist == nullptr ||
-	    sqlite3_step(stm_select_exist) != SQLITE_ROW)
-		return FALSE;
-	int64_t count = sqlite3_column_int64(stm_select_exist, 0);
-	stm_select_exist.finalize();
 	pgiven_mids->count = 0;
-	if (count <= 0) {
+	if (existence.empty()) {
 		pgiven_mids->pids = NULL;
 	} else {
-		pgiven_mids->pids = cu_alloc<uint64_t>(count);
+		pgiven_mids->pids = cu_alloc<uint64_t>(existence.size());
 		if (NULL == pgiven_mids->pids) {
 			return FALSE;
 		}
-		auto stm_select_ex = gx_sql_prep(psqlite, "SELECT message_id"
-		                     " FROM existence ORDER BY message_id DESC");
-		if (stm_select_ex == nullptr)
-			return FALSE;
-		while (sqlite3_step(stm_select_ex) == SQLITE_ROW) {
-			uint64_t mid_val = sqlite3_column_int64(stm_select_ex, 0);
-			pgiven_mids->pids[pgiven_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-		}
+		for (auto it = existence.crbegin(); it != existence.crend(); ++it)
+			pgiven_mids->pids[pgiven_mids->count++] = rop_util_make_eid_ex(1, *it);
 	}
-	} /* section 4 */
 
 	/* Query section 5 */
-	if (NULL != pread) {
-		auto stm_select_rd = gx_sql_prep(psqlite, "SELECT count(*) FROM reads");
-		if (stm_select_rd == nullptr ||
-		    sqlite3_step(stm_select_rd) != SQLITE_ROW)
-			return FALSE;
-		uint64_t count = sqlite3_column_int64(stm_select_rd, 0);
-		stm_select_rd.finalize();
-		pread_mids->count = 0;
-		punread_mids->count = 0;
-		if (count <= 0) {
-			pread_mids->pids = NULL;
-			punread_mids->pids = NULL;
-		} else {
-			pread_mids->pids = cu_alloc<uint64_t>(count);
-			if (NULL == pread_mids->pids) {
-				return FALSE;
-			}
-			punread_mids->pids = cu_alloc<uint64_t>(count);
-			if (NULL == punread_mids->pids) {
-				return FALSE;
-			}
-			stm_select_rd = gx_sql_prep(psqlite,
-					"SELECT message_id, read_state FROM reads");
-			if (stm_select_rd == nullptr)
-				return FALSE;
-			while (sqlite3_step(stm_select_rd) == SQLITE_ROW) {
-				uint64_t mid_val = sqlite3_column_int64(stm_select_rd, 0);
-				if (punread_mids->count == count ||
-				    pread_mids->count == count)
-					/*
-					 * This thread is holding the DB. There can't really be a
-					 * discrepance between SELECT COUNT(*) and the subsequent
-					 * SELECT. But check for it anyway to appease static checkers.
-					 */
-					break;
-				if (sqlite3_column_int64(stm_select_rd, 1) == 0)
-					punread_mids->pids[punread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-				else
-					pread_mids->pids[pread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-			}
-		}
-	} else {
-		pread_mids->count = 0;
+	pread_mids->count = 0;
+	punread_mids->count = 0;
+	if (reads.empty()) {
 		pread_mids->pids = NULL;
-		punread_mids->count = 0;
 		punread_mids->pids = NULL;
-	} /* section 5 */
+	} else {
+		pread_mids->pids = cu_alloc<uint64_t>(reads.size());
+		if (NULL == pread_mids->pids) {
+			return FALSE;
+		}
+		punread_mids->pids = cu_alloc<uint64_t>(reads.size());
+		if (NULL == punread_mids->pids) {
+			return FALSE;
+		}
+		for (const auto &[mid_val, read_state] : reads) {
+			if (read_state)
+				pread_mids->pids[pread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
+			else
+				punread_mids->pids[punread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
+		}
+	}
 	return TRUE;
 }
 
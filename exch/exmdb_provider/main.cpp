@@ -43,6 +43,7 @@ static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"exmdb_schema_upgrades", "auto"},
 	{"exmdb_search_nice", "0"},
 	{"exmdb_search_pacing", "250", CFG_SIZE},
+	{"exmdb_search_parallelism", "4", CFG_SIZE, "1", "64"},
 	{"exmdb_search_yield", "0", CFG_BOOL},
 	{"exrpc_debug", "0"},
 	{"listen_ip", "::1"},
@@ -92,6 +93,7 @@ static bool exmdb_provider_reload(std::shared_ptr<CONFIG_FILE> pconfig) try
 	g_exmdb_search_pacing = pconfig->get_ll("exmdb_search_pacing");
 	g_exmdb_search_yield = pconfig->get_ll("exmdb_search_yield");
 	g_exmdb_search_nice = pconfig->get_ll("exmdb_search_nice");
+	g_exmdb_search_parallelism = pconfig->get_ll("exmdb_search_parallelism");
 	auto s = pconfig->get_value("exmdb_schema_upgrades");
 	if (strcmp(s, "auto") == 0)
 		g_exmdb_schema_upgrades = EXMDB_UPGRADE_AUTO;
@@ -115,6 +117,7 @@ static BOOL svc_exmdb_provider(int reason, void **ppdata) try
 		textmaps_init();
 		exmdb_rpc_alloc = common_util_alloc;
 		exmdb_rpc_free = [](void *) {};
+		exmdb_rpc_borrow = true;
 		std::string cfg_path = get_plugin_name();
 		auto pos = cfg_path.find_last_of('.');
 		if (pos != cfg_path.npos)
@@ -29,7 +29,10 @@
 #include <gromox/mapidefs.h>
 #include <gromox/oxcmail.hpp>
 #include <gromox/proptag_array.hpp>
+#include <gromox/propval.hpp>
+#include <gromox/restriction.hpp>
 #include <gromox/rop_util.hpp>
+#include <gromox/rule_actions.hpp>
 #include <gromox/scope.hpp>
 #include <gromox/svc_common.h>
 #include <gromox/util.hpp>
@@ -45,11 +48,7 @@ using namespace gromox;
 
 namespace {
 
-struct RULE_NODE {
-	uint32_t sequence = 0, state = 0;
-	uint64_t id = 0;
-	std::string provider;
-};
+using RULE_NODE = rule_node;
 
 struct DAM_NODE {
 	uint64_t rule_id = 0, folder_id = 0, message_id = 0;
@@ -64,11 +63,12 @@ struct message_node {
 struct seen_list {
 	std::vector<uint64_t> fld;
 	std::vector<message_node> msg;
+	DB_ITEM *pdb = nullptr; /* for the rule cache */
 };
 
 }
 
-static ec_error_t message_rule_new_message(BOOL, const char *, const char *, uint32_t, sqlite3 *, uint64_t, uint64_t, const char *, seen_list &);
+static ec_error_t message_rule_new_message(BOOL, const char *, const char *, uint32_t, sqlite3 *, uint64_t, uint64_t, const char *, const TPROPVAL_ARRAY *, seen_list &);
 
 static constexpr uint8_t fake_true = true;
 static constexpr uint32_t dummy_rcpttype = MAPI_TO;
@@ -2203,124 +2203,6 @@ static BOOL message_write_message(BOOL b_internal, sqlite3 *psqlite,
 			parent_id, 0, psqlite, &tmp_propval, &b_result);
 }
 
-static BOOL message_load_folder_rules(BOOL b_oof, sqlite3 *psqlite,
-    uint64_t folder_id, std::list<RULE_NODE> &plist)
-{
-	char sql_string[256];
-	
-	snprintf(sql_string, arsizeof(sql_string), "SELECT state, rule_id,"
-					" sequence, provider FROM rules WHERE"
-					" folder_id=%lld", LLU{folder_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr)
-		return FALSE;
-	while (SQLITE_ROW == sqlite3_step(pstmt)) {
-		uint32_t state = sqlite3_column_int64(pstmt, 0);
-		if (state & (ST_PARSE_ERROR | ST_ERROR))
-			continue;
-		if (state & ST_ENABLED) {
-			/* do nothing */
-		} else if (state & ST_ONLY_WHEN_OOF) {
-			if (!b_oof)
-				continue;
-		} else {
-			continue;
-		}
-		std::list<RULE_NODE> rn;
-		uint32_t seq = 0;
-		try {
-			auto prov = reinterpret_cast<const char *>(sqlite3_column_text(pstmt, 3));
-			if (prov == nullptr)
-				continue;
-			uint64_t msg_id = sqlite3_column_int64(pstmt, 1);
-			seq = sqlite3_column_int64(pstmt, 2);
-			rn.push_back(RULE_NODE{seq, state, msg_id, prov});
-		} catch (const std::bad_alloc &) {
-			mlog(LV_ERR, "E-1561: ENOMEM");
-			return false;
-		}
-		auto it = std::find_if(plist.begin(), plist.end(),
-		          [&](const RULE_NODE &r) { return r.sequence == seq; });
-		plist.splice(it, std::move(rn));
-	}
-	return TRUE;
-}
-
-static BOOL message_load_folder_ext_rules(BOOL b_oof, sqlite3 *psqlite,
-    uint64_t folder_id, std::list<RULE_NODE> &plist)
-{
-	char sql_string[256];
-	
-	if (exmdb_server::is_private())
-		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id "
-				"FROM messages WHERE parent_fid=%llu AND "
-				"is_associated=1", LLU{folder_id});
-	else
-		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id "
-				"FROM messages WHERE parent_fid=%llu AND "
-				"is_associated=1 AND is_deleted=0",
-				LLU{folder_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr)
-		return FALSE;
-	size_t count = 0, ext_count = 0;
-	while (SQLITE_ROW == sqlite3_step(pstmt)) {
-		if (++count > MAX_FAI_COUNT)
-			break;
-		uint64_t message_id = sqlite3_column_int64(pstmt, 0);
-		void *pvalue = nullptr;
-		if (!cu_get_property(db_table::msg_props,
-		    message_id, 0, psqlite, PR_MESSAGE_CLASS, &pvalue))
-			return FALSE;
-		if (pvalue != nullptr && strcasecmp(static_cast<char *>(pvalue),
-		    "IPM.ExtendedRule.Message") != 0)
-			continue;
-		if (!cu_get_property(db_table::msg_props,
-		    message_id, 0, psqlite, PR_RULE_MSG_STATE, &pvalue))
-			return FALSE;
-		if (NULL == pvalue) {
-			continue;
-		}
-		auto state = *static_cast<uint32_t *>(pvalue);
-		if (state & (ST_PARSE_ERROR | ST_ERROR))
-			continue;
-		if (state & ST_ENABLED) {
-			/* do nothing */
-		} else if (state & ST_ONLY_WHEN_OOF) {
-			if (!b_oof)
-				continue;
-		} else {
-			continue;
-		}
-		if (!cu_get_property(db_table::msg_props,
-		    message_id, 0, psqlite, PR_RULE_MSG_SEQUENCE, &pvalue))
-			return FALSE;
-		if (NULL == pvalue) {
-			continue;
-		}
-		auto seq = *static_cast<uint32_t *>(pvalue);
-		if (!cu_get_property(db_table::msg_props,
-		    message_id, 0, psqlite, PR_RULE_MSG_PROVIDER, &pvalue))
-			return FALSE;
-		if (NULL == pvalue) {
-			continue;
-		}
-		std::list<RULE_NODE> rn;
-		try {
-			rn.push_back(RULE_NODE{seq, state, message_id, static_cast<char *>(pvalue)});
-		} catch (const std::bad_alloc &) {
-			mlog(LV_ERR, "E-1507: ENOMEM");
-			return false;
-		}
-		auto it = std::find_if(plist.begin(), plist.end(),
-		          [&](const RULE_NODE &r) { return r.sequence == seq; });
-		plist.splice(it, std::move(rn));
-		if (++ext_count > g_max_extrule_num)
-			break;
-	}
-	return TRUE;
-}
-
 static BOOL message_get_real_propid(sqlite3 *psqlite,
 	NAMEDPROPERTY_INFOMATION *ppropname_info,
 	uint32_t *pproptag, BOOL *pb_replaced)
@@ -2448,6 +2330,349 @@ static BOOL message_replace_restriction_propid(sqlite3 *psqlite,
 	return TRUE;
 }
 
+/* Splice before the first node with the same sequence, like before */
+static void message_insert_rule(std::vector<RULE_NODE> &plist, RULE_NODE &&rn)
+{
+	auto it = std::find_if(plist.begin(), plist.end(),
+	          [&](const RULE_NODE &r) { return r.sequence == rn.sequence; });
+	plist.insert(it, std::move(rn));
+}
+
+static BOOL message_load_folder_rules(BOOL b_oof, sqlite3 *psqlite,
+    uint64_t folder_id, std::vector<RULE_NODE> &plist) try
+{
+	char sql_string[256];
+	
+	snprintf(sql_string, arsizeof(sql_string), "SELECT state, rule_id,"
+					" sequence, provider FROM rules WHERE"
+					" folder_id=%lld", LLU{folder_id});
+	auto pstmt = gx_sql_prep(psqlite, sql_string);
+	if (pstmt == nullptr)
+		return FALSE;
+	while (SQLITE_ROW == sqlite3_step(pstmt)) {
+		uint32_t state = sqlite3_column_int64(pstmt, 0);
+		if (state & (ST_PARSE_ERROR | ST_ERROR))
+			continue;
+		if (state & ST_ENABLED) {
+			/* do nothing */
+		} else if (state & ST_ONLY_WHEN_OOF) {
+			if (!b_oof)
+				continue;
+		} else {
+			continue;
+		}
+		auto prov = reinterpret_cast<const char *>(sqlite3_column_text(pstmt, 3));
+		if (prov == nullptr)
+			continue;
+		RULE_NODE rn{static_cast<uint32_t>(sqlite3_column_int64(pstmt, 2)),
+			state, static_cast<uint64_t>(sqlite3_column_int64(pstmt, 1)), prov};
+		void *pvalue = nullptr;
+		if (!common_util_get_rule_property(rn.id, psqlite,
+		    PR_RULE_CONDITION, &pvalue))
+			return FALSE;
+		if (pvalue != nullptr) {
+			auto cond = static_cast<RESTRICTION *>(pvalue);
+			rn.cond.reset(restriction_dup(cond), restriction_free);
+			if (rn.cond == nullptr)
+				throw std::bad_alloc();
+			rn.b_counting = cu_restriction_counting(cond);
+		}
+		if (!common_util_get_rule_property(rn.id, psqlite,
+		    PR_RULE_ACTIONS, &pvalue))
+			return FALSE;
+		if (pvalue != nullptr) {
+			rn.actions.reset(rule_actions_dup(static_cast<RULE_ACTIONS *>(pvalue)),
+				rule_actions_free);
+			if (rn.actions == nullptr)
+				throw std::bad_alloc();
+		}
+		message_insert_rule(plist, std::move(rn));
+	}
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1561: ENOMEM");
+	return false;
+}
+
+static BOOL message_load_folder_ext_rules(BOOL b_oof, sqlite3 *psqlite,
+    uint64_t folder_id, folder_rules &frules) try
+{
+	char sql_string[256];
+	auto &plist = frules.ext_rules;
+	
+	if (exmdb_server::is_private())
+		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id "
+				"FROM messages WHERE parent_fid=%llu AND "
+				"is_associated=1", LLU{folder_id});
+	else
+		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id "
+				"FROM messages WHERE parent_fid=%llu AND "
+				"is_associated=1 AND is_deleted=0",
+				LLU{folder_id});
+	auto pstmt = gx_sql_prep(psqlite, sql_string);
+	if (pstmt == nullptr)
+		return FALSE;
+	size_t count = 0, ext_count = 0;
+	while (SQLITE_ROW == sqlite3_step(pstmt)) {
+		if (++count > MAX_FAI_COUNT)
+			break;
+		uint64_t message_id = sqlite3_column_int64(pstmt, 0);
+		frules.fai_ids.push_back(message_id);
+		void *pvalue = nullptr;
+		if (!cu_get_property(db_table::msg_props,
+		    message_id, 0, psqlite, PR_MESSAGE_CLASS, &pvalue))
+			return FALSE;
+		if (pvalue != nullptr && strcasecmp(static_cast<char *>(pvalue),
+		    "IPM.ExtendedRule.Message") != 0)
+			continue;
+		if (!cu_get_property(db_table::msg_props,
+		    message_id, 0, psqlite, PR_RULE_MSG_STATE, &pvalue))
+			return FALSE;
+		if (NULL == pvalue) {
+			continue;
+		}
+		auto state = *static_cast<uint32_t *>(pvalue);
+		if (state & (ST_PARSE_ERROR | ST_ERROR))
+			continue;
+		if (state & ST_ENABLED) {
+			/* do nothing */
+		} else if (state & ST_ONLY_WHEN_OOF) {
+			if (!b_oof)
+				continue;
+		} else {
+			continue;
+		}
+		if (!cu_get_property(db_table::msg_props,
+		    message_id, 0, psqlite, PR_RULE_MSG_SEQUENCE, &pvalue))
+			return FALSE;
+		if (NULL == pvalue) {
+			continue;
+		}
+		auto seq = *static_cast<uint32_t *>(pvalue);
+		if (!cu_get_property(db_table::msg_props,
+		    message_id, 0, psqlite, PR_RULE_MSG_PROVIDER, &pvalue))
+			return FALSE;
+		if (NULL == pvalue) {
+			continue;
+		}
+		RULE_NODE rn{seq, state, message_id, static_cast<char *>(pvalue)};
+		if (!cu_get_property(db_table::msg_props, message_id, 0, psqlite,
+		    PR_EXTENDED_RULE_MSG_CONDITION, &pvalue))
+			return FALSE;
+		auto bv = static_cast<BINARY *>(pvalue);
+		if (bv != nullptr && bv->cb != 0) {
+			EXT_PULL ext_pull;
+			ext_pull.init(bv->pb, bv->cb, common_util_alloc,
+				EXT_FLAG_WCOUNT | EXT_FLAG_UTF16);
+			NAMEDPROPERTY_INFOMATION propname_info;
+			RESTRICTION restriction;
+			/* unparsable conditions never match */
+			if (ext_pull.g_namedprop_info(&propname_info) == EXT_ERR_SUCCESS &&
+			    ext_pull.g_restriction(&restriction) == EXT_ERR_SUCCESS) {
+				if (!message_replace_restriction_propid(psqlite,
+				    &propname_info, &restriction))
+					return FALSE;
+				rn.cond.reset(restriction_dup(&restriction), restriction_free);
+				if (rn.cond == nullptr)
+					throw std::bad_alloc();
+				rn.b_counting = cu_restriction_counting(&restriction);
+			}
+		}
+		message_insert_rule(plist, std::move(rn));
+		if (++ext_count > g_max_extrule_num)
+			break;
+	}
+	std::sort(frules.fai_ids.begin(), frules.fai_ids.end());
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1507: ENOMEM");
+	return false;
+}
+
+/* Cheap fingerprint of a folder's FAI messages (extended rules live there) */
+static BOOL message_fai_snapshot(sqlite3 *psqlite, uint64_t folder_id,
+    uint64_t &count, uint64_t &max_cn, uint64_t &deleted)
+{
+	auto pstmt = gx_sql_prep(psqlite, exmdb_server::is_private() ?
+	             "SELECT count(*), max(change_number), 0 FROM messages "
+	             "WHERE parent_fid=? AND is_associated=1" :
+	             "SELECT count(*), max(change_number), sum(is_deleted) "
+	             "FROM messages WHERE parent_fid=? AND is_associated=1");
+	if (pstmt == nullptr)
+		return FALSE;
+	sqlite3_bind_int64(pstmt, 1, folder_id);
+	if (pstmt.step() != SQLITE_ROW)
+		return FALSE;
+	count   = sqlite3_column_int64(pstmt, 0);
+	max_cn  = sqlite3_column_int64(pstmt, 1);
+	deleted = sqlite3_column_int64(pstmt, 2);
+	return TRUE;
+}
+
+/**
+ * Return the parsed rules of @folder_id, from the DB_ITEM cache when it is
+ * still current. The rules table is guarded by explicit invalidation
+ * (update_folder_rule); the FAI fingerprint catches extended rule changes
+ * that bypass the notification paths.
+ */
+static std::shared_ptr<const folder_rules>
+message_get_folder_rules(DB_ITEM *pdb, BOOL b_oof, sqlite3 *psqlite,
+    uint64_t folder_id) try
+{
+	uint64_t count = 0, max_cn = 0, deleted = 0;
+	if (!message_fai_snapshot(psqlite, folder_id, count, max_cn, deleted))
+		return nullptr;
+	if (pdb != nullptr) {
+		auto it = pdb->rule_cache.find(folder_id);
+		if (it != pdb->rule_cache.end()) {
+			auto &fr = *it->second;
+			if (fr.b_oof == !!b_oof && fr.fai_count == count &&
+			    fr.fai_max_cn == max_cn && fr.fai_deleted == deleted)
+				return it->second;
+			pdb->rule_cache.erase(it);
+		}
+	}
+	auto fr = std::make_shared<folder_rules>();
+	fr->b_oof = b_oof;
+	fr->fai_count = count;
+	fr->fai_max_cn = max_cn;
+	fr->fai_deleted = deleted;
+	if (!message_load_folder_rules(b_oof, psqlite, folder_id, fr->rules) ||
+	    !message_load_folder_ext_rules(b_oof, psqlite, folder_id, *fr))
+		return nullptr;
+	if (pdb != nullptr)
+		pdb->rule_cache[folder_id] = fr;
+	return fr;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2808: ENOMEM");
+	return nullptr;
+}
+
+/*
+ * Value of @proptag as it will read back from the store after
+ * message_write_message, or nullptr if that cannot be told from the
+ * delivered property list alone.
+ */
+static const void *message_precheck_getval(const TPROPVAL_ARRAY *props,
+    uint32_t proptag)
+{
+	switch (proptag) {
+	case PR_BODY:
+	case PR_HTML:
+	case PR_TRANSPORT_MESSAGE_HEADERS:
+		/* kept verbatim in content files */
+		return props->getval(proptag);
+	case PR_MSG_STATUS:
+	case PR_SEARCH_KEY:
+	case PR_BODY_CONTENT_ID:
+	case PR_CONVERSATION_ID:
+	case PR_CONVERSATION_INDEX:
+	case PR_CONVERSATION_INDEX_TRACKING:
+	case PR_CONVERSATION_TOPIC:
+	case PR_CHANGE_KEY:
+	case PR_PREDECESSOR_CHANGE_LIST:
+	case PR_INTERNET_ARTICLE_NUMBER:
+		/* set or replaced by message_write_message */
+		return nullptr;
+	}
+	/* 8-bit strings are stored converted */
+	if (PROP_TYPE(proptag) == PT_STRING8 ||
+	    cu_msgprop_is_synthesized(proptag))
+		return nullptr;
+	return props->getval(proptag);
+}
+
+/*
+ * Evaluate a rule condition against the in-memory properties of a message
+ * being delivered. Returns 0 or 1 when the outcome is certain, -1 if the
+ * store needs to be consulted.
+ */
+static int message_precheck_restriction(const RESTRICTION *pres,
+    const TPROPVAL_ARRAY *props)
+{
+	switch (pres->rt) {
+	case RES_AND:
+	case RES_OR: {
+		int want = pres->rt == RES_OR, ret = !want;
+		for (size_t i = 0; i < pres->andor->count; ++i) {
+			auto r = message_precheck_restriction(&pres->andor->pres[i], props);
+			if (r == want)
+				return want;
+			if (r < 0)
+				ret = -1;
+		}
+		return ret;
+	}
+	case RES_NOT: {
+		auto r = message_precheck_restriction(&pres->xnot->res, props);
+		return r < 0 ? r : !r;
+	}
+	case RES_CONTENT: {
+		auto rcon = pres->cont;
+		if (PROP_TYPE(rcon->proptag) != PROP_TYPE(rcon->propval.proptag))
+			return 0;
+		if (PROP_TYPE(rcon->proptag) != PT_BINARY &&
+		    PROP_TYPE(rcon->proptag) != PT_STRING8 &&
+		    PROP_TYPE(rcon->proptag) != PT_UNICODE)
+			return 0;
+		auto pvalue = message_precheck_getval(props, rcon->proptag);
+		if (pvalue == nullptr)
+			return -1;
+		return cu_eval_content(rcon, pvalue);
+	}
+	case RES_PROPERTY: {
+		auto rprop = pres->prop;
+		if (rprop->proptag == PR_ANR)
+			return -1;
+		auto pvalue = message_precheck_getval(props, rprop->proptag);
+		if (pvalue == nullptr)
+			return -1;
+		return propval_compare_relop_nullok(rprop->relop,
+		       PROP_TYPE(rprop->proptag), pvalue, rprop->propval.pvalue);
+	}
+	case RES_BITMASK: {
+		auto rbm = pres->bm;
+		if (PROP_TYPE(rbm->proptag) != PT_LONG)
+			return 0;
+		auto pvalue = message_precheck_getval(props, rbm->proptag);
+		if (pvalue == nullptr)
+			return -1;
+		auto v = *static_cast<const uint32_t *>(pvalue) & rbm->mask;
+		switch (rbm->bitmask_relop) {
+		case BMR_EQZ:
+			return v == 0;
+		case BMR_NEZ:
+			return v != 0;
+		}
+		return 0;
+	}
+	case RES_EXIST:
+		return message_precheck_getval(props, pres->exist->proptag) != nullptr ? 1 : -1;
+	default:
+		return -1;
+	}
+}
+
+static bool message_eval_rule_cond(sqlite3 *psqlite, uint64_t message_id,
+    const TPROPVAL_ARRAY *props, const RULE_NODE *prnode)
+{
+	if (prnode->cond == nullptr)
+		return false;
+	auto r = props != nullptr ? message_precheck_restriction(prnode->cond.get(), props) : -1;
+	if (r >= 0)
+		return r;
+	if (!prnode->b_counting)
+		return cu_eval_msg_restriction(psqlite, 0, message_id, prnode->cond.get());
+	/* RES_COUNT decrements its counter while evaluating */
+	std::unique_ptr<RESTRICTION, void (*)(RESTRICTION *)>
+		cond(restriction_dup(prnode->cond.get()), restriction_free);
+	if (cond == nullptr) {
+		mlog(LV_ERR, "E-2809: ENOMEM");
+		return false;
+	}
+	return cu_eval_msg_restriction(psqlite, 0, message_id, cond.get());
+}
+
 static BOOL message_replace_actions_propid(sqlite3 *psqlite,
 	NAMEDPROPERTY_INFOMATION *ppropname_info, EXT_RULE_ACTIONS *pactions)
 {
@@ -2533,13 +2758,15 @@ static BOOL message_make_deferred_error_message(const char *username,
 }
 
 static ec_error_t message_disable_rule(sqlite3 *psqlite,
-	BOOL b_extended, uint64_t id)
+	BOOL b_extended, const RULE_NODE *prnode)
 {
 	void *pvalue;
 	BOOL b_result;
 	char sql_string[128];
 	TAGGED_PROPVAL propval;
+	auto id = prnode->id;
 	
+	prnode->b_disabled = true;
 	if (!b_extended) {
 		snprintf(sql_string, arsizeof(sql_string), "UPDATE rules SET state=state|%u "
 		         "WHERE rule_id=%llu", ST_ERROR, LLU{id});
@@ -3174,7 +3401,7 @@ static ec_error_t op_move_same(BOOL b_oof, const char *from_address,
 			psqlite, folder_id, message_id, prnode->id,
 			RULE_ERROR_MOVECOPY, block.type,
 			rule_idx, prnode->provider.c_str(), seen);
-		return message_disable_rule(psqlite, false, prnode->id);
+		return message_disable_rule(psqlite, false, prnode);
 	}
 	int tmp_id = 0, tmp_id1 = 0;
 	auto is_pvt = exmdb_server::is_private();
@@ -3223,7 +3450,7 @@ static ec_error_t op_move_same(BOOL b_oof, const char *from_address,
 		pdigest1 = NULL;
 	}
 	auto ec = message_rule_new_message(b_oof, from_address, account,
-	          cpid, psqlite, dst_fid, dst_mid, pdigest1, seen);
+	          cpid, psqlite, dst_fid, dst_mid, pdigest1, nullptr, seen);
 	if (ec != ecSuccess)
 		return ec;
 	if (block.type == OP_MOVE) {
@@ -3280,7 +3507,7 @@ static ec_error_t op_reply(const char *from_address, const char *account,
 		message_make_deferred_error_message(account, psqlite, folder_id,
 			message_id, prnode->id, RULE_ERROR_RETRIEVE_TEMPLATE,
 			block.type, rule_idx, prnode->provider.c_str(), seen);
-		return message_disable_rule(psqlite, false, prnode->id);
+		return message_disable_rule(psqlite, false, prnode);
 	}
 	return ecSuccess;
 }
@@ -3315,7 +3542,7 @@ static ec_error_t op_forward(const char *from_address, const char *account,
 		message_make_deferred_error_message(account, psqlite, folder_id,
 			message_id, prnode->id, RULE_ERROR_TOO_MANY_RCPTS,
 			block.type, rule_idx, prnode->provider.c_str(), seen);
-		return message_disable_rule(psqlite, false, prnode->id);
+		return message_disable_rule(psqlite, false, prnode);
 	}
 	return message_forward_message(from_address, account, psqlite, cpid,
 	       message_id, pdigest, block.flavor, false, pfwddlgt->count,
@@ -3335,7 +3562,7 @@ static ec_error_t op_delegate(const char *from_address, const char *account,
 		message_make_deferred_error_message(account, psqlite, folder_id,
 			message_id, prnode->id, RULE_ERROR_TOO_MANY_RCPTS,
 			block.type, rule_idx, prnode->provider.c_str(), seen);
-		return message_disable_rule(psqlite, false, prnode->id);
+		return message_disable_rule(psqlite, false, prnode);
 	}
 	MESSAGE_CONTENT *pmsgctnt = nullptr;
 	if (!message_read_message(psqlite, cpid, message_id, &pmsgctnt) ||
@@ -3510,25 +3737,19 @@ static ec_error_t op_switcheroo(BOOL b_oof, const char *from_address,
 
 static ec_error_t op_process(BOOL b_oof, const char *from_address,
     const char *account, uint32_t cpid, sqlite3 *psqlite, uint64_t folder_id,
-    uint64_t message_id, const char *pdigest, seen_list &seen,
-    const RULE_NODE *prnode, BOOL &b_del, BOOL &b_exit,
+    uint64_t message_id, const char *pdigest, const TPROPVAL_ARRAY *props,
+    seen_list &seen, const RULE_NODE *prnode, BOOL &b_del, BOOL &b_exit,
     std::list<DAM_NODE> &dam_list)
 {
 	if (b_exit && !(prnode->state & ST_ONLY_WHEN_OOF))
 		return ecSuccess;
-	void *pvalue = nullptr;
-	if (!common_util_get_rule_property(prnode->id, psqlite,
-	    PR_RULE_CONDITION, &pvalue))
-		return ecError;
-	if (pvalue == nullptr || !cu_eval_msg_restriction(psqlite,
-	    0, message_id, static_cast<RESTRICTION *>(pvalue)))
+	if (prnode->state & ST_ERROR || prnode->b_disabled)
+		return ecSuccess;
+	if (!message_eval_rule_cond(psqlite, message_id, props, prnode))
 		return ecSuccess;
 	if (prnode->state & ST_EXIT_LEVEL)
 		b_exit = TRUE;
-	RULE_ACTIONS *pactions = nullptr;
-	if (!common_util_get_rule_property(prnode->id, psqlite,
-	    PR_RULE_ACTIONS, reinterpret_cast<void **>(&pactions)))
-		return ecError;
+	auto pactions = prnode->actions.get();
 	if (NULL == pactions) {
 		return ecSuccess;
 	}
@@ -3547,14 +3768,14 @@ static ec_error_t opx_move_private(const char *account, sqlite3 *psqlite,
 {
 	if (EITLT_PRIVATE_FOLDER !=
 	    pextmvcp->folder_eid.folder_type) {
-		return message_disable_rule(psqlite, TRUE, prnode->id);
+		return message_disable_rule(psqlite, TRUE, prnode);
 	}
 	int tmp_id = 0;
 	if (!common_util_get_id_from_username(account, &tmp_id))
 		return ecSuccess;
 	auto tmp_guid = rop_util_make_user_guid(tmp_id);
 	if (tmp_guid != pextmvcp->folder_eid.database_guid)
-		return message_disable_rule(psqlite, TRUE, prnode->id);
+		return message_disable_rule(psqlite, TRUE, prnode);
 	return ecSuccess;
 }
 
@@ -3563,7 +3784,7 @@ static ec_error_t opx_move_public(const char *account, sqlite3 *psqlite,
 {
 	if (EITLT_PUBLIC_FOLDER !=
 	    pextmvcp->folder_eid.folder_type) {
-		return message_disable_rule(psqlite, TRUE, prnode->id);
+		return message_disable_rule(psqlite, TRUE, prnode);
 	}
 	const char *pc = strchr(account, '@'); /* CONST-STRCHR-MARKER */
 	if (pc == nullptr)
@@ -3575,7 +3796,7 @@ static ec_error_t opx_move_public(const char *account, sqlite3 *psqlite,
 		return ecSuccess;
 	auto tmp_guid = rop_util_make_domain_guid(tmp_id);
 	if (tmp_guid != pextmvcp->folder_eid.database_guid)
-		return message_disable_rule(psqlite, TRUE, prnode->id);
+		return message_disable_rule(psqlite, TRUE, prnode);
 	return ecSuccess;
 }
 
@@ -3600,7 +3821,7 @@ static ec_error_t opx_move(BOOL b_oof, const char *from_address,
 	if (!common_util_check_folder_id(psqlite, dst_fid, &b_exist))
 		return ecError;
 	if (!b_exist)
-		return message_disable_rule(psqlite, TRUE, prnode->id);
+		return message_disable_rule(psqlite, TRUE, prnode);
 	int tmp_id = 0, tmp_id1 = 0;
 	auto is_pvt = exmdb_server::is_private();
 	if (is_pvt) {
@@ -3644,7 +3865,7 @@ static ec_error_t opx_move(BOOL b_oof, const char *from_address,
 		pdigest1 = NULL;
 	}
 	ec = message_rule_new_message(b_oof, from_address, account,
-	     cpid, psqlite, dst_fid, dst_mid, pdigest1, seen);
+	     cpid, psqlite, dst_fid, dst_mid, pdigest1, nullptr, seen);
 	if (ec != ecSuccess)
 		return ec;
 	if (block.type == OP_MOVE) {
@@ -3675,7 +3896,7 @@ static ec_error_t opx_reply(const char *from_address, const char *account,
 			return ecSuccess;
 		auto tmp_guid = rop_util_make_user_guid(tmp_id);
 		if (tmp_guid != pextreply->message_eid.message_database_guid)
-			return message_disable_rule(psqlite, TRUE, prnode->id);
+			return message_disable_rule(psqlite, TRUE, prnode);
 	} else {
 		auto pc = strchr(account, '@');
 		if (pc == nullptr)
@@ -3686,7 +3907,7 @@ static ec_error_t opx_reply(const char *from_address, const char *account,
 			return ecSuccess;
 		auto tmp_guid = rop_util_make_domain_guid(tmp_id);
 		if (tmp_guid != pextreply->message_eid.message_database_guid)
-			return message_disable_rule(psqlite, TRUE, prnode->id);
+			return message_disable_rule(psqlite, TRUE, prnode);
 	}
 	auto dst_mid = rop_util_gc_to_value(
 		       pextreply->message_eid.message_global_counter);
@@ -3696,7 +3917,7 @@ static ec_error_t opx_reply(const char *from_address, const char *account,
 	    dst_mid, pextreply->template_guid, &b_result))
 		return ecError;
 	if (!b_result)
-		return message_disable_rule(psqlite, TRUE, prnode->id);
+		return message_disable_rule(psqlite, TRUE, prnode);
 	return ecSuccess;
 }
 
@@ -3709,7 +3930,7 @@ static ec_error_t opx_delegate(const char *from_address, const char *account,
 	    pdigest == nullptr || pextfwddlgt->count == 0)
 		return ecSuccess;
 	if (pextfwddlgt->count > MAX_RULE_RECIPIENTS) {
-		return message_disable_rule(psqlite, TRUE, prnode->id);
+		return message_disable_rule(psqlite, TRUE, prnode);
 	}
 	MESSAGE_CONTENT *pmsgctnt = nullptr;
 	if (!message_read_message(psqlite, cpid,
@@ -3839,7 +4060,7 @@ static ec_error_t opx_switcheroo(BOOL b_oof, const char *from_address,
 	case OP_FORWARD: {
 		auto pextfwddlgt = static_cast<EXT_FORWARDDELEGATE_ACTION *>(block.pdata);
 		if (pextfwddlgt->count > MAX_RULE_RECIPIENTS) {
-			return message_disable_rule(psqlite, TRUE, prnode->id);
+			return message_disable_rule(psqlite, TRUE, prnode);
 		}
 		return message_forward_message(from_address, account, psqlite,
 		       cpid, message_id, pdigest, block.flavor, TRUE,
@@ -3883,38 +4104,27 @@ static ec_error_t opx_switcheroo(BOOL b_oof, const char *from_address,
 
 static ec_error_t opx_process(BOOL b_oof, const char *from_address,
     const char *account, uint32_t cpid, sqlite3 *psqlite, uint64_t folder_id,
-    uint64_t message_id, const char *pdigest, seen_list &seen,
-    const RULE_NODE *prnode, BOOL &b_del, BOOL &b_exit)
+    uint64_t message_id, const char *pdigest, const TPROPVAL_ARRAY *props,
+    seen_list &seen, const RULE_NODE *prnode, BOOL &b_del, BOOL &b_exit)
 {
 	if (b_exit && !(prnode->state & ST_ONLY_WHEN_OOF))
 		return ecSuccess;
-	void *pvalue = nullptr;
-	if (!cu_get_property(db_table::msg_props, prnode->id, 0, psqlite,
-	    PR_EXTENDED_RULE_MSG_CONDITION, &pvalue))
-		return ecError;
-	auto bv = static_cast<BINARY *>(pvalue);
-	if (pvalue == nullptr || bv->cb == 0)
-		return ecSuccess;
-	EXT_PULL ext_pull;
-	ext_pull.init(bv->pb, bv->cb, common_util_alloc,
-		EXT_FLAG_WCOUNT | EXT_FLAG_UTF16);
-	NAMEDPROPERTY_INFOMATION propname_info;
-	RESTRICTION restriction;
-	if (ext_pull.g_namedprop_info(&propname_info) != EXT_ERR_SUCCESS ||
-	    ext_pull.g_restriction(&restriction) != EXT_ERR_SUCCESS)
+	if (prnode->state & ST_ERROR || prnode->b_disabled)
 		return ecSuccess;
-	if (!message_replace_restriction_propid(psqlite, &propname_info, &restriction))
-		return ecError;
-	if (!cu_eval_msg_restriction(psqlite, 0, message_id, &restriction))
+	if (!message_eval_rule_cond(psqlite, message_id, props, prnode))
 		return ecSuccess;
 	if (prnode->state & ST_EXIT_LEVEL)
 		b_exit = TRUE;
+	void *pvalue = nullptr;
 	if (!cu_get_property(db_table::msg_props, prnode->id, 0, psqlite,
 	    PR_EXTENDED_RULE_MSG_ACTIONS, &pvalue))
 		return ecError;
+	auto bv = static_cast<BINARY *>(pvalue);
 	if (NULL == pvalue) {
 		return ecSuccess;
 	}
+	EXT_PULL ext_pull;
+	NAMEDPROPERTY_INFOMATION propname_info;
 	ext_pull.init(bv->pb, bv->cb, common_util_alloc,
 		EXT_FLAG_WCOUNT | EXT_FLAG_UTF16);
 	EXT_RULE_ACTIONS ext_actions;
@@ -3939,18 +4149,29 @@ static ec_error_t opx_process(BOOL b_oof, const char *from_address,
 /* extended rules do not produce DAM or DEM */
 static ec_error_t message_rule_new_message(BOOL b_oof, const char *from_address,
     const char *account, uint32_t cpid, sqlite3 *psqlite, uint64_t folder_id,
-    uint64_t message_id, const char *pdigest, seen_list &seen)
+    uint64_t message_id, const char *pdigest, const TPROPVAL_ARRAY *props,
+    seen_list &seen)
 {
-	std::list<RULE_NODE> rule_list, ext_rule_list;
 	std::list<DAM_NODE> dam_list;
 	
-	if (!message_load_folder_rules(b_oof, psqlite, folder_id, rule_list) ||
-	    !message_load_folder_ext_rules(b_oof, psqlite, folder_id, ext_rule_list))
+	/* holds the rule set alive even if a rule action invalidates it */
+	auto frules = message_get_folder_rules(seen.pdb, b_oof, psqlite, folder_id);
+	if (frules == nullptr)
 		return ecError;
+	auto cl_0 = make_scope_exit([&]() {
+		auto dis = [](const rule_node &r) { return r.b_disabled; };
+		if (seen.pdb == nullptr ||
+		    (std::none_of(frules->rules.begin(), frules->rules.end(), dis) &&
+		    std::none_of(frules->ext_rules.begin(), frules->ext_rules.end(), dis)))
+			return;
+		auto it = seen.pdb->rule_cache.find(folder_id);
+		if (it != seen.pdb->rule_cache.end() && it->second == frules)
+			seen.pdb->rule_cache.erase(it);
+	});
 	BOOL b_del = false, b_exit = false;
-	for (const auto &rnode : rule_list) {
+	for (const auto &rnode : frules->rules) {
 		auto ec = op_process(b_oof, from_address, account, cpid,
-		          psqlite, folder_id, message_id, pdigest, seen,
+		          psqlite, folder_id, message_id, pdigest, props, seen,
 		          &rnode, b_del, b_exit, dam_list);
 		if (ec != ecSuccess)
 			return ec;
@@ -3958,9 +4179,9 @@ static ec_error_t message_rule_new_message(BOOL b_oof, const char *from_address,
 	if (dam_list.size() > 0 && !message_make_deferred_action_messages(account,
 	    psqlite, folder_id, message_id, std::move(dam_list), seen))
 		return ecError;
-	for (const auto &rnode : ext_rule_list) {
+	for (const auto &rnode : frules->ext_rules) {
 		auto ec = opx_process(b_oof, from_address, account, cpid,
-		          psqlite, folder_id, message_id, pdigest, seen,
+		          psqlite, folder_id, message_id, pdigest, props, seen,
 		          &rnode, b_del, b_exit);
 		if (ec != ecSuccess)
 			return ec;
@@ -4181,8 +4402,10 @@ BOOL exmdb_server::delivery_message(const char *dir,
 	mlog(LV_DEBUG, "user=%s host=unknown  "
 		"Message %llu is delivered into folder "
 		"%llu", account, LLU{message_id}, LLU{fid_val});
+	seen.pdb = pdb.get();
 	auto ec = message_rule_new_message(b_oof, from_address, account,
-	          cpid, pdb->psqlite, fid_val, message_id, pdigest, seen);
+	          cpid, pdb->psqlite, fid_val, message_id, pdigest,
+	          &tmp_msg.proplist, seen);
 	if (ec != ecSuccess)
 		return FALSE;
 	sql_transact.commit();
@@ -4295,6 +4518,48 @@ BOOL exmdb_server::read_message(const char *dir, const char *username,
 	return TRUE;
 }
 
+BOOL exmdb_server::read_messages(const char *dir, const char *username,
+    uint32_t cpid, const EID_ARRAY *pmessage_ids, uint32_t size_limit,
+    uint32_t *pcount, MESSAGE_CONTENT ***ppmsgctnts)
+{
+	*pcount = 0;
+	*ppmsgctnts = nullptr;
+	if (pmessage_ids->count == 0)
+		return TRUE;
+	auto pdb = db_engine_get_db(dir);
+	if (pdb == nullptr || pdb->psqlite == nullptr)
+		return FALSE;
+	auto msgs = cu_alloc<MESSAGE_CONTENT *>(pmessage_ids->count);
+	if (msgs == nullptr)
+		return FALSE;
+	if (!exmdb_server::is_private())
+		exmdb_server::set_public_username(username);
+	auto cl_0 = make_scope_exit([]() { exmdb_server::set_public_username(nullptr); });
+	/* One transaction and one set of prepared statements for the batch */
+	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+	if (!common_util_begin_message_optimize(pdb->psqlite))
+		return FALSE;
+	uint64_t total_size = 0;
+	uint32_t i;
+	for (i = 0; i < pmessage_ids->count && (i == 0 || total_size < size_limit); ++i) {
+		if (!message_read_message(pdb->psqlite, cpid,
+		    rop_util_get_gc_value(pmessage_ids->pids[i]), &msgs[i])) {
+			common_util_end_message_optimize();
+			return FALSE;
+		}
+		if (msgs[i] == nullptr)
+			continue;
+		auto num = msgs[i]->proplist.get<const uint32_t>(PR_MESSAGE_SIZE);
+		if (num != nullptr)
+			total_size += *num;
+	}
+	common_util_end_message_optimize();
+	sql_transact.commit();
+	*pcount = i;
+	*ppmsgctnts = msgs;
+	return TRUE;
+}
+
 BOOL exmdb_server::rule_new_message(const char *dir,
 	const char *username, const char *account, uint32_t cpid,
 	uint64_t folder_id, uint64_t message_id)
@@ -4339,8 +4604,9 @@ BOOL exmdb_server::rule_new_message(const char *dir,
 		return false;
 	}
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+	seen.pdb = pdb.get();
 	auto ec = message_rule_new_message(false, "none@none", account,
-	          cpid, pdb->psqlite, fid_val, mid_val, pdigest, seen);
+	          cpid, pdb->psqlite, fid_val, mid_val, pdigest, nullptr, seen);
 	if (ec != ecSuccess)
 		return FALSE;
 	sql_transact.commit();
@@ -138,13 +138,16 @@ static constexpr const char *exmdb_rpc_names[] = {
 	nullptr,
 	nullptr,
 	E(UNLOAD_STORE),
+	E(READ_MESSAGES),
+	E(BATCH),
+	E(QUERY_FOLDER_CHANGES),
 };
 #undef E
 
 const char *exmdb_rpc_idtoname(exmdb_callid i)
 {
 	auto j = static_cast<uint8_t>(i);
-	static_assert(arsizeof(exmdb_rpc_names) == static_cast<uint8_t>(exmdb_callid::unload_store) + 1);
+	static_assert(arsizeof(exmdb_rpc_names) == static_cast<uint8_t>(exmdb_callid::query_folder_changes) + 1);
 	const char *s = j < arsizeof(exmdb_rpc_names) ? exmdb_rpc_names[j] : nullptr;
 	return znul(s);
 }
@@ -5,33 +5,42 @@
 #include <memory>
 #include <mutex>
 #include <poll.h>
+#include <string>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_ext.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/exmdb_server.hpp>
+#include <gromox/util.hpp>
 #include "exmdb_parser.h"
 #include "notification_agent.h"
 
-void notification_agent_backward_notify(const char *remote_id,
-    const DB_NOTIFY_DATAGRAM *pnotify)
+using namespace gromox;
+
+namespace {
+struct held_datagram {
+	std::string remote_id; /* empty: in-process subscriber */
+	BINARY bin{};
+};
+}
+
+/*
+ * Datagrams produced on this thread while an exmdb batch runs. They are
+ * only sent once the batch has committed, so that a rolled-back batch
+ * does not announce objects that never came to exist.
+ */
+static thread_local bool g_holding;
+static thread_local std::vector<held_datagram> g_held;
+
+static void na_route(const char *remote_id, BINARY &bin)
 {
-	if (NULL == remote_id) {
-		for (size_t i = 0; i < pnotify->id_array.count; ++i)
-			exmdb_server::event_proc(pnotify->dir, pnotify->b_table,
-				pnotify->id_array.pl[i], &pnotify->db_notify);
-		return;
-	}
 	auto prouter = exmdb_parser_get_router(remote_id);
 	if (NULL == prouter) {
+		free(bin.pb);
 		return;
 	}
-	BINARY bin{};
-	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS) {
-		exmdb_parser_put_router(std::move(prouter));
-		return;	
-	}
 	try {
 		std::unique_lock rt_hold(prouter->lock);
 		prouter->datagram_list.push_back(bin);
@@ -43,6 +52,63 @@ void notification_agent_backward_notify(const char *remote_id,
 	exmdb_parser_put_router(std::move(prouter));
 }
 
+static void na_local(const DB_NOTIFY_DATAGRAM *pnotify)
+{
+	for (size_t i = 0; i < pnotify->id_array.count; ++i)
+		exmdb_server::event_proc(pnotify->dir, pnotify->b_table,
+			pnotify->id_array.pl[i], &pnotify->db_notify);
+}
+
+void notification_agent_backward_notify(const char *remote_id,
+    const DB_NOTIFY_DATAGRAM *pnotify)
+{
+	if (remote_id == nullptr && !g_holding) {
+		na_local(pnotify);
+		return;
+	}
+	BINARY bin{};
+	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS)
+		return;
+	if (!g_holding) {
+		na_route(remote_id, bin);
+		return;
+	}
+	try {
+		g_held.push_back({znul(remote_id), bin});
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-2826: ENOMEM");
+		free(bin.pb);
+	}
+}
+
+void notification_agent_hold()
+{
+	g_holding = true;
+}
+
+/**
+ * Stop holding back datagrams, and send (@deliver) or drop those held.
+ */
+void notification_agent_release(bool deliver)
+{
+	g_holding = false;
+	for (auto &h : g_held) {
+		if (!deliver) {
+			free(h.bin.pb);
+		} else if (!h.remote_id.empty()) {
+			na_route(h.remote_id.c_str(), h.bin);
+		} else {
+			/* skip the length prefix of the wire format */
+			BINARY bin{h.bin.cb - 4, {h.bin.pb + 4}};
+			DB_NOTIFY_DATAGRAM dg{};
+			if (exmdb_ext_pull_db_notify(&bin, &dg) == EXT_ERR_SUCCESS)
+				na_local(&dg);
+			free(h.bin.pb);
+		}
+	}
+	g_held.clear();
+}
+
 static BOOL notification_agent_read_response(std::shared_ptr<ROUTER_CONNECTION> prouter)
 {
 	int tv_msec;
@@ -7,8 +7,10 @@
 #include <cstring>
 #include <fcntl.h>
 #include <iconv.h>
+#include <string>
 #include <unistd.h>
 #include <vector>
+#include <libHX/string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <gromox/database.h>
@@ -598,6 +600,104 @@ static inline const BINARY *get_conv_id(const RESTRICTION *x)
 	return b->cb == 16 ? b : nullptr;
 }
 
+/*
+ * Columns of message_hotprops (schema EV-9/EB-8 onwards) for the sort
+ * properties which it mirrors; nullptr for everything else.
+ */
+static const char *table_hot_column(uint32_t proptag)
+{
+	switch (proptag) {
+	case PR_MESSAGE_DELIVERY_TIME: return "dtime";
+	case PR_CLIENT_SUBMIT_TIME: return "stime";
+	case PR_LAST_MODIFICATION_TIME: return "mtime";
+	case PR_CREATION_TIME: return "ctime";
+	case PR_NORMALIZED_SUBJECT: return "nsubj";
+	case PR_SENDER_NAME: return "sender";
+	case PR_SENT_REPRESENTING_NAME: return "srepr";
+	case PR_MESSAGE_CLASS: return "msgclass";
+	case PR_IMPORTANCE: return "importance";
+	case PR_FLAG_STATUS: return "flagst";
+	case PR_MESSAGE_SIZE: return "msize";
+	default: return nullptr;
+	}
+}
+
+/*
+ * For a flat (uncategorized, non-multi-instance) sort of a plain folder
+ * whose keys are all mirrored in message_hotprops, produce the base query
+ * and the ORDER BY clause, so that the content table can be filled in
+ * order straight from an index scan rather than through the stbl copy.
+ *
+ * The string columns only mirror PT_UNICODE values (the triggers cannot
+ * convert 8-bit strings), so a folder in which some message carries a
+ * sort key as PT_STRING8 keeps the old path.
+ */
+static bool table_hot_query(sqlite3 *psqlite, uint64_t fid_val,
+    uint8_t table_flags, const SORTORDER_SET *psorts, std::string &query,
+    std::string &order) try
+{
+	if (psorts->ccategories != 0 || psorts->count == 0 ||
+	    (table_flags & TABLE_FLAG_CONVERSATIONMEMBERS))
+		return false;
+	if (exmdb_server::is_private() &&
+	    ((table_flags & TABLE_FLAG_SOFTDELETES) ||
+	    (!g_enable_dam && fid_val == PRIVATE_FID_DEFERRED_ACTION)))
+		return false;
+	std::string clause, str8_tags;
+	for (size_t i = 0; i < psorts->count; ++i) {
+		const auto &s = psorts->psort[i];
+		if (s.type & MVI_FLAG)
+			return false;
+		if (s.table_sort != TABLE_SORT_ASCEND &&
+		    s.table_sort != TABLE_SORT_DESCEND)
+			return false;
+		auto col = table_hot_column(PROP_TAG(s.type, s.propid));
+		if (col == nullptr)
+			return false;
+		clause += clause.empty() ? " ORDER BY h." : ", h.";
+		clause += col;
+		clause += s.table_sort == TABLE_SORT_ASCEND ? " ASC" : " DESC";
+		if (s.type == PT_UNICODE) {
+			str8_tags += str8_tags.empty() ? "" : ",";
+			str8_tags += std::to_string(PROP_TAG(PT_STRING8, s.propid));
+		}
+	}
+	if (sqlite3_table_column_metadata(psqlite, nullptr, "message_hotprops",
+	    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr) != SQLITE_OK)
+		return false;
+	char sql_string[256];
+	if (exmdb_server::is_private())
+		snprintf(sql_string, std::size(sql_string), "SELECT messages.message_id"
+		         " FROM message_hotprops AS h JOIN messages ON"
+		         " messages.message_id=h.message_id WHERE"
+		         " h.parent_fid=%llu AND h.is_associated=%u",
+		         LLU{fid_val}, !!(table_flags & TABLE_FLAG_ASSOCIATED));
+	else
+		snprintf(sql_string, std::size(sql_string), "SELECT messages.message_id"
+		         " FROM message_hotprops AS h JOIN messages ON"
+		         " messages.message_id=h.message_id WHERE"
+		         " h.parent_fid=%llu AND h.is_associated=%u"
+		         " AND messages.is_deleted=%u", LLU{fid_val},
+		         !!(table_flags & TABLE_FLAG_ASSOCIATED),
+		         !!(table_flags & TABLE_FLAG_SOFTDELETES));
+	if (!str8_tags.empty()) {
+		auto pstmt = gx_sql_prep(psqlite, ("SELECT 1 FROM message_hotprops"
+		             " AS h JOIN message_properties AS p ON"
+		             " p.message_id=h.message_id WHERE h.parent_fid=" +
+		             std::to_string(fid_val) + " AND h.is_associated=" +
+		             std::to_string(!!(table_flags & TABLE_FLAG_ASSOCIATED)) +
+		             " AND p.proptag IN (" + str8_tags + ") LIMIT 1").c_str());
+		if (pstmt == nullptr || pstmt.step() != SQLITE_DONE)
+			return false;
+	}
+	query = sql_string;
+	order = std::move(clause);
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2810: ENOMEM");
+	return false;
+}
+
 /* under public mode username always available for read state */
 static BOOL table_load_content_table(db_item_ptr &pdb, uint32_t cpid,
 	uint64_t fid_val, const char *username, uint8_t table_flags,
@@ -743,7 +843,26 @@ static BOOL table_load_content_table(db_item_ptr &pdb, uint32_t cpid,
 		}
 	}
 	xtransaction psort_transact;
-	if (NULL != psorts) {
+	std::string hot_sql, hot_order;
+	bool b_hot = psorts != nullptr && !b_search && conv_id == nullptr &&
+	             table_hot_query(pdb->psqlite, fid_val, table_flags, psorts,
+	             hot_sql, hot_order);
+	if (b_hot) {
+		ptnode->psorts = sortorder_set_dup(psorts);
+		if (ptnode->psorts == nullptr)
+			return false;
+		snprintf(sql_string, std::size(sql_string), "CREATE UNIQUE INDEX"
+		         " t%u_4 ON t%u (inst_id)", table_id, table_id);
+		if (gx_sql_exec(pdb->tables.psqlite, sql_string) != SQLITE_OK)
+			return false;
+		snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u"
+		         " (inst_id, prev_id, row_type, parent_id, depth, inst_num,"
+		         " idx) VALUES (?, ?, %u, 0, 0, 0, ?)", table_id,
+		         CONTENT_ROW_MESSAGE);
+		pstmt1 = gx_sql_prep(pdb->tables.psqlite, sql_string);
+		if (pstmt1 == nullptr)
+			return false;
+	} else if (NULL != psorts) {
 		ptnode->psorts = sortorder_set_dup(psorts);
 		if (NULL == ptnode->psorts) {
 			return false;
@@ -874,7 +993,9 @@ static BOOL table_load_content_table(db_item_ptr &pdb, uint32_t cpid,
 		if (pstmt1 == nullptr)
 			return false;
 	}
-	if (exmdb_server::is_private()) {
+	if (b_hot) {
+		gx_strlcpy(sql_string, hot_sql.c_str(), std::size(sql_string));
+	} else if (exmdb_server::is_private()) {
 		if ((table_flags & TABLE_FLAG_SOFTDELETES) ||
 		    (!g_enable_dam && fid_val == PRIVATE_FID_DEFERRED_ACTION)) {
 			strcpy(sql_string, "SELECT message_id FROM messages WHERE 0");
@@ -941,9 +1062,20 @@ static BOOL table_load_content_table(db_item_ptr &pdb, uint32_t cpid,
 		            " AND is_associated=0 AND is_deleted=%u",
 		            !!(table_flags & TABLE_FLAG_SOFTDELETES));
 	}
-	pstmt = gx_sql_prep(pdb->psqlite, sql_string);
-	if (pstmt == nullptr)
-		return false;
+	/* Every query variant above ends in a condition that can be extended. */
+	msg_res_sql compiled;
+	bool b_compiled = prestriction != nullptr && conv_id == nullptr &&
+	                  cu_msg_restriction_to_sql(prestriction, compiled);
+	if (b_compiled) {
+		pstmt = gx_sql_prep(pdb->psqlite, (std::string(sql_string) +
+		        " AND (" + compiled.where + ")" + hot_order).c_str());
+		if (pstmt == nullptr || !compiled.bind(pstmt))
+			return false;
+	} else {
+		pstmt = gx_sql_prep(pdb->psqlite, (sql_string + hot_order).c_str());
+		if (pstmt == nullptr)
+			return false;
+	}
 	last_row_id = 0;
 	while (SQLITE_ROW == sqlite3_step(pstmt)) {
 		mid_val = sqlite3_column_int64(pstmt, 0);
@@ -956,12 +1088,12 @@ static BOOL table_load_content_table(db_item_ptr &pdb, uint32_t cpid,
 			if (0 == parent_fid) {
 				continue;
 			}
-		} else if (prestriction != nullptr &&
+		} else if (prestriction != nullptr && !b_compiled &&
 		    !cu_eval_msg_restriction(pdb->psqlite, cpid, mid_val, prestriction)) {
 			continue;
 		}
 		sqlite3_bind_int64(pstmt1, 1, mid_val);
-		if (NULL != psorts) {
+		if (NULL != psorts && !b_hot) {
 			for (size_t i = 0; i < tag_count; ++i) {
 				tmp_proptag = tmp_proptags[i];
 				if (tmp_proptag == ptnode->instance_tag) {
@@ -1152,18 +1284,18 @@ static BOOL table_load_content_table(db_item_ptr &pdb, uint32_t cpid,
 		if (SQLITE_DONE != sqlite3_step(pstmt1)) {
 			return false;
 		}
-		if (NULL == psorts) {
+		if (NULL == psorts || b_hot) {
 			last_row_id = sqlite3_last_insert_rowid(pdb->tables.psqlite);
 		}
 		sqlite3_reset(pstmt1);
 	}
-	if (NULL != psorts) {
+	if (NULL != psorts && !b_hot) {
 		psort_transact.commit();
 		psort_transact = gx_sql_begin_trans(psqlite);
 	}
 	pstmt.finalize();
 	pstmt1.finalize();
-	if (NULL != psorts) {
+	if (NULL != psorts && !b_hot) {
 		snprintf(sql_string, arsizeof(sql_string), "INSERT INTO t%u "
 			    "(inst_id, row_type, row_stat, parent_id, depth, "
 			    "count, inst_num, value, extremum, prev_id) VALUES"
@@ -16,6 +16,7 @@
 #include <pthread.h>
 #include <string>
 #include <unistd.h>
+#include <vector>
 #include <libHX/io.h>
 #include <libHX/string.h>
 #include <netinet/in.h>
@@ -38,15 +39,16 @@ static void *htls_thrwork(void *);
 
 static unsigned int g_mss_size;
 static gromox::atomic_bool g_stop_accept;
-static pthread_t g_thr_id;
-static int g_listener_sock = -1, g_listener_ssl_sock = -1;
+static unsigned int g_acceptors = 1;
+static std::vector<int> g_listener_socks, g_listener_ssl_socks;
+static std::vector<pthread_t> g_thr_ids;
 static std::string g_listener_addr;
 static uint16_t g_listener_port, g_listener_ssl_port;
-static pthread_t g_ssl_thr_id;
 
 void listener_init(const char *addr, uint16_t port, uint16_t ssl_port,
-    unsigned int mss_size)
+    unsigned int mss_size, unsigned int acceptors)
 {
+	g_acceptors = acceptors;
 	g_listener_addr = addr;
 	g_listener_port = port;
 	g_listener_ssl_port = ssl_port;
@@ -64,76 +66,95 @@ void listener_init(const char *addr, uint16_t port, uint16_t ssl_port,
  */
 int listener_run()
 {
-	g_listener_sock = gx_inet_listen(g_listener_addr.c_str(), g_listener_port);
-	if (g_listener_sock < 0) {
+	auto ret = gx_inet_listen_multi(g_listener_addr.c_str(), g_listener_port,
+	           g_acceptors, g_listener_socks);
+	if (ret < 0) {
 		mlog(LV_ERR, "listener: failed to create socket [*]:%hu: %s",
-		       g_listener_port, strerror(-g_listener_sock));
+		       g_listener_port, strerror(-ret));
 		return -1;
 	}
-	gx_reexec_record(g_listener_sock);
-	if (g_mss_size > 0 &&
-	    setsockopt(g_listener_sock, IPPROTO_TCP, TCP_MAXSEG,
-	    &g_mss_size, sizeof(g_mss_size)) < 0)
-		return -2;
-	
+	for (auto fd : g_listener_socks) {
+		gx_reexec_record(fd);
+		if (g_mss_size > 0 &&
+		    setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG,
+		    &g_mss_size, sizeof(g_mss_size)) < 0)
+			return -2;
+	}
 	if (g_listener_ssl_port > 0) {
-		g_listener_ssl_sock = gx_inet_listen(g_listener_addr.c_str(), g_listener_ssl_port);
-		if (g_listener_ssl_sock < 0) {
+		ret = gx_inet_listen_multi(g_listener_addr.c_str(),
+		      g_listener_ssl_port, g_acceptors, g_listener_ssl_socks);
+		if (ret < 0) {
 			mlog(LV_ERR, "listener: failed to create socket [*]:%hu: %s",
-			       g_listener_ssl_port, strerror(-g_listener_ssl_sock));
+			       g_listener_ssl_port, strerror(-ret));
 			return -1;
 		}
-		gx_reexec_record(g_listener_ssl_sock);
-		if (g_mss_size > 0 &&
-		    setsockopt(g_listener_ssl_sock, IPPROTO_TCP, TCP_MAXSEG,
-		    &g_mss_size, sizeof(g_mss_size)) < 0)
-			return -2;
+		for (auto fd : g_listener_ssl_socks) {
+			gx_reexec_record(fd);
+			if (g_mss_size > 0 &&
+			    setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG,
+			    &g_mss_size, sizeof(g_mss_size)) < 0)
+				return -2;
+		}
 	}
 
 	return 0;
 }
 
-int listener_trigger_accept()
+static int listener_spawn(unsigned int acceptor, bool use_tls, size_t count)
 {
-	auto ret = pthread_create(&g_thr_id, nullptr, htls_thrwork,
-	           reinterpret_cast<void *>(uintptr_t(false)));
+	pthread_t tid;
+	auto ret = pthread_create(&tid, nullptr, htls_thrwork,
+	           reinterpret_cast<void *>(uintptr_t(acceptor) << 1 | use_tls));
 	if (ret != 0) {
 		mlog(LV_ERR, "listener: failed to create listener thread: %s", strerror(ret));
-		return -1;
+		return ret;
 	}
-	pthread_setname_np(g_thr_id, "accept");
-	if (g_listener_ssl_port > 0) {
-		ret = pthread_create(&g_ssl_thr_id, nullptr, htls_thrwork,
-		      reinterpret_cast<void *>(uintptr_t(true)));
-		if (ret != 0) {
-			mlog(LV_ERR, "listener: failed to create listener thread: %s", strerror(ret));
+	g_thr_ids.push_back(tid);
+	char name[16];
+	if (count == 1)
+		gx_strlcpy(name, use_tls ? "tls_accept" : "accept", std::size(name));
+	else
+		snprintf(name, std::size(name), use_tls ? "tls_accept/%u" :
+		         "accept/%u", acceptor);
+	pthread_setname_np(tid, name);
+	return 0;
+}
+
+int listener_trigger_accept() try
+{
+	g_thr_ids.reserve(g_listener_socks.size() + g_listener_ssl_socks.size());
+	for (size_t i = 0; i < g_listener_socks.size(); ++i)
+		if (listener_spawn(i, false, g_listener_socks.size()) != 0)
+			return -1;
+	for (size_t i = 0; i < g_listener_ssl_socks.size(); ++i)
+		if (listener_spawn(i, true, g_listener_ssl_socks.size()) != 0)
 			return -2;
-		}
-		pthread_setname_np(g_ssl_thr_id, "tls_accept");
-	}
 	return 0;
+} catch (const std::bad_alloc &) {
+	return -1;
 }
 
 void listener_stop_accept()
 {
 	g_stop_accept = true;
-	if (g_listener_sock >= 0)
-		shutdown(g_listener_sock, SHUT_RDWR); /* closed in listener_stop */
-	if (!pthread_equal(g_thr_id, {})) {
-		pthread_kill(g_thr_id, SIGALRM);
-		pthread_join(g_thr_id, NULL);
-	}
-	if (g_listener_ssl_sock >= 0)
-		shutdown(g_listener_ssl_sock, SHUT_RDWR);
-	if (!pthread_equal(g_ssl_thr_id, {})) {
-		pthread_kill(g_ssl_thr_id, SIGALRM);
-		pthread_join(g_ssl_thr_id, NULL);
-	}
+	/* closed in listener_stop */
+	for (auto fd : g_listener_socks)
+		shutdown(fd, SHUT_RDWR);
+	for (auto fd : g_listener_ssl_socks)
+		shutdown(fd, SHUT_RDWR);
+	for (auto tid : g_thr_ids)
+		pthread_kill(tid, SIGALRM);
+	for (auto tid : g_thr_ids)
+		pthread_join(tid, nullptr);
+	g_thr_ids.clear();
 }
 
 static void *htls_thrwork(void *arg)
 {
-	bool use_tls = reinterpret_cast<uintptr_t>(arg);
+	auto acceptor = reinterpret_cast<uintptr_t>(arg) >> 1;
+	bool use_tls = reinterpret_cast<uintptr_t>(arg) & 1;
+	auto &socks = use_tls ? g_listener_ssl_socks : g_listener_socks;
+	int lsock = socks[acceptor];
 	socklen_t addrlen;
 	int len, flag, sockd2;
 	struct sockaddr_storage fact_addr, client_peer;
@@ -144,8 +165,7 @@ static void *htls_thrwork(void *arg)
 	for (;;) {
 		addrlen = sizeof(client_peer);
 		/* wait for an incoming connection */
-		sockd2 = accept(use_tls ? g_listener_ssl_sock : g_listener_sock,
-		         reinterpret_cast<struct sockaddr *>(&client_peer), &addrlen);
+		sockd2 = accept(lsock, reinterpret_cast<struct sockaddr *>(&client_peer), &addrlen);
 		if (g_stop_accept) {
 			if (sockd2 >= 0)
 				close(sockd2);
@@ -198,6 +218,7 @@ static void *htls_thrwork(void *arg)
 			continue;
 		}
 		pcontext->type = CONTEXT_CONSTRUCTING;
+		contexts_pool_bind_shard(pcontext, acceptor, socks.size());
 		/* pass the client ipaddr into the ipaddr filter */
 		if (system_services_judge_ip != nullptr &&
 		    !system_services_judge_ip(client_hostip)) {
@@ -251,12 +272,10 @@ static void *htls_thrwork(void *arg)
 
 void listener_stop()
 {
-	if (g_listener_sock >= 0) {
-		close(g_listener_sock);
-		g_listener_sock = -1;
-	}
-	if (g_listener_ssl_sock >= 0) {
-		close(g_listener_ssl_sock);
-		g_listener_ssl_sock = -1;
-	}
+	for (auto fd : g_listener_socks)
+		close(fd);
+	g_listener_socks.clear();
+	for (auto fd : g_listener_ssl_socks)
+		close(fd);
+	g_listener_ssl_socks.clear();
 }
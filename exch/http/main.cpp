@@ -79,15 +79,18 @@ static constexpr cfg_directive http_cfg_defaults[] = {
 	{"config_file_path", PKGSYSCONFDIR "/http:" PKGSYSCONFDIR},
 	{"context_average_mem", "256K", CFG_SIZE, "192K"},
 	{"context_num", "400", CFG_SIZE},
+	{"context_poll_shards", "0", CFG_SIZE, "0", "64"},
 	{"data_file_path", PKGDATADIR "/http:" PKGDATADIR},
 	{"fastcgi_cache_size", "256K", CFG_SIZE, "64K"},
 	{"fastcgi_exec_timeout", "10min", CFG_TIME, "1min"},
+	{"fastcgi_keepalive_conns", "4", CFG_SIZE},
 	{"fastcgi_max_size", "4M", CFG_SIZE, "64K"},
 	{"hpm_cache_size", "512K", CFG_SIZE, "64K"},
 	{"hpm_max_size", "4M", CFG_SIZE, "64K"},
 	{"http_auth_times", "10", CFG_SIZE, "1"},
 	{"http_conn_timeout", "3min", CFG_TIME, "30s"},
 	{"http_debug", "0"},
+	{"http_listen_acceptors", "1", CFG_SIZE, "1", "64"},
 	{"http_listen_addr", "::"},
 	{"http_listen_port", "80"},
 	{"http_listen_tls_port", "0"},
@@ -280,10 +283,14 @@ int main(int argc, const char **argv) try
 	std::chrono::seconds fastcgi_exec_timeout{g_config_file->get_ll("fastcgi_exec_timeout")};
 	HX_unit_seconds(temp_buff, arsizeof(temp_buff), fastcgi_exec_timeout.count(), 0);
 	mlog(LV_INFO, "http: fastcgi execution timeout is %s", temp_buff);
+	unsigned int fastcgi_keepalive_conns = g_config_file->get_ll("fastcgi_keepalive_conns");
+	mlog(LV_INFO, "mod_fastcgi: keeping up to %u idle connections per back-end",
+	        fastcgi_keepalive_conns);
 	uint16_t listen_port = g_config_file->get_ll("http_listen_port");
 	unsigned int mss_size = g_config_file->get_ll("tcp_max_segment");
 	listener_init(g_config_file->get_value("http_listen_addr"),
-		listen_port, listen_tls_port, mss_size);
+		listen_port, listen_tls_port, mss_size,
+		g_config_file->get_ll("http_listen_acceptors"));
 	auto cleanup_4 = make_scope_exit(listener_stop);
 	if (0 != listener_run()) {
 		mlog(LV_ERR, "system: failed to start listener");
@@ -361,7 +368,7 @@ int main(int argc, const char **argv) try
 		return EXIT_FAILURE;
 	}
 	mod_fastcgi_init(context_num, fastcgi_cache_size,
-		fastcgi_max_size, fastcgi_exec_timeout); 
+		fastcgi_max_size, fastcgi_exec_timeout, fastcgi_keepalive_conns);
 	auto cleanup_18 = make_scope_exit(mod_fastcgi_stop);
 	if (0 != mod_fastcgi_run()) { 
 		mlog(LV_ERR, "system: failed to start mod_fastcgi");
@@ -388,7 +395,8 @@ int main(int argc, const char **argv) try
 		context_num,
 		http_parser_get_context_socket,
 		http_parser_get_context_timestamp,
-		thread_charge_num, http_conn_timeout); 
+		thread_charge_num, http_conn_timeout,
+		g_config_file->get_ll("context_poll_shards"));
 	auto cleanup_24 = make_scope_exit(contexts_pool_stop);
 	if (0 != contexts_pool_run()) { 
 		mlog(LV_ERR, "system: failed to start context_pool");
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
 #include <cstddef>
@@ -9,9 +10,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <mutex>
 #include <poll.h>
 #include <string>
 #include <unistd.h>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <libHX/string.h>
@@ -42,6 +45,10 @@
 
 #define FCGI_REQUEST_ID							1
 
+#define FCGI_KEEP_CONN							1
+
+#define STDIN_RECORD_MAX						65535
+
 
 #define RECORD_TYPE_BEGIN_REQUEST				1
 #define RECORD_TYPE_ABORT_REQUEST				2
@@ -105,6 +112,10 @@ static uint64_t g_cache_size;
 static std::vector<FASTCGI_NODE> g_fastcgi_list;
 static std::unique_ptr<FASTCGI_CONTEXT[]> g_context_list;
 static std::atomic<int> g_unavailable_times;
+static unsigned int g_max_idle_conns;
+static std::mutex g_idle_lock;
+/* idle FCGI_KEEP_CONN sockets, keyed by back-end socket path */
+static std::unordered_map<std::string, std::vector<int>> g_idle_conns;
 
 static const FASTCGI_NODE *mod_fastcgi_find_backend(const char *domain,
     const char *uri_path, const char *file_name, const char *suffix,
@@ -131,13 +142,14 @@ static const FASTCGI_NODE *mod_fastcgi_find_backend(const char *domain,
 }
 
 void mod_fastcgi_init(int context_num, uint64_t cache_size, uint64_t max_size,
-    time_duration exec_timeout)
+    time_duration exec_timeout, unsigned int max_idle_conns)
 {
 	g_context_num = context_num;
 	g_unavailable_times = 0;
 	g_cache_size = cache_size;
 	g_max_size = max_size;
 	g_exec_timeout = exec_timeout;
+	g_max_idle_conns = max_idle_conns;
 }
 
 static int mod_fastcgi_defaults()
@@ -216,6 +228,11 @@ int mod_fastcgi_run() try
 void mod_fastcgi_stop()
 {
 	g_context_list.reset();
+	std::lock_guard hold(g_idle_lock);
+	for (const auto &[path, fds] : g_idle_conns)
+		for (auto fd : fds)
+			close(fd);
+	g_idle_conns.clear();
 }
 
 static int mod_fastcgi_push_name_value(NDR_PUSH *pndr,
@@ -257,7 +274,7 @@ static int mod_fastcgi_push_begin_request(NDR_PUSH *pndr)
 	/* begin request role */
 	TRY(ndr_push_uint16(pndr, ROLE_RESPONDER));
 	/* begin request flags */
-	TRY(ndr_push_uint8(pndr, 0));
+	TRY(ndr_push_uint8(pndr, g_max_idle_conns > 0 ? FCGI_KEEP_CONN : 0));
 	/* begin request reserved bytes */
 	return ndr_push_zero(pndr, 5);
 }
@@ -388,6 +405,55 @@ static int mod_fastcgi_connect_backend(const char *path)
 	return sockd;
 }
 
+/**
+ * Hand out an idle keep-conn socket for @node if there is one, otherwise
+ * connect anew. *pooled tells the caller whether a failed write should be
+ * retried on a fresh connection.
+ */
+static int mod_fastcgi_get_backend(const FASTCGI_NODE &node, bool *pooled)
+{
+	while (true) {
+		int fd = -1;
+		{
+			std::lock_guard hold(g_idle_lock);
+			auto it = g_idle_conns.find(node.sock_path);
+			if (it == g_idle_conns.end() || it->second.empty())
+				break;
+			fd = it->second.back();
+			it->second.pop_back();
+		}
+		/*
+		 * Between requests, the back-end has nothing to say; readability
+		 * means EOF (worker recycled) or junk, so the socket is unusable.
+		 */
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if (poll(&pfd, 1, 0) == 0) {
+			*pooled = true;
+			return fd;
+		}
+		close(fd);
+	}
+	*pooled = false;
+	return mod_fastcgi_connect_backend(node.sock_path.c_str());
+}
+
+static void mod_fastcgi_put_backend(FASTCGI_CONTEXT *pcontext)
+{
+	auto fd = pcontext->cli_sockd;
+	pcontext->cli_sockd = -1;
+	if (g_max_idle_conns > 0) try {
+		std::lock_guard hold(g_idle_lock);
+		auto &fds = g_idle_conns[pcontext->pfnode->sock_path];
+		if (fds.size() < g_max_idle_conns) {
+			fds.push_back(fd);
+			return;
+		}
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-2801: ENOMEM");
+	}
+	close(fd);
+}
+
 bool mod_fastcgi_take_request(HTTP_CONTEXT *phttp)
 {
 	BOOL b_index;
@@ -501,24 +567,9 @@ bool mod_fastcgi_take_request(HTTP_CONTEXT *phttp)
 	auto pcontext = &g_context_list[phttp->context_id];
 	pcontext->last_time = tp_now();
 	pcontext->pfnode = pfnode;
-	if (b_chunked || content_length > g_cache_size) {
-		auto path = LOCAL_DISK_TMPDIR;
-		if (mkdir(path, 0777) < 0 && errno != EEXIST) {
-			mlog(LV_ERR, "E-2077: mkdir %s: %s", path, strerror(errno));
-			return false;
-		}
-		pcontext->cache_fd = open_tmpfile(path, &pcontext->tmpfile,
-		                     O_RDWR | O_TRUNC);
-		if (pcontext->cache_fd < 0) {
-			mlog(LV_ERR, "E-2078: open_tmpfile{%s, %s}: %s",
-			        path, pcontext->tmpfile.c_str(),
-			        strerror(-pcontext->cache_fd));
-			return FALSE;
-		}
-		pcontext->cache_size = 0;
-	} else {
-		pcontext->cache_fd = -1;
-	}
+	pcontext->cache_fd = -1;
+	pcontext->cache_size = 0;
+	pcontext->body_cache.clear();
 	pcontext->b_index = b_index;
 	pcontext->b_chunked = b_chunked;
 	if (b_chunked) {
@@ -553,7 +604,6 @@ static BOOL mod_fastcgi_build_params(HTTP_CONTEXT *phttp,
 	NDR_PUSH ndr_push;
 	char uri_path[8192];
 	char tmp_buff[8192];
-	struct stat node_stat;
 	
 	ndr_push_init(&ndr_push, pbuff, *plength,
 		NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
@@ -749,32 +799,30 @@ static BOOL mod_fastcgi_build_params(HTTP_CONTEXT *phttp,
 		    hdr.c_str(), tmp_buff, GX_ARRAY_SIZE(tmp_buff)))
 			QRF(mod_fastcgi_push_name_value(&ndr_push,
 			    hdr.c_str(), tmp_buff));
-	if (!phttp->pfast_context->b_chunked) {
-		snprintf(tmp_buff, sizeof(tmp_buff), "%llu",
-		         static_cast<unsigned long long>(phttp->pfast_context->content_length));
-		QRF(mod_fastcgi_push_name_value(&ndr_push, "CONTENT_LENGTH", tmp_buff));
-	} else {
-		if (fstat(phttp->pfast_context->cache_fd, &node_stat) != 0)
-			return FALSE;
-		snprintf(tmp_buff, sizeof(tmp_buff), "%llu",
-		         static_cast<unsigned long long>(node_stat.st_size));
-		QRF(mod_fastcgi_push_name_value(&ndr_push, "CONTENT_LENGTH", tmp_buff));
-	}
+	/* chunked bodies are fully staged (decoded) before this is called */
+	snprintf(tmp_buff, sizeof(tmp_buff), "%llu",
+	         static_cast<unsigned long long>(phttp->pfast_context->b_chunked ?
+	         phttp->pfast_context->cache_size :
+	         phttp->pfast_context->content_length));
+	QRF(mod_fastcgi_push_name_value(&ndr_push, "CONTENT_LENGTH", tmp_buff));
 	QRF(mod_fastcgi_push_params_end(&ndr_push));
 	*plength = ndr_push.offset;
 	return TRUE;
 }
 
-BOOL mod_fastcgi_relay_content(HTTP_CONTEXT *phttp)
+/**
+ * Obtain a back-end connection and send BEGIN_REQUEST plus the PARAMS stream.
+ * A pooled socket that turns out to be dead on first write is discarded and
+ * the next one (ultimately a fresh connection) is tried.
+ */
+static BOOL mod_fastcgi_begin_request(HTTP_CONTEXT *phttp)
 {
-	void *pbuff;
-	int cli_sockd;
 	int ndr_length;
 	NDR_PUSH ndr_push;
-	char tmp_buff[65535];
-	uint8_t ndr_buff[65800];
+	uint8_t begin_buff[16], end_buff[8], ndr_buff[65800];
+	auto pfast_context = phttp->pfast_context;
 	
-	ndr_push_init(&ndr_push, tmp_buff, 16,
+	ndr_push_init(&ndr_push, begin_buff, sizeof(begin_buff),
 		NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
 	if (mod_fastcgi_push_begin_request(&ndr_push) != NDR_ERR_SUCCESS ||
 	    ndr_push.offset != 16)
@@ -782,128 +830,115 @@ BOOL mod_fastcgi_relay_content(HTTP_CONTEXT *phttp)
 	ndr_length = sizeof(ndr_buff);
 	if (!mod_fastcgi_build_params(phttp, ndr_buff, &ndr_length))
 		return FALSE;	
-	cli_sockd = mod_fastcgi_connect_backend(phttp->pfast_context->pfnode->sock_path.c_str());
-	if (cli_sockd < 0) {
-		phttp->log(LV_DEBUG, "failed to "
-				"connect to fastcgi back-end %s",
-				phttp->pfast_context->pfnode->sock_path.c_str());
-		return FALSE;
-	}
-	if (16 != write(cli_sockd, tmp_buff, 16) ||
-		ndr_length != write(cli_sockd, ndr_buff,
-		ndr_length)) {
-		close(cli_sockd);
-		phttp->log(LV_DEBUG, "failed to "
-			"write record to fastcgi back-end %s",
-			phttp->pfast_context->pfnode->sock_path.c_str());
-		return FALSE;
-	}
-	ndr_push_init(&ndr_push, tmp_buff, 8,
+	ndr_push_init(&ndr_push, end_buff, sizeof(end_buff),
 		NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
 	if (NDR_ERR_SUCCESS != mod_fastcgi_push_params_begin(&ndr_push) ||
-		NDR_ERR_SUCCESS != mod_fastcgi_push_params_end(&ndr_push) ||
-		8 != ndr_push.offset || 8 != write(cli_sockd, tmp_buff, 8)) {
-		close(cli_sockd);
-		phttp->log(LV_DEBUG, "failed to "
-			"write record to fastcgi back-end %s",
-			phttp->pfast_context->pfnode->sock_path.c_str());
+	    NDR_ERR_SUCCESS != mod_fastcgi_push_params_end(&ndr_push) ||
+	    8 != ndr_push.offset)
 		return FALSE;
-	}
-	if (phttp->pfast_context->cache_fd < 0) {
-		if (phttp->pfast_context->content_length == 0)
-			goto END_OF_STDIN;
-		unsigned int tmp_len = sizeof(tmp_buff);
-		while ((pbuff = phttp->stream_in.get_read_buf(&tmp_len)) != nullptr) {
-			if (tmp_len > phttp->pfast_context->content_length) {
-				phttp->stream_in.rewind_read_ptr(tmp_len - phttp->pfast_context->content_length);
-				tmp_len = phttp->pfast_context->content_length;
-				phttp->pfast_context->content_length = 0;
-			} else{
-				phttp->pfast_context->content_length -= tmp_len;
-			}
-			ndr_push_init(&ndr_push, ndr_buff, sizeof(ndr_buff),
-						NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
-			if (NDR_ERR_SUCCESS != mod_fastcgi_push_stdin(
-				&ndr_push, pbuff, tmp_len)) {
-				close(cli_sockd);
-				phttp->log(LV_DEBUG, "failed to "
-					"push stdin record for mod_fastcgi");
-				return FALSE;
-			}
-			auto ret = write(cli_sockd, ndr_buff, ndr_push.offset);
-			if (ret < 0 || static_cast<size_t>(ret) != ndr_push.offset) {
-				close(cli_sockd);
-				phttp->log(LV_DEBUG, "failed to "
-					"write record to fastcgi back-end %s (ret=%zd, %s)",
-					phttp->pfast_context->pfnode->sock_path.c_str(),
-					ret, strerror(errno));
-				return FALSE;
-			}
-			if (phttp->pfast_context->content_length == 0)
-				break;
-			tmp_len = sizeof(tmp_buff);
+	auto sock_path = pfast_context->pfnode->sock_path.c_str();
+	bool pooled;
+	do {
+		auto cli_sockd = mod_fastcgi_get_backend(*pfast_context->pfnode, &pooled);
+		if (cli_sockd < 0) {
+			phttp->log(LV_DEBUG, "failed to "
+				"connect to fastcgi back-end %s", sock_path);
+			return FALSE;
 		}
-	} else {
-		lseek(phttp->pfast_context->cache_fd, 0, SEEK_SET);
-		while (true) {
-			auto tmp_len = read(phttp->pfast_context->cache_fd,
-				tmp_buff, sizeof(tmp_buff));
-			if (tmp_len < 0) {
-				close(cli_sockd);
-				phttp->log(LV_DEBUG, "failed to"
-					" read cache file for mod_fastcgi");
-				return FALSE;
-			} else if (0 == tmp_len) {
-				close(phttp->pfast_context->cache_fd);
-				phttp->pfast_context->cache_fd = -1;
-				if (!phttp->pfast_context->tmpfile.empty() &&
-				    unlink(phttp->pfast_context->tmpfile.c_str()) < 0 &&
-				    errno != ENOENT)
-					mlog(LV_WARN, "W-1362: unlink %s: %s",
-					        phttp->pfast_context->tmpfile.c_str(),
-					        strerror(errno));
-				break;
-			}
-			ndr_push_init(&ndr_push, ndr_buff, sizeof(ndr_buff),
-						NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
-			if (NDR_ERR_SUCCESS != mod_fastcgi_push_stdin(
-				&ndr_push, tmp_buff, tmp_len)) {
-				close(cli_sockd);
-				phttp->log(LV_DEBUG, "failed to "
-					"push stdin record for mod_fastcgi");
-				return FALSE;
-			}
-			auto ret = write(cli_sockd, ndr_buff, ndr_push.offset);
-			if (ret < 0 || static_cast<size_t>(ret) != ndr_push.offset) {
-				close(cli_sockd);
-				phttp->log(LV_DEBUG, "failed to "
-					"write record to fastcgi back-end %s (ret=%zd, %s)",
-					phttp->pfast_context->pfnode->sock_path.c_str(),
-					ret, strerror(errno));
-				return FALSE;
-			}
+		if (16 == write(cli_sockd, begin_buff, 16) &&
+		    ndr_length == write(cli_sockd, ndr_buff, ndr_length) &&
+		    8 == write(cli_sockd, end_buff, 8)) {
+			pfast_context->cli_sockd = cli_sockd;
+			return TRUE;
 		}
-	}
- END_OF_STDIN:
+		close(cli_sockd);
+	} while (pooled);
+	phttp->log(LV_DEBUG, "failed to "
+		"write record to fastcgi back-end %s", sock_path);
+	return FALSE;
+}
+
+static BOOL mod_fastcgi_write_stdin(HTTP_CONTEXT *phttp,
+    const void *pbuff, uint16_t length)
+{
+	NDR_PUSH ndr_push;
+	uint8_t ndr_buff[65800];
+	
 	ndr_push_init(&ndr_push, ndr_buff, sizeof(ndr_buff),
 				NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
 	if (NDR_ERR_SUCCESS != mod_fastcgi_push_stdin(
-		&ndr_push, NULL, 0)) {
-		close(cli_sockd);
-		phttp->log(LV_DEBUG, "failed to push "
-			"last empty stdin record for mod_fastcgi");
+		&ndr_push, pbuff, length)) {
+		phttp->log(LV_DEBUG, "failed to "
+			"push stdin record for mod_fastcgi");
 		return FALSE;
 	}
-	auto ret = write(cli_sockd, ndr_buff, ndr_push.offset);
+	auto ret = write(phttp->pfast_context->cli_sockd,
+	           ndr_buff, ndr_push.offset);
 	if (ret < 0 || static_cast<size_t>(ret) != ndr_push.offset) {
-		close(cli_sockd);
-		phttp->log(LV_DEBUG, "failed to write"
-			" last empty stdin to fastcgi back-end %s (ret=%zd, %s)",
+		phttp->log(LV_DEBUG, "failed to "
+			"write record to fastcgi back-end %s (ret=%zd, %s)",
 			phttp->pfast_context->pfnode->sock_path.c_str(),
 			ret, strerror(errno));
 		return FALSE;
 	}
-	phttp->pfast_context->cli_sockd = cli_sockd;
+	return TRUE;
+}
+
+BOOL mod_fastcgi_relay_content(HTTP_CONTEXT *phttp)
+{
+	char tmp_buff[STDIN_RECORD_MAX];
+	auto pfast_context = phttp->pfast_context;
+	
+	/*
+	 * Content-Length bodies have already been streamed by
+	 * mod_fastcgi_write_request; only the staged chunked ones remain.
+	 */
+	if (pfast_context->b_chunked) {
+		if (!mod_fastcgi_begin_request(phttp))
+			return FALSE;
+		if (pfast_context->cache_fd < 0) {
+			const auto &cache = pfast_context->body_cache;
+			for (size_t offset = 0; offset < cache.size(); ) {
+				auto tmp_len = std::min(cache.size() - offset,
+				               static_cast<size_t>(STDIN_RECORD_MAX));
+				if (!mod_fastcgi_write_stdin(phttp,
+				    &cache[offset], tmp_len))
+					return FALSE;
+				offset += tmp_len;
+			}
+			pfast_context->body_cache.clear();
+			pfast_context->body_cache.shrink_to_fit();
+		} else {
+			lseek(pfast_context->cache_fd, 0, SEEK_SET);
+			while (true) {
+				auto tmp_len = read(pfast_context->cache_fd,
+				               tmp_buff, sizeof(tmp_buff));
+				if (tmp_len < 0) {
+					phttp->log(LV_DEBUG, "failed to"
+						" read cache file for mod_fastcgi");
+					return FALSE;
+				} else if (0 == tmp_len) {
+					close(pfast_context->cache_fd);
+					pfast_context->cache_fd = -1;
+					if (!pfast_context->tmpfile.empty() &&
+					    unlink(pfast_context->tmpfile.c_str()) < 0 &&
+					    errno != ENOENT)
+						mlog(LV_WARN, "W-1362: unlink %s: %s",
+						        pfast_context->tmpfile.c_str(),
+						        strerror(errno));
+					break;
+				}
+				if (!mod_fastcgi_write_stdin(phttp, tmp_buff, tmp_len))
+					return FALSE;
+			}
+		}
+	}
+	if (!mod_fastcgi_write_stdin(phttp, nullptr, 0)) {
+		phttp->log(LV_DEBUG, "failed to write last "
+			"empty stdin record for mod_fastcgi");
+		return FALSE;
+	}
+	pfast_context->last_time = tp_now();
 	return TRUE;
 }
 
@@ -918,6 +953,8 @@ void mod_fastcgi_put_context(HTTP_CONTEXT *phttp)
 			mlog(LV_WARN, "W-1362: unlink %s: %s",
 				fc.tmpfile.c_str(), strerror(errno));
 	}
+	fc.body_cache.clear();
+	fc.body_cache.shrink_to_fit();
 	if (phttp->pfast_context->cli_sockd != -1) {
 		close(phttp->pfast_context->cli_sockd);
 		phttp->pfast_context->cli_sockd = -1;
@@ -925,6 +962,57 @@ void mod_fastcgi_put_context(HTTP_CONTEXT *phttp)
 	phttp->pfast_context = NULL;
 }
 
+/**
+ * Keep decoded chunked request data in memory up to fastcgi_cache_size and
+ * spill everything to a temporary file once that is exceeded.
+ */
+static BOOL mod_fastcgi_stage_body(HTTP_CONTEXT *phttp,
+    const void *pbuff, size_t length)
+{
+	auto pfast_context = phttp->pfast_context;
+	if (pfast_context->cache_fd < 0 &&
+	    pfast_context->body_cache.size() + length <= g_cache_size) {
+		try {
+			pfast_context->body_cache.append(static_cast<const char *>(pbuff), length);
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-2802: ENOMEM");
+			return FALSE;
+		}
+		return TRUE;
+	}
+	if (pfast_context->cache_fd < 0) {
+		auto path = LOCAL_DISK_TMPDIR;
+		if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+			mlog(LV_ERR, "E-2077: mkdir %s: %s", path, strerror(errno));
+			return false;
+		}
+		pfast_context->cache_fd = open_tmpfile(path,
+		                          &pfast_context->tmpfile, O_RDWR | O_TRUNC);
+		if (pfast_context->cache_fd < 0) {
+			mlog(LV_ERR, "E-2078: open_tmpfile{%s, %s}: %s",
+			        path, pfast_context->tmpfile.c_str(),
+			        strerror(-pfast_context->cache_fd));
+			return FALSE;
+		}
+		auto &cache = pfast_context->body_cache;
+		if (write(pfast_context->cache_fd, cache.data(),
+		    cache.size()) != static_cast<ssize_t>(cache.size())) {
+			phttp->log(LV_DEBUG, "failed to"
+				" write cache file for mod_fastcgi");
+			return FALSE;
+		}
+		cache.clear();
+		cache.shrink_to_fit();
+	}
+	if (write(pfast_context->cache_fd, pbuff,
+	    length) != static_cast<ssize_t>(length)) {
+		phttp->log(LV_DEBUG, "failed to"
+			" write cache file for mod_fastcgi");
+		return FALSE;
+	}
+	return TRUE;
+}
+
 BOOL mod_fastcgi_write_request(HTTP_CONTEXT *phttp)
 {
 	int size;
@@ -932,112 +1020,91 @@ BOOL mod_fastcgi_write_request(HTTP_CONTEXT *phttp)
 	void *pbuff;
 	char *ptoken;
 	char tmp_buff[1024];
+	auto pfast_context = phttp->pfast_context;
 	
-	if (phttp->pfast_context->b_end)
-		return TRUE;
-	if (phttp->pfast_context->cache_fd < 0) {
-		if (phttp->pfast_context->content_length <= phttp->stream_in.get_total_length())
-			phttp->pfast_context->b_end = TRUE;	
+	if (pfast_context->b_end)
 		return TRUE;
-	}
-	if (!phttp->pfast_context->b_chunked) {
-		if (phttp->pfast_context->cache_size + phttp->stream_in.get_total_length() < phttp->pfast_context->content_length &&
-		    phttp->stream_in.get_total_length() < g_cache_size)
-			return TRUE;	
-		size = STREAM_BLOCK_SIZE;
-		while ((pbuff = phttp->stream_in.get_read_buf(reinterpret_cast<unsigned int *>(&size))) != nullptr) {
-			if (phttp->pfast_context->cache_size + size >
-				phttp->pfast_context->content_length) {
-				tmp_len = phttp->pfast_context->content_length
-							- phttp->pfast_context->cache_size;
+	if (!pfast_context->b_chunked) {
+		/*
+		 * The length is known up front, so PARAMS can go out right
+		 * away and the body is forwarded as STDIN records while it
+		 * is still arriving from the client.
+		 */
+		if (pfast_context->cli_sockd < 0 &&
+		    !mod_fastcgi_begin_request(phttp))
+			return FALSE;
+		size = STDIN_RECORD_MAX;
+		while (pfast_context->cache_size < pfast_context->content_length &&
+		       (pbuff = phttp->stream_in.get_read_buf(reinterpret_cast<unsigned int *>(&size))) != nullptr) {
+			if (pfast_context->cache_size + size > pfast_context->content_length) {
+				tmp_len = pfast_context->content_length - pfast_context->cache_size;
 				phttp->stream_in.rewind_read_ptr(size - tmp_len);
-				phttp->pfast_context->cache_size =
-					phttp->pfast_context->content_length;
-			} else {
-				phttp->pfast_context->cache_size += size;
-				tmp_len = size;
+				size = tmp_len;
 			}
-			if (tmp_len != write(phttp->pfast_context->cache_fd,
-				pbuff, tmp_len)) {
-				phttp->log(LV_DEBUG, "failed to"
-					" write cache file for mod_fastcgi");
+			if (!mod_fastcgi_write_stdin(phttp, pbuff, size))
 				return FALSE;
-			}
-			if (phttp->pfast_context->cache_size ==
-				phttp->pfast_context->content_length) {
-				phttp->pfast_context->b_end = TRUE;
-				return TRUE;
-			}
-			size = STREAM_BLOCK_SIZE;
+			pfast_context->cache_size += size;
+			pfast_context->last_time = tp_now();
+			size = STDIN_RECORD_MAX;
 		}
-	} else {
+		if (pfast_context->cache_size == pfast_context->content_length) {
+			/* anything left in stream_in is the next pipelined request */
+			pfast_context->b_end = TRUE;
+			return TRUE;
+		}
+		phttp->stream_in.clear();
+		return TRUE;
+	}
  CHUNK_BEGIN:
-		if (phttp->pfast_context->chunk_size ==
-			phttp->pfast_context->chunk_offset) {
-			size = phttp->stream_in.peek_buffer(tmp_buff, 1024);
-			if (size < 5)
-				return TRUE;
-			if (0 == strncmp("0\r\n\r\n", tmp_buff, 5)) {
-				phttp->stream_in.fwd_read_ptr(5);
-				phttp->pfast_context->b_end = TRUE;
-				return TRUE;
-			}
-			ptoken = static_cast<char *>(memmem(tmp_buff, size, "\r\n", 2));
-			if (NULL == ptoken) {
-				if (1024 == size) {
-					phttp->log(LV_DEBUG, "failed to "
-						"parse chunked block for mod_fastcgi");
-					return FALSE;
-				}
-				return TRUE;
-			}
-			*ptoken = '\0';
-			phttp->pfast_context->chunk_size =
-					strtol(tmp_buff, NULL, 16);
-			if (0 == phttp->pfast_context->chunk_size) {
+	if (pfast_context->chunk_size == pfast_context->chunk_offset) {
+		size = phttp->stream_in.peek_buffer(tmp_buff, 1024);
+		if (size < 5)
+			return TRUE;
+		if (0 == strncmp("0\r\n\r\n", tmp_buff, 5)) {
+			phttp->stream_in.fwd_read_ptr(5);
+			pfast_context->b_end = TRUE;
+			return TRUE;
+		}
+		ptoken = static_cast<char *>(memmem(tmp_buff, size, "\r\n", 2));
+		if (NULL == ptoken) {
+			if (1024 == size) {
 				phttp->log(LV_DEBUG, "failed to "
 					"parse chunked block for mod_fastcgi");
 				return FALSE;
 			}
-			phttp->pfast_context->chunk_offset = 0;
-			tmp_len = ptoken + 2 - tmp_buff;
-			phttp->stream_in.fwd_read_ptr(tmp_len);
+			return TRUE;
 		}
-		size = STREAM_BLOCK_SIZE;
-		while ((pbuff = phttp->stream_in.get_read_buf(reinterpret_cast<unsigned int *>(&size))) != nullptr) {
-			if (phttp->pfast_context->chunk_size >=
-				size + phttp->pfast_context->chunk_offset) {
-				if (size != write(phttp->pfast_context->cache_fd,
-					pbuff, size)) {
-					phttp->log(LV_DEBUG, "failed to"
-						" write cache file for mod_fastcgi");
-					return FALSE;
-				}
-				phttp->pfast_context->chunk_offset += size;
-				phttp->pfast_context->cache_size += size;
-			} else {
-				tmp_len = phttp->pfast_context->chunk_size
-					- phttp->pfast_context->chunk_offset;
-				if (tmp_len != write(phttp->pfast_context->cache_fd,
-					pbuff, tmp_len)) {
-					phttp->log(LV_DEBUG, "failed to"
-						" write cache file for mod_fastcgi");
-					return FALSE;
-				}
-				phttp->stream_in.rewind_read_ptr(size - tmp_len);
-				phttp->pfast_context->cache_size += tmp_len;
-				phttp->pfast_context->chunk_offset =
-					phttp->pfast_context->chunk_size;
-			}
-			if (phttp->pfast_context->cache_size > g_max_size) {
-				phttp->log(LV_DEBUG, "chunked content"
-						" length is too long for mod_fastcgi");
-				return FALSE;
-			}
-			if (phttp->pfast_context->chunk_offset ==
-			    phttp->pfast_context->chunk_size)
-				goto CHUNK_BEGIN;	
+		*ptoken = '\0';
+		pfast_context->chunk_size = strtol(tmp_buff, NULL, 16);
+		if (0 == pfast_context->chunk_size) {
+			phttp->log(LV_DEBUG, "failed to "
+				"parse chunked block for mod_fastcgi");
+			return FALSE;
+		}
+		pfast_context->chunk_offset = 0;
+		tmp_len = ptoken + 2 - tmp_buff;
+		phttp->stream_in.fwd_read_ptr(tmp_len);
+	}
+	size = STREAM_BLOCK_SIZE;
+	while ((pbuff = phttp->stream_in.get_read_buf(reinterpret_cast<unsigned int *>(&size))) != nullptr) {
+		if (pfast_context->chunk_size >= size + pfast_context->chunk_offset) {
+			tmp_len = size;
+		} else {
+			tmp_len = pfast_context->chunk_size - pfast_context->chunk_offset;
+			phttp->stream_in.rewind_read_ptr(size - tmp_len);
+		}
+		if (pfast_context->cache_size + tmp_len > g_max_size) {
+			phttp->log(LV_DEBUG, "chunked content"
+					" length is too long for mod_fastcgi");
+			return FALSE;
 		}
+		if (!mod_fastcgi_stage_body(phttp, pbuff, tmp_len))
+			return FALSE;
+		pfast_context->chunk_offset += tmp_len;
+		pfast_context->cache_size += tmp_len;
+		if (pfast_context->chunk_offset == pfast_context->chunk_size)
+			goto CHUNK_BEGIN;	
+		size = STREAM_BLOCK_SIZE;
 	}
 	phttp->stream_in.clear();
 	return TRUE;
@@ -1154,15 +1221,19 @@ BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 			ndr_pull_init(&ndr_pull, tmp_buff, tmp_len,
 				NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
 			if (mod_fastcgi_pull_end_request(&ndr_pull,
-			    header.padding_len, &end_request) != NDR_ERR_SUCCESS)
+			    header.padding_len, &end_request) != NDR_ERR_SUCCESS) {
 				phttp->log(LV_DEBUG, "failed to"
 					" pull record body in mod_fastcgi");
-			else
+			} else {
 				phttp->log(LV_DEBUG, "app_status %u, "
 						"protocol_status %d from fastcgi back-end"
 						" %s", end_request.app_status,
 						(int)end_request.protocol_status,
 						phttp->pfast_context->pfnode->sock_path.c_str());
+				/* the record stream is in sync; the socket may serve the next request */
+				if (end_request.protocol_status == PROTOCOL_STATUS_REQUEST_COMPLETE)
+					mod_fastcgi_put_backend(phttp->pfast_context);
+			}
 			if (phttp->pfast_context->b_header &&
 			    phttp->pfast_context->b_chunked)
 				phttp->stream_out.write("0\r\n\r\n", 5);
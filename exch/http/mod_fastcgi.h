@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <ctime>
+#include <string>
 #include <gromox/clock.hpp>
 #include <gromox/common_types.hpp>
 #define RESPONSE_TIMEOUT				-1
@@ -15,16 +16,16 @@ struct FASTCGI_CONTEXT {
 	uint32_t chunk_size = 0, chunk_offset = 0;
 	uint64_t content_length = 0;
 	const FASTCGI_NODE *pfnode = nullptr;
-	uint64_t cache_size = 0;
+	uint64_t cache_size = 0; /* body bytes relayed/staged so far */
 	int cache_fd = -1, cli_sockd = -1;
 	gromox::time_point last_time{};
-	std::string tmpfile;
+	std::string tmpfile, body_cache;
 };
 
 struct http_context;
 using HTTP_CONTEXT = http_context;
 
-extern void mod_fastcgi_init(int context_num, uint64_t cache_size, uint64_t max_size, gromox::time_duration exec_timeout);
+extern void mod_fastcgi_init(int context_num, uint64_t cache_size, uint64_t max_size, gromox::time_duration exec_timeout, unsigned int max_idle_conns);
 extern int mod_fastcgi_run();
 extern void mod_fastcgi_stop();
 extern bool mod_fastcgi_take_request(HTTP_CONTEXT *);
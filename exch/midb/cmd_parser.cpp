@@ -22,6 +22,7 @@
 #include <gromox/common_types.hpp>
 #include <gromox/defs.h>
 #include <gromox/double_list.hpp>
+#include <gromox/endian.hpp>
 #include <gromox/midb.hpp>
 #include <gromox/scope.hpp>
 #include <gromox/util.hpp>
@@ -150,6 +151,8 @@ void cmd_parser_register_command(const char *command, MIDB_CMD_HANDLER handler)
 
 static thread_local int dbg_current_argc;
 static thread_local char **dbg_current_argv;
+/* response of the framed request being executed, if any */
+static thread_local std::string *g_frame_out;
 
 static void cmd_dump_argv(int argc, char **argv)
 {
@@ -162,7 +165,17 @@ static void cmd_dump_argv(int argc, char **argv)
 static ssize_t __attribute__((warn_unused_result))
 cmd_write_x(unsigned int level, int fd, const char *buf, size_t z)
 {
-	auto ret = HXio_fullwrite(fd, buf, z);
+	ssize_t ret = z;
+	if (g_frame_out == nullptr) {
+		ret = HXio_fullwrite(fd, buf, z);
+	} else {
+		try {
+			g_frame_out->append(buf, z);
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-2819: ENOMEM");
+			ret = -1;
+		}
+	}
 	if (g_cmd_debug < level)
 		return ret;
 	if (dbg_current_argv != nullptr) {
@@ -187,6 +200,11 @@ int cmd_write(int fd, const char *sbuf, size_t z)
 	return cmd_write_x(2, fd, sbuf, z) < 0 ? MIDB_E_NETIO : 0;
 }
 
+bool cmd_framed()
+{
+	return g_frame_out != nullptr;
+}
+
 static std::pair<bool, int> midcp_exec1(int argc, char **argv, MIDB_CONNECTION *conn)
 {
 	if (g_notify_stop)
@@ -217,6 +235,49 @@ static int midcp_exec(int argc, char **argv, MIDB_CONNECTION *conn)
 	return cmd_write_x(1, conn->sockd, rsp, len) < 0 ? MIDB_E_NETIO : 0;
 }
 
+/**
+ * Execute the frame at the start of @buffer. Returns the number of bytes
+ * consumed, 0 if the frame is not complete yet, or -1 if the connection
+ * is to be dropped.
+ */
+static int midcp_frame(MIDB_CONNECTION *conn, const char *buffer, int offset,
+    char **argv) try
+{
+	if (offset < MIDB_FRAME_HDRLEN)
+		return 0;
+	auto reqid = le32p_to_cpu(&buffer[4]);
+	size_t len = le32p_to_cpu(&buffer[8]);
+	if (len > CONN_BUFFLEN - MIDB_FRAME_HDRLEN - 2)
+		return -1;
+	if (static_cast<size_t>(offset) < MIDB_FRAME_HDRLEN + len)
+		return 0;
+	/* generate_args needs two bytes of slack past the command */
+	std::string cmd(&buffer[MIDB_FRAME_HDRLEN], len);
+	cmd.append(2, '\0');
+	std::string out(MIDB_FRAME_HDRLEN, '\0');
+	auto argc = cmd_parser_generate_args(cmd.data(), len, argv);
+	g_frame_out = &out;
+	auto cl_0 = make_scope_exit([]() { g_frame_out = nullptr; });
+	if (argc < 2) {
+		out += "FALSE 1\r\n";
+	} else {
+		HX_strupper(argv[0]);
+		if (midcp_exec(argc, argv, conn) == MIDB_E_NETIO)
+			return -1;
+	}
+	g_frame_out = nullptr;
+	out[0] = static_cast<char>(MIDB_FRAME_MAGIC);
+	cpu_to_le32p(&out[4], reqid);
+	cpu_to_le32p(&out[8], out.size() - MIDB_FRAME_HDRLEN);
+	if (HXio_fullwrite(conn->sockd, out.data(), out.size()) !=
+	    static_cast<ssize_t>(out.size()))
+		return -1;
+	return MIDB_FRAME_HDRLEN + len;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2820: ENOMEM");
+	return -1;
+}
+
 static void *midcp_thrwork(void *param)
 {
 	int i, argc, offset, tv_msec, read_len;
@@ -268,8 +329,35 @@ static void *midcp_thrwork(void *param)
 		}
 		offset += read_len;
 		for (i=0; i<offset-1; i++) {
+			if (i == 0 && pconnection->framed &&
+			    static_cast<uint8_t>(buffer[0]) == MIDB_FRAME_MAGIC) {
+				auto used = midcp_frame(&*pconnection, buffer, offset, argv);
+				if (used < 0) {
+					co_hold.lock();
+					gc.splice(gc.end(), g_connlist_active, pconnection);
+					goto NEXT_LOOP;
+				}
+				if (used == 0)
+					break;
+				offset -= used;
+				memmove(buffer, buffer + used, offset);
+				i = -1;
+				continue;
+			}
 			if (buffer[i] != '\r' || buffer[i+1] != '\n')
 				continue;
+			if (5 == i && 0 == strncasecmp(buffer, "FRAME", 5)) {
+				if (HXio_fullwrite(pconnection->sockd, "TRUE\r\n", 6) != 6) {
+					co_hold.lock();
+					gc.splice(gc.end(), g_connlist_active, pconnection);
+					goto NEXT_LOOP;
+				}
+				pconnection->framed = true;
+				offset -= i + 2;
+				memmove(buffer, buffer + i + 2, offset);
+				i = -1;
+				continue;
+			}
 			if (4 == i && 0 == strncasecmp(buffer, "QUIT", 4)) {
 				if (HXio_fullwrite(pconnection->sockd, "BYE\r\n", 5) != 5)
 					/* ignore */;
@@ -288,7 +376,7 @@ static void *midcp_thrwork(void *param)
 				offset -= i + 2;
 				if (offset >= 0)
 					memmove(buffer, buffer + i + 2, offset);
-				i = 0;
+				i = -1;
 				continue;
 			}
 
@@ -300,7 +388,7 @@ static void *midcp_thrwork(void *param)
 			}
 			offset -= i + 2;
 			memmove(buffer, buffer + i + 2, offset);
-			i = 0;
+			i = -1;
 		}
 
 		if (CONN_BUFFLEN == offset) {
@@ -314,7 +402,7 @@ static void *midcp_thrwork(void *param)
 
 static int cmd_parser_ping(int argc, char **argv, int sockd)
 {
-	return HXio_fullwrite(sockd, "TRUE\r\n", 6) < 0 ? MIDB_E_NETIO : 0;
+	return cmd_write(sockd, "TRUE\r\n");
 }
 
 static int cmd_parser_generate_args(char* cmd_line, int cmd_len, char** argv)
@@ -9,6 +9,7 @@ struct midb_conn {
 	DOUBLE_LIST_NODE node{};
 	int sockd = -1;
 	BOOL is_selecting = false;
+	bool framed = false; /* client may send MIDB_FRAME_MAGIC frames */
 	pthread_t thr_id{};
 };
 using MIDB_CONNECTION = midb_conn;
@@ -22,5 +23,6 @@ extern std::list<midb_conn> cmd_parser_get_connection();
 extern void cmd_parser_put_connection(std::list<midb_conn> &&);
 extern void cmd_parser_register_command(const char *command, MIDB_CMD_HANDLER);
 extern int cmd_write(int fd, const char *buf, size_t size = -1) __attribute__((warn_unused_result));
+extern bool cmd_framed();
 
 extern unsigned int g_cmd_debug;
@@ -35,6 +35,7 @@
 #include <gromox/dbop.h>
 #include <gromox/defs.h>
 #include <gromox/double_list.hpp>
+#include <gromox/endian.hpp>
 #include <gromox/fileio.h>
 #include <gromox/mail.hpp>
 #include <gromox/mail_func.hpp>
@@ -167,8 +168,9 @@ struct SIMU_NODE {
 	DOUBLE_LIST_NODE node;
 	uint32_t idx;
 	uint32_t uid;
+	uint64_t modseq;
 	char *mid_string;
-	char *flags_buff;
+	unsigned int flags;
 };
 
 }
@@ -307,7 +309,7 @@ static uint64_t mail_engine_get_digest(sqlite3 *psqlite,
 	}
 	auto pstmt = gx_sql_prep(psqlite, "SELECT uid, recent, read,"
 	             " unsent, flagged, replied, forwarded, deleted, ext,"
-	             " folder_id FROM messages WHERE mid_string=?");
+	             " folder_id, modseq FROM messages WHERE mid_string=?");
 	if (pstmt == nullptr)
 		return 0;
 	sqlite3_bind_text(pstmt, 1, mid_string, -1, SQLITE_STATIC);
@@ -323,6 +325,7 @@ static uint64_t mail_engine_get_digest(sqlite3 *psqlite,
 	set_digest(digest_buff, MAX_DIGLEN, "replied", pstmt.col_int64(5));
 	set_digest(digest_buff, MAX_DIGLEN, "forwarded", pstmt.col_int64(6));
 	set_digest(digest_buff, MAX_DIGLEN, "deleted", pstmt.col_int64(7));
+	set_digest(digest_buff, MAX_DIGLEN, "modseq", pstmt.col_int64(10));
 	if (sqlite3_column_type(pstmt, 8) == SQLITE_NULL)
 		return folder_id;
 	pext = S2A(sqlite3_column_text(pstmt, 8));
@@ -1495,54 +1498,59 @@ static const char *field_to_col(unsigned int sf)
 	}
 }
 
-static BOOL mail_engine_sort_folder(IDB_ITEM *pidb,
-	const char *folder_name, int sort_field)
+static const char *sort_field_col(int sort_field)
 {
-	uint32_t idx;
-	uint64_t folder_id;
-	char sql_string[1024];
-	
-	auto field_name = field_to_col(sort_field);
-	if (field_name == nullptr) {
-		field_name = "uid";
-		sort_field = FIELD_UID;
+	auto col = field_to_col(sort_field);
+	return col != nullptr ? col : "uid";
+}
+
+/*
+ * Sequence numbers (the 1-based position of a message in the requested sort
+ * order) are not stored, so that clients using different sort orders on the
+ * same folder do not rewrite the whole folder on every command. Every sort
+ * field has a (folder_id, <field>, uid) index: ranges are read with
+ * LIMIT/OFFSET off that index, and a position is a row-value count over it.
+ *
+ * For a UID range [@first, @last], only the requested rows are numbered: in
+ * UID order, consecutively, offset by the count of lower UIDs; in other
+ * orders, each by counting the rows sorting before it. Without a range, the
+ * whole folder is numbered with a window function. (@first/@last are
+ * seq_node::unset when open.)
+ *
+ * The text written to @buf is a CTE prefix; the query that follows selects
+ * "FROM sorted JOIN messages ON message_id=smid" and uses "seq".
+ */
+static void mail_engine_sorted_view(char *buf, size_t z, uint64_t folder_id,
+    int sort_field, seq_node::value_type first = seq_node::unset,
+    seq_node::value_type last = seq_node::unset)
+{
+	if (field_to_col(sort_field) == nullptr && first != seq_node::unset) {
+		char upper[24] = "";
+		if (last != seq_node::unset)
+			snprintf(upper, std::size(upper), " AND uid<=%u", last);
+		snprintf(buf, z, "WITH sorted(smid, seq) AS (SELECT message_id, "
+		         "(SELECT count(*) FROM messages WHERE folder_id=%llu "
+		         "AND uid<%u) + ROW_NUMBER() OVER (ORDER BY uid) "
+		         "FROM messages WHERE folder_id=%llu AND uid>=%u%s) ",
+		         LLU{folder_id}, first, LLU{folder_id}, first, upper);
+		return;
 	}
-	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT folder_id,"
-	             " sort_field FROM folders WHERE name=?");
-	if (pstmt == nullptr)
-		return FALSE;
-	sqlite3_bind_text(pstmt, 1, folder_name, -1, SQLITE_STATIC);
-	if (sqlite3_step(pstmt) != SQLITE_ROW)
-		return FALSE;
-	folder_id = sqlite3_column_int64(pstmt, 0);
-	if (sqlite3_column_int64(pstmt, 1) == sort_field)
-		return TRUE;
-	pstmt.finalize();
-	snprintf(sql_string, arsizeof(sql_string), "SELECT message_id FROM messages"
-	          " WHERE folder_id=%llu ORDER BY %s", LLU{folder_id}, field_name);
-	pstmt = gx_sql_prep(pidb->psqlite, sql_string);
-	if (pstmt == nullptr)
-		return FALSE;
-	auto pstmt1 = gx_sql_prep(pidb->psqlite, "UPDATE messages"
-	              " SET idx=? WHERE message_id=?");
-	if (pstmt1 == nullptr)
-		return FALSE;
-	idx = 1;
-	while (SQLITE_ROW == sqlite3_step(pstmt)) {
-		sqlite3_reset(pstmt1);
-		sqlite3_bind_int64(pstmt1, 1, idx);
-		sqlite3_bind_int64(pstmt1, 2,
-			sqlite3_column_int64(pstmt, 0));
-		if (sqlite3_step(pstmt1) != SQLITE_DONE)
-			return FALSE;
-		idx ++;
+	if (first != seq_node::unset) {
+		auto col = sort_field_col(sort_field);
+		char upper[24] = "";
+		if (last != seq_node::unset)
+			snprintf(upper, std::size(upper), " AND m.uid<=%u", last);
+		snprintf(buf, z, "WITH sorted(smid, seq) AS (SELECT m.message_id, "
+		         "(SELECT count(*) FROM messages AS c WHERE c.folder_id=%llu "
+		         "AND (c.%s, c.uid)<=(m.%s, m.uid)) FROM messages AS m "
+		         "WHERE m.folder_id=%llu AND m.uid>=%u%s) ",
+		         LLU{folder_id}, col, col, LLU{folder_id}, first, upper);
+		return;
 	}
-	pstmt.finalize();
-	pstmt1.finalize();
-	snprintf(sql_string, arsizeof(sql_string), "UPDATE folders SET sort_field=%d "
-	        "WHERE folder_id=%llu", sort_field, LLU{folder_id});
-	gx_sql_exec(pidb->psqlite, sql_string);
-	return TRUE;
+	snprintf(buf, z, "WITH sorted(smid, seq) AS (SELECT message_id, "
+	         "ROW_NUMBER() OVER (ORDER BY %s, uid) FROM messages "
+	         "WHERE folder_id=%llu) ", sort_field_col(sort_field),
+	         LLU{folder_id});
 }
 
 static void mail_engine_extract_digest_fields(const char *digest, char *subject,
@@ -1716,33 +1724,189 @@ static void mail_engine_sync_message(IDB_ITEM *pidb,
 			NULL, message_flags, received_time, mod_time);
 }
 
-static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id)
+/*
+ * Bring one midb row in line with the exmdb message: insert it if it is new,
+ * else update the flags (or re-extract it if its content changed).
+ * @stm_sel: SELECT message_id, mid_string, mod_time, unsent, read FROM messages
+ */
+static void mail_engine_sync_row(IDB_ITEM *pidb, sqlite3_stmt *stm_sel,
+    sqlite3_stmt *stm_ins, sqlite3_stmt *stm_upd, uint32_t *puidnext,
+    uint64_t message_id, const char *mid_string, uint64_t mod_time,
+    uint32_t message_flags, uint64_t received_time)
+{
+	sqlite3_reset(stm_sel);
+	sqlite3_bind_int64(stm_sel, 1, message_id);
+	if (sqlite3_step(stm_sel) != SQLITE_ROW) {
+		++*puidnext;
+		mail_engine_insert_message(stm_ins, puidnext, message_id,
+			mid_string, message_flags, received_time, mod_time);
+		return;
+	}
+	mail_engine_sync_message(pidb, stm_ins, stm_upd, puidnext, message_id,
+		received_time, mid_string, S2A(sqlite3_column_text(stm_sel, 1)),
+		mod_time, sqlite3_column_int64(stm_sel, 2), message_flags,
+		sqlite3_column_int64(stm_sel, 3), sqlite3_column_int64(stm_sel, 4));
+}
+
+static void mail_engine_sync_rows(IDB_ITEM *pidb, sqlite3_stmt *stm_sel,
+    sqlite3_stmt *stm_ins, sqlite3_stmt *stm_upd, uint32_t *puidnext,
+    const TARRAY_SET &rows)
+{
+	for (size_t i = 0; i < rows.count; ++i) {
+		auto num = rows.pparray[i]->get<const uint64_t>(PidTagMid);
+		auto flags = rows.pparray[i]->get<const uint32_t>(PR_MESSAGE_FLAGS);
+		if (num == nullptr || flags == nullptr)
+			continue;
+		auto mod_time = rows.pparray[i]->get<uint64_t>(PR_LAST_MODIFICATION_TIME);
+		auto recv_time = rows.pparray[i]->get<uint64_t>(PR_MESSAGE_DELIVERY_TIME);
+		mail_engine_sync_row(pidb, stm_sel, stm_ins, stm_upd, puidnext,
+			rop_util_get_gc_value(*num),
+			rows.pparray[i]->get<const char>(PidTagMidString),
+			mod_time != nullptr ? *mod_time : 0, *flags,
+			recv_time != nullptr ? *recv_time : 0);
+	}
+}
+
+static size_t mail_engine_folder_count(IDB_ITEM *pidb, uint64_t folder_id)
+{
+	char sql_string[128];
+
+	snprintf(sql_string, arsizeof(sql_string), "SELECT COUNT(*) FROM "
+	         "messages WHERE folder_id=%llu", LLU{folder_id});
+	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
+	if (pstmt == nullptr || sqlite3_step(pstmt) != SQLITE_ROW)
+		return SIZE_MAX;
+	return sqlite3_column_int64(pstmt, 0);
+}
+
+/*
+ * Incremental resync: fetch only the messages whose change number is above
+ * the one recorded at the last sync. Deletions leave no trace in the
+ * private store, so they are looked for only when the message count
+ * disagrees afterwards, by handing exmdb the list of IDs midb has. Returns
+ * false if the caller should fall back to a full sync.
+ */
+static bool mail_engine_sync_delta(IDB_ITEM *pidb, uint64_t folder_id,
+    uint64_t *psync_cn, uint32_t *puidnext)
+{
+	auto dir = common_util_get_maildir();
+	uint32_t total = 0;
+	TARRAY_SET rows{};
+	EID_ARRAY given{}, deleted{};
+
+	if (!exmdb_client::query_folder_changes(dir,
+	    rop_util_make_eid_ex(1, folder_id), *psync_cn, &given, psync_cn,
+	    &total, &rows, &deleted))
+		return false;
+	auto stm_sel = gx_sql_prep(pidb->psqlite, "SELECT message_id, mid_string,"
+	               " mod_time, unsent, read FROM messages WHERE message_id=?");
+	if (stm_sel == nullptr)
+		return false;
+	char sql_string[256];
+	snprintf(sql_string, arsizeof(sql_string), "INSERT INTO messages (message_id, "
+		"folder_id, mid_string, mod_time, uid, unsent, read, subject,"
+		" sender, rcpt, size, received) VALUES (?, %llu, ?, ?, ?, ?, "
+		"?, ?, ?, ?, ?, ?)", LLU{folder_id});
+	auto stm_ins = gx_sql_prep(pidb->psqlite, sql_string);
+	if (stm_ins == nullptr)
+		return false;
+	auto stm_upd = gx_sql_prep(pidb->psqlite, "UPDATE messages"
+	               " SET unsent=?, read=? WHERE message_id=?");
+	if (stm_upd == nullptr)
+		return false;
+	if (rows.count > 0)
+		mlog(LV_NOTICE, "sync_delta %s fld %llu: %u changed",
+		        dir, LLU{folder_id}, rows.count);
+	mail_engine_sync_rows(pidb, stm_sel, stm_ins, stm_upd, puidnext, rows);
+	auto count = mail_engine_folder_count(pidb, folder_id);
+	if (count == total)
+		return true;
+	if (count < total || count > UINT32_MAX)
+		return false;
+
+	snprintf(sql_string, arsizeof(sql_string), "SELECT message_id FROM "
+	         "messages WHERE folder_id=%llu", LLU{folder_id});
+	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
+	if (pstmt == nullptr)
+		return false;
+	given.pids = cu_alloc<uint64_t>(count);
+	if (given.pids == nullptr)
+		return false;
+	while (given.count < count && sqlite3_step(pstmt) == SQLITE_ROW)
+		given.pids[given.count++] = rop_util_make_eid_ex(1, sqlite3_column_int64(pstmt, 0));
+	pstmt.finalize();
+	if (!exmdb_client::query_folder_changes(dir,
+	    rop_util_make_eid_ex(1, folder_id), *psync_cn, &given, psync_cn,
+	    &total, &rows, &deleted))
+		return false;
+	mail_engine_sync_rows(pidb, stm_sel, stm_ins, stm_upd, puidnext, rows);
+	pstmt = gx_sql_prep(pidb->psqlite, "DELETE FROM messages WHERE message_id=?");
+	if (pstmt == nullptr)
+		return false;
+	for (size_t i = 0; i < deleted.count; ++i) {
+		sqlite3_reset(pstmt);
+		sqlite3_bind_int64(pstmt, 1, rop_util_get_gc_value(deleted.pids[i]));
+		if (sqlite3_step(pstmt) != SQLITE_DONE)
+			return false;
+	}
+	mlog(LV_NOTICE, "sync_delta %s fld %llu: %u removed",
+	        dir, LLU{folder_id}, deleted.count);
+	return mail_engine_folder_count(pidb, folder_id) == total;
+}
+
+static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id,
+    bool full)
 {
-	const char *dir;
 	TARRAY_SET rows;
 	sqlite3 *psqlite;
-	uint32_t uidnext;
-	uint32_t uidnext1;
+	uint32_t uidnext, uidnext1;
+	uint64_t sync_cn, sync_cn1;
 	DOUBLE_LIST temp_list;
 	char sql_string[1024];
 	DOUBLE_LIST_NODE *pnode;
 	
-	dir = common_util_get_maildir();
-	mlog(LV_NOTICE, "Running sync_contents for %s, folder %llu",
-	        dir, LLU{folder_id});
-	if (!exmdb_client::query_folder_messages(dir,
-	    rop_util_make_eid_ex(1, folder_id), &rows))
-		return FALSE;
-	snprintf(sql_string, arsizeof(sql_string), "SELECT uidnext FROM"
-	          " folders WHERE folder_id=%llu", LLU{folder_id});
+	auto dir = common_util_get_maildir();
+	snprintf(sql_string, arsizeof(sql_string), "SELECT uidnext, sync_cn"
+	          " FROM folders WHERE folder_id=%llu", LLU{folder_id});
 	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
 	if (sqlite3_step(pstmt) != SQLITE_ROW)
 		return TRUE;
-	uidnext = sqlite3_column_int64(pstmt, 0);
+	uidnext = uidnext1 = sqlite3_column_int64(pstmt, 0);
+	sync_cn = sync_cn1 = sqlite3_column_int64(pstmt, 1);
 	pstmt.finalize();
-	uidnext1 = uidnext;
+	auto cl_1 = make_scope_exit([&]() {
+		if (uidnext == uidnext1 && sync_cn == sync_cn1)
+			return;
+		char upd[128];
+		snprintf(upd, arsizeof(upd), "UPDATE folders SET uidnext=%u, "
+		         "sync_cn=%llu WHERE folder_id=%llu", uidnext,
+		         LLU{sync_cn}, LLU{folder_id});
+		gx_sql_exec(pidb->psqlite, upd);
+	});
+	if (!full && sync_cn != 0) {
+		if (mail_engine_sync_delta(pidb, folder_id, &sync_cn, &uidnext))
+			return TRUE;
+		sync_cn = sync_cn1;
+	}
+	mlog(LV_NOTICE, "Running sync_contents for %s, folder %llu",
+	        dir, LLU{folder_id});
+	/*
+	 * A full listing is a delta from CN 0; older exmdb servers only know
+	 * query_folder_messages, and then no CN is recorded.
+	 */
+	uint32_t total = 0;
+	uint64_t full_cn = 0;
+	EID_ARRAY given{}, deleted{};
+	if (!exmdb_client::query_folder_changes(dir,
+	    rop_util_make_eid_ex(1, folder_id), 0, &given, &full_cn, &total,
+	    &rows, &deleted)) {
+		full_cn = 0;
+		if (!exmdb_client::query_folder_messages(dir,
+		    rop_util_make_eid_ex(1, folder_id), &rows))
+			return FALSE;
+	}
 	if (sqlite3_open_v2(":memory:", &psqlite, SQLITE_OPEN_READWRITE |
 	    SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
 		return FALSE;
@@ -1815,29 +1979,12 @@ static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id)
 	if (stm_upd_msg == nullptr)
 		return FALSE;
 	while (SQLITE_ROW == sqlite3_step(pstmt)) {
-		uint64_t message_id = sqlite3_column_int64(pstmt, 0);
-		sqlite3_reset(pstmt1);
-		sqlite3_bind_int64(pstmt1, 1, message_id);
-		if (SQLITE_ROW != sqlite3_step(pstmt1)) {
-			uidnext ++;
-			mail_engine_insert_message(
-				pstmt2, &uidnext, message_id,
-				S2A(sqlite3_column_text(pstmt, 1)),
-				sqlite3_column_int64(pstmt, 3),
-				sqlite3_column_int64(pstmt, 4),
-				sqlite3_column_int64(pstmt, 2));
-		} else {
-			mail_engine_sync_message(pidb,
-				pstmt2, stm_upd_msg, &uidnext, message_id,
-				sqlite3_column_int64(pstmt, 4),
-				S2A(sqlite3_column_text(pstmt, 1)),
-				S2A(sqlite3_column_text(pstmt1, 1)),
-				sqlite3_column_int64(pstmt, 2),
-				sqlite3_column_int64(pstmt1, 2),
-				sqlite3_column_int64(pstmt, 3),
-				sqlite3_column_int64(pstmt1, 3),
-				sqlite3_column_int64(pstmt1, 4));
-		}
+		mail_engine_sync_row(pidb, pstmt1, pstmt2, stm_upd_msg,
+			&uidnext, sqlite3_column_int64(pstmt, 0),
+			S2A(sqlite3_column_text(pstmt, 1)),
+			sqlite3_column_int64(pstmt, 2),
+			sqlite3_column_int64(pstmt, 3),
+			sqlite3_column_int64(pstmt, 4));
 		if (++procmsgs % 512 == 0)
 			mlog(LV_NOTICE, "sync_contents %s fld %llu progress: %zu/%zu",
 			        dir, LLU{folder_id}, procmsgs, totalmsgs);
@@ -1890,16 +2037,8 @@ static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id)
 		}
 		pstmt.finalize();
 	}
-	if (uidnext != uidnext1) {
-		snprintf(sql_string, arsizeof(sql_string), "UPDATE folders SET uidnext=%u "
-		        "WHERE folder_id=%llu", uidnext, LLU{folder_id});
-		if (gx_sql_exec(pidb->psqlite, sql_string) != SQLITE_OK)
-			return FALSE;
-	}
+	sync_cn = full_cn;
 	}
-	snprintf(sql_string, arsizeof(sql_string), "UPDATE folders SET sort_field=%d "
-	        "WHERE folder_id=%llu", FIELD_NONE, LLU{folder_id});
-	gx_sql_exec(pidb->psqlite, sql_string);
 	return TRUE;
 }
 
@@ -2149,7 +2288,7 @@ static BOOL mail_engine_sync_mailbox(IDB_ITEM *pidb, bool force_resync = false)
 				continue;	
 			b_new = FALSE;
 		}
-		if (!mail_engine_sync_contents(pidb, folder_id))
+		if (!mail_engine_sync_contents(pidb, folder_id, force_resync))
 			return false;
 		if (!b_new) {
 			snprintf(sql_string, arsizeof(sql_string), "UPDATE folders SET commit_max=%llu"
@@ -2545,8 +2684,7 @@ static int mail_engine_mlist(int argc, char **argv, int sockd)
 	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
-	if (!mail_engine_sort_folder(pidb.get(), argv[2], sort_field))
-		return MIDB_E_MNG_SORTFOLDER;
+	auto sort_col = sort_field_col(sort_field);
 	snprintf(sql_string, arsizeof(sql_string), "SELECT count(message_id) "
 	          "FROM messages WHERE folder_id=%llu", LLU{folder_id});
 	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
@@ -2570,8 +2708,8 @@ static int mail_engine_mlist(int argc, char **argv, int sockd)
 			length = total_mail - idx1 + 1;
 		idx2 = idx1 + length - 1;
 		snprintf(sql_string, arsizeof(sql_string), "SELECT mid_string FROM messages "
-			"WHERE folder_id=%llu AND idx>=%d AND idx<=%d ORDER BY idx",
-			LLU{folder_id}, idx1, idx2);
+			"WHERE folder_id=%llu ORDER BY %s, uid LIMIT %d OFFSET %d",
+			LLU{folder_id}, sort_col, length, idx1 - 1);
 	} else {
 		if (offset < 0) {
 			idx2 = std::min(-offset, total_mail);
@@ -2586,8 +2724,8 @@ static int mail_engine_mlist(int argc, char **argv, int sockd)
 			length = idx2;
 		idx1 = idx2 - length + 1;
 		snprintf(sql_string, arsizeof(sql_string), "SELECT mid_string FROM messages "
-			"WHERE folder_id=%llu AND idx>=%d AND idx<=%d ORDER BY idx "
-			"DESC", LLU{folder_id}, idx1, idx2);
+			"WHERE folder_id=%llu ORDER BY %s DESC, uid DESC LIMIT %d OFFSET %d",
+			LLU{folder_id}, sort_col, length, total_mail - idx2);
 	}
 	pstmt = gx_sql_prep(pidb->psqlite, sql_string);
 	if (pstmt == nullptr)
@@ -3279,17 +3417,22 @@ static int mail_engine_pofst(int argc, char **argv, int sockd)
 	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
-	if (!mail_engine_sort_folder(pidb.get(), argv[2], sort_field))
-		return MIDB_E_MNG_SORTFOLDER;
-	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT folder_id,"
-	             " idx FROM messages WHERE mid_string=?");
+	auto sort_col = sort_field_col(sort_field);
+	snprintf(sql_string, arsizeof(sql_string), "SELECT count(*) FROM "
+	         "messages AS m, messages AS x WHERE x.mid_string=? AND "
+	         "x.folder_id=%llu AND m.folder_id=%llu AND "
+	         "(m.%s, m.uid) <= (x.%s, x.uid)", LLU{folder_id},
+	         LLU{folder_id}, sort_col, sort_col);
+	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
 	sqlite3_bind_text(pstmt, 1, argv[3], -1, SQLITE_STATIC);
-	if (sqlite3_step(pstmt) != SQLITE_ROW ||
-	    gx_sql_col_uint64(pstmt, 0) != folder_id)
+	if (sqlite3_step(pstmt) != SQLITE_ROW)
+		return MIDB_E_SQLUNEXP;
+	/* the message itself is always counted */
+	idx = sqlite3_column_int64(pstmt, 0);
+	if (idx == 0)
 		return MIDB_E_NO_MESSAGE;
-	idx = sqlite3_column_int64(pstmt, 1);
 	pstmt.finalize();
 	if (!b_asc) {
 		snprintf(sql_string, arsizeof(sql_string), "SELECT count(message_id) "
@@ -3341,7 +3484,7 @@ static int mail_engine_punid(int argc, char **argv, int sockd)
  * Request:
  * 	P-FDDT <dir> <folder> <sortfield> <ascdesc>
  * Response:
- * 	TRUE <msgcount> <#recents> <#unreads> <uidvalidity(folder_id)> <uidnext> <offset>
+ * 	TRUE <msgcount> <#recents> <#unreads> <uidvalidity(folder_id)> <uidnext> <offset> <highestmodseq>
  * offset is first unread msg. minus 1?!
  */
 static int mail_engine_pfddt(int argc, char **argv, int sockd)
@@ -3350,14 +3493,15 @@ static int mail_engine_pfddt(int argc, char **argv, int sockd)
 	int temp_len;
 	uint32_t total;
 	uint32_t uidnext;
-	uint64_t uidvalid;
+	uint64_t uidvalid, modseq;
 	uint64_t folder_id;
 	char temp_buff[1024];
 	char sql_string[1024];
 	
 	if (argc != 5 || strlen(argv[1]) >= 256 || strlen(argv[2]) >= 1024)
 		return MIDB_E_PARAMETER_ERROR;
-	if (kw_to_sort_field(argv[3]) < FIELD_NONE)
+	auto sort_field = kw_to_sort_field(argv[3]);
+	if (sort_field < FIELD_NONE)
 		return MIDB_E_PARAMETER_ERROR;
 	bool b_asc;
 	if (!kw_to_sort_order(argv[4], b_asc))
@@ -3366,7 +3510,7 @@ static int mail_engine_pfddt(int argc, char **argv, int sockd)
 	if (pidb == nullptr)
 		return MIDB_E_HASHTABLE_FULL;
 	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT folder_id,"
-	             " uidnext FROM folders WHERE name=?");
+	             " uidnext, modseq FROM folders WHERE name=?");
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
 	sqlite3_bind_text(pstmt, 1, argv[2], -1, SQLITE_STATIC);
@@ -3374,6 +3518,7 @@ static int mail_engine_pfddt(int argc, char **argv, int sockd)
 		return MIDB_E_NO_FOLDER;
 	folder_id = sqlite3_column_int64(pstmt, 0);
 	uidnext = sqlite3_column_int64(pstmt, 1);
+	modseq = sqlite3_column_int64(pstmt, 2);
 	pstmt.finalize();
 	snprintf(sql_string, arsizeof(sql_string), "SELECT count(message_id) "
 	          "FROM messages WHERE folder_id=%llu", LLU{folder_id});
@@ -3398,8 +3543,12 @@ static int mail_engine_pfddt(int argc, char **argv, int sockd)
 		return MIDB_E_SQLPREP;
 	uint32_t recents = sqlite3_step(pstmt) == SQLITE_ROW ? sqlite3_column_int64(pstmt, 0) : 0;
 	pstmt.finalize();
-	snprintf(sql_string, arsizeof(sql_string), "SELECT min(idx) FROM messages "
-	          "WHERE folder_id=%llu AND read=0", LLU{folder_id});
+	auto sort_col = sort_field_col(sort_field);
+	snprintf(sql_string, arsizeof(sql_string), "SELECT count(*) FROM "
+	          "messages AS m, (SELECT %s AS f, uid FROM messages "
+	          "WHERE folder_id=%llu AND read=0 ORDER BY %s, uid LIMIT 1) AS x "
+	          "WHERE m.folder_id=%llu AND (m.%s, m.uid) <= (x.f, x.uid)",
+	          sort_col, LLU{folder_id}, sort_col, LLU{folder_id}, sort_col);
 	pstmt = gx_sql_prep(pidb->psqlite, sql_string);
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
@@ -3415,8 +3564,9 @@ static int mail_engine_pfddt(int argc, char **argv, int sockd)
 	pstmt.finalize();
 	pidb.reset();
 	uidvalid = folder_id;
-	temp_len = sprintf(temp_buff, "TRUE %u %u %u %llu %u %d\r\n",
-	           total, recents, unreads, LLU{uidvalid}, uidnext + 1, offset);
+	temp_len = sprintf(temp_buff, "TRUE %u %u %u %llu %u %d %llu\r\n",
+	           total, recents, unreads, LLU{uidvalid}, uidnext + 1, offset,
+	           LLU{modseq});
 	return cmd_write(sockd, temp_buff, temp_len);
 }
 
@@ -3490,13 +3640,74 @@ static int mail_engine_psubl(int argc, char **argv, int sockd)
 	return cmd_write(sockd, temp_buff + 32 - offset, offset + temp_len - 32);
 }
 
+/* Flag columns replied, unsent, flagged, deleted, read, recent, forwarded */
+static unsigned int simrec_flags(sqlite3_stmt *pstmt, int col)
+{
+	unsigned int fl = 0;
+	if (sqlite3_column_int64(pstmt, col) != 0)
+		fl |= MIDB_RF_ANSWERED;
+	if (sqlite3_column_int64(pstmt, col + 1) != 0)
+		fl |= MIDB_RF_DRAFT;
+	if (sqlite3_column_int64(pstmt, col + 2) != 0)
+		fl |= MIDB_RF_FLAGGED;
+	if (sqlite3_column_int64(pstmt, col + 3) != 0)
+		fl |= MIDB_RF_DELETED;
+	if (sqlite3_column_int64(pstmt, col + 4) != 0)
+		fl |= MIDB_RF_SEEN;
+	if (sqlite3_column_int64(pstmt, col + 5) != 0)
+		fl |= MIDB_RF_RECENT;
+	if (sqlite3_column_int64(pstmt, col + 6) != 0)
+		fl |= MIDB_RF_FORWARDED;
+	return fl;
+}
+
+/* Text form "(AUFDSRW)" of MIDB_RF_* bits; @buf needs 10 bytes */
+static void simrec_flags_str(unsigned int fl, char *buf)
+{
+	*buf++ = '(';
+	if (fl & MIDB_RF_ANSWERED)
+		*buf++ = 'A';
+	if (fl & MIDB_RF_DRAFT)
+		*buf++ = 'U';
+	if (fl & MIDB_RF_FLAGGED)
+		*buf++ = 'F';
+	if (fl & MIDB_RF_DELETED)
+		*buf++ = 'D';
+	if (fl & MIDB_RF_SEEN)
+		*buf++ = 'S';
+	if (fl & MIDB_RF_RECENT)
+		*buf++ = 'R';
+	if (fl & MIDB_RF_FORWARDED)
+		*buf++ = 'W';
+	*buf++ = ')';
+	*buf = '\0';
+}
+
+/* Binary record for framed P-SIML/P-SIMU responses, see midb.hpp */
+static int simrec_put(char *buf, size_t z, uint32_t idx, uint32_t uid,
+    uint64_t modseq, unsigned int fl, const char *mid)
+{
+	auto midlen = std::min(strlen(mid), z - MIDB_SIMREC_LEN);
+	cpu_to_le32p(&buf[0], idx);
+	cpu_to_le32p(&buf[4], uid);
+	cpu_to_le64p(&buf[8], modseq);
+	cpu_to_le16p(&buf[16], fl);
+	cpu_to_le16p(&buf[18], midlen);
+	memcpy(&buf[MIDB_SIMREC_LEN], mid, midlen);
+	return MIDB_SIMREC_LEN + midlen;
+}
+
 /*
  * List mails in folder, returning the MIDs.
  * Request:
- * 	P-SIML <dir> <folder> <sort-field> <ascdesc> <idx> <msgcount>
+ * 	P-SIML <dir> <folder> <sort-field> <ascdesc> <idx> <msgcount> [<changedsince>]
  * Response:
  * 	TRUE <msgcount>
- * 	<mid> <uid> <flags> (repeat x msgcount)
+ * 	<mid> <uid> <flags> <modseq> (repeat x msgcount)
+ * With changedsince, only messages of the range whose modseq is greater are
+ * listed (0 lists all), and each line is prefixed by the message's <idx> as
+ * in P-SIMU.
+ * In a framed request, the lines are replaced by binary records.
  */
 static int mail_engine_psiml(int argc, char **argv, int sockd)
 {
@@ -3505,16 +3716,16 @@ static int mail_engine_psiml(int argc, char **argv, int sockd)
 	int temp_len;
 	int buff_len;
 	uint32_t uid;
-	int flags_len;
 	int idx1, idx2;
 	int total_mail;
 	char flags_buff[16];
+	uint32_t rec_idx;
 	char temp_line[1024];
 	char sql_string[1024];
 	const char *mid_string;
 	char temp_buff[256*1024];
 	
-	if ((argc != 5 && argc != 7) || strlen(argv[1]) >= 256 ||
+	if ((argc != 5 && argc != 7 && argc != 8) || strlen(argv[1]) >= 256 ||
 	    strlen(argv[2]) >= 1024)
 		return MIDB_E_PARAMETER_ERROR;
 	auto sort_field = kw_to_sort_field(argv[3]);
@@ -3523,7 +3734,8 @@ static int mail_engine_psiml(int argc, char **argv, int sockd)
 	bool b_asc;
 	if (!kw_to_sort_order(argv[4], b_asc))
 		return MIDB_E_PARAMETER_ERROR;
-	if (7 == argc) {
+	uint64_t changedsince = argc == 8 ? strtoull(argv[7], nullptr, 0) : 0;
+	if (argc >= 7) {
 		offset = strtol(argv[5], nullptr, 0);
 		length = strtol(argv[6], nullptr, 0);
 		if (length < 0)
@@ -3538,8 +3750,7 @@ static int mail_engine_psiml(int argc, char **argv, int sockd)
 	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
-	if (!mail_engine_sort_folder(pidb.get(), argv[2], sort_field))
-		return MIDB_E_MNG_SORTFOLDER;
+	auto sort_col = sort_field_col(sort_field);
 	snprintf(sql_string, arsizeof(sql_string), "SELECT count(message_id) "
 	          "FROM messages WHERE folder_id=%llu", LLU{folder_id});
 	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
@@ -3563,9 +3774,9 @@ static int mail_engine_psiml(int argc, char **argv, int sockd)
 			length = total_mail - idx1 + 1;
 		idx2 = idx1 + length - 1;
 		snprintf(sql_string, arsizeof(sql_string), "SELECT mid_string, uid, replied, "
-				"unsent, flagged, deleted, read, recent, forwarded FROM "
-				"messages WHERE folder_id=%llu AND idx>=%d AND idx<=%d "
-				"ORDER BY idx", LLU{folder_id}, idx1, idx2);
+				"unsent, flagged, deleted, read, recent, forwarded, modseq "
+				"FROM messages WHERE folder_id=%llu ORDER BY %s, uid "
+				"LIMIT %d OFFSET %d", LLU{folder_id}, sort_col, length, idx1 - 1);
 	} else {
 		if (offset < 0) {
 			idx2 = std::min(-offset, total_mail);
@@ -3580,53 +3791,53 @@ static int mail_engine_psiml(int argc, char **argv, int sockd)
 			length = idx2;
 		idx1 = idx2 - length + 1;
 		snprintf(sql_string, arsizeof(sql_string), "SELECT mid_string, uid, replied, "
-				"unsent, flagged, deleted, read, recent, forwarded FROM "
-				"messages WHERE folder_id=%llu AND idx>=%d AND idx<=%d "
-				"ORDER BY idx DESC", LLU{folder_id}, idx1, idx2);
+				"unsent, flagged, deleted, read, recent, forwarded, modseq "
+				"FROM messages WHERE folder_id=%llu ORDER BY %s DESC, uid DESC "
+				"LIMIT %d OFFSET %d", LLU{folder_id}, sort_col, length,
+				total_mail - idx2);
+	}
+	if (changedsince > 0) {
+		/* Filtering happens per row below so positions stay intact */
+		char count_string[1280];
+		snprintf(count_string, std::size(count_string),
+		         "SELECT count(*) FROM (%s) WHERE modseq>%llu",
+		         sql_string, LLU{changedsince});
+		pstmt = gx_sql_prep(pidb->psqlite, count_string);
+		if (pstmt == nullptr)
+			return MIDB_E_SQLPREP;
+		if (sqlite3_step(pstmt) != SQLITE_ROW)
+			return MIDB_E_NO_FOLDER;
+		length = sqlite3_column_int64(pstmt, 0);
+		pstmt.finalize();
 	}
 	pstmt = gx_sql_prep(pidb->psqlite, sql_string);
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
+	auto framed = cmd_framed();
+	rec_idx = b_asc ? idx1 - 1 : total_mail - idx2;
 	temp_len = sprintf(temp_buff, "TRUE %d\r\n", length);
 	while (SQLITE_ROW == sqlite3_step(pstmt)) {
+		auto modseq = gx_sql_col_uint64(pstmt, 9);
+		auto this_idx = rec_idx++;
+		if (changedsince > 0 && modseq <= changedsince)
+			continue;
 		mid_string = S2A(sqlite3_column_text(pstmt, 0));
 		uid = sqlite3_column_int64(pstmt, 1);
-		flags_buff[0] = '(';
-		flags_len = 1;
-		if (0 != sqlite3_column_int64(pstmt, 2)) {
-			flags_buff[flags_len] = 'A';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 3)) {
-			flags_buff[flags_len] = 'U';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 4)) {
-			flags_buff[flags_len] = 'F';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 5)) {
-			flags_buff[flags_len] = 'D';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 6)) {
-			flags_buff[flags_len] = 'S';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 7)) {
-			flags_buff[flags_len] = 'R';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 8)) {
-			flags_buff[flags_len] = 'W';
-			flags_len ++;
+		auto fl = simrec_flags(pstmt, 2);
+		if (framed) {
+			buff_len = simrec_put(temp_line, std::size(temp_line),
+			           this_idx, uid, modseq, fl, mid_string);
+		} else if (argc == 8) {
+			simrec_flags_str(fl, flags_buff);
+			buff_len = gx_snprintf(temp_line, GX_ARRAY_SIZE(temp_line),
+			           "%u %s %u %s %llu\r\n", this_idx, mid_string,
+			           uid, flags_buff, LLU{modseq});
+		} else {
+			simrec_flags_str(fl, flags_buff);
+			buff_len = gx_snprintf(temp_line, GX_ARRAY_SIZE(temp_line),
+			           "%s %u %s %llu\r\n", mid_string, uid,
+			           flags_buff, LLU{modseq});
 		}
-		flags_buff[flags_len] = ')';
-		flags_len ++;
-		flags_buff[flags_len] = '\0';
-		buff_len = gx_snprintf(temp_line, GX_ARRAY_SIZE(temp_line),
-			"%s %u %s\r\n", mid_string, uid,
-			flags_buff);
 		if (256*1024 - temp_len < buff_len) {
 			auto ret = cmd_write(sockd, temp_buff, temp_len);
 			if (ret != 0)
@@ -3641,11 +3852,20 @@ static int mail_engine_psiml(int argc, char **argv, int sockd)
 	return cmd_write(sockd, temp_buff, temp_len);
 }
 
+/*
+ * List mails in folder by UID range.
+ * Request:
+ * 	P-SIMU <dir> <folder> <sort-field> <ascdesc> <first-uid> <last-uid> [<changedsince>]
+ * 	TRUE <msgcount>
+ * 	<idx> <mid> <uid> <flags> <modseq> (repeat x msgcount)
+ * With changedsince, only messages whose modseq is greater are listed.
+ * In a framed request, the lines are replaced by binary records.
+ */
 static int mail_engine_psimu(int argc, char **argv, int sockd)
 {
 	int buff_len;
 	int temp_len;
-	int flags_len, total_mail = 0;
+	int total_mail = 0;
 	char flags_buff[16];
 	char temp_line[1024];
 	char sql_string[1024];
@@ -3653,7 +3873,8 @@ static int mail_engine_psimu(int argc, char **argv, int sockd)
 	DOUBLE_LIST_NODE *pnode;
 	char temp_buff[256*1024];
 	
-	if (argc != 7 || strlen(argv[1]) >= 256 || strlen(argv[2]) >= 1024)
+	if ((argc != 7 && argc != 8) || strlen(argv[1]) >= 256 ||
+	    strlen(argv[2]) >= 1024)
 		return MIDB_E_PARAMETER_ERROR;
 	auto sort_field = kw_to_sort_field(argv[3]);
 	if (sort_field < FIELD_NONE)
@@ -3661,6 +3882,7 @@ static int mail_engine_psimu(int argc, char **argv, int sockd)
 	bool b_asc;
 	if (!kw_to_sort_order(argv[4], b_asc))
 		return MIDB_E_PARAMETER_ERROR;
+	uint64_t changedsince = argc == 8 ? strtoull(argv[7], nullptr, 0) : 0;
 	seq_node::value_type first = strtol(argv[5], nullptr, 0), last = strtol(argv[6], nullptr, 0);
 	if (first < 1 && first != seq_node::unset)
 		return MIDB_E_PARAMETER_ERROR;
@@ -3676,34 +3898,26 @@ static int mail_engine_psimu(int argc, char **argv, int sockd)
 	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
-	if (!mail_engine_sort_folder(pidb.get(), argv[2], sort_field))
-		return MIDB_E_MNG_SORTFOLDER;
-	if (b_asc) {
-		if (first == seq_node::unset && last == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu ORDER BY idx", LLU{folder_id});
-		else if (first == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu AND uid<=%u ORDER BY idx",
-				LLU{folder_id}, last);
-		else if (last == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu AND uid>=%u ORDER BY idx",
-				LLU{folder_id}, first);
-		else if (last == first)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu AND uid=%u",
-				LLU{folder_id}, first);
-		else
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu AND uid>=%u AND uid<=%u "
-				"ORDER BY idx", LLU{folder_id}, first, last);
-	} else {
+	char sorted[384];
+	mail_engine_sorted_view(sorted, std::size(sorted), folder_id,
+		sort_field, first, last);
+	char range[96];
+	if (first == seq_node::unset && last == seq_node::unset)
+		*range = '\0';
+	else if (first == seq_node::unset)
+		snprintf(range, std::size(range), " AND uid<=%u", last);
+	else if (last == seq_node::unset)
+		snprintf(range, std::size(range), " AND uid>=%u", first);
+	else if (last == first)
+		snprintf(range, std::size(range), " AND uid=%u", first);
+	else
+		snprintf(range, std::size(range), " AND uid>=%u AND uid<=%u", first, last);
+	if (changedsince > 0) {
+		auto z = strlen(range);
+		snprintf(&range[z], std::size(range) - z, " AND modseq>%llu",
+		         LLU{changedsince});
+	}
+	if (!b_asc) {
 		snprintf(sql_string, arsizeof(sql_string), "SELECT count(message_id) "
 			"FROM messages WHERE folder_id=%llu", LLU{folder_id});
 		auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
@@ -3713,32 +3927,11 @@ static int mail_engine_psimu(int argc, char **argv, int sockd)
 			return MIDB_E_NO_FOLDER;
 		total_mail = sqlite3_column_int64(pstmt, 0);
 		pstmt.finalize();
-		if (first == seq_node::unset && last == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded"
-				" FROM messages WHERE folder_id=%llu ORDER BY idx DESC",
-				LLU{folder_id});
-		else if (first == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu AND uid<=%u ORDER BY idx"
-				" DESC", LLU{folder_id}, last);
-		else if (last == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu AND uid>=%u ORDER BY idx"
-				" DESC", LLU{folder_id}, first);
-		else if (last == first)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu AND uid=%u",
-				LLU{folder_id}, first);
-		else
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string, uid, "
-				"replied, unsent, flagged, deleted, read, recent, forwarded "
-				"FROM messages WHERE folder_id=%llu AND uid>=%u AND uid<=%u "
-				"ORDER BY idx DESC", LLU{folder_id}, first, last);
 	}
+	snprintf(sql_string, arsizeof(sql_string), "%sSELECT seq, mid_string, uid, "
+		"replied, unsent, flagged, deleted, read, recent, forwarded, modseq "
+		"FROM sorted JOIN messages ON message_id=smid WHERE 1%s ORDER BY seq%s",
+		sorted, range, b_asc ? "" : " DESC");
 	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
@@ -3754,53 +3947,29 @@ static int mail_engine_psimu(int argc, char **argv, int sockd)
 		if (psm_node->mid_string == nullptr)
 			return MIDB_E_NO_MEMORY;
 		psm_node->uid = sqlite3_column_int64(pstmt, 2);
-		flags_buff[0] = '(';
-		flags_len = 1;
-		if (0 != sqlite3_column_int64(pstmt, 3)) {
-			flags_buff[flags_len] = 'A';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 4)) {
-			flags_buff[flags_len] = 'U';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 5)) {
-			flags_buff[flags_len] = 'F';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 6)) {
-			flags_buff[flags_len] = 'D';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 7)) {
-			flags_buff[flags_len] = 'S';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 8)) {
-			flags_buff[flags_len] = 'R';
-			flags_len ++;
-		}
-		if (0 != sqlite3_column_int64(pstmt, 9)) {
-			flags_buff[flags_len] = 'W';
-			flags_len ++;
-		}
-		flags_buff[flags_len] = ')';
-		flags_len ++;
-		flags_buff[flags_len] = '\0';
-		psm_node->flags_buff = common_util_dup(flags_buff);
-		if (psm_node->flags_buff == nullptr)
-			return MIDB_E_NO_MEMORY;
+		psm_node->flags = simrec_flags(pstmt, 3);
+		psm_node->modseq = sqlite3_column_int64(pstmt, 10);
 		double_list_append_as_tail(&temp_list, &psm_node->node);
 	}
 	pstmt.finalize();
+	auto framed = cmd_framed();
 	temp_len = sprintf(temp_buff, "TRUE %zu\r\n",
 		double_list_get_nodes_num(&temp_list));
 	for (pnode=double_list_get_head(&temp_list); NULL!=pnode;
 		pnode=double_list_get_after(&temp_list, pnode)) {
 		auto psm_node = static_cast<SIMU_NODE *>(pnode->pdata);
-		buff_len = gx_snprintf(temp_line, GX_ARRAY_SIZE(temp_line), "%u %s %u %s\r\n",
-					psm_node->idx - 1, psm_node->mid_string,
-					psm_node->uid, psm_node->flags_buff);
+		if (framed) {
+			buff_len = simrec_put(temp_line, std::size(temp_line),
+			           psm_node->idx - 1, psm_node->uid,
+			           psm_node->modseq, psm_node->flags,
+			           psm_node->mid_string);
+		} else {
+			simrec_flags_str(psm_node->flags, flags_buff);
+			buff_len = gx_snprintf(temp_line, GX_ARRAY_SIZE(temp_line), "%u %s %u %s %llu\r\n",
+			           psm_node->idx - 1, psm_node->mid_string,
+			           psm_node->uid, flags_buff,
+			           LLU{psm_node->modseq});
+		}
 		if (256*1024 - temp_len < buff_len) {
 			auto ret = cmd_write(sockd, temp_buff, temp_len);
 			if (ret != 0)
@@ -3846,8 +4015,8 @@ static int mail_engine_pdell(int argc, char **argv, int sockd)
 	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
-	if (!mail_engine_sort_folder(pidb.get(), argv[2], sort_field))
-		return MIDB_E_MNG_SORTFOLDER;
+	char sorted[256];
+	mail_engine_sorted_view(sorted, std::size(sorted), folder_id, sort_field);
 	snprintf(sql_string, arsizeof(sql_string), "SELECT count(message_id) FROM "
 		"messages WHERE folder_id=%llu AND deleted=1", LLU{folder_id});
 	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
@@ -3857,10 +4026,9 @@ static int mail_engine_pdell(int argc, char **argv, int sockd)
 		return MIDB_E_NO_FOLDER;
 	length = sqlite3_column_int64(pstmt, 0);
 	pstmt.finalize();
-	snprintf(sql_string, arsizeof(sql_string), b_asc ?
-	         "SELECT idx, mid_string, uid FROM messages WHERE folder_id=%llu AND deleted=1 ORDER BY idx" :
-	         "SELECT idx, mid_string, uid FROM messages WHERE folder_id=%llu AND deleted=1 ORDER BY idx DESC",
-	         LLU{folder_id});
+	snprintf(sql_string, arsizeof(sql_string), "%sSELECT seq, mid_string, uid "
+	         "FROM sorted JOIN messages ON message_id=smid WHERE deleted=1 "
+	         "ORDER BY seq%s", sorted, b_asc ? "" : " DESC");
 	pstmt = gx_sql_prep(pidb->psqlite, sql_string);
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
@@ -3885,6 +4053,98 @@ static int mail_engine_pdell(int argc, char **argv, int sockd)
 	return cmd_write(sockd, temp_buff, temp_len);
 }
 
+/*
+ * List UIDs expunged since a given modification sequence
+ *
+ * Request:
+ * 	P-VNSH <dir> <folder> <modseq>
+ * Response:
+ * 	TRUE <uid-set>
+ * uid-set is in IMAP sequence-set syntax (e.g. "3:5,9"), or empty.
+ * If <modseq> predates the pruned part of the vanished table, all UIDs
+ * up to uidnext that are not in the folder anymore are reported.
+ */
+static int mail_engine_pvnsh(int argc, char **argv, int sockd)
+{
+	char sql_string[1024];
+
+	if (argc != 4 || strlen(argv[1]) >= 256 || strlen(argv[2]) >= 1024)
+		return MIDB_E_PARAMETER_ERROR;
+	uint64_t modseq = strtoull(argv[3], nullptr, 0);
+	auto pidb = mail_engine_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
+	if (folder_id == 0)
+		return MIDB_E_NO_FOLDER;
+	snprintf(sql_string, arsizeof(sql_string), "SELECT vanished_floor, "
+	         "uidnext FROM folders WHERE folder_id=%llu", LLU{folder_id});
+	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
+	if (pstmt == nullptr)
+		return MIDB_E_SQLPREP;
+	if (pstmt.step() != SQLITE_ROW)
+		return MIDB_E_NO_FOLDER;
+	uint64_t floor = sqlite3_column_int64(pstmt, 0);
+	uint32_t uidnext = sqlite3_column_int64(pstmt, 1);
+	pstmt.finalize();
+	std::string out = "TRUE";
+	uint32_t first = 0, last = 0;
+	auto flush = [&]() {
+		out += out.size() == 4 ? ' ' : ',';
+		out += std::to_string(first);
+		if (last != first)
+			out += ":" + std::to_string(last);
+	};
+	auto add = [&](uint32_t lo, uint32_t hi) {
+		if (first != 0 && lo == last + 1) {
+			last = hi;
+			return;
+		}
+		if (first != 0)
+			flush();
+		first = lo;
+		last = hi;
+	};
+	if (modseq < floor) {
+		/*
+		 * Tombstones newer than @modseq may have been pruned. Report
+		 * every UID up to uidnext which is not in the folder now.
+		 */
+		snprintf(sql_string, arsizeof(sql_string), "SELECT uid FROM "
+		         "messages WHERE folder_id=%llu ORDER BY uid",
+		         LLU{folder_id});
+		pstmt = gx_sql_prep(pidb->psqlite, sql_string);
+		if (pstmt == nullptr)
+			return MIDB_E_SQLPREP;
+		uint32_t next = 1;
+		while (pstmt.step() == SQLITE_ROW) {
+			uint32_t uid = sqlite3_column_int64(pstmt, 0);
+			if (uid > next)
+				add(next, uid - 1);
+			next = uid + 1;
+		}
+		if (next <= uidnext)
+			add(next, uidnext);
+	} else {
+		snprintf(sql_string, arsizeof(sql_string), "SELECT DISTINCT uid FROM "
+		         "vanished WHERE folder_id=%llu AND modseq>%llu ORDER BY uid",
+		         LLU{folder_id}, LLU{modseq});
+		pstmt = gx_sql_prep(pidb->psqlite, sql_string);
+		if (pstmt == nullptr)
+			return MIDB_E_SQLPREP;
+		while (pstmt.step() == SQLITE_ROW) {
+			uint32_t uid = sqlite3_column_int64(pstmt, 0);
+			add(uid, uid);
+		}
+	}
+	if (first != 0)
+		flush();
+	pstmt.finalize();
+	pidb.reset();
+	out += "\r\n";
+	return cmd_write(sockd, out.c_str(), out.size());
+}
+
 static int mail_engine_pdtlu(int argc, char **argv, int sockd)
 {
 	BOOL b_asc;
@@ -3921,30 +4181,21 @@ static int mail_engine_pdtlu(int argc, char **argv, int sockd)
 	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
-	if (!mail_engine_sort_folder(pidb.get(), argv[2], sort_field))
-		return MIDB_E_MNG_SORTFOLDER;
-	if (b_asc) {
-		if (first == seq_node::unset && last == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string"
-				" FROM messages WHERE folder_id=%llu ORDER BY idx",
-				LLU{folder_id});
-		else if (first == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string "
-					"FROM messages WHERE folder_id=%llu AND uid<=%u"
-					" ORDER BY idx", LLU{folder_id}, last);
-		else if (last == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string "
-					"FROM messages WHERE folder_id=%llu AND uid>=%u"
-					" ORDER BY idx", LLU{folder_id}, first);
-		else if (last == first)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string "
-					"FROM messages WHERE folder_id=%llu AND uid=%u",
-					LLU{folder_id}, first);
-		else
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string "
-				"FROM messages WHERE folder_id=%llu AND uid>=%u AND"
-				" uid<=%u ORDER BY idx", LLU{folder_id}, first, last);
-	} else {
+	char sorted[384];
+	mail_engine_sorted_view(sorted, std::size(sorted), folder_id,
+		sort_field, first, last);
+	char range[64];
+	if (first == seq_node::unset && last == seq_node::unset)
+		*range = '\0';
+	else if (first == seq_node::unset)
+		snprintf(range, std::size(range), " WHERE uid<=%u", last);
+	else if (last == seq_node::unset)
+		snprintf(range, std::size(range), " WHERE uid>=%u", first);
+	else if (last == first)
+		snprintf(range, std::size(range), " WHERE uid=%u", first);
+	else
+		snprintf(range, std::size(range), " WHERE uid>=%u AND uid<=%u", first, last);
+	if (!b_asc) {
 		snprintf(sql_string, arsizeof(sql_string), "SELECT count(message_id) "
 		          "FROM messages WHERE folder_id=%llu", LLU{folder_id});
 		auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
@@ -3954,27 +4205,10 @@ static int mail_engine_pdtlu(int argc, char **argv, int sockd)
 			return MIDB_E_NO_FOLDER;
 		total_mail = sqlite3_column_int64(pstmt, 0);
 		pstmt.finalize();
-		if (first == seq_node::unset && last == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string"
-				" FROM messages WHERE folder_id=%llu ORDER BY idx"
-				" DESC", LLU{folder_id});
-		else if (first == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string "
-					"FROM messages WHERE folder_id=%llu AND uid<=%u"
-					" ORDER BY idx DESC", LLU{folder_id}, last);
-		else if (last == seq_node::unset)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string "
-					"FROM messages WHERE folder_id=%llu AND uid>=%u"
-					" ORDER BY idx", LLU{folder_id}, first);
-		else if (last == first)
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string "
-					"FROM messages WHERE folder_id=%llu AND uid=%u",
-					LLU{folder_id}, first);
-		else
-			snprintf(sql_string, arsizeof(sql_string), "SELECT idx, mid_string "
-				"FROM messages WHERE folder_id=%llu AND uid>=%u AND "
-				"uid<=%u ORDER BY idx DESC", LLU{folder_id}, first, last);
 	}
+	snprintf(sql_string, arsizeof(sql_string), "%sSELECT seq, mid_string "
+	         "FROM sorted JOIN messages ON message_id=smid%s ORDER BY seq%s",
+	         sorted, range, b_asc ? "" : " DESC");
 	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
@@ -4195,7 +4429,7 @@ static int mail_engine_prflg(int argc, char **argv, int sockd)
  * Request:
  * 	P-GFLG <dir> <folder> <midstr>
  * Response:
- * 	TRUE (<flags>)
+ * 	TRUE (<flags>) <modseq>
  * flags e.g. Answered(A), Unsent(U), Flagged(F), Deleted(D), Read/Seen(S),
  * Recent(R), Forwarded(W)
  */
@@ -4215,8 +4449,8 @@ static int mail_engine_pgflg(int argc, char **argv, int sockd)
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
 	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT folder_id, recent, "
-	             "read, unsent, flagged, replied, forwarded, deleted "
-	             "FROM messages WHERE mid_string=?");
+	             "read, unsent, flagged, replied, forwarded, deleted, "
+	             "modseq FROM messages WHERE mid_string=?");
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
 	sqlite3_bind_text(pstmt, 1, argv[3], -1, SQLITE_STATIC);
@@ -4253,12 +4487,13 @@ static int mail_engine_pgflg(int argc, char **argv, int sockd)
 		flags_buff[flags_len] = 'R';
 		flags_len ++;
 	}
+	uint64_t modseq = sqlite3_column_int64(pstmt, 8);
 	pstmt.finalize();
 	pidb.reset();
 	flags_buff[flags_len] = ')';
 	flags_len ++;
 	flags_buff[flags_len] = '\0';
-	temp_len = sprintf(temp_buff, "TRUE %s\r\n", flags_buff);
+	temp_len = sprintf(temp_buff, "TRUE %s %llu\r\n", flags_buff, LLU{modseq});
 	return cmd_write(sockd, temp_buff, temp_len);
 }
 
@@ -4455,7 +4690,7 @@ static int mail_engine_xrsyf(int argc, char **argv, int sockd)
 	auto idb = mail_engine_get_idb(argv[1]);
 	if (idb == nullptr)
 		return MIDB_E_HASHTABLE_FULL;
-	if (!mail_engine_sync_contents(idb.get(), strtoul(argv[2], nullptr, 0)))
+	if (!mail_engine_sync_contents(idb.get(), strtoul(argv[2], nullptr, 0), true))
 		return cmd_write(sockd, "FALSE 1\r\n");
 	else
 		return cmd_write(sockd, "TRUE 1\r\n");
@@ -4518,8 +4753,7 @@ static void mail_engine_add_notification_message(
 	uidnext = sqlite3_column_int64(pstmt, 0);
 	pstmt.finalize();
 	snprintf(sql_string, arsizeof(sql_string), "UPDATE folders SET"
-		" uidnext=uidnext+1, sort_field=%d "
-		"WHERE folder_id=%llu", FIELD_NONE, LLU{folder_id});
+		" uidnext=uidnext+1 WHERE folder_id=%llu", LLU{folder_id});
 	if (gx_sql_exec(pidb->psqlite, sql_string) != SQLITE_OK)
 		return;
 	snprintf(sql_string, arsizeof(sql_string), "INSERT INTO messages ("
@@ -4565,9 +4799,6 @@ static void mail_engine_delete_notification_message(
 	snprintf(sql_string, arsizeof(sql_string), "DELETE FROM messages"
 	        " WHERE message_id=%llu", LLU{message_id});
 	gx_sql_exec(pidb->psqlite, sql_string);
-	snprintf(sql_string, arsizeof(sql_string), "UPDATE folders SET sort_field=%d "
-	        "WHERE folder_id=%llu", FIELD_NONE, LLU{folder_id});
-	gx_sql_exec(pidb->psqlite, sql_string);
 }
 
 static BOOL mail_engine_add_notification_folder(
@@ -4957,7 +5188,7 @@ static void mail_engine_notification_proc(const char *dir,
 		folder_id = n->folder_id;
 		parent_id = n->parent_id;
 		if (mail_engine_add_notification_folder(pidb.get(), parent_id, folder_id))
-			mail_engine_sync_contents(pidb.get(), folder_id);
+			mail_engine_sync_contents(pidb.get(), folder_id, false);
 		break;
 	}
 	case DB_NOTIFY_TYPE_MESSAGE_COPIED: {
@@ -5031,6 +5262,7 @@ int mail_engine_run()
 	cmd_parser_register_command("P-SIML", mail_engine_psiml);
 	cmd_parser_register_command("P-SIMU", mail_engine_psimu);
 	cmd_parser_register_command("P-DELL", mail_engine_pdell);
+	cmd_parser_register_command("P-VNSH", mail_engine_pvnsh);
 	cmd_parser_register_command("P-DTLU", mail_engine_pdtlu);
 	cmd_parser_register_command("P-SFLG", mail_engine_psflg);
 	cmd_parser_register_command("P-RFLG", mail_engine_prflg);
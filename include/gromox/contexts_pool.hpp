@@ -36,14 +36,16 @@ struct schedule_context {
 	BOOL b_waiting = false; /* is still in epoll queue */
 	int polling_mask = 0;
 	unsigned int context_id = 0;
+	unsigned int shard = 0; /* event queue the context is assigned to */
 };
 using SCHEDULE_CONTEXT = schedule_context;
 
-extern GX_EXPORT void contexts_pool_init(schedule_context **, unsigned int context_num, int (*get_socket)(const schedule_context *), gromox::time_point (*get_ts)(const schedule_context *), unsigned int contexts_per_thr, gromox::time_duration timeout);
+extern GX_EXPORT void contexts_pool_init(schedule_context **, unsigned int context_num, int (*get_socket)(const schedule_context *), gromox::time_point (*get_ts)(const schedule_context *), unsigned int contexts_per_thr, gromox::time_duration timeout, unsigned int shards);
 extern int contexts_pool_run();
 extern void contexts_pool_stop();
 SCHEDULE_CONTEXT* contexts_pool_get_context(int type);
 void contexts_pool_put_context(SCHEDULE_CONTEXT *pcontext, int type);
+extern GX_EXPORT void contexts_pool_bind_shard(schedule_context *, unsigned int acceptor, unsigned int num_acceptors);
 BOOL contexts_pool_wakeup_context(SCHEDULE_CONTEXT *pcontext, int type);
 void context_pool_activate_context(SCHEDULE_CONTEXT *);
 void contexts_pool_signal(SCHEDULE_CONTEXT *pcontext);
@@ -7,7 +7,8 @@ namespace gromox {
 
 class GX_EXPORT xtransaction {
 	public:
-	constexpr xtransaction(sqlite3 *d = nullptr) { m_db = d; }
+	constexpr xtransaction(sqlite3 *d = nullptr, bool nested = false) :
+		m_db(d), m_nested(nested) {}
 	xtransaction(xtransaction &&) noexcept = delete;
 	~xtransaction();
 	void commit();
@@ -15,6 +16,7 @@ class GX_EXPORT xtransaction {
 
 	protected:
 	sqlite3 *m_db = nullptr;
+	bool m_nested = false; /* savepoint inside an outer transaction */
 };
 
 struct GX_EXPORT xstmt {
@@ -58,6 +60,8 @@ enum {
 
 extern GX_EXPORT struct xstmt gx_sql_prep(sqlite3 *, const char *);
 extern GX_EXPORT xtransaction gx_sql_begin_trans(sqlite3 *);
+/* Make gx_sql_begin_trans nest on this db (nullptr to end) for this thread. */
+extern GX_EXPORT void gx_sql_set_batch_db(sqlite3 *);
 extern GX_EXPORT int gx_sql_exec(sqlite3 *, const char *query, unsigned int flags = 0);
 
 static inline uint64_t gx_sql_col_uint64(sqlite3_stmt *s, int c)
@@ -4,6 +4,7 @@
 #include <sqlite3.h>
 #include <string>
 #include <type_traits>
+#include <utility>
 #include <vector>
 #include <gromox/common_types.hpp>
 #include <gromox/defs.h>
@@ -139,6 +140,22 @@ BOOL common_util_load_search_scopes(sqlite3 *psqlite,
 	uint64_t folder_id, LONGLONG_ARRAY *pfolder_ids);
 extern bool cu_eval_folder_restriction(sqlite3 *, uint64_t folder_id, const RESTRICTION *);
 extern bool cu_eval_msg_restriction(sqlite3 *, uint32_t cpid, uint64_t msgid, const RESTRICTION *);
+extern bool cu_restriction_counting(const RESTRICTION *);
+extern bool cu_eval_content(const RESTRICTION_CONTENT *, const void *pvalue);
+extern bool cu_msgprop_is_synthesized(uint32_t proptag);
+
+/**
+ * A message restriction translated to an SQL condition over the `messages`
+ * table (referenced by that name). Parameters are numbered (?1, ?2, ...)
+ * and point into the restriction, which must outlive the statement.
+ */
+struct msg_res_sql {
+	std::string where;
+	std::vector<std::pair<uint16_t, const void *>> params;
+
+	bool bind(sqlite3_stmt *) const;
+};
+extern bool cu_msg_restriction_to_sql(const RESTRICTION *, msg_res_sql &);
 BOOL common_util_check_search_result(sqlite3 *psqlite,
 	uint64_t folder_id, uint64_t message_id, BOOL *pb_exist);
 BOOL common_util_get_mid_string(sqlite3 *psqlite,
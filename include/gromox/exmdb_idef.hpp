@@ -15,6 +15,11 @@ EXMIDL(set_folder_by_class, (const char *dir, uint64_t folder_id, const char *st
 EXMIDL(get_folder_class_table, (const char *dir, IDLOUT TARRAY_SET *table))
 EXMIDL(check_folder_id, (const char *dir, uint64_t folder_id, IDLOUT BOOL *b_exist))
 EXMIDL(query_folder_messages, (const char *dir, uint64_t folder_id, IDLOUT TARRAY_SET *set))
+/*
+ * Messages of @folder_id changed (or read/unread) after @since_cn, plus the
+ * members of @pgiven that have left the folder. CNs are GC values, not EIDs.
+ */
+EXMIDL(query_folder_changes, (const char *dir, uint64_t folder_id, uint64_t since_cn, const EID_ARRAY *pgiven, IDLOUT uint64_t *last_cn, uint32_t *total, TARRAY_SET *set, EID_ARRAY *deleted))
 EXMIDL(check_folder_deleted, (const char *dir, uint64_t folder_id, IDLOUT BOOL *b_del))
 EXMIDL(get_folder_by_name, (const char *dir, uint64_t parent_id, const char *str_name, IDLOUT uint64_t *folder_id))
 EXMIDL(get_folder_perm, (const char *dir, uint64_t folder_id, const char *username, IDLOUT uint32_t *permission))
@@ -113,6 +118,12 @@ EXMIDL(update_folder_rule, (const char *dir, uint64_t folder_id, uint16_t count,
 EXMIDL(delivery_message, (const char *dir, const char *from_address, const char *account, uint32_t cpid, const MESSAGE_CONTENT *pmsg, const char *pdigest, IDLOUT uint32_t *result))
 EXMIDL(write_message, (const char *dir, const char *account, uint32_t cpid, uint64_t folder_id, const MESSAGE_CONTENT *pmsgctnt, IDLOUT gxerr_t *e_result))
 EXMIDL(read_message, (const char *dir, const char *username, uint32_t cpid, uint64_t message_id, IDLOUT MESSAGE_CONTENT **pmsgctnt))
+/*
+ * Reads a prefix of @pmessage_ids: at least one message, stopping once the
+ * PR_MESSAGE_SIZE sum reaches @size_limit. pmsgctnts[i] is NULL for
+ * messages that no longer exist.
+ */
+EXMIDL(read_messages, (const char *dir, const char *username, uint32_t cpid, const EID_ARRAY *pmessage_ids, uint32_t size_limit, IDLOUT uint32_t *count, MESSAGE_CONTENT ***pmsgctnts))
 EXMIDL(get_content_sync, (const char *dir, uint64_t folder_id, const char *username, const IDSET *pgiven, const IDSET *pseen, const IDSET *pseen_fai, const IDSET *pread, uint32_t cpid, const RESTRICTION *prestriction, BOOL b_ordered, IDLOUT uint32_t *fai_count, uint64_t *fai_total, uint32_t *normal_count, uint64_t *normal_total, EID_ARRAY *updated_mids, EID_ARRAY *chg_mids, uint64_t *last_cn, EID_ARRAY *given_mids, EID_ARRAY *deleted_mids, EID_ARRAY *nolonger_mids, EID_ARRAY *read_mids, EID_ARRAY *unread_mids, uint64_t *last_readcn))
 EXMIDL(get_hierarchy_sync, (const char *dir, uint64_t folder_id, const char *username, const IDSET *pgiven, const IDSET *pseen, IDLOUT FOLDER_CHANGES *fldchgs, uint64_t *last_cn, EID_ARRAY *given_fids, EID_ARRAY *deleted_fids))
 EXMIDL(allocate_ids, (const char *dir, uint32_t count, IDLOUT uint64_t *begin_eid))
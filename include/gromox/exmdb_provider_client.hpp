@@ -17,6 +17,7 @@ namespace exmdb_client_local {
 #include <gromox/exmdb_idef.hpp>
 #undef EXMIDL
 #undef IDLOUT
+extern GX_EXPORT BOOL batch(const char *dir, uint32_t count, exreq *const *reqs, exresp *const *resps);
 }
 
 namespace exmdb_client = exmdb_client_local;
@@ -147,6 +147,9 @@ enum class exmdb_callid : uint8_t {
 	get_folder_by_class /* v2 */ = 0x7c,
 	load_permission_table /* v2 */ = 0x7d,
 	unload_store = 0x80,
+	read_messages = 0x81,
+	batch = 0x82,
+	query_folder_changes = 0x83,
 };
 
 struct exreq {
@@ -216,6 +219,12 @@ struct exreq_query_folder_messages : public exreq {
 	uint64_t folder_id;
 };
 
+struct exreq_query_folder_changes : public exreq {
+	uint64_t folder_id;
+	uint64_t since_cn;
+	EID_ARRAY *pgiven;
+};
+
 struct exreq_check_folder_deleted : public exreq {
 	uint64_t folder_id;
 };
@@ -767,6 +776,13 @@ struct exreq_read_message : public exreq {
 	uint64_t message_id;
 };
 
+struct exreq_read_messages : public exreq {
+	char *username;
+	uint32_t cpid;
+	EID_ARRAY *pmessage_ids;
+	uint32_t size_limit;
+};
+
 struct exreq_get_content_sync : public exreq {
 	uint64_t folder_id;
 	char *username;
@@ -821,6 +837,22 @@ struct exresp {
 	exmdb_callid call_id;
 };
 
+/*
+ * Runs the sub-requests in order, under one store lock and one transaction.
+ * They must all refer to the batch's own directory. If any of them fails,
+ * the whole batch fails and its database changes are rolled back.
+ */
+struct exreq_batch : public exreq {
+	uint32_t count;
+	exreq **preqs;
+};
+
+/* The caller pre-allocates presps[i] with the type matching preqs[i]. */
+struct exresp_batch : public exresp {
+	uint32_t count;
+	exresp **presps;
+};
+
 struct exresp_get_all_named_propids : public exresp {
 	PROPID_ARRAY propids;
 };
@@ -880,6 +912,13 @@ struct exresp_query_folder_messages : public exresp {
 	TARRAY_SET set;
 };
 
+struct exresp_query_folder_changes : public exresp {
+	uint64_t last_cn;
+	uint32_t total;
+	TARRAY_SET set;
+	EID_ARRAY deleted;
+};
+
 struct exresp_check_folder_deleted : public exresp {
 	BOOL b_del;
 };
@@ -1210,6 +1249,11 @@ struct exresp_read_message : public exresp {
 	MESSAGE_CONTENT *pmsgctnt;
 };
 
+struct exresp_read_messages : public exresp {
+	uint32_t count;
+	MESSAGE_CONTENT **pmsgctnts;
+};
+
 struct exresp_get_content_sync : public exresp {
 	uint32_t fai_count;
 	uint64_t fai_total;
@@ -1295,6 +1339,7 @@ extern GX_EXPORT int exmdb_ext_pull_request(const BINARY *, exreq *&);
 extern GX_EXPORT int exmdb_ext_push_request(const exreq *, BINARY *);
 extern GX_EXPORT int exmdb_ext_pull_response(const BINARY *, exresp *);
 extern GX_EXPORT int exmdb_ext_push_response(const exresp *presponse, BINARY *);
+extern GX_EXPORT int exmdb_ext_copy_response(const exresp *src, exresp *dst);
 extern GX_EXPORT int exmdb_ext_pull_db_notify(const BINARY *, DB_NOTIFY_DATAGRAM *);
 extern GX_EXPORT int exmdb_ext_push_db_notify(const DB_NOTIFY_DATAGRAM *, BINARY *);
 extern GX_EXPORT const char *exmdb_rpc_strerror(exmdb_response);
@@ -1303,6 +1348,13 @@ extern GX_EXPORT BOOL exmdb_client_write_socket(int, const BINARY &, long timeou
 
 extern GX_EXPORT void *(*exmdb_rpc_alloc)(size_t);
 extern GX_EXPORT void (*exmdb_rpc_free)(void *);
+/*
+ * Decode strings and binaries as pointers into the wire buffer. Only for
+ * programs whose exmdb_rpc_alloc is an arena outliving each request (so
+ * exmdb_rpc_free does nothing); exmdb_parser then also keeps the request
+ * buffer until the response has been produced.
+ */
+extern GX_EXPORT bool exmdb_rpc_borrow;
 
 namespace exmdb_client_remote {
 #define IDLOUT
@@ -1310,4 +1362,5 @@ namespace exmdb_client_remote {
 #include <gromox/exmdb_idef.hpp>
 #undef EXMIDL
 #undef IDLOUT
+extern GX_EXPORT BOOL batch(const char *dir, uint32_t count, exreq *const *reqs, exresp *const *resps);
 }
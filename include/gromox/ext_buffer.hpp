@@ -34,6 +34,10 @@ enum {
  * 			(GetContentsTable / GetHierarchyTable)
  * %EXT_FLAG_ABK:	packed rep includes extra set/unset flags
  * %EXT_FLAG_ZCORE:	unpacked rep uses zcore types for rule element pointers
+ * %EXT_FLAG_BORROW:	unpacked strings and binaries point into the packed
+ * 			buffer instead of being copied (only transcoded
+ * 			strings are allocated); the buffer must outlive
+ * 			the unpacked rep
  *
  * The Exchange protocols use UTF-16, but the Gromox exmdb and zcore RPC
  * protocols use UTF-8. This may require using more than one context to process
@@ -48,6 +52,7 @@ enum {
 	EXT_FLAG_TBLLMT = 1U << 2,
 	EXT_FLAG_ABK = 1U << 3,
 	EXT_FLAG_ZCORE = 1U << 4,
+	EXT_FLAG_BORROW = 1U << 5,
 };
 
 using EXT_BUFFER_ALLOC = void *(*)(size_t);
@@ -126,6 +131,7 @@ struct EXT_PULL {
 	int g_bin(BINARY *);
 	int g_sbin(BINARY *);
 	int g_bin_ex(BINARY *);
+	int g_bin_data(BINARY *);
 	int g_uint16_a(SHORT_ARRAY *);
 	int g_uint32_a(LONG_ARRAY *);
 	int g_uint64_a(LONGLONG_ARRAY *);
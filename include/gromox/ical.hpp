@@ -114,6 +114,7 @@ struct ICAL_TIME {
 
 struct GX_EXPORT ical_rrule {
 	bool iterate();
+	void skip_before(const ICAL_TIME &);
 	inline bool endless() const { return total_count == 0 && !b_until; }
 	inline const ICAL_TIME *get_until_itime() const { return b_until ? &until_itime : nullptr; }
 	inline int sequence() const { return current_instance; }
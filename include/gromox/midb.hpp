@@ -31,10 +31,43 @@ enum {
 	MIDB_E_MDB_SETMSGRD,
 	MIDB_E_MDB_WRITEMESSAGE,
 	MIDB_E_MNG_CTMATCH,
-	MIDB_E_MNG_SORTFOLDER,
-	MIDB_E_OXCMAIL_IMPORT,
+	/* 31 was MIDB_E_MNG_SORTFOLDER */
+	MIDB_E_OXCMAIL_IMPORT = 32,
 	MIDB_E_SHORT_READ,
 	MIDB_E_SQLPREP,
 	MIDB_E_SQLUNEXP,
 	MIDB_E_SSGETID,
 };
+
+/*
+ * Framed requests. After a connection has been switched with the "FRAME"
+ * verb, a client may send, in addition to CRLF-terminated text lines,
+ * frames of the form
+ *
+ * 	u8 magic, u8 pad[3], le32 reqid, le32 length, <length bytes>
+ *
+ * where the payload is a command line without the CRLF. Any number of
+ * frames may be outstanding; each is answered with a frame of the same
+ * layout carrying the request's reqid. P-SIML and P-SIMU answered in a
+ * frame use "TRUE <count>\r\n" followed by count fixed-layout records
+ *
+ * 	le32 idx, le32 uid, le64 modseq, le16 flags, le16 midlen, <midlen bytes>
+ *
+ * instead of text lines.
+ */
+enum {
+	MIDB_FRAME_MAGIC = 0xFA,
+	MIDB_FRAME_HDRLEN = 12,
+	MIDB_SIMREC_LEN = 20,
+};
+
+/* MIDB_SIMREC flags */
+enum {
+	MIDB_RF_RECENT    = 0x1,
+	MIDB_RF_ANSWERED  = 0x2,
+	MIDB_RF_FLAGGED   = 0x4,
+	MIDB_RF_DELETED   = 0x8,
+	MIDB_RF_SEEN      = 0x10,
+	MIDB_RF_DRAFT     = 0x20,
+	MIDB_RF_FORWARDED = 0x40,
+};
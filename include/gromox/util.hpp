@@ -41,10 +41,20 @@ struct stream_block {
 	char buf[STREAM_BLOCK_SIZE];
 };
 
+struct lb_depot;
+
+/*
+ * Fixed-size object pool with a hard item limit. With @per_thread, freed
+ * objects are kept in small per-thread magazines that exchange batches
+ * with a shared depot, so that get/put usually touch no shared state;
+ * objects in magazines and in the depot still count towards max_items
+ * (a get that hits the limit reclaims them from all magazines first).
+ */
 struct GX_EXPORT LIB_BUFFER {
 	LIB_BUFFER(const char *n) : m_name(n) {}
 	LIB_BUFFER(LIB_BUFFER &&) noexcept = delete;
-	LIB_BUFFER(size_t size, size_t items, const char *name = nullptr, const char *hint = nullptr);
+	LIB_BUFFER(size_t size, size_t items, const char *name = nullptr, const char *hint = nullptr, bool per_thread = false);
+	~LIB_BUFFER();
 	LIB_BUFFER &operator=(LIB_BUFFER &&) noexcept;
 	inline LIB_BUFFER *operator->() { return this; }
 	void *get_raw();
@@ -65,12 +75,15 @@ struct GX_EXPORT LIB_BUFFER {
 	std::atomic<size_t> allocated_num{0};
 	size_t item_size = 0, max_items = 0;
 	const char *m_name = nullptr, *m_hint = nullptr;
+	size_t m_mag_size = 0;
+	std::shared_ptr<lb_depot> m_depot;
+	std::vector<std::shared_ptr<lb_depot>> m_retired;
 };
 
 template<typename T> struct GX_EXPORT alloc_limiter : private LIB_BUFFER {
 	constexpr alloc_limiter(const char *name) : LIB_BUFFER(name) {}
-	constexpr alloc_limiter(size_t max, const char *name = nullptr, const char *hint = nullptr) :
-		LIB_BUFFER(sizeof(T), max, name, hint) {}
+	alloc_limiter(size_t max, const char *name = nullptr, const char *hint = nullptr) :
+		LIB_BUFFER(sizeof(T), max, name, hint, true) {}
 	inline T *get() { return LIB_BUFFER::get<T>(); }
 	inline void put(T *x) { LIB_BUFFER::put(x); }
 	alloc_limiter<T> *operator->() { return this; }
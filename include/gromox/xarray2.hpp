@@ -3,6 +3,7 @@
 // This file is part of Gromox.
 #pragma once
 #include <atomic>
+#include <cstdint>
 #include <unordered_map>
 #include <vector>
 #include <gromox/mem_file.hpp>
@@ -11,6 +12,7 @@ struct MITEM {
 	char mid[128]{};
 	int id = 0, uid = 0;
 	char flag_bits = 0;
+	uint64_t modseq = 0;
 	MEM_FILE f_digest{};
 };
 
@@ -2,13 +2,17 @@
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
 #endif
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <mutex>
 #include <pthread.h>
+#include <thread>
 #include <unistd.h>
 #ifdef HAVE_SYS_EPOLL_H
 #	include <sys/epoll.h>
@@ -45,14 +49,27 @@ struct evqueue {
 	errno_t del(SCHEDULE_CONTEXT *);
 	void reset();
 };
+
+/*
+ * Every shard has its own event queue, dispatcher and timeout scanner, and
+ * keeps the POLLING and IDLING lists of the contexts assigned to it. FREE,
+ * SLEEPING and TURNING stay global since threads_pool draws from them.
+ */
+struct ctx_shard {
+	~ctx_shard();
+
+	evqueue m_poll_ctx;
+	pthread_t m_thread_id{}, m_scan_id{};
+	DOUBLE_LIST m_polling{}, m_idling{};
+	std::mutex m_poll_lock, m_idle_lock;
+};
 }
 
 static time_duration g_time_out;
-static unsigned int g_context_num, g_contexts_per_thr;
-static evqueue g_poll_ctx;
-static pthread_t g_scan_id;
+static unsigned int g_context_num, g_contexts_per_thr, g_shard_num;
+static std::unique_ptr<ctx_shard[]> g_shards;
+static std::atomic<unsigned int> g_shard_next;
 static SCHEDULE_CONTEXT **g_context_list;
-static pthread_t g_thread_id;
 static gromox::atomic_bool g_notify_stop{true};
 static DOUBLE_LIST g_context_lists[CONTEXT_TYPES];
 static std::mutex g_context_locks[CONTEXT_TYPES];
@@ -150,6 +167,35 @@ errno_t evqueue::del(SCHEDULE_CONTEXT *ctx)
 #endif
 }
 
+ctx_shard::~ctx_shard()
+{
+	double_list_free(&m_polling);
+	double_list_free(&m_idling);
+}
+
+static inline ctx_shard &shard_of(const schedule_context *ctx)
+{
+	return g_shards[ctx->shard];
+}
+
+static DOUBLE_LIST *ctx_list(const schedule_context *ctx, int type)
+{
+	if (type == CONTEXT_POLLING)
+		return &shard_of(ctx).m_polling;
+	else if (type == CONTEXT_IDLING)
+		return &shard_of(ctx).m_idling;
+	return &g_context_lists[type];
+}
+
+static std::mutex &ctx_lock(const schedule_context *ctx, int type)
+{
+	if (type == CONTEXT_POLLING)
+		return shard_of(ctx).m_poll_lock;
+	else if (type == CONTEXT_IDLING)
+		return shard_of(ctx).m_idle_lock;
+	return g_context_locks[type];
+}
+
 static void context_init(SCHEDULE_CONTEXT *pcontext)
 {
 	if (NULL == pcontext) {
@@ -194,14 +240,15 @@ int contexts_pool_get_param(int type)
 
 static void *ctxp_thrwork(void *pparam)
 {
+	auto &shard = *static_cast<ctx_shard *>(pparam);
 	while (!g_notify_stop) {
-		auto num = g_poll_ctx.wait();
+		auto num = shard.m_poll_ctx.wait();
 		if (num <= 0) {
 			continue;
 		}
 		for (unsigned int i = 0; i < static_cast<unsigned int>(num); ++i) {
-			auto pcontext = g_poll_ctx.get_data(i);
-			std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
+			auto pcontext = shard.m_poll_ctx.get_data(i);
+			std::unique_lock poll_hold(shard.m_poll_lock);
 			if (CONTEXT_POLLING != pcontext->type) {
 				/* context may be waked up and modified by
 				scan_work_func or context_pool_activate_context */
@@ -213,8 +260,7 @@ static void *ctxp_thrwork(void *pparam)
 					" context: %p", pcontext);
 				continue;
 			}
-			double_list_remove(&g_context_lists[CONTEXT_POLLING],
-				&pcontext->node);
+			double_list_remove(&shard.m_polling, &pcontext->node);
 			pcontext->type = CONTEXT_SWITCHING;
 			poll_hold.unlock();
 			contexts_pool_put_context(pcontext, CONTEXT_TURNING);
@@ -230,6 +276,7 @@ static void *ctxp_thrwork(void *pparam)
 
 static void *ctxp_scanwork(void *pparam)
 {
+	auto &shard = *static_cast<ctx_shard *>(pparam);
 	int num;
 	DOUBLE_LIST temp_list;
 	DOUBLE_LIST_NODE *pnode;
@@ -238,11 +285,10 @@ static void *ctxp_scanwork(void *pparam)
 	
 	double_list_init(&temp_list);
 	while (!g_notify_stop) {
-		std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
+		std::unique_lock poll_hold(shard.m_poll_lock);
 		auto current_time = tp_now();
-		ptail = double_list_get_tail(
-			&g_context_lists[CONTEXT_POLLING]);
-		while ((pnode = double_list_pop_front(&g_context_lists[CONTEXT_POLLING])) != nullptr) {
+		ptail = double_list_get_tail(&shard.m_polling);
+		while ((pnode = double_list_pop_front(&shard.m_polling)) != nullptr) {
 			pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
 			if (!pcontext->b_waiting) {
 				pcontext->type = CONTEXT_SWITCHING;
@@ -250,7 +296,7 @@ static void *ctxp_scanwork(void *pparam)
 				goto CHECK_TAIL;
 			}
 			if (current_time - contexts_pool_get_context_timestamp(pcontext) >= g_time_out) {
-				if (g_poll_ctx.del(pcontext) != 0) {
+				if (shard.m_poll_ctx.del(pcontext) != 0) {
 					mlog(LV_DEBUG, "contexts_pool: failed to remove event from epoll");
 				} else {
 					pcontext->b_waiting = FALSE;
@@ -259,16 +305,15 @@ static void *ctxp_scanwork(void *pparam)
 					goto CHECK_TAIL;
 				}
 			}
-			double_list_append_as_tail(
-				&g_context_lists[CONTEXT_POLLING], pnode);
+			double_list_append_as_tail(&shard.m_polling, pnode);
  CHECK_TAIL:
 			if (pnode == ptail) {
 				break;
 			}
 		}
 		poll_hold.unlock();
-		std::unique_lock idle_hold(g_context_locks[CONTEXT_IDLING]);
-		while ((pnode = double_list_pop_front(&g_context_lists[CONTEXT_IDLING])) != nullptr) {
+		std::unique_lock idle_hold(shard.m_idle_lock);
+		while ((pnode = double_list_pop_front(&shard.m_idling)) != nullptr) {
 			pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
 			pcontext->type = CONTEXT_SWITCHING;
 			double_list_append_as_tail(&temp_list, pnode);
@@ -297,9 +342,14 @@ static void *ctxp_scanwork(void *pparam)
 void contexts_pool_init(SCHEDULE_CONTEXT **pcontexts, unsigned int context_num,
     int (*get_socket)(const schedule_context *),
     time_point (*get_timestamp)(const schedule_context *),
-    unsigned int contexts_per_thr, time_duration timeout)
+    unsigned int contexts_per_thr, time_duration timeout, unsigned int shards)
 {
 	setup_sigalrm();
+	if (shards == 0)
+		shards = std::clamp(std::thread::hardware_concurrency(), 1U, 8U);
+	g_shard_num = shards;
+	g_shard_next = 0;
+	g_shards = std::make_unique<ctx_shard[]>(shards);
 	g_context_list = pcontexts;
 	g_context_num = context_num;
 	contexts_pool_get_context_socket = get_socket;
@@ -308,6 +358,10 @@ void contexts_pool_init(SCHEDULE_CONTEXT **pcontexts, unsigned int context_num,
 	g_time_out = timeout;
 	for (size_t i = CONTEXT_BEGIN; i < CONTEXT_TYPES; ++i)
 		double_list_init(&g_context_lists[i]);
+	for (size_t i = 0; i < g_shard_num; ++i) {
+		double_list_init(&g_shards[i].m_polling);
+		double_list_init(&g_shards[i].m_idling);
+	}
 	for (size_t i = 0; i < g_context_num; ++i) {
 		auto pcontext = g_context_list[i];
 		context_init(pcontext);
@@ -316,51 +370,72 @@ void contexts_pool_init(SCHEDULE_CONTEXT **pcontexts, unsigned int context_num,
 	}
 }
 
+static void contexts_pool_join()
+{
+	for (size_t i = 0; i < g_shard_num; ++i) {
+		auto &shard = g_shards[i];
+		if (!pthread_equal(shard.m_thread_id, {}))
+			pthread_kill(shard.m_thread_id, SIGALRM);
+		if (!pthread_equal(shard.m_scan_id, {}))
+			pthread_kill(shard.m_scan_id, SIGALRM);
+	}
+	for (size_t i = 0; i < g_shard_num; ++i) {
+		auto &shard = g_shards[i];
+		if (!pthread_equal(shard.m_thread_id, {}))
+			pthread_join(shard.m_thread_id, nullptr);
+		if (!pthread_equal(shard.m_scan_id, {}))
+			pthread_join(shard.m_scan_id, nullptr);
+		shard.m_thread_id = shard.m_scan_id = {};
+		shard.m_poll_ctx.reset();
+	}
+}
+
 int contexts_pool_run()
 {    
-	auto ret = g_poll_ctx.init(g_context_num);
-	if (ret != 0) {
-		mlog(LV_ERR, "contexts_pool: evqueue: %s", strerror(ret));
-		return -1;
+	for (size_t i = 0; i < g_shard_num; ++i) {
+		auto ret = g_shards[i].m_poll_ctx.init(g_context_num);
+		if (ret != 0) {
+			mlog(LV_ERR, "contexts_pool: evqueue: %s", strerror(ret));
+			contexts_pool_join();
+			return -1;
+		}
 	}
 	g_notify_stop = false;
-	ret = pthread_create(&g_thread_id, nullptr, ctxp_thrwork, nullptr);
-	if (ret != 0) {
-		mlog(LV_ERR, "contexts_pool: failed to create epoll thread: %s", strerror(ret));
-		g_notify_stop = true;
-		return -3;
-	}
-	pthread_setname_np(g_thread_id, "epollctx/work");
-	ret = pthread_create(&g_scan_id, nullptr, ctxp_scanwork, nullptr);
-	if (ret != 0) {
-		mlog(LV_ERR, "contexts_pool: failed to create scan thread: %s", strerror(ret));
-		g_notify_stop = true;
-		if (!pthread_equal(g_thread_id, {})) {
-			pthread_kill(g_thread_id, SIGALRM);
-			pthread_join(g_thread_id, NULL);
+	for (size_t i = 0; i < g_shard_num; ++i) {
+		auto &shard = g_shards[i];
+		char name[16];
+		auto ret = pthread_create(&shard.m_thread_id, nullptr, ctxp_thrwork, &shard);
+		if (ret != 0) {
+			mlog(LV_ERR, "contexts_pool: failed to create epoll thread: %s", strerror(ret));
+			g_notify_stop = true;
+			contexts_pool_join();
+			return -3;
 		}
-		return -4;
+		snprintf(name, std::size(name), "epollctx/work%zu", i);
+		pthread_setname_np(shard.m_thread_id, name);
+		ret = pthread_create(&shard.m_scan_id, nullptr, ctxp_scanwork, &shard);
+		if (ret != 0) {
+			mlog(LV_ERR, "contexts_pool: failed to create scan thread: %s", strerror(ret));
+			g_notify_stop = true;
+			contexts_pool_join();
+			return -4;
+		}
+		snprintf(name, std::size(name), "epollctx/scan%zu", i);
+		pthread_setname_np(shard.m_scan_id, name);
 	}
-	pthread_setname_np(g_scan_id, "epollctx/scan");
 	return 0;    
 }
 
 void contexts_pool_stop()
 {
 	g_notify_stop = true;
-	if (!pthread_equal(g_thread_id, {}))
-		pthread_kill(g_thread_id, SIGALRM);
-	if (!pthread_equal(g_scan_id, {}))
-		pthread_kill(g_scan_id, SIGALRM);
-	if (!pthread_equal(g_thread_id, {}))
-		pthread_join(g_thread_id, NULL);
-	if (!pthread_equal(g_scan_id, {}))
-		pthread_join(g_scan_id, NULL);
-	g_poll_ctx.reset();
+	contexts_pool_join();
 	for (size_t i = 0; i < g_context_num; ++i)
 		context_free(g_context_list[i]);
 	for (size_t i = CONTEXT_BEGIN; i < CONTEXT_TYPES; ++i)
 		double_list_free(&g_context_lists[i]);
+	g_shards.reset();
+	g_shard_num = 0;
 	g_context_list = NULL;
 	
 	g_context_num = 0;
@@ -379,10 +454,32 @@ SCHEDULE_CONTEXT* contexts_pool_get_context(int type)
 	if (CONTEXT_FREE != type && CONTEXT_TURNING != type) {
 		return NULL;
 	}
-	std::lock_guard xhold(g_context_locks[type]);
+	std::unique_lock xhold(g_context_locks[type]);
 	pnode = double_list_pop_front(&g_context_lists[type]);
+	xhold.unlock();
+	if (pnode == nullptr)
+		return nullptr;
 	/* do not change context type under this circumstance */
-	return pnode != nullptr ? static_cast<SCHEDULE_CONTEXT *>(pnode->pdata) : nullptr;
+	auto pcontext = static_cast<SCHEDULE_CONTEXT *>(pnode->pdata);
+	/*
+	 * A fresh connection is assigned to the next shard; it stays there
+	 * until the context is freed.
+	 */
+	if (type == CONTEXT_FREE)
+		pcontext->shard = g_shard_next++ % g_shard_num;
+	return pcontext;
+}
+
+/*
+ *	pin a freshly accepted context to the shard of its acceptor thread;
+ *	only done if there are at least as many acceptors as shards, otherwise
+ *	round-robin assignment spreads the load better
+ */
+void contexts_pool_bind_shard(SCHEDULE_CONTEXT *pcontext,
+    unsigned int acceptor, unsigned int num_acceptors)
+{
+	if (num_acceptors >= g_shard_num)
+		pcontext->shard = acceptor % g_shard_num;
 }
 
 /*
@@ -410,20 +507,21 @@ void contexts_pool_put_context(SCHEDULE_CONTEXT *pcontext, int type)
 		return;
 	}
 	
+	auto &evq = shard_of(pcontext).m_poll_ctx;
 	/* append the context at the tail of the corresponding list */
-	std::lock_guard xhold(g_context_locks[type]);
+	std::lock_guard xhold(ctx_lock(pcontext, type));
 	auto original_type = pcontext->type;
 	pcontext->type = type;
 	if (CONTEXT_POLLING == type) {
 		if (original_type == CONTEXT_CONSTRUCTING) {
-			if (g_poll_ctx.mod(pcontext, true) != 0) {
+			if (evq.mod(pcontext, true) != 0) {
 				pcontext->b_waiting = FALSE;
 				mlog(LV_DEBUG, "contexts_pool: failed to add event to epoll");
 			} else {
 				pcontext->b_waiting = TRUE;
 			}
-		} else if (g_poll_ctx.mod(pcontext, false) != 0) {
-			if (errno == ENOENT && g_poll_ctx.mod(pcontext, true) != 0) {
+		} else if (evq.mod(pcontext, false) != 0) {
+			if (errno == ENOENT && evq.mod(pcontext, true) != 0) {
 				/* sometimes, fd will be removed by scanning
 				thread because of timeout, add it back
 				into epoll queue again */
@@ -440,17 +538,17 @@ void contexts_pool_put_context(SCHEDULE_CONTEXT *pcontext, int type)
 				no need to call epoll_ctl with EPOLL_CTL_DEL */
 			pcontext->b_waiting = FALSE;
 	}
-	double_list_append_as_tail(&g_context_lists[type], 
-									&pcontext->node);
+	double_list_append_as_tail(ctx_list(pcontext, type), &pcontext->node);
 }
 
 void contexts_pool_signal(SCHEDULE_CONTEXT *pcontext)
 {
-	std::unique_lock idle_hold(g_context_locks[CONTEXT_IDLING]);
+	auto &shard = shard_of(pcontext);
+	std::unique_lock idle_hold(shard.m_idle_lock);
 	if (CONTEXT_IDLING != pcontext->type) {
 		return;
 	}
-	double_list_remove(&g_context_lists[CONTEXT_IDLING], &pcontext->node);
+	double_list_remove(&shard.m_idling, &pcontext->node);
 	pcontext->type = CONTEXT_SWITCHING;
 	idle_hold.unlock();
 	contexts_pool_put_context(pcontext, CONTEXT_TURNING);
@@ -500,11 +598,12 @@ BOOL contexts_pool_wakeup_context(SCHEDULE_CONTEXT *pcontext, int type)
  */
 void context_pool_activate_context(SCHEDULE_CONTEXT *pcontext)
 {
-	std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
+	auto &shard = shard_of(pcontext);
+	std::unique_lock poll_hold(shard.m_poll_lock);
 	if (CONTEXT_POLLING != pcontext->type) {
 		return;
 	}
-	double_list_remove(&g_context_lists[CONTEXT_POLLING], &pcontext->node);
+	double_list_remove(&shard.m_polling, &pcontext->node);
 	pcontext->type = CONTEXT_SWITCHING;
 	poll_hold.unlock();
 	std::unique_lock turn_hold(g_context_locks[CONTEXT_TURNING]);
@@ -22,11 +22,18 @@ xstmt gx_sql_prep(sqlite3 *db, const char *query)
 	return out;
 }
 
+static void gx_sql_rollback(sqlite3 *db, bool nested)
+{
+	sqlite3_exec(db, nested ? "ROLLBACK TO gx_nested; RELEASE gx_nested" :
+	             "ROLLBACK", nullptr, nullptr, nullptr);
+}
+
 xtransaction &xtransaction::operator=(xtransaction &&o) noexcept
 {
 	if (m_db != nullptr)
-		sqlite3_exec(m_db, "ROLLBACK", nullptr, nullptr, nullptr);
+		gx_sql_rollback(m_db, m_nested);
 	m_db = o.m_db;
+	m_nested = o.m_nested;
 	o.m_db = nullptr;
 	return *this;
 }
@@ -34,17 +41,35 @@ xtransaction &xtransaction::operator=(xtransaction &&o) noexcept
 xtransaction::~xtransaction()
 {
 	if (m_db != nullptr)
-		sqlite3_exec(m_db, "ROLLBACK", nullptr, nullptr, nullptr);
+		gx_sql_rollback(m_db, m_nested);
 }
 
 void xtransaction::commit()
 {
-	sqlite3_exec(m_db, "COMMIT TRANSACTION", nullptr, nullptr, nullptr);
+	sqlite3_exec(m_db, m_nested ? "RELEASE gx_nested" : "COMMIT TRANSACTION",
+	             nullptr, nullptr, nullptr);
 	m_db = nullptr;
 }
 
+/* Database whose outer transaction is held open by an exmdb batch. */
+static thread_local sqlite3 *gx_batch_db;
+
+void gx_sql_set_batch_db(sqlite3 *db)
+{
+	gx_batch_db = db;
+}
+
+/**
+ * Only on the database of a running batch (see gx_sql_set_batch_db), a
+ * savepoint is used instead of BEGIN, so that the inner commit does not end
+ * the batch's outer transaction. All other callers are unaffected.
+ */
 xtransaction gx_sql_begin_trans(sqlite3 *db)
 {
+	if (db == gx_batch_db && !sqlite3_get_autocommit(db)) {
+		sqlite3_exec(db, "SAVEPOINT gx_nested", nullptr, nullptr, nullptr);
+		return xtransaction(db, true);
+	}
 	sqlite3_exec(db, "BEGIN TRANSACTION", nullptr, nullptr, nullptr);
 	return xtransaction(db);
 }
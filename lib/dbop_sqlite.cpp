@@ -340,6 +340,123 @@ static constexpr char tbl_pub_replmap_0[] =
 "  replid INTEGER PRIMARY KEY AUTOINCREMENT,"
 "  replguid TEXT COLLATE NOCASE UNIQUE NOT NULL)";
 
+static constexpr char tbl_cidhash_8[] =
+"CREATE TABLE cid_hashes ("
+"  hash BLOB PRIMARY KEY,"
+"  cid INTEGER NOT NULL);"
+"CREATE INDEX cid_hashes_index8 ON cid_hashes(cid);";
+
+/*
+ * Denormalized copy of the properties that content tables sort on most,
+ * so that a sorted view can be served by (parent_fid, is_associated, col)
+ * index scans instead of one message_properties lookup per row and column.
+ * Only the PT_UNICODE variants are mirrored, since that is what exmdb
+ * stores whenever a codepage is known; table.cpp does not use the mirror
+ * for folders holding PT_STRING8 copies. Kept current by triggers, so none
+ * of the property writers need to know about it.
+ *
+ * dtime=PR_MESSAGE_DELIVERY_TIME, stime=PR_CLIENT_SUBMIT_TIME,
+ * mtime=PR_LAST_MODIFICATION_TIME, ctime=PR_CREATION_TIME,
+ * nsubj=PR_NORMALIZED_SUBJECT, sender=PR_SENDER_NAME,
+ * srepr=PR_SENT_REPRESENTING_NAME, msgclass=PR_MESSAGE_CLASS,
+ * importance=PR_IMPORTANCE, flagst=PR_FLAG_STATUS,
+ * msize=PR_MESSAGE_SIZE (from messages.message_size).
+ */
+static constexpr char tbl_hotprops_9[] =
+"CREATE TABLE message_hotprops ("
+"  message_id INTEGER PRIMARY KEY,"
+"  parent_fid INTEGER,"
+"  is_associated INTEGER,"
+"  msize INTEGER,"
+"  dtime INTEGER DEFAULT NULL,"
+"  stime INTEGER DEFAULT NULL,"
+"  mtime INTEGER DEFAULT NULL,"
+"  ctime INTEGER DEFAULT NULL,"
+"  nsubj TEXT COLLATE NOCASE DEFAULT NULL,"
+"  sender TEXT COLLATE NOCASE DEFAULT NULL,"
+"  srepr TEXT COLLATE NOCASE DEFAULT NULL,"
+"  msgclass TEXT COLLATE NOCASE DEFAULT NULL,"
+"  importance INTEGER DEFAULT NULL,"
+"  flagst INTEGER DEFAULT NULL,"
+"  FOREIGN KEY (message_id) REFERENCES messages (message_id) ON DELETE CASCADE ON UPDATE CASCADE);"
+"CREATE INDEX hot_msize_index9 ON message_hotprops(parent_fid, is_associated, msize);"
+"CREATE INDEX hot_dtime_index9 ON message_hotprops(parent_fid, is_associated, dtime);"
+"CREATE INDEX hot_stime_index9 ON message_hotprops(parent_fid, is_associated, stime);"
+"CREATE INDEX hot_mtime_index9 ON message_hotprops(parent_fid, is_associated, mtime);"
+"CREATE INDEX hot_ctime_index9 ON message_hotprops(parent_fid, is_associated, ctime);"
+"CREATE INDEX hot_nsubj_index9 ON message_hotprops(parent_fid, is_associated, nsubj);"
+"CREATE INDEX hot_sender_index9 ON message_hotprops(parent_fid, is_associated, sender);"
+"CREATE INDEX hot_srepr_index9 ON message_hotprops(parent_fid, is_associated, srepr);"
+"CREATE INDEX hot_msgclass_index9 ON message_hotprops(parent_fid, is_associated, msgclass);"
+"CREATE INDEX hot_importance_index9 ON message_hotprops(parent_fid, is_associated, importance);"
+"CREATE INDEX hot_flagst_index9 ON message_hotprops(parent_fid, is_associated, flagst);"
+"CREATE TRIGGER hot_msg_insert9 AFTER INSERT ON messages BEGIN"
+"  INSERT OR REPLACE INTO message_hotprops (message_id, parent_fid, is_associated, msize)"
+"    VALUES (NEW.message_id, NEW.parent_fid, NEW.is_associated, NEW.message_size & 4294967295);"
+" END;"
+"CREATE TRIGGER hot_msg_update9 AFTER UPDATE OF parent_fid, is_associated, message_size ON messages BEGIN"
+"  UPDATE message_hotprops SET parent_fid=NEW.parent_fid, is_associated=NEW.is_associated,"
+"    msize=NEW.message_size & 4294967295 WHERE message_id=NEW.message_id;"
+" END;"
+"CREATE TRIGGER hot_prop_insert9 AFTER INSERT ON message_properties"
+"  WHEN NEW.proptag IN (235274304, 3735616, 805830720, 805765184, 236781599, 203030559, 4325407, 1703967, 1507331, 277872643) BEGIN"
+"  UPDATE message_hotprops SET"
+"    dtime=CASE NEW.proptag WHEN 235274304 THEN NEW.propval ELSE dtime END,"
+"    stime=CASE NEW.proptag WHEN 3735616 THEN NEW.propval ELSE stime END,"
+"    mtime=CASE NEW.proptag WHEN 805830720 THEN NEW.propval ELSE mtime END,"
+"    ctime=CASE NEW.proptag WHEN 805765184 THEN NEW.propval ELSE ctime END,"
+"    nsubj=CASE NEW.proptag WHEN 236781599 THEN NEW.propval ELSE nsubj END,"
+"    sender=CASE NEW.proptag WHEN 203030559 THEN NEW.propval ELSE sender END,"
+"    srepr=CASE NEW.proptag WHEN 4325407 THEN NEW.propval ELSE srepr END,"
+"    msgclass=CASE NEW.proptag WHEN 1703967 THEN NEW.propval ELSE msgclass END,"
+"    importance=CASE NEW.proptag WHEN 1507331 THEN NEW.propval ELSE importance END,"
+"    flagst=CASE NEW.proptag WHEN 277872643 THEN NEW.propval ELSE flagst END"
+"    WHERE message_id=NEW.message_id;"
+" END;"
+"CREATE TRIGGER hot_prop_update9 AFTER UPDATE OF propval ON message_properties"
+"  WHEN NEW.proptag IN (235274304, 3735616, 805830720, 805765184, 236781599, 203030559, 4325407, 1703967, 1507331, 277872643) BEGIN"
+"  UPDATE message_hotprops SET"
+"    dtime=CASE NEW.proptag WHEN 235274304 THEN NEW.propval ELSE dtime END,"
+"    stime=CASE NEW.proptag WHEN 3735616 THEN NEW.propval ELSE stime END,"
+"    mtime=CASE NEW.proptag WHEN 805830720 THEN NEW.propval ELSE mtime END,"
+"    ctime=CASE NEW.proptag WHEN 805765184 THEN NEW.propval ELSE ctime END,"
+"    nsubj=CASE NEW.proptag WHEN 236781599 THEN NEW.propval ELSE nsubj END,"
+"    sender=CASE NEW.proptag WHEN 203030559 THEN NEW.propval ELSE sender END,"
+"    srepr=CASE NEW.proptag WHEN 4325407 THEN NEW.propval ELSE srepr END,"
+"    msgclass=CASE NEW.proptag WHEN 1703967 THEN NEW.propval ELSE msgclass END,"
+"    importance=CASE NEW.proptag WHEN 1507331 THEN NEW.propval ELSE importance END,"
+"    flagst=CASE NEW.proptag WHEN 277872643 THEN NEW.propval ELSE flagst END"
+"    WHERE message_id=NEW.message_id;"
+" END;"
+"CREATE TRIGGER hot_prop_delete9 AFTER DELETE ON message_properties"
+"  WHEN OLD.proptag IN (235274304, 3735616, 805830720, 805765184, 236781599, 203030559, 4325407, 1703967, 1507331, 277872643) BEGIN"
+"  UPDATE message_hotprops SET"
+"    dtime=CASE OLD.proptag WHEN 235274304 THEN NULL ELSE dtime END,"
+"    stime=CASE OLD.proptag WHEN 3735616 THEN NULL ELSE stime END,"
+"    mtime=CASE OLD.proptag WHEN 805830720 THEN NULL ELSE mtime END,"
+"    ctime=CASE OLD.proptag WHEN 805765184 THEN NULL ELSE ctime END,"
+"    nsubj=CASE OLD.proptag WHEN 236781599 THEN NULL ELSE nsubj END,"
+"    sender=CASE OLD.proptag WHEN 203030559 THEN NULL ELSE sender END,"
+"    srepr=CASE OLD.proptag WHEN 4325407 THEN NULL ELSE srepr END,"
+"    msgclass=CASE OLD.proptag WHEN 1703967 THEN NULL ELSE msgclass END,"
+"    importance=CASE OLD.proptag WHEN 1507331 THEN NULL ELSE importance END,"
+"    flagst=CASE OLD.proptag WHEN 277872643 THEN NULL ELSE flagst END"
+"    WHERE message_id=OLD.message_id;"
+" END;"
+"INSERT INTO message_hotprops SELECT m.message_id, m.parent_fid, m.is_associated,"
+"  m.message_size & 4294967295"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=235274304)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=3735616)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=805830720)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=805765184)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=236781599)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=203030559)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=4325407)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=1703967)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=1507331)"
+"  , (SELECT propval FROM message_properties AS p WHERE p.message_id=m.message_id AND p.proptag=277872643)"
+"  FROM messages AS m";
+
 static constexpr tbl_init tbl_pvt_init_0[] = {
 	{"configurations", tbl_config_0},
 	{"allocated_eids", tbl_alloc_eids_0},
@@ -381,6 +498,8 @@ static constexpr tbl_init tbl_pvt_init_top[] = {
 	{"receive_table", tbl_pvt_recvfld_0},
 	{"search_scopes", tbl_pvt_searchscopes_0},
 	{"search_result", tbl_pvt_searchresult_0},
+	{"cid_hashes", tbl_cidhash_8},
+	{"message_hotprops", tbl_hotprops_9},
 	{},
 };
 
@@ -425,6 +544,8 @@ static constexpr tbl_init tbl_pub_init_top[] = {
 	{"read_states", tbl_pub_readst_0},
 	{"read_cns", tbl_pub_readcn_0},
 	{"replca_mapping", tbl_pub_replmap_0},
+	{"cid_hashes", tbl_cidhash_8},
+	{"message_hotprops", tbl_hotprops_9},
 	{},
 };
 
@@ -482,6 +603,97 @@ static constexpr char tbl_midb_mapping_0[] =
 "  mid_string TEXT NOT NULL,"
 "  flag_string TEXT)";
 
+/*
+ * Modification sequences for IMAP CONDSTORE/QRESYNC. Every flag change,
+ * insertion and removal of a message bumps the per-folder counter; removals
+ * additionally leave a (uid, modseq) tombstone in the vanished table. The
+ * triggers keep all the existing UPDATE/DELETE statements in midb unchanged.
+ */
+static constexpr char tbl_midb_modseq_2[] =
+"ALTER TABLE folders ADD COLUMN modseq INTEGER DEFAULT 1;"
+"ALTER TABLE messages ADD COLUMN modseq INTEGER DEFAULT 1;"
+"CREATE INDEX fid_modseq_index2 ON messages(folder_id, modseq);"
+"CREATE TABLE vanished ("
+"  folder_id INTEGER NOT NULL,"
+"  uid INTEGER NOT NULL,"
+"  modseq INTEGER NOT NULL);"
+"CREATE INDEX fid_vanished_index2 ON vanished(folder_id, modseq);"
+"CREATE TRIGGER msg_insert_modseq2 AFTER INSERT ON messages BEGIN"
+"  UPDATE folders SET modseq=modseq+1 WHERE folder_id=NEW.folder_id;"
+"  UPDATE messages SET modseq=(SELECT modseq FROM folders"
+"    WHERE folder_id=NEW.folder_id) WHERE message_id=NEW.message_id;"
+" END;"
+"CREATE TRIGGER msg_flags_modseq2 AFTER UPDATE OF"
+"  unsent, read, flagged, replied, forwarded, deleted ON messages"
+"  WHEN OLD.unsent IS NOT NEW.unsent OR OLD.read IS NOT NEW.read OR"
+"  OLD.flagged IS NOT NEW.flagged OR OLD.replied IS NOT NEW.replied OR"
+"  OLD.forwarded IS NOT NEW.forwarded OR OLD.deleted IS NOT NEW.deleted BEGIN"
+"  UPDATE folders SET modseq=modseq+1 WHERE folder_id=NEW.folder_id;"
+"  UPDATE messages SET modseq=(SELECT modseq FROM folders"
+"    WHERE folder_id=NEW.folder_id) WHERE message_id=NEW.message_id;"
+" END;"
+"CREATE TRIGGER msg_delete_modseq2 AFTER DELETE ON messages BEGIN"
+"  UPDATE folders SET modseq=modseq+1 WHERE folder_id=OLD.folder_id;"
+"  INSERT INTO vanished (folder_id, uid, modseq) SELECT OLD.folder_id,"
+"    OLD.uid, modseq FROM folders WHERE folder_id=OLD.folder_id;"
+" END;"
+"CREATE TRIGGER fld_delete_vanished2 AFTER DELETE ON folders BEGIN"
+"  DELETE FROM vanished WHERE folder_id=OLD.folder_id;"
+" END;";
+
+/*
+ * IMAP sequence numbers are computed with ROW_NUMBER() over (<field>, uid)
+ * instead of being materialized in messages.idx; give every sort field an
+ * index in that exact order so the numbering comes off an index scan.
+ */
+static constexpr char tbl_midb_sortidx_3[] =
+"DROP INDEX IF EXISTS fid_idx_index;"
+"DROP INDEX IF EXISTS fid_read_index;"
+"DROP INDEX IF EXISTS fid_received_index;"
+"DROP INDEX IF EXISTS fid_flagged_index;"
+"DROP INDEX IF EXISTS fid_subject_index;"
+"DROP INDEX IF EXISTS fid_from_index;"
+"DROP INDEX IF EXISTS fid_rcpt_index;"
+"DROP INDEX IF EXISTS fid_size_index;"
+"CREATE INDEX fid_read_uid_index3 ON messages(folder_id, read, uid);"
+"CREATE INDEX fid_received_uid_index3 ON messages(folder_id, received, uid);"
+"CREATE INDEX fid_flagged_uid_index3 ON messages(folder_id, flagged, uid);"
+"CREATE INDEX fid_subject_uid_index3 ON messages(folder_id, subject, uid);"
+"CREATE INDEX fid_from_uid_index3 ON messages(folder_id, sender, uid);"
+"CREATE INDEX fid_rcpt_uid_index3 ON messages(folder_id, rcpt, uid);"
+"CREATE INDEX fid_size_uid_index3 ON messages(folder_id, size, uid);";
+
+/* Last exmdb change number seen by a content sync, for incremental resyncs */
+static constexpr char tbl_midb_synccn_4[] =
+"ALTER TABLE folders ADD COLUMN sync_cn INTEGER DEFAULT 0;";
+
+/*
+ * Bound the vanished table: only the tombstones of the last 65536 modseqs
+ * of a folder are kept. vanished_floor records the highest pruned modseq;
+ * a QRESYNC client whose modseq is below it gets the full range instead.
+ */
+static constexpr char tbl_midb_vanfloor_5[] =
+"ALTER TABLE folders ADD COLUMN vanished_floor INTEGER DEFAULT 0;"
+"DROP TRIGGER IF EXISTS msg_delete_modseq2;"
+"CREATE TRIGGER msg_delete_modseq5 AFTER DELETE ON messages BEGIN"
+"  UPDATE folders SET modseq=modseq+1 WHERE folder_id=OLD.folder_id;"
+"  INSERT INTO vanished (folder_id, uid, modseq) SELECT OLD.folder_id,"
+"    OLD.uid, modseq FROM folders WHERE folder_id=OLD.folder_id;"
+"  UPDATE folders SET vanished_floor=modseq-65536"
+"    WHERE folder_id=OLD.folder_id AND modseq-65536>vanished_floor;"
+"  DELETE FROM vanished WHERE folder_id=OLD.folder_id AND modseq<="
+"    (SELECT vanished_floor FROM folders WHERE folder_id=OLD.folder_id);"
+" END;";
+
+/*
+ * messages.idx and folders.sort_field held the materialized sequence numbers
+ * and the order they were computed in; both are unused since schema 3.
+ */
+static constexpr char tbl_midb_dropidx_6[] =
+"DROP INDEX IF EXISTS fid_idx_index;"
+"ALTER TABLE messages DROP COLUMN idx;"
+"ALTER TABLE folders DROP COLUMN sort_field;";
+
 static constexpr tbl_init tbl_midb_init_0[] = {
 	{"configurations", tbl_config_0},
 	{"folders", tbl_midb_folders_0},
@@ -495,6 +707,11 @@ static constexpr tbl_init tbl_midb_init_top[] = {
 	{"folders", tbl_midb_folders_0},
 	{"messages", tbl_midb_msgs_0},
 	{"mapping", tbl_midb_mapping_0},
+	{"vanished", tbl_midb_modseq_2},
+	{"sort indexes", tbl_midb_sortidx_3},
+	{"sync_cn", tbl_midb_synccn_4},
+	{"vanished floor", tbl_midb_vanfloor_5},
+	{"drop idx", tbl_midb_dropidx_6},
 	{},
 };
 
@@ -510,6 +727,8 @@ static constexpr tblite_upgradefn tbl_pvt_upgrade_list[] = {
 	 * Recreate that table to make that column official.
 	 */
 	{7, nullptr, "messages", tbl_pvt_msgs_7, tbl_pvt_msgs_move7},
+	{8, tbl_cidhash_8},
+	{9, tbl_hotprops_9},
 	{},
 };
 
@@ -520,11 +739,18 @@ static constexpr tblite_upgradefn tbl_pub_upgrade_list[] = {
 	{4, nullptr, "message_properties", tbl_msgprops_4, tbl_msgprops_move4},
 	{5, nullptr, "recipients_properties", tbl_rcptprops_5, tbl_rcptprops_move5},
 	{6, nullptr, "attachment_properties", tbl_atxprops_6, tbl_atxprops_move6},
+	{7, tbl_cidhash_8},
+	{8, tbl_hotprops_9},
 	{},
 };
 
 static constexpr tblite_upgradefn tbl_midb_upgrade_list[] = {
 	{1, nullptr, "configurations", tbl_config_1, tbl_config_move1},
+	{2, tbl_midb_modseq_2},
+	{3, tbl_midb_sortidx_3},
+	{4, tbl_midb_synccn_4},
+	{5, tbl_midb_vanfloor_5},
+	{6, tbl_midb_dropidx_6},
 	{},
 };
 
@@ -2551,3 +2551,140 @@ bool ical_rrule::iterate()
 		return true;
 	}
 }
+
+static unsigned int ical_bitmap_count(const unsigned char *pbitmap, size_t bytes)
+{
+	unsigned int count = 0;
+	for (size_t i = 0; i < bytes; ++i)
+		count += __builtin_popcount(pbitmap[i]);
+	return count;
+}
+
+/*
+ * Number of instances per period for rules whose periods all look alike,
+ * so that iteration can be shifted by whole periods. 0 if the rule is not
+ * of that kind.
+ */
+static unsigned int ical_rrule_period_count(const ICAL_RRULE *pirrule)
+{
+	unsigned int count = 1;
+	for (unsigned int i = 0; i < std::size(pirrule->by_mask); ++i) {
+		if (!pirrule->by_mask[i])
+			continue;
+		switch (i) {
+		case RRULE_BY_DAY:
+			/* plain weekdays, only meaningful for WEEKLY */
+			if (pirrule->frequency != ical_frequency::week ||
+			    (pirrule->wday_bitmap[0] & 0x80) != 0 ||
+			    ical_bitmap_count(&pirrule->wday_bitmap[1], std::size(pirrule->wday_bitmap) - 1) != 0 ||
+			    ical_bitmap_count(pirrule->nwday_bitmap, std::size(pirrule->nwday_bitmap)) != 0)
+				return 0;
+			count *= ical_bitmap_count(pirrule->wday_bitmap, 1);
+			break;
+		case RRULE_BY_MONTHDAY:
+			/*
+			 * Days 1..28 exist in every month. The period rollover
+			 * in ical_next_rrule_itime compares only the month
+			 * (resp. year) field, which multi-month periods
+			 * wrapping a year end and YEARLY periods not starting
+			 * in January do not satisfy; leave those to iterate().
+			 */
+			if ((pirrule->frequency != ical_frequency::month ||
+			    pirrule->interval != 1) &&
+			    (pirrule->frequency != ical_frequency::year ||
+			    !pirrule->by_mask[RRULE_BY_MONTH]))
+				return 0;
+			if ((pirrule->mday_bitmap[3] & 0xf0) != 0 ||
+			    ical_bitmap_count(pirrule->nmday_bitmap, std::size(pirrule->nmday_bitmap)) != 0)
+				return 0;
+			count *= ical_bitmap_count(pirrule->mday_bitmap, std::size(pirrule->mday_bitmap));
+			break;
+		case RRULE_BY_MONTH:
+			/*
+			 * With INTERVAL>1, iterate() does not confine the
+			 * BYMONTH expansion to every n-th year, so the
+			 * per-period count does not hold; leave it alone.
+			 */
+			if (pirrule->frequency != ical_frequency::year ||
+			    pirrule->interval != 1)
+				return 0;
+			count *= ical_bitmap_count(pirrule->month_bitmap, std::size(pirrule->month_bitmap));
+			break;
+		default:
+			return 0;
+		}
+	}
+	return count;
+}
+
+/*
+ * Jump over whole periods of the recurrence so that the current instance
+ * becomes the last one that lies at least one period before @target.
+ * Rules whose instance count per period varies (BYSETPOS, BYYEARDAY,
+ * ordinal BYDAY, month-end days, sub-daily frequencies, ...) are left
+ * alone and simply keep iterating.
+ */
+void ical_rrule::skip_before(const ICAL_TIME &target)
+{
+	if (target <= instance_itime)
+		return;
+	/* an off-pattern DTSTART is yielded first; move onto the pattern */
+	if (b_start_exceptional && (real_start_itime >= target || !iterate()))
+		return;
+	/* add_month/add_year clamping of month-end days is cumulative */
+	if ((frequency == ical_frequency::month || frequency == ical_frequency::year) &&
+	    (instance_itime.day > 28 || base_itime.day > 28))
+		return;
+	auto per_period = ical_rrule_period_count(this);
+	if (per_period == 0)
+		return;
+	/* whole periods from the current instance to @itime */
+	auto periods_to = [&](const ICAL_TIME &itime) -> long {
+		if (itime <= instance_itime)
+			return 0;
+		switch (frequency) {
+		case ical_frequency::day:
+			return itime.delta_day(instance_itime) / interval;
+		case ical_frequency::week:
+			return itime.delta_day(instance_itime) / (7 * interval);
+		case ical_frequency::month:
+			return ((itime.year - instance_itime.year) * 12 +
+			       itime.month - instance_itime.month) / interval;
+		case ical_frequency::year:
+			return (itime.year - instance_itime.year) / interval;
+		default:
+			return 0;
+		}
+	};
+	auto shift = [&](ICAL_TIME itime, long periods) {
+		switch (frequency) {
+		case ical_frequency::day:
+			itime.add_day(periods * interval);
+			break;
+		case ical_frequency::week:
+			itime.add_day(periods * 7 * interval);
+			break;
+		case ical_frequency::month:
+			itime.add_month(periods * interval);
+			break;
+		default:
+			itime.add_year(periods * interval);
+			break;
+		}
+		return itime;
+	};
+	auto skip = periods_to(target) - 1;
+	if (total_count != 0)
+		skip = std::min(skip, static_cast<long>((total_count - current_instance) / per_period));
+	if (b_until) {
+		skip = std::min(skip, periods_to(until_itime));
+		while (skip > 0 && shift(instance_itime, skip) > until_itime)
+			--skip;
+	}
+	if (skip <= 0)
+		return;
+	instance_itime = shift(instance_itime, skip);
+	base_itime = shift(base_itime, skip);
+	ical_next_rrule_base_itime(this);
+	current_instance += skip * per_period;
+}
@@ -492,6 +492,30 @@ BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
 
 }
 
+/**
+ * Send @count requests for @dir in a single round trip. The server runs
+ * them under one store lock and one SQLite transaction. The type of
+ * resps[i] has to match reqs[i]->call_id.
+ */
+BOOL exmdb_client_remote::batch(const char *dir, uint32_t count,
+    exreq *const *reqs, exresp *const *resps)
+{
+	exreq_batch q{};
+	exresp_batch r{};
+
+	q.call_id = exmdb_callid::batch;
+	q.dir = deconst(dir);
+	q.count = count;
+	q.preqs = deconst(reqs);
+	for (size_t i = 0; i < count; ++i) {
+		reqs[i]->dir = deconst(dir);
+		resps[i]->call_id = reqs[i]->call_id;
+	}
+	r.count = count;
+	r.presps = deconst(resps);
+	return gromox::exmdb_client_do_rpc(&q, &r);
+}
+
 #ifdef TEST1
 int main(int argc, const char **argv)
 {
@@ -20,6 +20,7 @@ using namespace gromox;
 
 void *(*exmdb_rpc_alloc)(size_t) = malloc;
 void (*exmdb_rpc_free)(void *) = free;
+bool exmdb_rpc_borrow;
 template<typename T> T *cu_alloc()
 {
 	static_assert(std::is_trivially_destructible_v<T>);
@@ -198,6 +199,23 @@ static int exmdb_push(EXT_PUSH &x, const exreq_query_folder_messages &d)
 	return x.p_uint64(d.folder_id);
 }
 
+static int exmdb_pull(EXT_PULL &x, exreq_query_folder_changes &d)
+{
+	TRY(x.g_uint64(&d.folder_id));
+	TRY(x.g_uint64(&d.since_cn));
+	d.pgiven = cu_alloc<EID_ARRAY>();
+	if (d.pgiven == nullptr)
+		return EXT_ERR_ALLOC;
+	return x.g_eid_a(d.pgiven);
+}
+
+static int exmdb_push(EXT_PUSH &x, const exreq_query_folder_changes &d)
+{
+	TRY(x.p_uint64(d.folder_id));
+	TRY(x.p_uint64(d.since_cn));
+	return x.p_eid_a(*d.pgiven);
+}
+
 static int exmdb_pull(EXT_PULL &x, exreq_check_folder_deleted &d)
 {
 	return x.g_uint64(&d.folder_id);
@@ -1876,6 +1894,36 @@ static int exmdb_push(EXT_PUSH &x, const exreq_read_message &d)
 	return x.p_uint64(d.message_id);
 }
 
+static int exmdb_pull(EXT_PULL &x, exreq_read_messages &d)
+{
+	uint8_t tmp_byte;
+	
+	TRY(x.g_uint8(&tmp_byte));
+	if (tmp_byte == 0)
+		d.username = nullptr;
+	else
+		TRY(x.g_str(&d.username));
+	TRY(x.g_uint32(&d.cpid));
+	d.pmessage_ids = cu_alloc<EID_ARRAY>();
+	if (d.pmessage_ids == nullptr)
+		return EXT_ERR_ALLOC;
+	TRY(x.g_eid_a(d.pmessage_ids));
+	return x.g_uint32(&d.size_limit);
+}
+
+static int exmdb_push(EXT_PUSH &x, const exreq_read_messages &d)
+{
+	if (d.username == nullptr) {
+		TRY(x.p_uint8(0));
+	} else {
+		TRY(x.p_uint8(1));
+		TRY(x.p_str(d.username));
+	}
+	TRY(x.p_uint32(d.cpid));
+	TRY(x.p_eid_a(*d.pmessage_ids));
+	return x.p_uint32(d.size_limit);
+}
+
 static int gcsr_failure(int status, exreq_get_content_sync &d)
 {
 	delete d.pgiven;
@@ -2190,6 +2238,64 @@ static int exmdb_push(EXT_PUSH &x, const exreq_get_public_folder_unread_count &d
 	return x.p_uint64(d.folder_id);
 }
 
+/*
+ * Sync requests carry heap-allocated IDSETs which only the dispatcher frees,
+ * and would be leaked if the batch got aborted before reaching them.
+ */
+static bool exmdb_batchable(exmdb_callid id)
+{
+	switch (id) {
+	case exmdb_callid::connect:
+	case exmdb_callid::listen_notification:
+	case exmdb_callid::batch:
+	case exmdb_callid::get_content_sync:
+	case exmdb_callid::get_hierarchy_sync:
+		return false;
+	default:
+		return true;
+	}
+}
+
+static int exmdb_pull(EXT_PULL &x, exreq_batch &d)
+{
+	TRY(x.g_uint32(&d.count));
+	if (d.count == 0) {
+		d.preqs = nullptr;
+		return EXT_ERR_SUCCESS;
+	}
+	d.preqs = cu_alloc<exreq *>(d.count);
+	if (d.preqs == nullptr) {
+		d.count = 0;
+		return EXT_ERR_ALLOC;
+	}
+	for (size_t i = 0; i < d.count; ++i) {
+		BINARY bin;
+		TRY(x.g_bin(&bin));
+		/* check before pulling, so no sub-request state gets allocated */
+		if (bin.cb < 1 || !exmdb_batchable(static_cast<exmdb_callid>(bin.pb[0])))
+			return EXT_ERR_FORMAT;
+		TRY(exmdb_ext_pull_request(&bin, d.preqs[i]));
+	}
+	return EXT_ERR_SUCCESS;
+}
+
+static int exmdb_push(EXT_PUSH &x, const exreq_batch &d)
+{
+	TRY(x.p_uint32(d.count));
+	for (size_t i = 0; i < d.count; ++i) {
+		if (!exmdb_batchable(d.preqs[i]->call_id))
+			return EXT_ERR_FORMAT;
+		BINARY bin;
+		TRY(exmdb_ext_push_request(d.preqs[i], &bin));
+		/* strip the length prefix; p_bin has its own */
+		BINARY sub = {bin.cb - static_cast<uint32_t>(sizeof(uint32_t)), {bin.pb + sizeof(uint32_t)}};
+		auto ret = x.p_bin(sub);
+		free(bin.pb);
+		TRY(ret);
+	}
+	return EXT_ERR_SUCCESS;
+}
+
 #define RQ_WITH_ARGS \
 	E(get_named_propids) \
 	E(get_named_propnames) \
@@ -2203,6 +2309,7 @@ static int exmdb_push(EXT_PUSH &x, const exreq_get_public_folder_unread_count &d
 	E(set_folder_by_class) \
 	E(check_folder_id) \
 	E(query_folder_messages) \
+	E(query_folder_changes) \
 	E(check_folder_deleted) \
 	E(get_folder_by_name) \
 	E(get_folder_perm) \
@@ -2300,6 +2407,8 @@ static int exmdb_push(EXT_PUSH &x, const exreq_get_public_folder_unread_count &d
 	E(delivery_message) \
 	E(write_message) \
 	E(read_message) \
+	E(read_messages) \
+	E(batch) \
 	E(get_content_sync) \
 	E(get_hierarchy_sync) \
 	E(allocate_ids) \
@@ -2318,7 +2427,8 @@ int exmdb_ext_pull_request(const BINARY *pbin_in, exreq *&prequest)
 	EXT_PULL ext_pull;
 	uint8_t raw_call_id;
 	
-	ext_pull.init(pbin_in->pb, pbin_in->cb, exmdb_rpc_alloc, EXT_FLAG_WCOUNT);
+	ext_pull.init(pbin_in->pb, pbin_in->cb, exmdb_rpc_alloc,
+		EXT_FLAG_WCOUNT | (exmdb_rpc_borrow ? EXT_FLAG_BORROW : 0));
 	TRY(ext_pull.g_uint8(&raw_call_id));
 	auto call_id = static_cast<exmdb_callid>(raw_call_id);
 	if (call_id == exmdb_callid::connect) {
@@ -2570,6 +2680,22 @@ static int exmdb_push(EXT_PUSH &x, const exresp_query_folder_messages &d)
 	return x.p_tarray_set(d.set);
 }
 
+static int exmdb_pull(EXT_PULL &x, exresp_query_folder_changes &d)
+{
+	TRY(x.g_uint64(&d.last_cn));
+	TRY(x.g_uint32(&d.total));
+	TRY(x.g_tarray_set(&d.set));
+	return x.g_eid_a(&d.deleted);
+}
+
+static int exmdb_push(EXT_PUSH &x, const exresp_query_folder_changes &d)
+{
+	TRY(x.p_uint64(d.last_cn));
+	TRY(x.p_uint32(d.total));
+	TRY(x.p_tarray_set(d.set));
+	return x.p_eid_a(d.deleted);
+}
+
 static int exmdb_pull(EXT_PULL &x, exresp_check_folder_deleted &d)
 {
 	return x.g_bool(&d.b_del);
@@ -3464,6 +3590,48 @@ static int exmdb_push(EXT_PUSH &x, const exresp_read_message &d)
 	return x.p_msgctnt(*d.pmsgctnt);
 }
 
+static int exmdb_pull(EXT_PULL &x, exresp_read_messages &d)
+{
+	uint8_t tmp_byte;
+	
+	TRY(x.g_uint32(&d.count));
+	if (d.count == 0) {
+		d.pmsgctnts = nullptr;
+		return EXT_ERR_SUCCESS;
+	}
+	d.pmsgctnts = cu_alloc<MESSAGE_CONTENT *>(d.count);
+	if (d.pmsgctnts == nullptr) {
+		d.count = 0;
+		return EXT_ERR_ALLOC;
+	}
+	for (size_t i = 0; i < d.count; ++i) {
+		TRY(x.g_uint8(&tmp_byte));
+		if (tmp_byte == 0) {
+			d.pmsgctnts[i] = nullptr;
+			continue;
+		}
+		d.pmsgctnts[i] = cu_alloc<MESSAGE_CONTENT>();
+		if (d.pmsgctnts[i] == nullptr)
+			return EXT_ERR_ALLOC;
+		TRY(x.g_msgctnt(d.pmsgctnts[i]));
+	}
+	return EXT_ERR_SUCCESS;
+}
+
+static int exmdb_push(EXT_PUSH &x, const exresp_read_messages &d)
+{
+	TRY(x.p_uint32(d.count));
+	for (size_t i = 0; i < d.count; ++i) {
+		if (d.pmsgctnts[i] == nullptr) {
+			TRY(x.p_uint8(0));
+			continue;
+		}
+		TRY(x.p_uint8(1));
+		TRY(x.p_msgctnt(*d.pmsgctnts[i]));
+	}
+	return EXT_ERR_SUCCESS;
+}
+
 static int exmdb_pull(EXT_PULL &x, exresp_get_content_sync &d)
 {
 	TRY(x.g_uint32(&d.fai_count));
@@ -3568,6 +3736,35 @@ static int exmdb_push(EXT_PUSH &x, const exresp_get_public_folder_unread_count &
 	return x.p_uint32(d.count);
 }
 
+static int exmdb_pull(EXT_PULL &x, exresp_batch &d)
+{
+	uint32_t count;
+	TRY(x.g_uint32(&count));
+	if (count != d.count)
+		return EXT_ERR_FORMAT;
+	for (size_t i = 0; i < d.count; ++i) {
+		BINARY bin;
+		TRY(x.g_bin(&bin));
+		TRY(exmdb_ext_pull_response(&bin, d.presps[i]));
+	}
+	return EXT_ERR_SUCCESS;
+}
+
+static int exmdb_push(EXT_PUSH &x, const exresp_batch &d)
+{
+	TRY(x.p_uint32(d.count));
+	for (size_t i = 0; i < d.count; ++i) {
+		BINARY bin;
+		TRY(exmdb_ext_push_response(d.presps[i], &bin));
+		/* strip status byte and length prefix */
+		BINARY sub = {bin.cb - 5, {bin.pb + 5}};
+		auto ret = x.p_bin(sub);
+		free(bin.pb);
+		TRY(ret);
+	}
+	return EXT_ERR_SUCCESS;
+}
+
 #define RSP_WITHOUT_ARGS \
 	E(ping_store) \
 	E(remove_store_properties) \
@@ -3611,6 +3808,7 @@ static int exmdb_push(EXT_PUSH &x, const exresp_get_public_folder_unread_count &
 	E(get_folder_class_table) \
 	E(check_folder_id) \
 	E(query_folder_messages) \
+	E(query_folder_changes) \
 	E(check_folder_deleted) \
 	E(get_folder_by_name) \
 	E(get_folder_perm) \
@@ -3688,6 +3886,8 @@ static int exmdb_push(EXT_PUSH &x, const exresp_get_public_folder_unread_count &
 	E(delivery_message) \
 	E(write_message) \
 	E(read_message) \
+	E(read_messages) \
+	E(batch) \
 	E(get_content_sync) \
 	E(get_hierarchy_sync) \
 	E(allocate_ids) \
@@ -3704,7 +3904,8 @@ int exmdb_ext_pull_response(const BINARY *pbin_in, exresp *presponse)
 {
 	EXT_PULL ext_pull;
 	
-	ext_pull.init(pbin_in->pb, pbin_in->cb, exmdb_rpc_alloc, EXT_FLAG_WCOUNT);
+	ext_pull.init(pbin_in->pb, pbin_in->cb, exmdb_rpc_alloc,
+		EXT_FLAG_WCOUNT | (exmdb_rpc_borrow ? EXT_FLAG_BORROW : 0));
 	switch (presponse->call_id) {
 #define E(t) case exmdb_callid::t:
 	RSP_WITHOUT_ARGS
@@ -3757,6 +3958,29 @@ int exmdb_ext_push_response(const exresp *presponse, BINARY *pbin_out)
 	return EXT_ERR_SUCCESS;
 }
 
+/**
+ * Shallow-copy a response into the caller-provided object of the same type,
+ * e.g. to hand back the results of a locally dispatched batch.
+ */
+int exmdb_ext_copy_response(const exresp *src, exresp *dst)
+{
+	if (src->call_id != dst->call_id)
+		return EXT_ERR_FORMAT;
+	switch (src->call_id) {
+#define E(t) case exmdb_callid::t:
+	RSP_WITHOUT_ARGS
+		return EXT_ERR_SUCCESS;
+#undef E
+#define E(t) case exmdb_callid::t: \
+		*static_cast<exresp_ ## t *>(dst) = *static_cast<const exresp_ ## t *>(src); \
+		return EXT_ERR_SUCCESS;
+	RSP_WITH_ARGS
+#undef E
+	default:
+		return EXT_ERR_BAD_SWITCH;
+	}
+}
+
 int exmdb_ext_pull_db_notify(const BINARY *pbin_in,
 	DB_NOTIFY_DATAGRAM *pnotify)
 {
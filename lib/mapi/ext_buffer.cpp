@@ -155,6 +155,10 @@ int EXT_PULL::g_str(char **ppstr)
 	if (len + 1 > m_data_size - m_offset)
 		return EXT_ERR_BUFSIZE;
 	len ++;
+	if (m_flags & EXT_FLAG_BORROW) {
+		*ppstr = deconst(&m_cdata[m_offset]);
+		return advance(len);
+	}
 	*ppstr = anew<char>(len);
 	if (*ppstr == nullptr)
 		return EXT_ERR_ALLOC;
@@ -193,6 +197,12 @@ int EXT_PULL::g_blob(DATA_BLOB *pblob)
 	if (m_offset > m_data_size)
 		return EXT_ERR_BUFSIZE;
 	uint32_t length = m_data_size - m_offset;
+	if (m_flags & EXT_FLAG_BORROW) {
+		pblob->pb = deconst(&m_udata[m_offset]);
+		pblob->cb = length;
+		m_offset += length;
+		return EXT_ERR_SUCCESS;
+	}
 	pblob->pb = anew<uint8_t>(length);
 	if (pblob->pb == nullptr)
 		return EXT_ERR_ALLOC;
@@ -202,6 +212,24 @@ int EXT_PULL::g_blob(DATA_BLOB *pblob)
 	return EXT_ERR_SUCCESS;
 }
 
+/* Payload of a BINARY whose @cb has already been read */
+int EXT_PULL::g_bin_data(BINARY *r)
+{
+	if (m_flags & EXT_FLAG_BORROW) {
+		if (m_data_size < r->cb || m_offset + r->cb > m_data_size)
+			return EXT_ERR_BUFSIZE;
+		r->pv = deconst(&m_udata[m_offset]);
+		m_offset += r->cb;
+		return EXT_ERR_SUCCESS;
+	}
+	r->pv = m_alloc(r->cb);
+	if (r->pv == nullptr) {
+		r->cb = 0;
+		return EXT_ERR_ALLOC;
+	}
+	return g_bytes(r->pv, r->cb);
+}
+
 int EXT_PULL::g_bin(BINARY *r)
 {
 	uint16_t cb;
@@ -216,12 +244,7 @@ int EXT_PULL::g_bin(BINARY *r)
 		r->pb = NULL;
 		return EXT_ERR_SUCCESS;
 	}
-	r->pv = m_alloc(r->cb);
-	if (r->pv == nullptr) {
-		r->cb = 0;
-		return EXT_ERR_ALLOC;
-	}
-	return g_bytes(r->pv, r->cb);
+	return g_bin_data(r);
 }
 
 int EXT_PULL::g_sbin(BINARY *r)
@@ -234,12 +257,7 @@ int EXT_PULL::g_sbin(BINARY *r)
 		r->pb = NULL;
 		return EXT_ERR_SUCCESS;
 	}
-	r->pv = m_alloc(r->cb);
-	if (r->pv == nullptr) {
-		r->cb = 0;
-		return EXT_ERR_ALLOC;
-	}
-	return g_bytes(r->pv, r->cb);
+	return g_bin_data(r);
 }
 
 int EXT_PULL::g_bin_ex(BINARY *r)
@@ -249,12 +267,7 @@ int EXT_PULL::g_bin_ex(BINARY *r)
 		r->pb = NULL;
 		return EXT_ERR_SUCCESS;
 	}
-	r->pv = m_alloc(r->cb);
-	if (r->pv == nullptr) {
-		r->cb = 0;
-		return EXT_ERR_ALLOC;
-	}
-	return g_bytes(r->pv, r->cb);
+	return g_bin_data(r);
 }
 
 int EXT_PULL::g_uint16_a(SHORT_ARRAY *r)
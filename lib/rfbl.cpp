@@ -4,6 +4,7 @@
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
 #endif
+#include <algorithm>
 #include <cerrno>
 #include <csignal>
 #include <cstdarg>
@@ -17,6 +18,7 @@
 #include <istream>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <shared_mutex>
 #include <spawn.h>
 #include <sstream>
@@ -77,30 +79,277 @@ static std::shared_mutex g_log_mutex;
 static std::unique_ptr<FILE, file_deleter> g_logfp;
 static bool g_log_direct = true, g_log_syslog;
 
+/*
+ * Magazine layer of LIB_BUFFER. Every thread keeps up to m_mag_size free
+ * items per pool; an empty magazine is refilled with half a magazine from
+ * the depot (or, failing that, with fresh slots reserved from
+ * allocated_num in one step), and a full one gives half of its items back
+ * to the depot. Idle items in magazines count against max_items, so a get
+ * that finds the pool at its limit drains all registered magazines into
+ * the depot before giving up (lb_steal). When a pool is reassigned or
+ * destroyed, its depot is retired; items of a retired depot that are still
+ * sitting in some thread are then freed whenever that thread next touches
+ * the pool or exits.
+ *
+ * Lock order: depot, then magazine. The owning thread takes only its
+ * magazine's lock on the fast path, which is uncontended unless a steal
+ * is in progress.
+ */
+namespace {
+struct lb_magazine;
+}
+
+struct lb_depot {
+	std::mutex lock;
+	LIB_BUFFER *owner = nullptr; /* nullptr once the pool is gone */
+	bool retired = false;
+	std::vector<void *> items;
+	std::vector<lb_magazine *> mags; /* magazines fed from this depot */
+};
+
+namespace {
+
+struct lb_magazine {
+	LIB_BUFFER *pool = nullptr;
+	std::shared_ptr<lb_depot> depot;
+	std::mutex lock;
+	std::vector<void *> items;
+};
+
+struct lb_magazine_set {
+	lb_magazine_set() = default;
+	~lb_magazine_set();
+	NOMOVE(lb_magazine_set);
+	std::list<lb_magazine> mags;
+};
+
+}
+
+static thread_local lb_magazine_set t_magazines;
+/* set once t_magazines is destroyed, for puts from later TLS destructors */
+static thread_local bool t_magazines_gone;
+
+/*
+ * Hand the last @n items of @m back (to the depot, or to the allocator).
+ * With @detach, @m is also unregistered from its depot.
+ */
+static void lb_release(lb_magazine &m, size_t n, bool detach = false)
+{
+	std::lock_guard lk(m.depot->lock);
+	std::lock_guard mk(m.lock);
+	if (detach)
+		std::erase(m.depot->mags, &m);
+	n = std::min(n, m.items.size()); /* a steal may have emptied it */
+	auto first = m.items.end() - n;
+	auto owner = m.depot->owner;
+	if (owner != nullptr && !m.depot->retired) try {
+		m.depot->items.insert(m.depot->items.end(), first, m.items.end());
+		m.items.erase(first, m.items.end());
+		return;
+	} catch (const std::bad_alloc &) {
+	}
+	for (auto i = first; i != m.items.end(); ++i)
+		free(*i);
+	m.items.erase(first, m.items.end());
+	if (owner != nullptr)
+		owner->allocated_num -= n;
+}
+
+lb_magazine_set::~lb_magazine_set()
+{
+	for (auto &m : mags)
+		lb_release(m, SIZE_MAX, true);
+	t_magazines_gone = true;
+}
+
+static void lb_retire(LIB_BUFFER *pool, bool gone)
+{
+	auto &d = *pool->m_depot;
+	std::lock_guard lk(d.lock);
+	for (auto p : d.items)
+		free(p);
+	pool->allocated_num -= d.items.size();
+	d.items.clear();
+	d.items.shrink_to_fit();
+	d.retired = true;
+	if (gone)
+		d.owner = nullptr;
+}
+
+static lb_magazine *lb_find(LIB_BUFFER *pool) try
+{
+	if (t_magazines_gone)
+		return nullptr;
+	for (auto &m : t_magazines.mags) {
+		if (m.pool != pool)
+			continue;
+		if (m.depot != pool->m_depot) {
+			/* pool was reassigned or replaced since */
+			lb_release(m, SIZE_MAX, true);
+			m.items.reserve(pool->m_mag_size);
+			m.depot = pool->m_depot;
+			std::lock_guard lk(m.depot->lock);
+			m.depot->mags.push_back(&m);
+		}
+		return &m;
+	}
+	auto &m = t_magazines.mags.emplace_back();
+	m.pool = pool;
+	m.items.reserve(pool->m_mag_size);
+	std::lock_guard lk(pool->m_depot->lock);
+	pool->m_depot->mags.push_back(&m);
+	m.depot = pool->m_depot;
+	return &m;
+} catch (const std::bad_alloc &) {
+	/* an unregistered magazine must not hold items */
+	auto &v = t_magazines.mags;
+	auto it = std::find_if(v.begin(), v.end(),
+	          [&](const lb_magazine &m) { return m.pool == pool; });
+	if (it != v.end())
+		v.erase(it);
+	return nullptr;
+}
+
+static void *lb_pop(lb_magazine &m)
+{
+	std::lock_guard mk(m.lock);
+	if (m.items.empty())
+		return nullptr;
+	auto ptr = m.items.back();
+	m.items.pop_back();
+	return ptr;
+}
+
+static void lb_refill(LIB_BUFFER &pool, lb_magazine &m)
+{
+	size_t want = std::max(pool.m_mag_size / 2, static_cast<size_t>(1));
+	{
+		std::lock_guard lk(m.depot->lock);
+		auto &d = m.depot->items;
+		auto n = std::min(want, d.size());
+		if (n > 0) {
+			std::lock_guard mk(m.lock);
+			m.items.insert(m.items.end(), d.end() - n, d.end());
+			d.resize(d.size() - n);
+			return;
+		}
+	}
+	auto exp = pool.allocated_num.load();
+	size_t n;
+	do {
+		if (exp >= pool.max_items)
+			return;
+		n = std::min(want, pool.max_items - exp);
+	} while (!pool.allocated_num.compare_exchange_weak(exp, exp + n));
+	std::lock_guard mk(m.lock);
+	for (size_t i = 0; i < n; ++i) {
+		auto ptr = malloc(pool.item_size);
+		if (ptr == nullptr) {
+			pool.allocated_num -= n - i;
+			return;
+		}
+		m.items.push_back(ptr);
+	}
+}
+
+/*
+ * The pool is at max_items: collect whatever idles in the magazines of
+ * all threads into the depot and take one item from there.
+ */
+static void *lb_steal(LIB_BUFFER &pool) try
+{
+	auto &d = *pool.m_depot;
+	std::lock_guard lk(d.lock);
+	if (d.retired)
+		return nullptr;
+	for (auto m : d.mags) {
+		std::lock_guard mk(m->lock);
+		d.items.insert(d.items.end(), m->items.begin(), m->items.end());
+		m->items.clear();
+	}
+	if (d.items.empty())
+		return nullptr;
+	auto ptr = d.items.back();
+	d.items.pop_back();
+	return ptr;
+} catch (const std::bad_alloc &) {
+	return nullptr;
+}
+
 LIB_BUFFER::LIB_BUFFER(size_t isize, size_t inum, const char *name,
-    const char *hint) :
+    const char *hint, bool per_thread) :
 	item_size(isize), max_items(inum), m_name(name), m_hint(hint)
 {
 	if (isize == 0 || inum == 0)
 		mlog(LV_ERR, "E-1669: Invalid parameters passed to LIB_BUFFER ctor");
+	/* keep what can idle in magazines small against the pool size */
+	if (per_thread)
+		m_mag_size = std::min(inum / 256, static_cast<size_t>(32));
+	if (m_mag_size > 0) {
+		m_depot = std::make_shared<lb_depot>();
+		m_depot->owner = this;
+	}
+}
+
+LIB_BUFFER::~LIB_BUFFER()
+{
+	if (m_depot != nullptr)
+		lb_retire(this, true);
+	for (auto &d : m_retired) {
+		std::lock_guard lk(d->lock);
+		d->owner = nullptr;
+	}
 }
 
 LIB_BUFFER &LIB_BUFFER::operator=(LIB_BUFFER &&o) noexcept
 {
+	if (m_depot != nullptr) {
+		lb_retire(this, false);
+		try {
+			m_retired.push_back(std::move(m_depot));
+		} catch (const std::bad_alloc &) {
+			std::lock_guard lk(m_depot->lock);
+			m_depot->owner = nullptr;
+		}
+		m_depot.reset();
+	}
 	allocated_num += o.allocated_num.load(); /* allow freeing previous takes */
 	o.allocated_num = 0;
 	item_size = o.item_size;
 	max_items = o.max_items;
 	m_name = o.m_name;
 	m_hint = o.m_hint;
+	m_mag_size = o.m_mag_size;
+	m_depot = std::move(o.m_depot);
+	if (m_depot != nullptr) {
+		std::lock_guard lk(m_depot->lock);
+		m_depot->owner = this;
+	}
 	return *this;
 }
 
 void *LIB_BUFFER::get_raw()
 {
+	if (m_mag_size > 0) {
+		auto m = lb_find(this);
+		if (m != nullptr) {
+			auto ptr = lb_pop(*m);
+			if (ptr == nullptr) {
+				lb_refill(*this, *m);
+				ptr = lb_pop(*m);
+			}
+			if (ptr != nullptr)
+				return ptr;
+		}
+	}
 	do {
 		auto exp = allocated_num.load();
 		if (exp >= max_items) {
+			if (m_mag_size > 0) {
+				auto ptr = lb_steal(*this);
+				if (ptr != nullptr)
+					return ptr;
+			}
 			mlog(LV_ERR, "E-1992: The buffer pool \"%s\" is full. "
 			        "This either means a memory leak, or the pool sizes "
 			        "have been configured too low.",
@@ -124,6 +373,19 @@ void *LIB_BUFFER::get_raw()
 
 void LIB_BUFFER::put_raw(void *item)
 {
+	if (m_mag_size > 0) {
+		auto m = lb_find(this);
+		if (m != nullptr) {
+			std::unique_lock mk(m->lock);
+			if (m->items.size() >= m_mag_size) {
+				mk.unlock();
+				lb_release(*m, std::max(m_mag_size / 2, static_cast<size_t>(1)));
+				mk.lock();
+			}
+			m->items.push_back(item);
+			return;
+		}
+	}
 	free(item);
 	--allocated_num;
 }
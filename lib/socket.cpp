@@ -10,6 +10,7 @@
 #include <memory>
 #include <netdb.h>
 #include <unistd.h>
+#include <vector>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -169,7 +170,7 @@ int gx_inet_connect(const char *host, uint16_t port, unsigned int oflags)
 	return -(errno = saved_errno);
 }
 
-static int gx_gai_listen(const struct addrinfo *r)
+static int gx_gai_listen(const struct addrinfo *r, bool reuseport = false)
 {
 	auto fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
 	if (fd < 0)
@@ -177,6 +178,10 @@ static int gx_gai_listen(const struct addrinfo *r)
 	static const int y = 1;
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)) < 0)
 		mlog(LV_WARN, "W-1385: setsockopt: %s", strerror(errno));
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &y, sizeof(y)) < 0)
+		mlog(LV_WARN, "W-2192: setsockopt SO_REUSEPORT: %s", strerror(errno));
+#endif
 	auto ret = bind(fd, r->ai_addr, r->ai_addrlen);
 	if (ret != 0) {
 		int se = errno;
@@ -216,6 +221,92 @@ int gx_inet_listen(const char *host, uint16_t port)
 	return -(errno = saved_errno);
 }
 
+/**
+ * Is @fd a listening socket bound to the address in @r?
+ */
+static bool gx_sock_is_bound_to(int fd, const struct addrinfo *r)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	int val = 0;
+	socklen_t vlen = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &val, &vlen) != 0 ||
+	    val != r->ai_socktype)
+		return false;
+	vlen = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &vlen) != 0 ||
+	    val == 0)
+		return false;
+	if (getsockname(fd, reinterpret_cast<sockaddr *>(&ss), &sslen) != 0)
+		return false;
+	return sslen == r->ai_addrlen && memcmp(&ss, r->ai_addr, sslen) == 0;
+}
+
+/**
+ * Like gx_inet_listen, but open up to @count sockets on the same address
+ * with SO_REUSEPORT, so that the kernel spreads incoming connections over
+ * them. Sockets inherited through HX_LISTEN_TOP_FD/LISTEN_FDS are picked up
+ * again (all of them, not just the first match). Returns 0 or a negative
+ * errno; @fds is filled with at least one descriptor on success.
+ */
+int gx_inet_listen_multi(const char *host, uint16_t port, unsigned int count,
+    std::vector<int> &fds) try
+{
+#ifndef SO_REUSEPORT
+	count = 1;
+#endif
+	fds.clear();
+	fds.reserve(count);
+	if (count <= 1) {
+		auto fd = gx_inet_listen(host, port);
+		if (fd < 0)
+			return fd;
+		fds.push_back(fd);
+		return 0;
+	}
+	int top_fd = -1;
+	auto s = getenv("LISTEN_FDS");
+	if (s != nullptr)
+		top_fd = 3 + strtoul(s, nullptr, 0);
+	else if ((s = getenv("HX_LISTEN_TOP_FD")) != nullptr)
+		top_fd = strtoul(s, nullptr, 0);
+	auto aires = gx_inet_lookup(host, port, AI_PASSIVE);
+	int saved_errno = EHOSTUNREACH;
+	for (auto r = aires.get(); r != nullptr; r = r->ai_next) {
+		for (int fd = 3; fd < top_fd && fds.size() < count; ++fd)
+			if (gx_sock_is_bound_to(fd, r))
+				fds.push_back(fd);
+		if (fds.size() > 0)
+			return 0;
+		auto fd = gx_gai_listen(r, true);
+		if (fd < 0) {
+			saved_errno = errno;
+			if (fd == -2)
+				continue;
+			break;
+		}
+		fds.push_back(fd);
+		while (fds.size() < count) {
+			fd = gx_gai_listen(r, true);
+			if (fd < 0) {
+				saved_errno = errno;
+				for (auto x : fds)
+					close(x);
+				fds.clear();
+				return -saved_errno;
+			}
+			fds.push_back(fd);
+		}
+		return 0;
+	}
+	return -(errno = saved_errno);
+} catch (const std::bad_alloc &) {
+	for (auto x : fds)
+		close(x);
+	fds.clear();
+	return -ENOMEM;
+}
+
 int gx_local_listen(const char *path)
 {
 	struct sockaddr_un u;
@@ -2,12 +2,10 @@
 // SPDX-FileCopyrightText: 2020–2021 grommunio GmbH
 // This file is part of Gromox.
 /*
- *  mail queue have three parts, tape, mess, message queue.when a mail
- *  is put into mail queue, first, check whether it is less
- *  than 64K, if it is, get a block (128K) from tape, and write the mail
- *  into this block; or, create a file in mess directory and write the
- *  mail into file. after mail is saved, system will send a message to
- *  message queue to indicate there's a new mail arrived!
+ *  mail queue have two parts, mess, notify socket. when a mail is put
+ *  into mail queue, a file is created in the mess directory and the mail
+ *  is written into it. once a group of such files is on disk, the enqueuer
+ *  sends one datagram to token.sock listing their mess IDs.
  */
 #include <cerrno>
 #include <csignal>
@@ -22,11 +20,12 @@
 #include <unistd.h>
 #include <vector>
 #include <libHX/string.h>
-#include <sys/ipc.h>
+#include <poll.h>
 #include <sys/mman.h>
-#include <sys/msg.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <gromox/atomic.hpp>
 #include <gromox/endian.hpp>
 #include <gromox/fileio.h>
@@ -35,24 +34,14 @@
 #include <gromox/util.hpp>
 #include "delivery.hpp"
 #define DEF_MODE    S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH
-#define TOKEN_MESSAGE_QUEUE		1
 #define BLOCK_SIZE				64*1024*2
-#define SLEEP_INTERVAL			50000
+#define RESCAN_INTERVAL			1000 /* ms */
 
 using namespace std::string_literals;
 using namespace gromox;
 
-namespace {
-
-struct MSG_BUFF {
-	long msg_type;
-	int msg_content;
-};
-
-}
-
 static std::string g_path, g_path_mess, g_path_save;
-static int				g_msg_id;	    /* message queue id */
+static int g_notify_fd = -1; /* token.sock */
 static size_t			g_message_units;/* allocated message units number */
 static size_t			g_max_memory;   /* maximum allocated memory for mess*/
 static size_t			g_current_mem;  /*current allocated memory */
@@ -86,7 +75,7 @@ void message_dequeue_init(const char *path, size_t max_memory)
 	g_path_save = path + "/save"s;
 	g_max_memory = ((max_memory-1)/(BLOCK_SIZE/2) + 1) * (BLOCK_SIZE/2);
 	g_current_mem = 0;
-	g_msg_id = -1;
+	g_notify_fd = -1;
 	g_message_ptr.reset();
 	g_mess_hash = NULL;
 	g_notify_stop = false;
@@ -138,31 +127,33 @@ static void message_dequeue_collect_resource()
 {
 	g_message_ptr.reset();
 	g_mess_hash.reset();
+	if (g_notify_fd >= 0)
+		close(g_notify_fd);
+	g_notify_fd = -1;
 }
 
 int message_dequeue_run()
 {
 	if (!message_dequeue_check())
 		return -1;
-	std::string name;
-	try {
-		name = g_path + "/token.ipc"s;
-	} catch (const std::bad_alloc &) {
-		mlog(LV_ERR, "MDQ-167: ENOMEM");
-		return false;
+	struct sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (static_cast<size_t>(snprintf(addr.sun_path, sizeof(addr.sun_path),
+	    "%s/token.sock", g_path.c_str())) >= sizeof(addr.sun_path)) {
+		mlog(LV_ERR, "mdq: %s: path too long for a socket", g_path.c_str());
+		return -2;
 	}
-	int fd = open(name.c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
-	if (fd >= 0)
-		close(fd);
-	auto k_msg = ftok(name.c_str(), TOKEN_MESSAGE_QUEUE);
-    if (-1 == k_msg) {
-		mlog(LV_ERR, "mdq: ftok %s: %s", name.c_str(), strerror(errno));
-        return -2;
-    }
-	/* create the message queue */
-	g_msg_id = msgget(k_msg, 0666|IPC_CREAT);
-	if (-1 == g_msg_id) {
-		mlog(LV_ERR, "mdq: msgget: %s", strerror(errno));
+	g_notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (g_notify_fd < 0) {
+		mlog(LV_ERR, "mdq: socket: %s", strerror(errno));
+		return -6;
+	}
+	if (unlink(addr.sun_path) < 0 && errno != ENOENT)
+		mlog(LV_WARN, "W-2189: unlink %s: %s", addr.sun_path, strerror(errno));
+	if (bind(g_notify_fd, reinterpret_cast<const sockaddr *>(&addr),
+	    sizeof(addr)) < 0) {
+		mlog(LV_ERR, "mdq: bind %s: %s", addr.sun_path, strerror(errno));
+		message_dequeue_collect_resource();
 		return -6;
 	}
 	g_message_units = g_max_memory/(BLOCK_SIZE/2);
@@ -235,7 +226,6 @@ void message_dequeue_stop()
 	message_dequeue_collect_resource();
     g_max_memory = 0;
 	g_current_mem  = 0;
-    g_msg_id = -1;
 	g_notify_stop = true;
 }
 
@@ -384,7 +374,7 @@ static void message_dequeue_load_from_mess(int mess) try
 
 static void *mdq_thrwork(void *arg)
 {
-	MSG_BUFF msg;
+	uint32_t ids[256];
     DIR *dirp;
     struct dirent *direntp;
 
@@ -394,19 +384,18 @@ static void *mdq_thrwork(void *arg)
         sleep(1);
     }
 
+	/* pick up whatever was enqueued while we were not running */
+	bool rescan = true;
 	while (!g_notify_stop) {
-		if (msgrcv(g_msg_id, &msg, sizeof(uint32_t), 0, IPC_NOWAIT) != -1) {
-			switch(msg.msg_type) {
-			case MESSAGE_MESS:
-				message_dequeue_load_from_mess(msg.msg_content);
-				break;
-			default:
-				mlog(LV_ERR, "mdq: unknown message queue type %ld, "
-					"should be MESSAGE_MESS", msg.msg_type);
-			}
+		struct pollfd pfd = {g_notify_fd, POLLIN};
+		if (!rescan && poll(&pfd, 1, RESCAN_INTERVAL) > 0) {
+			auto len = recv(g_notify_fd, ids, sizeof(ids), MSG_DONTWAIT);
+			for (ssize_t i = 0; i < len / static_cast<ssize_t>(sizeof(uint32_t)); ++i)
+				message_dequeue_load_from_mess(ids[i]);
 			continue;
 		}
-		usleep(SLEEP_INTERVAL);
+		/* idle (or interrupted): sweep for mess files nobody told us about */
+		rescan = false;
 		if (g_free_list.size() != g_message_units)
 			continue;
 		/* clean up mess */
@@ -1,17 +1,24 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 #include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <climits>
-#include <csignal>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <dirent.h>
 #include <fcntl.h>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <pthread.h>
+#include <queue>
 #include <string>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 #include <libHX/string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -26,22 +33,30 @@
 using namespace std::string_literals;
 using namespace gromox;
 
+namespace {
+/* next attempt time and spool file number */
+using cq_item = std::pair<time_t, int>;
+}
+
 static char g_path[256];
 static int g_mess_id;
 static int g_scan_interval;
 static int g_retrying_times;
 static pthread_t g_thread_id;
-static std::mutex g_id_lock;
+static std::mutex g_id_lock, g_due_lock;
+static std::condition_variable g_due_cond;
+static std::priority_queue<cq_item, std::vector<cq_item>, std::greater<cq_item>> g_due_list;
 static gromox::atomic_bool g_notify_stop{true};
 
-static int cache_queue_retrieve_mess_ID();
+static int cache_queue_rebuild();
 static int cache_queue_increase_mess_ID();
+static void cache_queue_schedule(int mess_id);
 static void *mdl_thrwork(void *);
 
 /*
  *	@param
  *		path [in]				queue path
- *		scan_interval			interval of queue scanning
+ *		scan_interval			interval between delivery attempts
  *		retrying_times			retrying times of delivery
  */
 void cache_queue_init(const char *path, int scan_interval, int retrying_times)
@@ -70,7 +85,9 @@ int cache_queue_run()
 		mlog(LV_ERR, "exmdb_local: %s is not a directory", g_path);
         return -2;
     }
-	g_mess_id = cache_queue_retrieve_mess_ID();
+	g_mess_id = cache_queue_rebuild();
+	if (g_mess_id < 0)
+		return -1;
 	g_notify_stop = false;
 	auto ret = pthread_create(&g_thread_id, nullptr, mdl_thrwork, nullptr);
 	if (ret != 0) {
@@ -87,10 +104,14 @@ void cache_queue_stop()
 	if (!g_notify_stop) {
 		g_notify_stop = true;
 		if (!pthread_equal(g_thread_id, {})) {
-			pthread_kill(g_thread_id, SIGALRM);
+			std::unique_lock hold(g_due_lock);
+			g_due_cond.notify_one();
+			hold.unlock();
 			pthread_join(g_thread_id, NULL);
 		}
 	}
+	std::unique_lock hold(g_due_lock);
+	g_due_list = {};
 }
 
 void cache_queue_free()
@@ -199,31 +220,65 @@ int cache_queue_put(MESSAGE_CONTEXT *pcontext, const char *rcpt_to,
 			        file_name.c_str(), strerror(errno));
         return -1;
 	}
+	cache_queue_schedule(mess_id);
 	return mess_id;
 }
 
 /*
- *	retrieve the message ID in the queue
+ *	rebuild the due list from the spool directory; every entry gets its
+ *	next attempt one interval from now
  *	@return
- *		message ID
+ *		highest message ID in the queue, or -1 on error
  */
-static int cache_queue_retrieve_mess_ID()
+static int cache_queue_rebuild() try
 {
     struct dirent *direntp;
 	int max_ID = 0;
+	std::vector<cq_item> items;
 
-    /*
-    read every file under directory and retrieve the maximum number and
-    return it
-    */
 	auto dirp = opendir_sd(g_path, nullptr);
-	if (dirp.m_dir != nullptr) while ((direntp = readdir(dirp.m_dir.get())) != nullptr) {
+	if (dirp.m_dir == nullptr) {
+		mlog(LV_ERR, "exmdb_local: failed to open cache directory %s: %s",
+			g_path, strerror(errno));
+		return -1;
+	}
+	auto due = time(nullptr) + g_scan_interval;
+	while ((direntp = readdir(dirp.m_dir.get())) != nullptr) {
 		if (strcmp(direntp->d_name, ".") == 0 ||
 		    strcmp(direntp->d_name, "..") == 0)
 			continue;
-		max_ID = std::max(max_ID, static_cast<int>(strtol(direntp->d_name, nullptr, 0)));
-    }
-    return max_ID;
+		int id = strtol(direntp->d_name, nullptr, 0);
+		if (id <= 0)
+			continue;
+		max_ID = std::max(max_ID, id);
+		items.emplace_back(due, id);
+	}
+	std::unique_lock hold(g_due_lock);
+	g_due_list = decltype(g_due_list)(std::greater<cq_item>(), std::move(items));
+	if (g_due_list.size() > 0)
+		mlog(LV_NOTICE, "exmdb_local: %zu messages in cache queue",
+		        g_due_list.size());
+	return max_ID;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2824: ENOMEM");
+	return -1;
+}
+
+/* (re)arm a spool file for its next delivery attempt */
+static void cache_queue_schedule(int mess_id) try
+{
+	std::unique_lock hold(g_due_lock);
+	bool earliest = g_due_list.empty();
+	auto due = time(nullptr) + g_scan_interval;
+	if (!earliest && due < g_due_list.top().first)
+		earliest = true;
+	g_due_list.emplace(due, mess_id);
+	hold.unlock();
+	if (earliest)
+		g_due_cond.notify_one();
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2825: ENOMEM; %s/%d will only be retried after restart",
+	        g_path, mess_id);
 }
 
 /*
@@ -243,245 +298,236 @@ static int cache_queue_increase_mess_ID()
     return current_id;
 }
 
-static void *mdl_thrwork(void *arg)
+/*
+ *	make one delivery attempt for a spool file
+ *	@return
+ *		true if the file stays in the queue
+ */
+static bool cache_queue_deliver(MESSAGE_CONTEXT *pcontext, int mess_id)
 {
 	const char *bounce_type = nullptr;
-	int i, scan_interval;
-	time_t scan_begin, scan_end;
-    struct dirent *direntp;
 	char temp_from[UADDR_SIZE], temp_rcpt[UADDR_SIZE];
 	char *ptr;
-	MESSAGE_CONTEXT *pcontext, *pbounce_context;
+	MESSAGE_CONTEXT *pbounce_context;
 	BOOL need_bounce = false, need_remove = false;
 
-	pcontext = get_context();
-	if (NULL == pcontext) {
-		mlog(LV_ERR, "exmdb_local: failed to get context in cache queue thread");
-		return nullptr;
+	std::string temp_path;
+	try {
+		temp_path = g_path + "/"s + std::to_string(mess_id);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1475: ENOMEM");
+		return true;
 	}
-	auto dirp = opendir_sd(g_path, nullptr);
-	if (dirp.m_dir == nullptr) {
-		mlog(LV_ERR, "exmdb_local: failed to open cache directory %s: %s",
-			g_path, strerror(errno));
-		return nullptr;
+	wrapfd fd = open(temp_path.c_str(), O_RDWR);
+	if (fd.get() < 0)
+		return false;
+	struct stat node_stat;
+	uint32_t times, mess_len;
+	if (fstat(fd.get(), &node_stat) != 0 || !S_ISREG(node_stat.st_mode))
+		return false;
+	if (read(fd.get(), &times, sizeof(uint32_t)) != sizeof(uint32_t))
+		return true;
+	times = le32_to_cpu(times);
+	if (times == 0)
+		return true;
+	uint64_t enc_origtime;
+	if (read(fd.get(), &enc_origtime, sizeof(uint64_t)) != sizeof(uint64_t) ||
+	    read(fd.get(), &mess_len, sizeof(uint32_t)) != sizeof(uint32_t)) {
+		mlog(LV_ERR, "exmdb_local: failed to read information from %s "
+			"in timer queue", temp_path.c_str());
+		return true;
 	}
-	i = 0;
-	scan_interval = g_scan_interval;
-	while (!g_notify_stop) {
-		if (i < scan_interval) {
-			i ++;
-			sleep(1);
-			continue;
-		}
-		seekdir(dirp.m_dir.get(), 0);
-		time(&scan_begin);
-		while ((direntp = readdir(dirp.m_dir.get())) != nullptr) {
-			if (g_notify_stop)
-				break;
-			if (strcmp(direntp->d_name, ".") == 0 ||
-			    strcmp(direntp->d_name, "..") == 0)
-				continue;
-			std::string temp_path;
-			try {
-				temp_path = std::string(g_path) + "/" + direntp->d_name;
-			} catch (const std::bad_alloc &) {
-				mlog(LV_ERR, "E-1475: ENOMEM");
-			}
-			wrapfd fd = open(temp_path.c_str(), O_RDWR);
-			if (fd.get() < 0)
-				continue;
-			struct stat node_stat;
-			uint32_t times, mess_len;
-			if (fstat(fd.get(), &node_stat) != 0 || !S_ISREG(node_stat.st_mode))
-				continue;
-			if (read(fd.get(), &times, sizeof(uint32_t)) != sizeof(uint32_t))
-				continue;
-			times = le32_to_cpu(times);
-			if (times == 0)
-		                continue;
-			uint64_t enc_origtime;
-			if (read(fd.get(), &enc_origtime, sizeof(uint64_t)) != sizeof(uint64_t) ||
-			    read(fd.get(), &mess_len, sizeof(uint32_t)) != sizeof(uint32_t)) {
-				mlog(LV_ERR, "exmdb_local: failed to read information from %s "
-					"in timer queue", temp_path.c_str());
-				continue;
-			}
-			time_t original_time = le64_to_cpu(enc_origtime);
-			mess_len = le32_to_cpu(mess_len);
-			size_t size = node_stat.st_size - sizeof(time_t) - 2 * sizeof(uint32_t);
-			if (size < mess_len) {
-				mlog(LV_WARN, "W-1554: garbage in %s; review and delete", temp_path.c_str());
-				continue;
-			}
-			auto pbuff = me_alloc<char>(((size - 1) / (64 * 1024) + 1) * 64 * 1024);
-			if (NULL == pbuff) {
-				mlog(LV_ERR, "exmdb_local: Failed to allocate memory for %s "
-					"in timer queue thread", temp_path.c_str());
-				continue;
-			}
-			auto rdret = read(fd.get(), pbuff, size);
-			if (rdret < 0 || static_cast<size_t>(rdret) != size) {
-				free(pbuff);
-				mlog(LV_ERR, "exmdb_local: partial read from %s", temp_path.c_str());
-				continue;
-			}
-			if (!pcontext->pmail->retrieve(pbuff, mess_len)) {
-				free(pbuff);
-				mlog(LV_ERR, "exmdb_local: failed to retrieve message %s in "
-				       "cache queue into mail object", temp_path.c_str());
-				continue;
-			}
-			ptr = pbuff + mess_len; /* to hell with this bullcrap */
-			size -= mess_len;
-			if (size < sizeof(uint32_t)) {
-				mlog(LV_WARN, "W-1555: garbage in %s; review and delete", temp_path.c_str());
-				continue;
-			}
-			pcontext->pcontrol->queue_ID = le32p_to_cpu(ptr);
-			ptr += sizeof(uint32_t);
-			size -= sizeof(uint32_t);
-			if (size < sizeof(uint32_t)) {
-				mlog(LV_WARN, "W-1556: garbage in %s; review and delete", temp_path.c_str());
-				continue;
-			}
-			pcontext->pcontrol->bound_type = le32p_to_cpu(ptr);
-			ptr += sizeof(uint32_t);
-			size -= sizeof(uint32_t);
-			if (size < sizeof(uint32_t)) {
-				mlog(LV_WARN, "W-1557: garbage in %s; review and delete", temp_path.c_str());
-				continue;
-			}
-			pcontext->pcontrol->is_spam = le32p_to_cpu(ptr);
-			ptr += sizeof(uint32_t);
-			size -= sizeof(uint32_t);
-			if (size < sizeof(uint32_t)) {
-				mlog(LV_WARN, "W-1558: garbage in %s; review and delete", temp_path.c_str());
-				continue;
-			}
-			pcontext->pcontrol->need_bounce = le32p_to_cpu(ptr);
-			ptr += sizeof(uint32_t);
-			size -= sizeof(uint32_t);
+	time_t original_time = le64_to_cpu(enc_origtime);
+	mess_len = le32_to_cpu(mess_len);
+	size_t size = node_stat.st_size - sizeof(time_t) - 2 * sizeof(uint32_t);
+	if (size < mess_len) {
+		mlog(LV_WARN, "W-1554: garbage in %s; review and delete", temp_path.c_str());
+		return true;
+	}
+	std::unique_ptr<char[], stdlib_delete> pbuff(me_alloc<char>(((size - 1) / (64 * 1024) + 1) * 64 * 1024));
+	if (NULL == pbuff) {
+		mlog(LV_ERR, "exmdb_local: Failed to allocate memory for %s "
+			"in timer queue thread", temp_path.c_str());
+		return true;
+	}
+	auto rdret = read(fd.get(), pbuff.get(), size);
+	if (rdret < 0 || static_cast<size_t>(rdret) != size) {
+		mlog(LV_ERR, "exmdb_local: partial read from %s", temp_path.c_str());
+		return true;
+	}
+	if (!pcontext->pmail->retrieve(pbuff.get(), mess_len)) {
+		mlog(LV_ERR, "exmdb_local: failed to retrieve message %s in "
+		       "cache queue into mail object", temp_path.c_str());
+		return true;
+	}
+	ptr = pbuff.get() + mess_len; /* to hell with this bullcrap */
+	size -= mess_len;
+	if (size < sizeof(uint32_t)) {
+		mlog(LV_WARN, "W-1555: garbage in %s; review and delete", temp_path.c_str());
+		return true;
+	}
+	pcontext->pcontrol->queue_ID = le32p_to_cpu(ptr);
+	ptr += sizeof(uint32_t);
+	size -= sizeof(uint32_t);
+	if (size < sizeof(uint32_t)) {
+		mlog(LV_WARN, "W-1556: garbage in %s; review and delete", temp_path.c_str());
+		return true;
+	}
+	pcontext->pcontrol->bound_type = le32p_to_cpu(ptr);
+	ptr += sizeof(uint32_t);
+	size -= sizeof(uint32_t);
+	if (size < sizeof(uint32_t)) {
+		mlog(LV_WARN, "W-1557: garbage in %s; review and delete", temp_path.c_str());
+		return true;
+	}
+	pcontext->pcontrol->is_spam = le32p_to_cpu(ptr);
+	ptr += sizeof(uint32_t);
+	size -= sizeof(uint32_t);
+	if (size < sizeof(uint32_t)) {
+		mlog(LV_WARN, "W-1558: garbage in %s; review and delete", temp_path.c_str());
+		return true;
+	}
+	pcontext->pcontrol->need_bounce = le32p_to_cpu(ptr);
+	ptr += sizeof(uint32_t);
+	size -= sizeof(uint32_t);
 
-			if (size == 0)
-				mlog(LV_WARN, "W-1559: garbage in %s; review and delete", temp_path.c_str());
-			auto zlen = strnlen(ptr, size);
-			if (zlen > INT32_MAX)
-				zlen = INT32_MAX;
-			snprintf(pcontext->pcontrol->from, arsizeof(pcontext->pcontrol->from),
-			         "%.*s", static_cast<int>(zlen), ptr);
-			snprintf(temp_from, arsizeof(temp_from),
-			         "%.*s", static_cast<int>(zlen), ptr);
-			ptr += zlen;
-			size -= zlen;
-			if (size == 0 || *ptr != '\0')
-				mlog(LV_WARN, "W-1570: garbage in %s; review and delete", temp_path.c_str());
-			++ptr;
-			--size;
+	if (size == 0)
+		mlog(LV_WARN, "W-1559: garbage in %s; review and delete", temp_path.c_str());
+	auto zlen = strnlen(ptr, size);
+	if (zlen > INT32_MAX)
+		zlen = INT32_MAX;
+	snprintf(pcontext->pcontrol->from, arsizeof(pcontext->pcontrol->from),
+	         "%.*s", static_cast<int>(zlen), ptr);
+	snprintf(temp_from, arsizeof(temp_from),
+	         "%.*s", static_cast<int>(zlen), ptr);
+	ptr += zlen;
+	size -= zlen;
+	if (size == 0 || *ptr != '\0')
+		mlog(LV_WARN, "W-1570: garbage in %s; review and delete", temp_path.c_str());
+	++ptr;
+	--size;
 
-			if (size == 0)
-				mlog(LV_WARN, "W-1590: garbage in %s; review and delete", temp_path.c_str());
-			zlen = strnlen(ptr, size);
-			/* Need \0 for going on */
-			int deliv_ret;
-			if (zlen == size) {
-				mlog(LV_WARN, "W-1591: garbage in %s; review and delete", temp_path.c_str());
-				deliv_ret = DELIVERY_OPERATION_ERROR;
-			} else {
-				pcontext->pcontrol->f_rcpt_to.clear();
-				pcontext->pcontrol->f_rcpt_to.writeline(ptr);
-				gx_strlcpy(temp_rcpt, ptr, arsizeof(temp_rcpt));
+	if (size == 0)
+		mlog(LV_WARN, "W-1590: garbage in %s; review and delete", temp_path.c_str());
+	zlen = strnlen(ptr, size);
+	/* Need \0 for going on */
+	int deliv_ret;
+	if (zlen == size) {
+		mlog(LV_WARN, "W-1591: garbage in %s; review and delete", temp_path.c_str());
+		deliv_ret = DELIVERY_OPERATION_ERROR;
+	} else {
+		pcontext->pcontrol->f_rcpt_to.clear();
+		pcontext->pcontrol->f_rcpt_to.writeline(ptr);
+		gx_strlcpy(temp_rcpt, ptr, arsizeof(temp_rcpt));
 
-				if (static_cast<unsigned int>(g_retrying_times) <= times) {
-					need_bounce = TRUE;
-					need_remove = TRUE;
-					bounce_type = "BOUNCE_OPERATION_ERROR";
-				} else {
-					need_bounce = FALSE;
-					need_remove = FALSE;
-				}
-				deliv_ret = exmdb_local_deliverquota(pcontext, ptr);
-			}
-			switch (deliv_ret) {
-			case DELIVERY_OPERATION_OK:
-				need_bounce = FALSE;
-				need_remove = TRUE;
-				net_failure_statistic(1, 0, 0, 0);
-				break;
-			case DELIVERY_OPERATION_DELIVERED:
-				bounce_type = "BOUNCE_MAIL_DELIVERED";
-				need_bounce = TRUE;
-				need_remove = TRUE;
-				net_failure_statistic(1, 0, 0, 0);
-				break;
-			case DELIVERY_NO_USER:
-				bounce_type = "BOUNCE_NO_USER";
-			    need_bounce = TRUE;
-				need_remove = TRUE;
-				net_failure_statistic(0, 0, 0, 1);
-				break;
-			case DELIVERY_MAILBOX_FULL:
-				bounce_type = "BOUNCE_MAILBOX_FULL";
-			    need_bounce = TRUE;
-				need_remove = TRUE;
-			    break;
-			case DELIVERY_OPERATION_ERROR:
-				bounce_type = "BOUNCE_OPERATION_ERROR";
-				need_bounce = TRUE;
-				need_remove = TRUE;
-				net_failure_statistic(0, 0, 1, 0);
-				break;
-			case DELIVERY_OPERATION_FAILURE:
-				net_failure_statistic(0, 1, 0, 0);
-				break;
-			}
-			if (!need_remove) {
-				/* rewrite type and until time */
-				lseek(fd.get(), 0, SEEK_SET);
-				times = cpu_to_le32(times + 1);
-				if (write(fd.get(), &times, sizeof(uint32_t)) != sizeof(uint32_t) ||
-				    fd.close_wr() < 0)
-					mlog(LV_ERR, "exmdb_local: error while updating "
-						"times");
-			}
-			fd.close_rd();
-			if (need_remove && remove(temp_path.c_str()) < 0 && errno != ENOENT)
-				mlog(LV_WARN, "W-1432: remove %s: %s",
-				        temp_path.c_str(), strerror(errno));
-			need_bounce &= pcontext->pcontrol->need_bounce;
-			
-			if (need_bounce && strcasecmp(pcontext->pcontrol->from, "none@none") != 0) {
-				pbounce_context = get_context();
-				if (NULL == pbounce_context) {
-					exmdb_local_log_info(pcontext, ptr, LV_ERR, "fail to get one "
-						"context for bounce mail");
-				} else if (!bounce_audit_check(temp_rcpt)) {
-					exmdb_local_log_info(pcontext, ptr, LV_ERR, "will not "
-						"produce bounce message, because of too many "
-						"mails to %s", temp_rcpt);
-					put_context(pbounce_context);
-				} else if (!exml_bouncer_make(temp_from,
-				    temp_rcpt, pcontext->pmail, original_time,
-				    bounce_type, pbounce_context->pmail)) {
-					exmdb_local_log_info(pcontext, ptr, LV_ERR,
-						"error during exml_bouncer_make for %s",
-						temp_rcpt);
-					put_context(pbounce_context);
-				} else {
-					sprintf(pbounce_context->pcontrol->from,
-					        "postmaster@%s", get_default_domain());
-					pbounce_context->pcontrol->f_rcpt_to.writeline(pcontext->pcontrol->from);
-					enqueue_context(pbounce_context);
-				}
-			}
-			free(pbuff);
+		if (static_cast<unsigned int>(g_retrying_times) <= times) {
+			need_bounce = TRUE;
+			need_remove = TRUE;
+			bounce_type = "BOUNCE_OPERATION_ERROR";
+		} else {
+			need_bounce = FALSE;
+			need_remove = FALSE;
 		}
-		time(&scan_end);
-		if (scan_end - scan_begin >= g_scan_interval) {
-			scan_interval = 0;
+		deliv_ret = exmdb_local_deliverquota(pcontext, ptr);
+	}
+	switch (deliv_ret) {
+	case DELIVERY_OPERATION_OK:
+		need_bounce = FALSE;
+		need_remove = TRUE;
+		net_failure_statistic(1, 0, 0, 0);
+		break;
+	case DELIVERY_OPERATION_DELIVERED:
+		bounce_type = "BOUNCE_MAIL_DELIVERED";
+		need_bounce = TRUE;
+		need_remove = TRUE;
+		net_failure_statistic(1, 0, 0, 0);
+		break;
+	case DELIVERY_NO_USER:
+		bounce_type = "BOUNCE_NO_USER";
+	    need_bounce = TRUE;
+		need_remove = TRUE;
+		net_failure_statistic(0, 0, 0, 1);
+		break;
+	case DELIVERY_MAILBOX_FULL:
+		bounce_type = "BOUNCE_MAILBOX_FULL";
+	    need_bounce = TRUE;
+		need_remove = TRUE;
+	    break;
+	case DELIVERY_OPERATION_ERROR:
+		bounce_type = "BOUNCE_OPERATION_ERROR";
+		need_bounce = TRUE;
+		need_remove = TRUE;
+		net_failure_statistic(0, 0, 1, 0);
+		break;
+	case DELIVERY_OPERATION_FAILURE:
+		net_failure_statistic(0, 1, 0, 0);
+		break;
+	}
+	if (!need_remove) {
+		/* rewrite type and until time */
+		lseek(fd.get(), 0, SEEK_SET);
+		times = cpu_to_le32(times + 1);
+		if (write(fd.get(), &times, sizeof(uint32_t)) != sizeof(uint32_t) ||
+		    fd.close_wr() < 0)
+			mlog(LV_ERR, "exmdb_local: error while updating "
+				"times");
+	}
+	fd.close_rd();
+	if (need_remove && remove(temp_path.c_str()) < 0 && errno != ENOENT)
+		mlog(LV_WARN, "W-1432: remove %s: %s",
+		        temp_path.c_str(), strerror(errno));
+	need_bounce &= pcontext->pcontrol->need_bounce;
+	
+	if (need_bounce && strcasecmp(pcontext->pcontrol->from, "none@none") != 0) {
+		pbounce_context = get_context();
+		if (NULL == pbounce_context) {
+			exmdb_local_log_info(pcontext, ptr, LV_ERR, "fail to get one "
+				"context for bounce mail");
+		} else if (!bounce_audit_check(temp_rcpt)) {
+			exmdb_local_log_info(pcontext, ptr, LV_ERR, "will not "
+				"produce bounce message, because of too many "
+				"mails to %s", temp_rcpt);
+			put_context(pbounce_context);
+		} else if (!exml_bouncer_make(temp_from,
+		    temp_rcpt, pcontext->pmail, original_time,
+		    bounce_type, pbounce_context->pmail)) {
+			exmdb_local_log_info(pcontext, ptr, LV_ERR,
+				"error during exml_bouncer_make for %s",
+				temp_rcpt);
+			put_context(pbounce_context);
 		} else {
-			scan_interval = g_scan_interval - (scan_end - scan_begin);
+			sprintf(pbounce_context->pcontrol->from,
+			        "postmaster@%s", get_default_domain());
+			pbounce_context->pcontrol->f_rcpt_to.writeline(pcontext->pcontrol->from);
+			enqueue_context(pbounce_context);
+		}
+	}
+	return !need_remove;
+}
+
+static void *mdl_thrwork(void *arg)
+{
+	auto pcontext = get_context();
+	if (NULL == pcontext) {
+		mlog(LV_ERR, "exmdb_local: failed to get context in cache queue thread");
+		return nullptr;
+	}
+	std::unique_lock hold(g_due_lock);
+	while (!g_notify_stop) {
+		if (g_due_list.empty()) {
+			g_due_cond.wait(hold);
+			continue;
+		}
+		auto [due, mess_id] = g_due_list.top();
+		if (due > time(nullptr)) {
+			g_due_cond.wait_until(hold, std::chrono::system_clock::from_time_t(due));
+			continue;
 		}
-		i = 0;
+		g_due_list.pop();
+		hold.unlock();
+		if (cache_queue_deliver(pcontext, mess_id))
+			cache_queue_schedule(mess_id);
+		hold.lock();
 	}
 	return NULL;
 }
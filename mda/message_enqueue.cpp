@@ -2,12 +2,15 @@
 // SPDX-FileCopyrightText: 2020–2021 grommunio GmbH
 // This file is part of Gromox.
 /*
- *  mail queue have two parts, mess, message queue.when a mail 
+ *  mail queue have two parts, mess, notify socket. when a mail
  *	is put into mail queue, and create a file in mess directory and write the
- *  mail into file. after mail is saved, system will send a message to
- *  message queue to indicate there's a new mail arrived!
+ *  mail into file. completed mails are committed in groups: writeback of
+ *  all files of the batch is started, then waited for once, then a single
+ *  datagram to delivery's token.sock naming all of the batch's mess IDs,
+ *  and only then are the SMTP sessions answered.
  */
 #include <cerrno>
+#include <chrono>
 #include <csignal>
 #include <cstdio>
 #include <cstring>
@@ -20,11 +23,11 @@
 #include <unistd.h>
 #include <utility>
 #include <libHX/string.h>
-#include <sys/ipc.h>
 #include <sys/mman.h>
-#include <sys/msg.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <gromox/atomic.hpp>
 #include <gromox/common_types.hpp>
 #include <gromox/config_file.hpp>
@@ -36,38 +39,29 @@
 #include <gromox/plugin.hpp>
 #include <gromox/stream.hpp>
 #include <gromox/util.hpp>
-#define TOKEN_MESSAGE_QUEUE     1
 #define MAX_LINE_LENGTH			64*1024
+#define MAX_COMMIT_BATCH		64
+#define MAX_NOTIFY_TRIES		5
+
+static constexpr auto COMMIT_WINDOW = std::chrono::milliseconds(5);
 
 using namespace std::string_literals;
 using namespace gromox;
 
-enum {
-	MESSAGE_MESS = 2,
-};
-
 enum {
 	SMTP_IN = 1,
 	SMTP_OUT,
 	SMTP_RELAY
 };
 
-namespace {
-
-struct MSG_BUFF {
-    long msg_type;
-    int msg_content;
-};
-
-}
-
 static void *meq_thrwork(void *);
 static BOOL message_enqueue_check();
 static int message_enqueue_retrieve_max_ID();
 static BOOL message_enqueue_try_save_mess(FLUSH_ENTITY *);
 
 static char         g_path[256];
-static int			g_msg_id;
+static int g_notify_fd = -1, g_mess_dirfd = -1;
+static struct sockaddr_un g_notify_addr;
 static pthread_t    g_flushing_thread;
 static gromox::atomic_bool g_notify_stop;
 static int			g_last_flush_ID;
@@ -111,26 +105,29 @@ static void message_enqueue_init(const char *path)
  */
 static int message_enqueue_run()
 {
-	key_t k_msg;
     char name[256];
 
 	if (!message_enqueue_check())
 		return -1;
-	snprintf(name, GX_ARRAY_SIZE(name), "%s/token.ipc", g_path);
-	int fd = open(name, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
-	if (fd >= 0)
-		close(fd);
-    k_msg = ftok(name, TOKEN_MESSAGE_QUEUE);
-    if (-1 == k_msg) {
-		mlog(LV_ERR, "message_enqueue: ftok %s: %s", name, strerror(errno));
-        return -2;
-    }
-    /* create the message queue */
-    g_msg_id = msgget(k_msg, 0666|IPC_CREAT);
-    if (-1 == g_msg_id) {
-		mlog(LV_ERR, "message_enqueue: msgget: %s", strerror(errno));
-        return -6;
-    }
+	g_notify_addr.sun_family = AF_UNIX;
+	if (static_cast<size_t>(snprintf(g_notify_addr.sun_path,
+	    sizeof(g_notify_addr.sun_path), "%s/token.sock", g_path)) >=
+	    sizeof(g_notify_addr.sun_path)) {
+		mlog(LV_ERR, "message_enqueue: %s: path too long for a socket", g_path);
+		return -2;
+	}
+	/* delivery need not be up yet; it rescans mess/ when it starts */
+	g_notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (g_notify_fd < 0) {
+		mlog(LV_ERR, "message_enqueue: socket: %s", strerror(errno));
+		return -6;
+	}
+	snprintf(name, GX_ARRAY_SIZE(name), "%s/mess", g_path);
+	g_mess_dirfd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (g_mess_dirfd < 0) {
+		mlog(LV_ERR, "message_enqueue: open %s: %s", name, strerror(errno));
+		return -6;
+	}
     g_last_flush_ID = message_enqueue_retrieve_max_ID();
 	g_notify_stop = false;
 	auto ret = pthread_create(&g_flushing_thread, nullptr, meq_thrwork, nullptr);
@@ -177,7 +174,12 @@ static void message_enqueue_free()
 	g_notify_stop = true;
     g_last_flush_ID = 0;
 	g_last_pos = 0;
-	g_msg_id = -1;
+	if (g_notify_fd >= 0)
+		close(g_notify_fd);
+	g_notify_fd = -1;
+	if (g_mess_dirfd >= 0)
+		close(g_mess_dirfd);
+	g_mess_dirfd = -1;
 }
 
 /*
@@ -223,30 +225,138 @@ static BOOL message_enqueue_check() try
 	return false;
 }
 
+/*
+ * Wake delivery. The socket is non-blocking so that a stalled delivery
+ * cannot hold up SMTP sessions; a full receive queue (EAGAIN) is retried
+ * with a short backoff (1+2+4+8 ms). Should delivery still not keep up,
+ * or not run at all, the mails are picked up by its rescan of mess/,
+ * which happens at startup and after every idle second.
+ */
+static void message_enqueue_notify(const uint32_t *ids, size_t count)
+{
+	for (unsigned int i = 0; i < MAX_NOTIFY_TRIES; ++i) {
+		if (i > 0)
+			usleep(1000 << (i - 1));
+		if (sendto(g_notify_fd, ids, count * sizeof(uint32_t), 0,
+		    reinterpret_cast<const sockaddr *>(&g_notify_addr),
+		    sizeof(g_notify_addr)) >= 0)
+			return;
+		if (errno == ENOENT || errno == ECONNREFUSED)
+			/* delivery not running */
+			return;
+		if (errno != EAGAIN && errno != EINTR)
+			break;
+	}
+	mlog(LV_WARN, "W-2187: sendto %s: %s; leaving the mails to the rescan",
+	        g_notify_addr.sun_path, strerror(errno));
+}
+
+static void message_enqueue_commit(std::list<FLUSH_ENTITY> &batch)
+{
+	if (batch.empty())
+		return;
+	/*
+	 * Group commit: writeback of every file of the batch is only started,
+	 * so the device gets the whole group at once, and a single syncfs
+	 * then waits for all of it, including the new directory entries and
+	 * one cache flush. (It also writes out whatever else is dirty on the
+	 * spool's filesystem.)
+	 */
+	bool dir_ok = true;
+	for (auto &e : batch) {
+		auto fp = static_cast<FILE *>(e.pflusher->flush_ptr);
+		if (fp == nullptr)
+			continue;
+#ifdef __linux__
+		if (sync_file_range(fileno(fp), 0, 0, SYNC_FILE_RANGE_WRITE) != 0) {
+			mlog(LV_ERR, "message_enqueue: sync_file_range mess/%d: %s",
+			        e.pflusher->flush_ID, strerror(errno));
+			e.pflusher->flush_result = FLUSH_TEMP_FAIL;
+		}
+#else
+		if (fdatasync(fileno(fp)) != 0) {
+			mlog(LV_ERR, "message_enqueue: fdatasync mess/%d: %s",
+			        e.pflusher->flush_ID, strerror(errno));
+			e.pflusher->flush_result = FLUSH_TEMP_FAIL;
+		}
+#endif
+		fclose(fp);
+		e.pflusher->flush_ptr = nullptr;
+	}
+#ifdef __linux__
+	if (syncfs(g_mess_dirfd) != 0) {
+		mlog(LV_ERR, "message_enqueue: syncfs mess/: %s", strerror(errno));
+		dir_ok = false;
+	}
+#else
+	if (fsync(g_mess_dirfd) != 0) {
+		mlog(LV_ERR, "message_enqueue: fsync mess/: %s", strerror(errno));
+		dir_ok = false;
+	}
+#endif
+	uint32_t ids[MAX_COMMIT_BATCH];
+	size_t count = 0;
+	for (const auto &e : batch)
+		if (dir_ok && e.pflusher->flush_result != FLUSH_TEMP_FAIL)
+			ids[count++] = e.pflusher->flush_ID;
+	if (count > 0)
+		message_enqueue_notify(ids, count);
+	while (!batch.empty()) {
+		std::list<FLUSH_ENTITY> entlist;
+		entlist.splice(entlist.end(), batch, batch.begin());
+		auto pflusher = entlist.front().pflusher;
+		if (dir_ok && pflusher->flush_result != FLUSH_TEMP_FAIL) {
+			pflusher->flush_result = FLUSH_RESULT_OK;
+			g_enqueued_num ++;
+		} else {
+			/* the client will retry; do not let delivery find it too */
+			auto name = g_path + "/mess/"s + std::to_string(pflusher->flush_ID);
+			if (remove(name.c_str()) < 0 && errno != ENOENT)
+				mlog(LV_WARN, "W-2188: remove %s: %s", name.c_str(), strerror(errno));
+			pflusher->flush_result = FLUSH_TEMP_FAIL;
+		}
+		feedback_entity(std::move(entlist));
+	}
+}
+
 static void *meq_thrwork(void *arg)
 {
-	MSG_BUFF msg;
+	std::list<FLUSH_ENTITY> batch;
+	auto batch_start = std::chrono::steady_clock::now();
 
 	while (!g_notify_stop) {
 		auto entlist = get_from_queue(); /* always size 1 */
 		if (entlist.size() == 0) {
+			/* nothing else arrived: no point holding the batch back */
+			if (!batch.empty()) {
+				message_enqueue_commit(batch);
+				continue;
+			}
             usleep(50000);
             continue;
         }
 		auto pentity = &entlist.front();
-		if (message_enqueue_try_save_mess(pentity)) {
-			if (FLUSH_WHOLE_MAIL == pentity->pflusher->flush_action) {
-    			msg.msg_type = MESSAGE_MESS;
-    			msg.msg_content = pentity->pflusher->flush_ID;
-				msgsnd(g_msg_id, &msg, sizeof(uint32_t), IPC_NOWAIT);
-				g_enqueued_num ++;
-			}
-			pentity->pflusher->flush_result = FLUSH_RESULT_OK;
-		} else {
+		if (!message_enqueue_try_save_mess(pentity)) {
 			pentity->pflusher->flush_result = FLUSH_TEMP_FAIL;
+			feedback_entity(std::move(entlist));
+			continue;
 		}
-		feedback_entity(std::move(entlist));
+		if (FLUSH_WHOLE_MAIL != pentity->pflusher->flush_action) {
+			pentity->pflusher->flush_result = FLUSH_RESULT_OK;
+			feedback_entity(std::move(entlist));
+			continue;
+		}
+		/* set by message_enqueue_commit on a failed sync */
+		pentity->pflusher->flush_result = FLUSH_RESULT_OK;
+		auto now = std::chrono::steady_clock::now();
+		if (batch.empty())
+			batch_start = now;
+		batch.splice(batch.end(), entlist);
+		if (batch.size() >= MAX_COMMIT_BATCH ||
+		    now - batch_start >= COMMIT_WINDOW)
+			message_enqueue_commit(batch);
 	}
+	message_enqueue_commit(batch);
 	return NULL;
 }
 
@@ -359,10 +469,10 @@ BOOL message_enqueue_try_save_mess(FLUSH_ENTITY *pentity)
 	*tmp_buff = 0;
 	fwrite(tmp_buff, 1, 1, fp);
 	fseek(fp, SEEK_SET, 0);
-	if (fwrite(&mess_len, 1, sizeof(uint64_t), fp) != sizeof(uint64_t))
+	if (fwrite(&mess_len, 1, sizeof(uint64_t), fp) != sizeof(uint64_t) ||
+	    fflush(fp) != 0)
 		goto REMOVE_MESS;
-    fclose(fp);
-	pentity->pflusher->flush_ptr = NULL;
+	/* stays open; message_enqueue_commit syncs and closes it */
 	return TRUE;
 
  REMOVE_MESS:
@@ -57,7 +57,9 @@ static constexpr cfg_directive smtp_cfg_defaults[] = {
 	{"config_file_path", PKGSYSCONFDIR "/smtp:" PKGSYSCONFDIR},
 	{"context_average_mem", "256K", CFG_SIZE, "64K"},
 	{"context_max_mem", "2M", CFG_SIZE},
+	{"context_poll_shards", "0", CFG_SIZE, "0", "64"},
 	{"data_file_path", PKGDATADIR "/smtp:" PKGDATADIR},
+	{"lda_listen_acceptors", "1", CFG_SIZE, "1", "64"},
 	{"lda_listen_addr", "::"},
 	{"lda_listen_port", "25"},
 	{"lda_listen_tls_port", "0"},
@@ -252,7 +254,8 @@ int main(int argc, const char **argv) try
 		scfg.cmd_prot = 0;
 
 	listener_init(g_config_file->get_value("lda_listen_addr"),
-		listen_port, listen_tls_port);
+		listen_port, listen_tls_port,
+		g_config_file->get_ll("lda_listen_acceptors"));
 	if (0 != listener_run()) {
 		mlog(LV_ERR, "system: failed to start listener");
 		return EXIT_FAILURE;
@@ -313,7 +316,8 @@ int main(int argc, const char **argv) try
 	contexts_pool_init(smtp_parser_get_contexts_list(), scfg.context_num,
 		smtp_parser_get_context_socket,
 		smtp_parser_get_context_timestamp,
-		thread_charge_num, scfg.timeout);
+		thread_charge_num, scfg.timeout,
+		g_config_file->get_ll("context_poll_shards"));
  
 	if (0 != contexts_pool_run()) { 
 		mlog(LV_ERR, "system: failed to start context pool");
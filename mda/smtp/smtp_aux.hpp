@@ -17,7 +17,7 @@ extern int flusher_run();
 extern void flusher_stop();
 BOOL flusher_put_to_queue(SMTP_CONTEXT *pcontext);
 void flusher_cancel(SMTP_CONTEXT *pcontext);
-extern void listener_init(const char *addr, uint16_t port, uint16_t ssl_port);
+extern void listener_init(const char *addr, uint16_t port, uint16_t ssl_port, unsigned int acceptors);
 extern int listener_run();
 extern int listener_trigger_accept();
 extern void listener_stop_accept();
@@ -62,6 +62,7 @@ enum {
 	IMAP_RETRIEVE_ERROR
 };
 
+struct imap_zstream;
 struct MJSON_MIME;
 struct XARRAY;
 struct XARRAY_UNIT;
@@ -92,8 +93,12 @@ struct imap_context final : public schedule_context {
 	NOMOVE(imap_context);
 	/* a.k.a. is_login in pop3 */
 	inline bool is_authed() const { return proto_stat >= PROTO_STAT_AUTH; }
+	/* client I/O, passing through the COMPRESS layer when it is active */
+	ssize_t read(void *, size_t);
+	ssize_t write(const void *, size_t);
 
 	GENERIC_CONNECTION connection;
+	std::unique_ptr<imap_zstream> zstrm; /* RFC 4978 */
 	std::string mid, file_path;
 	DOUBLE_LIST_NODE hash_node{}, sleeping_node{};
 	int proto_stat = 0, sched_stat = 0;
@@ -104,6 +109,7 @@ struct imap_context final : public schedule_context {
 	char selected_folder[1024]{};
 	BOOL b_readonly = false; /* is selected folder read only, this is for the examine command */
 	BOOL b_modify = false;
+	bool b_condstore = false, b_qresync = false; /* RFC 7162 ENABLEd */
 	MEM_FILE f_flags{};
 	char tag_string[32]{};
 	int command_len = 0;
@@ -132,6 +138,7 @@ extern void imap_parser_modify_flags(IMAP_CONTEXT *, const char *mid_string);
 extern void imap_parser_add_select(IMAP_CONTEXT *);
 extern void imap_parser_remove_select(IMAP_CONTEXT *);
 extern  void imap_parser_safe_write(IMAP_CONTEXT *, const void *pbuff, size_t count);
+extern int imap_parser_start_deflate(IMAP_CONTEXT *, const char *tag);
 extern alloc_limiter<file_block> *imap_parser_get_allocator();
 extern std::shared_ptr<MIME_POOL> imap_parser_get_mpool();
 /* get allocator for mjson mime */
@@ -143,6 +150,8 @@ extern void imap_parser_log_info(IMAP_CONTEXT *, int level, const char *format,
 extern void imap_cmd_parser_clsfld(IMAP_CONTEXT *);
 extern int imap_cmd_parser_capability(int argc, char **argv, IMAP_CONTEXT *);
 extern int imap_cmd_parser_id(int argc, char **argv, IMAP_CONTEXT *);
+extern int imap_cmd_parser_enable(int argc, char **argv, IMAP_CONTEXT *);
+extern int imap_cmd_parser_compress(int argc, char **argv, IMAP_CONTEXT *);
 extern int imap_cmd_parser_noop(int argc, char **argv, IMAP_CONTEXT *);
 extern int imap_cmd_parser_logout(int argc, char **argv, IMAP_CONTEXT *);
 extern int imap_cmd_parser_starttls(int argc, char **argv, IMAP_CONTEXT *);
@@ -180,7 +189,7 @@ extern int imap_cmd_parser_uid_copy(int argc, char **argv, IMAP_CONTEXT *);
 extern int imap_cmd_parser_uid_expunge(int argc, char **argv, IMAP_CONTEXT *);
 extern int imap_cmd_parser_dval(int argc, char **argv, IMAP_CONTEXT *, unsigned int res);
 
-extern void listener_init(const char *addr, uint16_t port, uint16_t port_ssl);
+extern void listener_init(const char *addr, uint16_t port, uint16_t port_ssl, unsigned int acceptors);
 extern int listener_run();
 extern int listener_trigger_accept();
 extern void listener_stop_accept();
@@ -205,7 +214,7 @@ extern BOOL (*system_services_add_user_into_temp_list)(const char *, int);
 extern authmgr_login_t system_services_auth_login;
 extern int (*system_services_get_id)(const char *, const char *, const char *, unsigned int *);
 extern int (*system_services_get_uid)(const char *, const char *, const char *, unsigned int *);
-extern int (*system_services_summary_folder)(const char *, const char *, int *, int *, int *, unsigned long*, unsigned int *, int *, int *);
+extern int (*system_services_summary_folder)(const char *, const char *, int *, int *, int *, unsigned long*, unsigned int *, int *, uint64_t *, int *);
 extern int (*system_services_make_folder)(const char *, const char *, int *);
 extern int (*system_services_remove_folder)(const char *, const char *, int *);
 extern int (*system_services_rename_folder)(const char *, const char *, const char *, int *);
@@ -223,10 +232,13 @@ extern int (*system_services_fetch_simple)(const char *, const char *, const DOU
 extern int (*system_services_fetch_detail)(const char *, const char *, const DOUBLE_LIST *, XARRAY *, int *);
 extern int (*system_services_fetch_simple_uid)(const char *, const char *, const DOUBLE_LIST *, XARRAY *, int *);
 extern int (*system_services_fetch_detail_uid)(const char *, const char *, const DOUBLE_LIST *, XARRAY *, int *);
+extern int (*system_services_fetch_changed_uid)(const char *, const char *, const DOUBLE_LIST *, uint64_t, XARRAY *, int *);
+extern int (*system_services_fetch_changed)(const char *, const char *, const DOUBLE_LIST *, uint64_t, XARRAY *, int *);
+extern int (*system_services_list_vanished)(const char *, const char *, uint64_t, std::string &, int *);
 extern void (*system_services_free_result)(XARRAY *);
 extern int (*system_services_set_flags)(const char *, const char *, const char *, int, int *);
 extern int (*system_services_unset_flags)(const char *, const char *, const char *, int, int *);
-extern int (*system_services_get_flags)(const char *, const char *, const char *, int *, int *);
+extern int (*system_services_get_flags)(const char *, const char *, const char *, int *, uint64_t *, int *);
 extern int (*system_services_copy_mail)(const char *, const char *, const char *, const char *, char *, int *);
 extern int (*system_services_search)(const char *, const char *, const char *, int, char **, std::string &, int *);
 extern int (*system_services_search_uid)(const char *, const char *, const char *, int, char **, std::string &, int *);
@@ -9,12 +9,15 @@
 #endif
 #include <atomic>
 #include <cerrno>
+#include <climits>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <fcntl.h>
 #include <memory>
 #include <string>
 #include <unistd.h>
+#include <vector>
 #include <libHX/ctype_helper.h>
 #include <libHX/string.h>
 #include <sys/stat.h>
@@ -180,6 +183,80 @@ static BOOL imap_cmd_parser_parse_sequence(DOUBLE_LIST *plist,
 	return TRUE;
 }
 
+/**
+ * Turn an ascending list of numbers into an IMAP sequence-set
+ * ("1:3,7,9:10").
+ */
+static std::string imap_cmd_parser_compress_set(const std::vector<unsigned int> &v)
+{
+	std::string out;
+	for (size_t i = 0; i < v.size(); ) {
+		size_t j = i;
+		while (j + 1 < v.size() && v[j+1] == v[j] + 1)
+			++j;
+		if (!out.empty())
+			out += ',';
+		out += std::to_string(v[i]);
+		if (j != i) {
+			out += ':';
+			out += std::to_string(v[j]);
+		}
+		i = j + 1;
+	}
+	return out;
+}
+
+/**
+ * Reduce a UID set as produced by midb (no "*") to those members which
+ * are also part of @plist.
+ */
+static std::string imap_cmd_parser_clip_uidset(const std::string &set,
+    DOUBLE_LIST *plist)
+{
+	std::vector<unsigned int> v;
+	const char *p = set.c_str();
+	while (*p != '\0') {
+		char *end = nullptr;
+		unsigned int lo = strtoul(p, &end, 10), hi = lo;
+		if (end == p)
+			break;
+		if (*end == ':')
+			hi = strtoul(end + 1, &end, 10);
+		for (auto uid = lo; uid <= hi && uid != 0; ++uid)
+			if (imap_cmd_parser_hint_sequence(plist, uid, UINT_MAX))
+				v.push_back(uid);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return imap_cmd_parser_compress_set(v);
+}
+
+/**
+ * Parse an RFC 7162 command modifier of the form "(NAME modseq)", or, when
+ * @pb_vanished is given, "(NAME modseq [VANISHED])".
+ */
+static bool imap_cmd_parser_modseq_arg(char *arg, const char *name,
+    uint64_t *pmodseq, bool *pb_vanished)
+{
+	char *targv[8], *end = nullptr;
+	auto len = strlen(arg);
+	if (len < 2 || arg[0] != '(' || arg[len-1] != ')')
+		return false;
+	auto targc = parse_imap_args(arg + 1, len - 2, targv, arsizeof(targv));
+	if (targc < 2 || strcasecmp(targv[0], name) != 0)
+		return false;
+	*pmodseq = strtoull(targv[1], &end, 10);
+	if (end == targv[1] || *end != '\0')
+		return false;
+	if (pb_vanished != nullptr)
+		*pb_vanished = false;
+	for (int i = 2; i < targc; ++i) {
+		if (pb_vanished == nullptr || strcasecmp(targv[i], "VANISHED") != 0)
+			return false;
+		*pb_vanished = true;
+	}
+	return true;
+}
+
 static void imap_cmd_parser_find_arg_node(DOUBLE_LIST *plist,
 	const char *arg_name, DOUBLE_LIST *plist_to)
 {
@@ -246,6 +323,7 @@ static BOOL imap_cmd_parser_parse_fetch_args(DOUBLE_LIST *plist,
 			0 == strcasecmp(argv[i], "ENVELOPE") ||
 			0 == strcasecmp(argv[i], "FLAGS") ||
 			0 == strcasecmp(argv[i], "INTERNALDATE") ||
+			0 == strcasecmp(argv[i], "MODSEQ") ||
 			0 == strcasecmp(argv[i], "RFC822") ||
 			0 == strcasecmp(argv[i], "RFC822.HEADER") ||
 			0 == strcasecmp(argv[i], "RFC822.SIZE") ||
@@ -400,6 +478,7 @@ static BOOL imap_cmd_parser_parse_fetch_args(DOUBLE_LIST *plist,
 	double_list_init(&temp_list);
 	imap_cmd_parser_find_arg_node(plist, "UID", &temp_list);
 	imap_cmd_parser_find_arg_node(plist, "FLAGS", &temp_list);
+	imap_cmd_parser_find_arg_node(plist, "MODSEQ", &temp_list);
 	imap_cmd_parser_find_arg_node(plist, "INTERNALDATE", &temp_list);
 	imap_cmd_parser_find_arg_node(plist, "RFC822.SIZE", &temp_list);
 	imap_cmd_parser_find_arg_node(plist, "ENVELOPE", &temp_list);
@@ -713,6 +792,24 @@ static int imap_cmd_parser_print_structure(IMAP_CONTEXT *pcontext,
 	return buff_len;
 }
 
+/**
+ * Returns whether the fetch item list has MODSEQ, optionally adding it
+ * (by way of the spare node @spare) when it is absent.
+ */
+static bool imap_cmd_parser_want_modseq(DOUBLE_LIST *plist,
+    DOUBLE_LIST_NODE *spare)
+{
+	for (auto pnode = double_list_get_head(plist); pnode != nullptr;
+	     pnode = double_list_get_after(plist, pnode))
+		if (strcasecmp(static_cast<char *>(pnode->pdata), "MODSEQ") == 0)
+			return true;
+	if (spare == nullptr)
+		return false;
+	spare->pdata = deconst("MODSEQ");
+	double_list_append_as_tail(plist, spare);
+	return true;
+}
+
 static int imap_cmd_parser_process_fetch_item(IMAP_CONTEXT *pcontext,
 	BOOL b_data, MITEM *pitem, int item_id, DOUBLE_LIST *pitem_list)
 {
@@ -887,6 +984,10 @@ static int imap_cmd_parser_process_fetch_item(IMAP_CONTEXT *pcontext,
 		} else if (strcasecmp(kw, "UID") == 0) {
 			buff_len += gx_snprintf(buff + buff_len,
 			            arsizeof(buff) - buff_len, "UID %d", pitem->uid);
+		} else if (strcasecmp(kw, "MODSEQ") == 0) {
+			buff_len += gx_snprintf(buff + buff_len,
+			            arsizeof(buff) - buff_len, "MODSEQ (%llu)",
+			            static_cast<unsigned long long>(pitem->modseq));
 		} else if (strncasecmp(kw, "BODY[", 5) == 0 ||
 		    strncasecmp(kw, "BODY.PEEK[", 10) == 0) {
 			auto pbody = strchr(static_cast<char *>(pnode->pdata), '[');
@@ -996,6 +1097,8 @@ static void imap_cmd_parser_store_flags(const char *cmd, const char *mid,
 	char buff[1024];
 	int string_length;
 	char flags_string[128];
+	uint64_t modseq = 0;
+	bool b_echo = false;
 	
 	string_length = 0;
 	if (0 == strcasecmp(cmd, "FLAGS") ||
@@ -1006,15 +1109,13 @@ static void imap_cmd_parser_store_flags(const char *cmd, const char *mid,
 		system_services_set_flags(pcontext->maildir,
 			pcontext->selected_folder, mid, flag_bits, &errnum);
 		if (0 == strcasecmp(cmd, "FLAGS")) {
-			imap_cmd_parser_convert_flags_string(flag_bits, flags_string);
-			if (uid != 0)
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
-			else
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
+			b_echo = true;
+			if (pcontext->b_condstore || pcontext->b_qresync) {
+				int cur_bits;
+				system_services_get_flags(pcontext->maildir,
+					pcontext->selected_folder, mid, &cur_bits,
+					&modseq, &errnum);
+			}
 		}
 	} else if (0 == strcasecmp(cmd, "+FLAGS") ||
 		0 == strcasecmp(cmd, "+FLAGS.SILENT")) {
@@ -1022,37 +1123,33 @@ static void imap_cmd_parser_store_flags(const char *cmd, const char *mid,
 		pcontext->selected_folder, mid, flag_bits, &errnum);
 		if (0 == strcasecmp(cmd, "+FLAGS") && 
 			MIDB_RESULT_OK == system_services_get_flags(pcontext->maildir,
-		    pcontext->selected_folder, mid, &flag_bits, &errnum)) {
-			imap_cmd_parser_convert_flags_string(flag_bits, flags_string);
-			if (uid != 0)
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
-			else
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
-		}
+		    pcontext->selected_folder, mid, &flag_bits, &modseq, &errnum))
+			b_echo = true;
 	} else if (0 == strcasecmp(cmd, "-FLAGS") ||
 		0 == strcasecmp(cmd, "-FLAGS.SILENT")) {
 		system_services_unset_flags(pcontext->maildir,
 			pcontext->selected_folder, mid, flag_bits, &errnum);
 		if (0 == strcasecmp(cmd, "-FLAGS") &&
 			MIDB_RESULT_OK == system_services_get_flags(pcontext->maildir,
-		    pcontext->selected_folder, mid, &flag_bits, &errnum)) {
-			imap_cmd_parser_convert_flags_string(flag_bits, flags_string);
-			if (uid != 0)
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
-			else
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
-		}
+		    pcontext->selected_folder, mid, &flag_bits, &modseq, &errnum))
+			b_echo = true;
 	}
-	if (string_length != 0)
-		imap_parser_safe_write(pcontext, buff, string_length);
+	if (!b_echo)
+		return;
+	imap_cmd_parser_convert_flags_string(flag_bits, flags_string);
+	string_length = gx_snprintf(buff, arsizeof(buff),
+	                "* %d FETCH (FLAGS %s", id, flags_string);
+	if (uid != 0)
+		string_length += gx_snprintf(buff + string_length,
+		                 arsizeof(buff) - string_length, " UID %d", uid);
+	/* RFC 7162 §3.2.4 */
+	if (pcontext->b_condstore || pcontext->b_qresync)
+		string_length += gx_snprintf(buff + string_length,
+		                 arsizeof(buff) - string_length,
+		                 " MODSEQ (%llu)", static_cast<unsigned long long>(modseq));
+	string_length += gx_snprintf(buff + string_length,
+	                 arsizeof(buff) - string_length, ")\r\n");
+	imap_parser_safe_write(pcontext, buff, string_length);
 }
 
 static BOOL imap_cmd_parser_convert_imaptime(const char *str_time, time_t *ptime)
@@ -1318,6 +1415,15 @@ int imap_cmd_parser_starttls(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	return 1704;
 }
 
+int imap_cmd_parser_compress(int argc, char **argv, IMAP_CONTEXT *pcontext)
+{
+	if (!pcontext->is_authed())
+		return 1804;
+	if (argc != 3 || strcasecmp(argv[2], "DEFLATE") != 0)
+		return 1800;
+	return imap_parser_start_deflate(pcontext, argv[0]);
+}
+
 int imap_cmd_parser_authenticate(int argc, char **argv, IMAP_CONTEXT *pcontext)
 {
 	char buff[1024];
@@ -1476,7 +1582,7 @@ int imap_cmd_parser_idle(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	pcontext->sched_stat = SCHED_STAT_IDLING;
 	size_t len = 0;
 	auto reply = resource_get_imap_code(1602, 1, &len);
-	pcontext->connection.write(reply, len);
+	pcontext->write(reply, len);
 	return 0;
 }
 
@@ -1500,23 +1606,68 @@ static int m2icode(int r, int e)
 	}
 }
 
-int imap_cmd_parser_select(int argc, char **argv, IMAP_CONTEXT *pcontext)
+/**
+ * Common part of SELECT and EXAMINE, including the RFC 7162 CONDSTORE and
+ * QRESYNC select parameters.
+ */
+static int imap_cmd_parser_selex(int argc, char **argv,
+    IMAP_CONTEXT *pcontext, bool readonly) try
 {
 	int errnum;
 	int exists;
 	int recent;
 	unsigned int uidnext;
-	unsigned long uidvalid;
+	unsigned long uidvalid, qr_uidvalid = 0;
+	uint64_t highestmodseq = 0, qr_modseq = 0;
 	int firstunseen;
+	bool b_qresync = false;
 	size_t string_length = 0;
 	char temp_name[1024];
 	char buff[1024];
+	char *temp_argv[8], *qr_argv[8], *known_uids = nullptr;
+	DOUBLE_LIST list_known;
+	SEQUENCE_NODE known_nodes[1024];
     
 	if (!pcontext->is_authed())
 		return 1804;
 	if (argc < 3 || 0 == strlen(argv[2]) || strlen(argv[2]) >= 1024 ||
 	    !imap_cmd_parser_imapfolder_to_sysfolder(pcontext->lang, argv[2], temp_name))
 		return 1800;
+	if (argc >= 4) {
+		/* (CONDSTORE) or (QRESYNC (uidvalidity modseq [known-uids])) */
+		auto len = strlen(argv[3]);
+		if (len < 2 || argv[3][0] != '(' || argv[3][len-1] != ')')
+			return 1800;
+		auto temp_argc = parse_imap_args(argv[3] + 1, len - 2,
+		                 temp_argv, arsizeof(temp_argv));
+		if (temp_argc == 1 && strcasecmp(temp_argv[0], "CONDSTORE") == 0) {
+			pcontext->b_condstore = true;
+		} else if (temp_argc == 2 && strcasecmp(temp_argv[0], "QRESYNC") == 0 &&
+		    pcontext->b_qresync) {
+			len = strlen(temp_argv[1]);
+			if (len < 2 || temp_argv[1][0] != '(' ||
+			    temp_argv[1][len-1] != ')')
+				return 1800;
+			auto qr_argc = parse_imap_args(temp_argv[1] + 1, len - 2,
+			               qr_argv, arsizeof(qr_argv));
+			if (qr_argc < 2)
+				return 1800;
+			qr_uidvalid = strtoul(qr_argv[0], nullptr, 10);
+			qr_modseq = strtoull(qr_argv[1], nullptr, 10);
+			if (qr_uidvalid == 0 || qr_modseq == 0)
+				return 1800;
+			/* the optional sequence-match data is not used */
+			if (qr_argc >= 3 && qr_argv[2][0] != '(') {
+				if (!imap_cmd_parser_parse_sequence(&list_known,
+				    known_nodes, qr_argv[2]))
+					return 1800;
+				known_uids = qr_argv[2];
+			}
+			b_qresync = true;
+		} else {
+			return 1800;
+		}
+	}
 	if (PROTO_STAT_SELECT == pcontext->proto_stat) {
 		imap_parser_remove_select(pcontext);
 		pcontext->proto_stat = PROTO_STAT_AUTH;
@@ -1525,95 +1676,135 @@ int imap_cmd_parser_select(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	
 	auto ssr = system_services_summary_folder(pcontext->maildir, temp_name,
 	           &exists, &recent, nullptr, &uidvalid, &uidnext,
-	           &firstunseen, &errnum);
+	           &firstunseen, &highestmodseq, &errnum);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
 	strcpy(pcontext->selected_folder, temp_name);
 	pcontext->proto_stat = PROTO_STAT_SELECT;
-	pcontext->b_readonly = FALSE;
+	pcontext->b_readonly = readonly ? TRUE : FALSE;
 	imap_parser_add_select(pcontext);
+	string_length = gx_snprintf(buff, arsizeof(buff),
+		"* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
+		"%s"
+		"* %d EXISTS\r\n"
+		"* %d RECENT\r\n",
+		readonly ? "* OK [PERMANENTFLAGS ()] no permanenet flag permitted\r\n" :
+		"* OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)] limited\r\n",
+		exists, recent);
 	if (firstunseen != -1)
-		string_length = gx_snprintf(buff, arsizeof(buff),
-			"* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
-			"* OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)] limited\r\n"
-			"* %d EXISTS\r\n"
-			"* %d RECENT\r\n"
-			"* OK [UNSEEN %d] message %d is first unseen\r\n"
-			"* OK [UIDVALIDITY %u] UIDs valid\r\n"
-			"* OK [UIDNEXT %d] predicted next UID\r\n"
-			"%s OK [READ-WRITE] SELECT completed\r\n", 
-			exists, recent, firstunseen, firstunseen,
-			(unsigned int)uidvalid, uidnext, argv[0]);
-	else
-		string_length = gx_snprintf(buff, arsizeof(buff),
-			"* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
-			"* OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)] limited\r\n"
-			"* %d EXISTS\r\n"
-			"* %d RECENT\r\n"
-			"* OK [UIDVALIDITY %u] UIDs valid\r\n"
-			"* OK [UIDNEXT %d] predicted next UID\r\n"
-			"%s OK [READ-WRITE] SELECT completed\r\n", 
-			exists, recent, (unsigned int)uidvalid, uidnext, argv[0]);
-	imap_parser_safe_write(pcontext, buff, string_length);
-	return DISPATCH_CONTINUE;
+		string_length += gx_snprintf(buff + string_length,
+			arsizeof(buff) - string_length,
+			"* OK [UNSEEN %d] message %d is first unseen\r\n",
+			firstunseen, firstunseen);
+	string_length += gx_snprintf(buff + string_length,
+		arsizeof(buff) - string_length,
+		"* OK [UIDVALIDITY %u] UIDs valid\r\n"
+		"* OK [UIDNEXT %d] predicted next UID\r\n"
+		"* OK [HIGHESTMODSEQ %llu] highest\r\n",
+		(unsigned int)uidvalid, uidnext,
+		static_cast<unsigned long long>(highestmodseq));
+	char tail[256];
+	auto tail_len = gx_snprintf(tail, arsizeof(tail), readonly ?
+	                "%s OK [READ-ONLY] EXAMINE completed\r\n" :
+	                "%s OK [READ-WRITE] SELECT completed\r\n", argv[0]);
+	if (!b_qresync || qr_uidvalid != uidvalid) {
+		/* QRESYNC data is only usable if the UIDs are still valid */
+		string_length += gx_snprintf(buff + string_length,
+		                 arsizeof(buff) - string_length, "%s", tail);
+		imap_parser_safe_write(pcontext, buff, string_length);
+		return DISPATCH_CONTINUE;
+	}
+	pcontext->stream.clear();
+	if (pcontext->stream.write(buff, string_length) != STREAM_WRITE_OK)
+		return 1922;
+	std::string vanished;
+	if (system_services_list_vanished(pcontext->maildir, temp_name,
+	    qr_modseq, vanished, &errnum) == MIDB_RESULT_OK) {
+		if (known_uids != nullptr)
+			vanished = imap_cmd_parser_clip_uidset(vanished, &list_known);
+		if (!vanished.empty()) {
+			vanished.insert(0, "* VANISHED (EARLIER) ");
+			vanished += "\r\n";
+			if (pcontext->stream.write(vanished.c_str(),
+			    vanished.size()) != STREAM_WRITE_OK)
+				return 1922;
+		}
+	}
+	DOUBLE_LIST list_seq;
+	SEQUENCE_NODE all_node;
+	char all_seq[8] = "1:*";
+	if (!imap_cmd_parser_parse_sequence(&list_seq, &all_node, all_seq))
+		return 1800;
+	XARRAY xarray(g_alloc_xarray);
+	if (system_services_fetch_changed_uid(pcontext->maildir, temp_name,
+	    &list_seq, qr_modseq, &xarray, &errnum) == MIDB_RESULT_OK) {
+		auto num = xarray.get_capacity();
+		for (size_t i = 0; i < num; ++i) {
+			auto pitem = xarray.get_item(i);
+			char flags_string[128];
+			imap_cmd_parser_convert_flags_string(pitem->flag_bits, flags_string);
+			string_length = gx_snprintf(buff, arsizeof(buff),
+			                "* %d FETCH (UID %d FLAGS %s MODSEQ (%llu))\r\n",
+			                pitem->id, pitem->uid, flags_string,
+			                static_cast<unsigned long long>(pitem->modseq));
+			if (pcontext->stream.write(buff, string_length) != STREAM_WRITE_OK)
+				return 1922;
+		}
+	}
+	if (pcontext->stream.write(tail, tail_len) != STREAM_WRITE_OK)
+		return 1922;
+	pcontext->write_offset = 0;
+	pcontext->sched_stat = SCHED_STAT_WRLST;
+	return DISPATCH_BREAK;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2796: ENOMEM");
+	return 1918;
+}
+
+int imap_cmd_parser_select(int argc, char **argv, IMAP_CONTEXT *pcontext)
+{
+	return imap_cmd_parser_selex(argc, argv, pcontext, false);
 }
 
 int imap_cmd_parser_examine(int argc, char **argv, IMAP_CONTEXT *pcontext)
 {
-	int errnum;
-	int exists;
-	int recent;
-	unsigned int uidnext;
-	unsigned long uidvalid;
-	int firstunseen;
+	return imap_cmd_parser_selex(argc, argv, pcontext, true);
+}
+
+int imap_cmd_parser_enable(int argc, char **argv, IMAP_CONTEXT *pcontext)
+{
+	char buff[256];
 	size_t string_length = 0;
-	char temp_name[1024];
-	char buff[1024];
-    
+
 	if (!pcontext->is_authed())
 		return 1804;
-	if (argc < 3 || 0 == strlen(argv[2]) || strlen(argv[2]) >= 1024 ||
-	    !imap_cmd_parser_imapfolder_to_sysfolder(pcontext->lang, argv[2], temp_name))
+	/* RFC 5161 §3.1: ENABLE is not valid once a mailbox is selected */
+	if (pcontext->proto_stat != PROTO_STAT_AUTH)
+		return 1821;
+	if (argc < 3)
 		return 1800;
-	if (PROTO_STAT_SELECT == pcontext->proto_stat) {
-		imap_parser_remove_select(pcontext);
-		pcontext->proto_stat = PROTO_STAT_AUTH;
-		pcontext->selected_folder[0] = '\0';
+	/* RFC 5161: only capabilities newly enabled are listed */
+	auto len = gx_snprintf(buff, arsizeof(buff), "* ENABLED");
+	for (int i = 2; i < argc; ++i) {
+		if (strcasecmp(argv[i], "CONDSTORE") == 0) {
+			if (pcontext->b_condstore)
+				continue;
+			pcontext->b_condstore = true;
+			len += gx_snprintf(buff + len, arsizeof(buff) - len, " CONDSTORE");
+		} else if (strcasecmp(argv[i], "QRESYNC") == 0) {
+			if (pcontext->b_qresync)
+				continue;
+			/* QRESYNC implies CONDSTORE */
+			pcontext->b_qresync = pcontext->b_condstore = true;
+			len += gx_snprintf(buff + len, arsizeof(buff) - len, " QRESYNC");
+		}
 	}
-	auto ssr = system_services_summary_folder(pcontext->maildir, temp_name,
-	           &exists, &recent, nullptr, &uidvalid, &uidnext,
-	           &firstunseen, &errnum);
-	auto ret = m2icode(ssr, errnum);
-	if (ret != 0)
-		return ret;
-	strcpy(pcontext->selected_folder, temp_name);
-	pcontext->proto_stat = PROTO_STAT_SELECT;
-	pcontext->b_readonly = TRUE;
-	imap_parser_add_select(pcontext);
-	if (firstunseen != -1)
-		string_length = gx_snprintf(buff, arsizeof(buff),
-			"* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
-			"* OK [PERMANENTFLAGS ()] no permanenet flag permitted\r\n"
-			"* %d EXISTS\r\n"
-			"* %d RECENT\r\n"
-			"* OK [UNSEEN %d] message %d is first unseen\r\n"
-			"* OK [UIDVALIDITY %u] UIDs valid\r\n"
-			"* OK [UIDNEXT %d] predicted next UID\r\n"
-			"%s OK [READ-ONLY] EXAMINE completed\r\n",
-			exists, recent, firstunseen, firstunseen,
-			(unsigned int)uidvalid, uidnext, argv[0]);
-	else
-		string_length = gx_snprintf(buff, arsizeof(buff),
-			"* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
-			"* OK [PERMANENTFLAGS ()] no permanenet flag permitted\r\n"
-			"* %d EXISTS\r\n"
-			"* %d RECENT\r\n"
-			"* OK [UIDVALIDITY %u] UIDs valid\r\n"
-			"* OK [UIDNEXT %d] predicted next UID\r\n"
-			"%s OK [READ-ONLY] EXAMINE completed\r\n",
-			exists, recent, (unsigned int)uidvalid, uidnext, argv[0]);
-	imap_parser_safe_write(pcontext, buff, string_length);
+	/* IMAP_CODE_2170031: OK ENABLE completed */
+	auto imap_reply_str = resource_get_imap_code(1731, 1, &string_length);
+	len += gx_snprintf(buff + len, arsizeof(buff) - len, "\r\n%s %s",
+	       argv[0], imap_reply_str);
+	imap_parser_safe_write(pcontext, buff, len);
 	return DISPATCH_CONTINUE;
 }
 
@@ -2063,6 +2254,7 @@ int imap_cmd_parser_status(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	unsigned int uidnext;
 	BOOL b_first;
 	unsigned long uidvalid;
+	uint64_t highestmodseq = 0;
 	int temp_argc;
 	char buff[1024];
 	size_t string_length = 0;
@@ -2080,7 +2272,8 @@ int imap_cmd_parser_status(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	if (temp_argc == -1)
 		return 1800;
 	auto ssr = system_services_summary_folder(pcontext->maildir, temp_name,
-	           &exists, &recent, &unseen, &uidvalid, &uidnext, nullptr, &errnum);
+	           &exists, &recent, &unseen, &uidvalid, &uidnext, nullptr,
+	           &highestmodseq, &errnum);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
@@ -2111,6 +2304,10 @@ int imap_cmd_parser_status(int argc, char **argv, IMAP_CONTEXT *pcontext)
 		else if (strcasecmp(temp_argv[i], "UNSEEN") == 0)
 			string_length += gx_snprintf(buff + string_length,
 			                 arsizeof(buff) - string_length, "UNSEEN %d", unseen);
+		else if (strcasecmp(temp_argv[i], "HIGHESTMODSEQ") == 0)
+			string_length += gx_snprintf(buff + string_length,
+			                 arsizeof(buff) - string_length, "HIGHESTMODSEQ %llu",
+			                 static_cast<unsigned long long>(highestmodseq));
 		else
 			return 1800;
 	}
@@ -2240,7 +2437,7 @@ int imap_cmd_parser_append(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	for (i=0; i<10; i++) {
 		if (system_services_summary_folder(pcontext->maildir,
 		    temp_name, nullptr, nullptr, nullptr, &uidvalid, nullptr,
-		    nullptr, &errnum) == MIDB_RESULT_OK &&
+		    nullptr, nullptr, &errnum) == MIDB_RESULT_OK &&
 		    system_services_get_uid(pcontext->maildir, temp_name,
 		    mid_string.c_str(), &uid) == MIDB_RESULT_OK) {
 			string_length = gx_snprintf(buff, arsizeof(buff),
@@ -2486,7 +2683,7 @@ static int imap_cmd_parser_append_end2(int argc, char **argv, IMAP_CONTEXT *pcon
 	for (i=0; i<10; i++) {
 		if (system_services_summary_folder(pcontext->maildir,
 		    temp_name, nullptr, nullptr, nullptr, &uidvalid,
-		    nullptr, nullptr, &errnum) == MIDB_RESULT_OK &&
+		    nullptr, nullptr, nullptr, &errnum) == MIDB_RESULT_OK &&
 		    system_services_get_uid(pcontext->maildir, temp_name,
 		    pcontext->mid.c_str(), &uid) == MIDB_RESULT_OK) {
 			string_length = gx_snprintf(buff, arsizeof(buff), "%s %s [APPENDUID %u %d] %s",
@@ -2574,8 +2771,12 @@ int imap_cmd_parser_expunge(int argc, char **argv, IMAP_CONTEXT *pcontext) try
 			mlog(LV_WARN, "W-2030: remove %s: %s",
 				eml_path.c_str(), strerror(errno));
 		imap_parser_log_info(pcontext, LV_DEBUG, "message %s has been deleted", eml_path.c_str());
-		string_length = gx_snprintf(buff, arsizeof(buff),
-			"* %d EXPUNGE\r\n", pitem->id - del_num);
+		if (pcontext->b_qresync)
+			string_length = gx_snprintf(buff, arsizeof(buff),
+				"* VANISHED %u\r\n", pitem->uid);
+		else
+			string_length = gx_snprintf(buff, arsizeof(buff),
+				"* %d EXPUNGE\r\n", pitem->id - del_num);
 		if (pcontext->stream.write(buff, string_length) != STREAM_WRITE_OK)
 			return 1922;
 		b_deleted = TRUE;
@@ -2665,12 +2866,22 @@ int imap_cmd_parser_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	if (!imap_cmd_parser_parse_fetch_args(&list_data, nodes, &b_detail,
 	    &b_data, argv[3], tmp_argv, arsizeof(tmp_argv)))
 		return 1800;
+	uint64_t changedsince = 0;
+	if (argc >= 5) {
+		if (!imap_cmd_parser_modseq_arg(argv[4], "CHANGEDSINCE",
+		    &changedsince, nullptr))
+			return 1800;
+		imap_cmd_parser_want_modseq(&list_data, &nodes[1022]);
+	}
+	if (imap_cmd_parser_want_modseq(&list_data, nullptr))
+		pcontext->b_condstore = true;
 	XARRAY xarray(g_alloc_xarray);
 	auto ssr = b_detail ?
 	           system_services_fetch_detail(pcontext->maildir,
 	           pcontext->selected_folder, &list_seq, &xarray, &errnum) :
-	           system_services_fetch_simple(pcontext->maildir,
-	           pcontext->selected_folder, &list_seq, &xarray, &errnum);
+	           system_services_fetch_changed(pcontext->maildir,
+	           pcontext->selected_folder, &list_seq, changedsince,
+	           &xarray, &errnum);
 	auto result = m2icode(ssr, errnum);
 	if (result != 0)
 		return result;
@@ -2678,6 +2889,8 @@ int imap_cmd_parser_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	num = xarray.get_capacity();
 	for (i=0; i<num; i++) {
 		auto pitem = xarray.get_item(i);
+		if (pitem->modseq <= changedsince && changedsince != 0)
+			continue;
 		result = imap_cmd_parser_process_fetch_item(pcontext, b_data,
 		         pitem, pitem->id, &list_data);
 		if (result != 0)
@@ -2716,7 +2929,7 @@ static bool store_flagkeyword(const char *str)
 	return false;
 }
 
-int imap_cmd_parser_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
+int imap_cmd_parser_store(int argc, char **argv, IMAP_CONTEXT *pcontext) try
 {
 	int errnum, i;
 	int flag_bits;
@@ -2727,17 +2940,27 @@ int imap_cmd_parser_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
 
 	if (pcontext->proto_stat != PROTO_STAT_SELECT)
 		return 1805;
-	if (argc < 5 || !imap_cmd_parser_parse_sequence(&list_seq,
-	    sequence_nodes, argv[2]) || !store_flagkeyword(argv[3]))
+	/* RFC 7162: STORE seq [(UNCHANGEDSINCE modseq)] keyword flags */
+	int k = 3;
+	uint64_t unchangedsince = UINT64_MAX;
+	if (argc > 3 && argv[3][0] == '(') {
+		if (!imap_cmd_parser_modseq_arg(argv[3], "UNCHANGEDSINCE",
+		    &unchangedsince, nullptr))
+			return 1800;
+		pcontext->b_condstore = true;
+		++k;
+	}
+	if (argc < k + 2 || !imap_cmd_parser_parse_sequence(&list_seq,
+	    sequence_nodes, argv[2]) || !store_flagkeyword(argv[k]))
 		return 1800;
-	if ('(' == argv[4][0] && ')' == argv[4][strlen(argv[4]) - 1]) {
-		temp_argc = parse_imap_args(argv[4] + 1, strlen(argv[4]) - 2,
+	if ('(' == argv[k+1][0] && ')' == argv[k+1][strlen(argv[k+1]) - 1]) {
+		temp_argc = parse_imap_args(argv[k+1] + 1, strlen(argv[k+1]) - 2,
 		            temp_argv, arsizeof(temp_argv));
 		if (temp_argc == -1)
 			return 1800;
 	} else {
 		temp_argc = 1;
-		temp_argv[0] = argv[4];
+		temp_argv[0] = argv[k+1];
 	}
 	if (pcontext->b_readonly)
 		return 1806;
@@ -2762,15 +2985,32 @@ int imap_cmd_parser_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	auto result = m2icode(ssr, errnum);
 	if (result != 0)
 		return result;
+	std::vector<unsigned int> modified;
 	int num = xarray.get_capacity();
 	for (i=0; i<num; i++) {
 		auto pitem = xarray.get_item(i);
-		imap_cmd_parser_store_flags(argv[3], pitem->mid,
+		if (pitem->modseq > unchangedsince) {
+			modified.push_back(pitem->id);
+			continue;
+		}
+		imap_cmd_parser_store_flags(argv[k], pitem->mid,
 			pitem->id, 0, flag_bits, pcontext);
 		imap_parser_modify_flags(pcontext, pitem->mid);
 	}
 	imap_parser_echo_modify(pcontext, NULL);
-	return 1721;
+	if (modified.empty())
+		return 1721;
+	/* IMAP_CODE_2170032: OK <MODIFIED> STORE completed */
+	size_t len1 = 0, len2 = 0;
+	auto str1 = resource_get_imap_code(1732, 1, &len1);
+	auto str2 = resource_get_imap_code(1732, 2, &len2);
+	auto buff = std::string(argv[0]) + " " + str1 + "[MODIFIED " +
+	            imap_cmd_parser_compress_set(modified) + "]" + str2;
+	imap_parser_safe_write(pcontext, buff.c_str(), buff.size());
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2798: ENOMEM");
+	return 1918;
 }
 
 int imap_cmd_parser_copy(int argc, char **argv, IMAP_CONTEXT *pcontext) try
@@ -2803,7 +3043,7 @@ int imap_cmd_parser_copy(int argc, char **argv, IMAP_CONTEXT *pcontext) try
 		return result;
 	if (system_services_summary_folder(pcontext->maildir,
 	    temp_name, nullptr, nullptr, nullptr, &uidvalidity, nullptr,
-	    nullptr, &errnum) != MIDB_RESULT_OK)
+	    nullptr, nullptr, &errnum) != MIDB_RESULT_OK)
 		uidvalidity = 0;
 	b_copied = TRUE;
 	b_first = FALSE;
@@ -2916,7 +3156,7 @@ int imap_cmd_parser_uid_search(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	return DISPATCH_BREAK;
 }
 
-int imap_cmd_parser_uid_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext)
+int imap_cmd_parser_uid_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext) try
 {
 	int num;
 	int errnum;
@@ -2948,19 +3188,49 @@ int imap_cmd_parser_uid_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext)
 		nodes[1023].pdata = deconst("UID");
 		double_list_insert_as_head(&list_data, &nodes[1023]);
 	}
+	uint64_t changedsince = 0;
+	bool b_vanished = false;
+	if (argc >= 6) {
+		if (!imap_cmd_parser_modseq_arg(argv[5], "CHANGEDSINCE",
+		    &changedsince, &b_vanished) ||
+		    (b_vanished && !pcontext->b_qresync))
+			return 1800;
+		imap_cmd_parser_want_modseq(&list_data, &nodes[1022]);
+	}
+	if (imap_cmd_parser_want_modseq(&list_data, nullptr))
+		pcontext->b_condstore = true;
 	XARRAY xarray(g_alloc_xarray);
 	auto ssr = b_detail ?
 	           system_services_fetch_detail_uid(pcontext->maildir,
 	           pcontext->selected_folder, &list_seq, &xarray, &errnum) :
-	           system_services_fetch_simple_uid(pcontext->maildir,
-	           pcontext->selected_folder, &list_seq, &xarray, &errnum);
+	           system_services_fetch_changed_uid(pcontext->maildir,
+	           pcontext->selected_folder, &list_seq, changedsince,
+	           &xarray, &errnum);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
 	pcontext->stream.clear();
+	if (b_vanished) {
+		std::string vanished;
+		ssr = system_services_list_vanished(pcontext->maildir,
+		      pcontext->selected_folder, changedsince, vanished, &errnum);
+		ret = m2icode(ssr, errnum);
+		if (ret != 0)
+			return ret;
+		vanished = imap_cmd_parser_clip_uidset(vanished, &list_seq);
+		if (!vanished.empty()) {
+			vanished.insert(0, "* VANISHED (EARLIER) ");
+			vanished += "\r\n";
+			if (pcontext->stream.write(vanished.c_str(),
+			    vanished.size()) != STREAM_WRITE_OK)
+				return 1922;
+		}
+	}
 	num = xarray.get_capacity();
 	for (i=0; i<num; i++) {
 		auto pitem = xarray.get_item(i);
+		if (pitem->modseq <= changedsince && changedsince != 0)
+			continue;
 		ret = imap_cmd_parser_process_fetch_item(pcontext, b_data,
 		      pitem, pitem->id, &list_data);
 		if (ret != 0)
@@ -2986,9 +3256,12 @@ int imap_cmd_parser_uid_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext)
 		pcontext->sched_stat = SCHED_STAT_WRLST;
 	}
 	return DISPATCH_BREAK;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2797: ENOMEM");
+	return 1918;
 }
 
-int imap_cmd_parser_uid_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
+int imap_cmd_parser_uid_store(int argc, char **argv, IMAP_CONTEXT *pcontext) try
 {
 	int errnum, i, flag_bits, temp_argc;
 	char *temp_argv[8];
@@ -2997,17 +3270,26 @@ int imap_cmd_parser_uid_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
 
 	if (pcontext->proto_stat != PROTO_STAT_SELECT)
 		return 1805;
-	if (argc < 6 || !imap_cmd_parser_parse_sequence(&list_seq,
-	    sequence_nodes, argv[3]) || !store_flagkeyword(argv[4]))
+	int k = 4;
+	uint64_t unchangedsince = UINT64_MAX;
+	if (argc > 4 && argv[4][0] == '(') {
+		if (!imap_cmd_parser_modseq_arg(argv[4], "UNCHANGEDSINCE",
+		    &unchangedsince, nullptr))
+			return 1800;
+		pcontext->b_condstore = true;
+		++k;
+	}
+	if (argc < k + 2 || !imap_cmd_parser_parse_sequence(&list_seq,
+	    sequence_nodes, argv[3]) || !store_flagkeyword(argv[k]))
 		return 1800;
-	if ('(' == argv[5][0] && ')' == argv[5][strlen(argv[5]) - 1]) {
-		temp_argc = parse_imap_args(argv[5] + 1, strlen(argv[5]) - 2,
+	if ('(' == argv[k+1][0] && ')' == argv[k+1][strlen(argv[k+1]) - 1]) {
+		temp_argc = parse_imap_args(argv[k+1] + 1, strlen(argv[k+1]) - 2,
 		            temp_argv, arsizeof(temp_argv));
 		if (temp_argc == -1)
 			return 1800;
 	} else {
 		temp_argc = 1;
-		temp_argv[0] = argv[5];
+		temp_argv[0] = argv[k+1];
 	}
 	if (pcontext->b_readonly)
 		return 1806;
@@ -3032,15 +3314,32 @@ int imap_cmd_parser_uid_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
+	std::vector<unsigned int> modified;
 	int num = xarray.get_capacity();
 	for (i=0; i<num; i++) {
 		auto pitem = xarray.get_item(i);
-		imap_cmd_parser_store_flags(argv[4], pitem->mid,
+		if (pitem->modseq > unchangedsince) {
+			modified.push_back(pitem->uid);
+			continue;
+		}
+		imap_cmd_parser_store_flags(argv[k], pitem->mid,
 			pitem->id, pitem->uid, flag_bits, pcontext);
 		imap_parser_modify_flags(pcontext, pitem->mid);
 	}
 	imap_parser_echo_modify(pcontext, NULL);
-	return 1724;
+	if (modified.empty())
+		return 1724;
+	/* IMAP_CODE_2170033: OK <MODIFIED> UID STORE completed */
+	size_t len1 = 0, len2 = 0;
+	auto str1 = resource_get_imap_code(1733, 1, &len1);
+	auto str2 = resource_get_imap_code(1733, 2, &len2);
+	auto buff = std::string(argv[0]) + " " + str1 + "[MODIFIED " +
+	            imap_cmd_parser_compress_set(modified) + "]" + str2;
+	imap_parser_safe_write(pcontext, buff.c_str(), buff.size());
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2799: ENOMEM");
+	return 1918;
 }
 
 int imap_cmd_parser_uid_copy(int argc, char **argv, IMAP_CONTEXT *pcontext) try
@@ -3072,7 +3371,7 @@ int imap_cmd_parser_uid_copy(int argc, char **argv, IMAP_CONTEXT *pcontext) try
 		return ret;
 	if (system_services_summary_folder(pcontext->maildir,
 	    temp_name, nullptr, nullptr, nullptr, &uidvalidity,
-	    nullptr, nullptr, &errnum) != MIDB_RESULT_OK)
+	    nullptr, nullptr, nullptr, &errnum) != MIDB_RESULT_OK)
 		uidvalidity = 0;
 	b_copied = TRUE;
 	b_first = FALSE;
@@ -3207,8 +3506,12 @@ int imap_cmd_parser_uid_expunge(int argc, char **argv, IMAP_CONTEXT *pcontext) t
 			mlog(LV_WARN, "W-2086: remove %s: %s",
 				eml_path.c_str(), strerror(errno));
 		imap_parser_log_info(pcontext, LV_DEBUG, "message %s has been deleted", eml_path.c_str());
-		string_length = gx_snprintf(buff, arsizeof(buff),
-			"* %d EXPUNGE\r\n", pitem->id - del_num);
+		if (pcontext->b_qresync)
+			string_length = gx_snprintf(buff, arsizeof(buff),
+				"* VANISHED %u\r\n", pitem->uid);
+		else
+			string_length = gx_snprintf(buff, arsizeof(buff),
+				"* %d EXPUNGE\r\n", pitem->id - del_num);
 		if (pcontext->stream.write(buff, string_length) != STREAM_WRITE_OK)
 			return 1922;
 		b_deleted = TRUE;
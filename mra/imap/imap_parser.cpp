@@ -16,6 +16,7 @@
 #include <string>
 #include <unistd.h>
 #include <vector>
+#include <zlib.h>
 #include <libHX/string.h>
 #include <openssl/err.h>
 #include <sys/socket.h>
@@ -90,6 +91,179 @@ static char g_certificate_passwd[1024];
 static SSL_CTX *g_ssl_ctx;
 static std::unique_ptr<std::mutex[]> g_ssl_mutex_buf;
 
+/**
+ * RFC 4978 COMPRESS=DEFLATE state. Both directions are raw deflate streams.
+ * The compressor runs with a 4 KB window and memLevel 5 (about 32 KB of zlib
+ * state rather than the default 256 KB), since it lives as long as the
+ * connection and most of those just sit in IDLE. The decompressor needs the
+ * full 32 KB window, because the client gets to pick it.
+ *
+ * Compressed output that the socket does not take right away is parked in
+ * @pending; no further plaintext is accepted until it is drained, so at
+ * most one write's worth is ever held. A hard socket error is sticky in
+ * @wr_err and reported by every later write.
+ *
+ * Inflated input that did not fit the caller's buffer stays inside zlib,
+ * where epoll cannot see it; has_input() tells imap_parser_process to run
+ * the context again instead of polling.
+ */
+struct imap_zstream {
+	imap_zstream() = default;
+	~imap_zstream();
+	NOMOVE(imap_zstream);
+
+	bool init();
+	ssize_t read(GENERIC_CONNECTION &, void *, size_t);
+	ssize_t write(GENERIC_CONNECTION &, const void *, size_t);
+	ssize_t drain(GENERIC_CONNECTION &);
+	inline bool drained() const { return pend_off == pending.size(); }
+	inline bool has_input() const { return inf.avail_in > 0 || inf_more; }
+
+	z_stream inf{}, def{};
+	bool inf_init = false, def_init = false, inf_more = false;
+	int wr_err = 0;
+	std::unique_ptr<char[]> inbuf;
+	std::string pending;
+	size_t pend_off = 0;
+};
+
+static constexpr size_t ZS_INBUF_SIZE = 4096, ZS_CHUNK_SIZE = 16384;
+
+imap_zstream::~imap_zstream()
+{
+	if (inf_init)
+		inflateEnd(&inf);
+	if (def_init)
+		deflateEnd(&def);
+}
+
+bool imap_zstream::init() try
+{
+	inbuf = std::make_unique<char[]>(ZS_INBUF_SIZE);
+	if (inflateInit2(&inf, -MAX_WBITS) != Z_OK)
+		return false;
+	inf_init = true;
+	if (deflateInit2(&def, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12, 5,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+	def_init = true;
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
+/**
+ * Returns a positive value once everything pending is out, otherwise the
+ * result of the failed write.
+ */
+ssize_t imap_zstream::drain(GENERIC_CONNECTION &conn)
+{
+	if (wr_err != 0) {
+		errno = wr_err;
+		return -1;
+	}
+	while (pend_off < pending.size()) {
+		auto ret = conn.write(&pending[pend_off], pending.size() - pend_off);
+		if (ret == 0 || (ret < 0 && errno != EAGAIN)) {
+			wr_err = ret == 0 ? EPIPE : errno;
+			errno = wr_err;
+			return -1;
+		}
+		if (ret < 0)
+			return ret;
+		pend_off += ret;
+	}
+	pending.clear();
+	pend_off = 0;
+	return 1;
+}
+
+ssize_t imap_zstream::write(GENERIC_CONNECTION &conn, const void *buf,
+    size_t z) try
+{
+	if (z == 0)
+		return 0;
+	auto ret = drain(conn);
+	if (ret <= 0)
+		return ret;
+	char chunk[ZS_CHUNK_SIZE];
+	def.next_in   = static_cast<Bytef *>(const_cast<void *>(buf));
+	def.avail_in  = z;
+	do {
+		def.next_out  = reinterpret_cast<Bytef *>(chunk);
+		def.avail_out = sizeof(chunk);
+		/* flush per write so that every response reaches the client */
+		if (deflate(&def, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+			errno = EIO;
+			return -1;
+		}
+		size_t have = sizeof(chunk) - def.avail_out, off = 0;
+		while (pending.empty() && off < have) {
+			ret = conn.write(&chunk[off], have - off);
+			if (ret == 0 || (ret < 0 && errno != EAGAIN)) {
+				/* the input is already in the deflate stream; no retry */
+				wr_err = ret == 0 ? EPIPE : errno;
+				errno = wr_err;
+				return -1;
+			}
+			if (ret < 0)
+				break;
+			off += ret;
+		}
+		pending.append(&chunk[off], have - off);
+	} while (def.avail_out == 0);
+	return z;
+} catch (const std::bad_alloc &) {
+	errno = ENOMEM;
+	return -1;
+}
+
+ssize_t imap_zstream::read(GENERIC_CONNECTION &conn, void *buf, size_t z)
+{
+	if (z == 0)
+		return 0;
+	inf.next_out  = static_cast<Bytef *>(buf);
+	inf.avail_out = z;
+	while (true) {
+		/* hand out what zlib may still hold before touching the socket */
+		if (inf.avail_in > 0 || inf_more) {
+			auto zr = inflate(&inf, Z_SYNC_FLUSH);
+			if (zr != Z_OK && zr != Z_BUF_ERROR && zr != Z_STREAM_END) {
+				errno = EIO;
+				return -1;
+			}
+			inf_more = inf.avail_out == 0;
+			size_t have = z - inf.avail_out;
+			if (have > 0)
+				return have;
+			if (zr == Z_STREAM_END)
+				return 0;
+		}
+		auto ret = conn.ssl != nullptr ?
+		           SSL_read(conn.ssl, inbuf.get(), ZS_INBUF_SIZE) :
+		           ::read(conn.sockd, inbuf.get(), ZS_INBUF_SIZE);
+		if (ret <= 0)
+			return ret;
+		inf.next_in  = reinterpret_cast<Bytef *>(inbuf.get());
+		inf.avail_in = ret;
+	}
+}
+
+ssize_t imap_context::read(void *buf, size_t z)
+{
+	if (zstrm != nullptr)
+		return zstrm->read(connection, buf, z);
+	return connection.ssl != nullptr ? SSL_read(connection.ssl, buf, z) :
+	       ::read(connection.sockd, buf, z);
+}
+
+ssize_t imap_context::write(const void *buf, size_t z)
+{
+	if (zstrm != nullptr)
+		return zstrm->write(connection, buf, z);
+	return connection.write(buf, z);
+}
+
 alloc_limiter<DIR_NODE> *imap_parser_get_dpool()
 {
 	return &g_alloc_dir;
@@ -405,13 +579,14 @@ static int ps_stat_notifying(IMAP_CONTEXT *pcontext)
 {
 	int exists = 0, recent = 0, err = 0;
 	if (MIDB_RESULT_OK == system_services_summary_folder(pcontext->maildir,
-	    pcontext->selected_folder, &exists, &recent, NULL, NULL, NULL, NULL, &err)) {
+	    pcontext->selected_folder, &exists, &recent, nullptr, nullptr,
+	    nullptr, nullptr, nullptr, &err)) {
 		char temp_buff[64];
 		auto len = gx_snprintf(temp_buff, arsizeof(temp_buff),
 		           "* %d RECENT\r\n"
 		           "* %d EXISTS\r\n",
 		           recent, exists);
-		pcontext->connection.write(temp_buff, len);
+		pcontext->write(temp_buff, len);
 	}
 	std::unique_lock ll_hold(g_list_lock);
 	double_list_append_as_tail(&g_sleeping_list, &pcontext->sleeping_node);
@@ -421,14 +596,8 @@ static int ps_stat_notifying(IMAP_CONTEXT *pcontext)
 
 static int ps_stat_rdcmd(IMAP_CONTEXT *pcontext)
 {
-	ssize_t read_len;
-	if (NULL != pcontext->connection.ssl) {
-		read_len = SSL_read(pcontext->connection.ssl, pcontext->read_buffer +
-		           pcontext->read_offset, 64*1024 - pcontext->read_offset);
-	} else {
-		read_len = read(pcontext->connection.sockd, pcontext->read_buffer +
-		           pcontext->read_offset, 64*1024 - pcontext->read_offset);
-	}
+	auto read_len = pcontext->read(pcontext->read_buffer +
+	                pcontext->read_offset, 64 * 1024 - pcontext->read_offset);
 	auto current_time = tp_now();
 	if (0 == read_len) {
 		imap_parser_log_info(pcontext, LV_DEBUG, "connection lost");
@@ -544,7 +713,7 @@ static int ps_literal_processing(IMAP_CONTEXT *pcontext)
 			/* IMAP_CODE_2160003: + ready for additional command text */
 			size_t string_length = 0;
 			auto imap_reply_str = resource_get_imap_code(1603, 1, &string_length);
-			pcontext->connection.write(imap_reply_str, string_length);
+			pcontext->write(imap_reply_str, string_length);
 			return X_LITERAL_CHECKING;
 		}
 		memcpy(&ctx.command_buffer[ctx.command_len],
@@ -572,7 +741,7 @@ static int ps_literal_processing(IMAP_CONTEXT *pcontext)
 				/* IMAP_CODE_2160003 + Ready for additional command text */
 				size_t string_length = 0;
 				auto imap_reply_str = resource_get_imap_code(1603, 1, &string_length);
-				pcontext->connection.write(imap_reply_str, string_length);
+				pcontext->write(imap_reply_str, string_length);
 				return PROCESS_CONTINUE;
 			}
 			case DISPATCH_SHOULD_CLOSE:
@@ -594,8 +763,8 @@ static int ps_literal_processing(IMAP_CONTEXT *pcontext)
 		/* IMAP_CODE_2180017: BAD literal size too large */
 		size_t string_length = 0;
 		auto imap_reply_str = resource_get_imap_code(1817, 1, &string_length);
-		pcontext->connection.write("* ", 2);
-		pcontext->connection.write(imap_reply_str, string_length);
+		pcontext->write("* ", 2);
+		pcontext->write(imap_reply_str, string_length);
 		ctx.read_offset -= &ctx.literal_ptr[nl_len] - ctx.read_buffer;
 		if (pcontext->read_offset > 0 && pcontext->read_offset < 64*1024) {
 			memmove(ctx.read_buffer, &ctx.literal_ptr[nl_len], ctx.read_offset);
@@ -676,9 +845,9 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 				}
 				size_t string_length = 0;
 				auto imap_reply_str = resource_get_imap_code(1800, 1, &string_length);
-				pcontext->connection.write(pcontext->tag_string, strlen(pcontext->tag_string));
-				pcontext->connection.write(" ", 1);
-				pcontext->connection.write(imap_reply_str, string_length);
+				pcontext->write(pcontext->tag_string, strlen(pcontext->tag_string));
+				pcontext->write(" ", 1);
+				pcontext->write(imap_reply_str, string_length);
 			} else {
 				imap_cmd_parser_append_end(argc, argv, pcontext);
 			}
@@ -702,9 +871,9 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 				imap_reply_str = resource_get_imap_code(1727, 1,
 				                 &string_length);
 			}
-			pcontext->connection.write(pcontext->tag_string, strlen(pcontext->tag_string));
-			pcontext->connection.write(" ", 1);
-			pcontext->connection.write(imap_reply_str, string_length);
+			pcontext->write(pcontext->tag_string, strlen(pcontext->tag_string));
+			pcontext->write(" ", 1);
+			pcontext->write(imap_reply_str, string_length);
 			pcontext->command_len = 0;
 			return X_LITERAL_PROCESSING;
 		}
@@ -713,12 +882,12 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 			size_t string_length = 0;
 			auto imap_reply_str = resource_get_imap_code(1800, 1, &string_length);
 			if (argc <= 0 || strlen(argv[0]) >= 32) {
-				pcontext->connection.write("* ", 2);
-				pcontext->connection.write(imap_reply_str, string_length);
+				pcontext->write("* ", 2);
+				pcontext->write(imap_reply_str, string_length);
 			} else {
-				pcontext->connection.write(argv[0], strlen(argv[0]));
-				pcontext->connection.write(" ", 1);
-				pcontext->connection.write(imap_reply_str, string_length);
+				pcontext->write(argv[0], strlen(argv[0]));
+				pcontext->write(" ", 1);
+				pcontext->write(imap_reply_str, string_length);
 			}
 			pcontext->command_len = 0;
 			return X_LITERAL_CHECKING;
@@ -743,7 +912,7 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 		pcontext->command_len = 0;
 		size_t string_length = 0;
 		auto imap_reply_str = resource_get_imap_code(1800, 1, &string_length);
-		pcontext->connection.write(imap_reply_str, string_length);
+		pcontext->write(imap_reply_str, string_length);
 	}
 
 	if (pcontext->sched_stat != SCHED_STAT_IDLING) {
@@ -765,12 +934,7 @@ static int ps_stat_appending(IMAP_CONTEXT *pcontext)
 		auto imap_reply_str = resource_get_imap_code(1809, 1, &string_length);
 		return ps_end_processing(pcontext, imap_reply_str, string_length);
 	}
-	ssize_t read_len;
-	if (NULL != pcontext->connection.ssl) {
-		read_len = SSL_read(pcontext->connection.ssl, pbuff, len);
-	} else {
-		read_len = read(pcontext->connection.sockd, pbuff, len);
-	}
+	auto read_len = pcontext->read(pbuff, len);
 	auto current_time = tp_now();
 	if (0 == read_len) {
 		imap_parser_log_info(pcontext, LV_DEBUG, "connection lost");
@@ -826,7 +990,7 @@ static int ps_stat_wrdat(IMAP_CONTEXT *pcontext)
 	if (0 == pcontext->write_length) {
 		imap_parser_wrdat_retrieve(pcontext);
 	}
-	auto written_len = pcontext->connection.write(&pcontext->write_buff[pcontext->write_offset],
+	auto written_len = pcontext->write(&pcontext->write_buff[pcontext->write_offset],
 	                   pcontext->write_length - pcontext->write_offset);
 	auto current_time = tp_now();
 	if (0 == written_len) {
@@ -912,7 +1076,7 @@ static int ps_stat_wrlst(IMAP_CONTEXT *pcontext)
 		pcontext->write_buff = static_cast<char *>(pcontext->stream.get_read_buf(&temp_len));
 		pcontext->write_length = temp_len;
 	}
-	auto written_len = pcontext->connection.write(&pcontext->write_buff[pcontext->write_offset],
+	auto written_len = pcontext->write(&pcontext->write_buff[pcontext->write_offset],
 	                   pcontext->write_length - pcontext->write_offset);
 	auto current_time = tp_now();
 	if (0 == written_len) {
@@ -984,6 +1148,28 @@ int imap_parser_process(IMAP_CONTEXT *ctx)
 		else
 			ret = ps_end_processing(ctx);
 	}
+	/*
+	 * Compressed output still queued has to go out before the context
+	 * waits for input. Contexts which went to sleep are already on the
+	 * sleeping list, so they only get a best-effort attempt.
+	 */
+	auto zs = ctx->zstrm.get();
+	if (zs == nullptr || ret == PROCESS_CLOSE)
+		return ret;
+	if (!zs->drained()) {
+		if (ret == PROCESS_POLLING_RDONLY && zs->drain(ctx->connection) <= 0) {
+			if (errno != EAGAIN) {
+				imap_parser_log_info(ctx, LV_DEBUG, "connection lost");
+				return ps_end_processing(ctx);
+			}
+			return PROCESS_POLLING_WRONLY;
+		} else if (ret == PROCESS_SLEEPING) {
+			zs->drain(ctx->connection);
+		}
+	}
+	/* pipelined commands may already sit inflated inside zlib */
+	if (ret == PROCESS_POLLING_RDONLY && zs->has_input())
+		return PROCESS_CONTINUE;
 	return ret;
 }
 
@@ -991,8 +1177,8 @@ static int ps_end_processing(IMAP_CONTEXT *pcontext,
     const char *imap_reply_str, ssize_t string_length)
 {
 	if (NULL != imap_reply_str) {
-		pcontext->connection.write("* ", 2);
-		pcontext->connection.write(imap_reply_str, string_length);
+		pcontext->write("* ", 2);
+		pcontext->write(imap_reply_str, string_length);
 	}
 	pcontext->connection.reset(SLEEP_BEFORE_CLOSE);
 	if (PROTO_STAT_SELECT == pcontext->proto_stat) {
@@ -1259,6 +1445,7 @@ void imap_parser_echo_modify(IMAP_CONTEXT *pcontext, STREAM *pstream)
 	char buff[1024];
 	char mid_string[256];
 	MEM_FILE temp_file;
+	uint64_t modseq = 0;
 	
 	mem_file_init(&temp_file, &g_alloc_file);
 	std::unique_lock hl_hold(g_hash_lock);
@@ -1270,12 +1457,12 @@ void imap_parser_echo_modify(IMAP_CONTEXT *pcontext, STREAM *pstream)
 	
 	if (b_modify && system_services_summary_folder(pcontext->maildir,
 	    pcontext->selected_folder, &exists, &recent, nullptr, nullptr,
-	    nullptr, nullptr, &err) == MIDB_RESULT_OK) {
+	    nullptr, nullptr, nullptr, &err) == MIDB_RESULT_OK) {
 		tmp_len = gx_snprintf(buff, arsizeof(buff), "* %d RECENT\r\n"
 									   "* %d EXISTS\r\n",
 									   recent, exists);
 		if (NULL == pstream) {
-			pcontext->connection.write(buff, tmp_len);
+			pcontext->write(buff, tmp_len);
 		} else if (pstream->write(buff, tmp_len) != STREAM_WRITE_OK) {
 			mem_file_free(&temp_file);
 			return;
@@ -1293,7 +1480,7 @@ void imap_parser_echo_modify(IMAP_CONTEXT *pcontext, STREAM *pstream)
 		    reinterpret_cast<unsigned int *>(&id)) != MIDB_RESULT_OK ||
 		    system_services_get_flags(pcontext->maildir,
 		    pcontext->selected_folder, mid_string, &flag_bits,
-		    &err) != MIDB_RESULT_OK)
+		    &modseq, &err) != MIDB_RESULT_OK)
 			continue;
 		tmp_len = gx_snprintf(buff, arsizeof(buff), "* %d FETCH (FLAGS (", id);
 		b_first = FALSE;
@@ -1340,9 +1527,14 @@ void imap_parser_echo_modify(IMAP_CONTEXT *pcontext, STREAM *pstream)
 			}
 			tmp_len += gx_snprintf(buff + tmp_len, arsizeof(buff) - tmp_len, "\\Draft");
 		}
-		tmp_len += gx_snprintf(buff + tmp_len, arsizeof(buff) - tmp_len, "))\r\n");
+		tmp_len += gx_snprintf(buff + tmp_len, arsizeof(buff) - tmp_len, ")");
+		/* RFC 7162 §3.2.4 */
+		if (pcontext->b_condstore || pcontext->b_qresync)
+			tmp_len += gx_snprintf(buff + tmp_len, arsizeof(buff) - tmp_len,
+			           " MODSEQ (%llu)", static_cast<unsigned long long>(modseq));
+		tmp_len += gx_snprintf(buff + tmp_len, arsizeof(buff) - tmp_len, ")\r\n");
 		if (pstream == nullptr)
-			pcontext->connection.write(buff, tmp_len);
+			pcontext->write(buff, tmp_len);
 		else if (pstream->write(buff, tmp_len) != STREAM_WRITE_OK)
 			break;
 	}
@@ -1364,6 +1556,10 @@ static int imap_parser_dispatch_cmd2(int argc, char **argv, IMAP_CONTEXT *pconte
         return imap_cmd_parser_capability(argc, argv, pcontext);
 	} else if (0 == strcasecmp(argv[1], "ID")) {
         return imap_cmd_parser_id(argc, argv, pcontext);
+	} else if (0 == strcasecmp(argv[1], "ENABLE")) {
+		return imap_cmd_parser_enable(argc, argv, pcontext);
+	} else if (0 == strcasecmp(argv[1], "COMPRESS")) {
+		return imap_cmd_parser_compress(argc, argv, pcontext);
 	} else if (0 == strcasecmp(argv[1], "NOOP")) {
         return imap_cmd_parser_noop(argc, argv, pcontext);
     } else if (0 == strcasecmp(argv[1], "LOGOUT")) {
@@ -1434,7 +1630,7 @@ static int imap_parser_dispatch_cmd2(int argc, char **argv, IMAP_CONTEXT *pconte
     } else {
 		imap_reply_str = resource_get_imap_code(1800, 1, &string_length);
 		string_length = gx_snprintf(reply_buff, arsizeof(reply_buff), "%s %s", argv[0], imap_reply_str);
-		pcontext->connection.write(reply_buff, string_length);
+		pcontext->write(reply_buff, string_length);
 		return DISPATCH_CONTINUE;
     }
 }
@@ -1486,6 +1682,7 @@ static void imap_parser_context_clear(IMAP_CONTEXT *pcontext)
         return;
     }
 	pcontext->connection.reset();
+	pcontext->zstrm.reset();
 	pcontext->proto_stat = 0;
 	pcontext->sched_stat = 0;
 	pcontext->mid[0] = '\0';
@@ -1497,6 +1694,7 @@ static void imap_parser_context_clear(IMAP_CONTEXT *pcontext)
 	pcontext->selected_time = 0;
 	pcontext->selected_folder[0] = '\0';
 	pcontext->b_readonly = FALSE;
+	pcontext->b_condstore = pcontext->b_qresync = false;
 	pcontext->tag_string[0] = '\0';
 	pcontext->command_len = 0;
 	pcontext->command_buffer[0] = '\0';
@@ -1764,6 +1962,40 @@ int imap_parser_get_sequence_ID()
 	return nu;
 }
 
+/**
+ * Sends the tagged OK for COMPRESS in the clear and switches the connection
+ * over to DEFLATE.
+ */
+int imap_parser_start_deflate(IMAP_CONTEXT *pcontext, const char *tag) try
+{
+	if (pcontext->zstrm != nullptr)
+		return 1924;
+	auto zs = std::make_unique<imap_zstream>();
+	if (!zs->init())
+		return 1918;
+	if (static_cast<size_t>(pcontext->read_offset) > ZS_INBUF_SIZE)
+		return 1800;
+	/* whatever the client sent past the command line is compressed already */
+	memcpy(zs->inbuf.get(), pcontext->read_buffer, pcontext->read_offset);
+	zs->inf.next_in  = reinterpret_cast<Bytef *>(zs->inbuf.get());
+	zs->inf.avail_in = pcontext->read_offset;
+	pcontext->read_offset = 0;
+	/* IMAP_CODE_2170034: OK DEFLATE active */
+	size_t string_length = 0;
+	char buff[1024];
+	auto imap_reply_str = resource_get_imap_code(1734, 1, &string_length);
+	string_length = gx_snprintf(buff, arsizeof(buff), "%s %s", tag, imap_reply_str);
+	imap_parser_safe_write(pcontext, buff, string_length);
+	/* pending output is retried from a buffer which may have moved */
+	if (pcontext->connection.ssl != nullptr)
+		SSL_set_mode(pcontext->connection.ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	pcontext->zstrm = std::move(zs);
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2800: ENOMEM");
+	return 1918;
+}
+
 void imap_parser_safe_write(IMAP_CONTEXT *pcontext, const void *pbuff, size_t count)
 {
 	int opt;
@@ -1774,7 +2006,7 @@ void imap_parser_safe_write(IMAP_CONTEXT *pcontext, const void *pbuff, size_t co
 	if (fcntl(pcontext->connection.sockd, F_SETFL, opt) < 0)
 		mlog(LV_WARN, "W-1365: fcntl: %s", strerror(errno));
 	/* end of set mode */
-	pcontext->connection.write(pbuff, count);
+	pcontext->write(pbuff, count);
 	/* set the socket back to non-block mode */
 	opt |= O_NONBLOCK;
 	if (fcntl(pcontext->connection.sockd, F_SETFL, opt) < 0)
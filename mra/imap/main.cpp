@@ -56,6 +56,7 @@ static constexpr cfg_directive imap_cfg_defaults[] = {
 	{"context_average_mitem", "64K", CFG_SIZE, "1"},
 	{"context_max_mem", "2M", CFG_SIZE},
 	{"context_num", "400", CFG_SIZE},
+	{"context_poll_shards", "0", CFG_SIZE, "0", "64"},
 	{"data_file_path", PKGDATADIR "/imap:" PKGDATADIR},
 	{"default_lang", "en"},
 	{"imap_auth_times", "10", CFG_SIZE, "1"},
@@ -64,6 +65,7 @@ static constexpr cfg_directive imap_cfg_defaults[] = {
 	{"imap_conn_timeout", "3min", CFG_TIME, "1s"},
 	{"imap_force_starttls", "imap_force_tls", CFG_ALIAS},
 	{"imap_force_tls", "false", CFG_BOOL},
+	{"imap_listen_acceptors", "1", CFG_SIZE, "1", "64"},
 	{"imap_listen_addr", "::"},
 	{"imap_listen_port", "143"},
 	{"imap_listen_tls_port", "0"},
@@ -239,7 +241,8 @@ int main(int argc, const char **argv) try
 	}
 	auto cleanup_2 = make_scope_exit(resource_stop);
 	listener_init(g_config_file->get_value("imap_listen_addr"),
-		listen_port, listen_tls_port);
+		listen_port, listen_tls_port,
+		g_config_file->get_ll("imap_listen_acceptors"));
 	if (0 != listener_run()) {
 		printf("[system]: fail to start listener\n");
 		return EXIT_FAILURE;
@@ -299,7 +302,8 @@ int main(int argc, const char **argv) try
 		context_num,
 		imap_parser_get_context_socket,
 		imap_parser_get_context_timestamp,
-		thread_charge_num, imap_conn_timeout); 
+		thread_charge_num, imap_conn_timeout,
+		g_config_file->get_ll("context_poll_shards"));
  
 	if (0 != contexts_pool_run()) { 
 		printf("[system]: failed to run contexts pool\n");
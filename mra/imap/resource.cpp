@@ -79,6 +79,10 @@ static constexpr std::pair<unsigned int, const char *> g_default_code_table[] =
 	{1728, "OK UID FETCH completed"},
 	{1729, "OK ID completed"},
 	{1730, "OK UID EXPUNGE completed"},
+	{1731, "OK ENABLE completed"},
+	{1732, "OK <MODIFIED> STORE completed"},
+	{1733, "OK <MODIFIED> UID STORE completed"},
+	{1734, "OK DEFLATE active"},
 	{1800, "BAD command not supported or parameter error"},
 	{1801, "BAD TLS negotiation only begin in not authenticated state"},
 	{1802, "BAD must issue a STARTTLS command first"},
@@ -100,6 +104,7 @@ static constexpr std::pair<unsigned int, const char *> g_default_code_table[] =
 	{1818, "BAD expected DONE"},
 	{1819, "BAD decode username error"},
 	{1820, "BAD decode password error"},
+	{1821, "BAD can only process in authenticated state"},
 	{1901, "NO access denied by user filter"},
 	{1902, "NO cannot get mailbox location from database"},
 	{1903, "NO too many failures, user will be blocked for a while"},
@@ -123,6 +128,7 @@ static constexpr std::pair<unsigned int, const char *> g_default_code_table[] =
 	{1921, "NO Too many messages in folder / midb returned too many results / IMAP buffer not big enough"},
 	{1922, "NO Too many messages in result"},
 	{1923, "NO Unable to read message file"},
+	{1924, "NO [COMPRESSIONACTIVE] DEFLATE already active"},
 	{2000 | MIDB_E_UNKNOWN_COMMAND, "midb: unknown command"},
 	{2000 | MIDB_E_PARAMETER_ERROR, "midb: command parameter error"},
 	{2000 | MIDB_E_HASHTABLE_FULL, "midb: hash table full"},
@@ -153,7 +159,6 @@ static constexpr std::pair<unsigned int, const char *> g_default_code_table[] =
 	{2000 | MIDB_E_MDB_SETMSGPROPS, "exmdb: set_msg_props RPC failed"},
 	{2000 | MIDB_E_MDB_WRITEMESSAGE, "exmdb: write_message RPC failed"},
 	{2000 | MIDB_E_MNG_CTMATCH, "midb: ct_match failed"},
-	{2000 | MIDB_E_MNG_SORTFOLDER, "midb: sort_folder failed"},
 	{2000 | MIDB_E_OXCMAIL_IMPORT, "oxcmail_import failed"},
 	{2000 | MIDB_E_SHORT_READ, "midb: short read on a file"},
 	{2000 | MIDB_E_SQLPREP, "sqlite3_prepare failed"},
@@ -31,6 +31,9 @@ E(fetch_simple)
 E(fetch_detail)
 E(fetch_simple_uid)
 E(fetch_detail_uid)
+E(fetch_changed_uid)
+E(fetch_changed)
+E(list_vanished)
 E(free_result)
 E(set_flags)
 E(unset_flags)
@@ -82,6 +85,9 @@ int system_services_run()
 	E(system_services_fetch_detail, "fetch_detail");
 	E(system_services_fetch_simple_uid, "fetch_simple_uid");
 	E(system_services_fetch_detail_uid, "fetch_detail_uid");
+	E(system_services_fetch_changed_uid, "fetch_changed_uid");
+	E(system_services_fetch_changed, "fetch_changed");
+	E(system_services_list_vanished, "list_vanished");
 	E(system_services_set_flags, "set_mail_flags");
 	E(system_services_unset_flags, "unset_mail_flags");
 	E(system_services_get_flags, "get_mail_flags");
@@ -127,6 +133,9 @@ void system_services_stop()
 	service_release("fetch_detail", "system");
 	service_release("fetch_simple_uid", "system");
 	service_release("fetch_detail_uid", "system");
+	service_release("fetch_changed_uid", "system");
+	service_release("fetch_changed", "system");
+	service_release("list_vanished", "system");
 	service_release("set_mail_flags", "system");
 	service_release("unset_mail_flags", "system");
 	service_release("get_mail_flags", "system");
@@ -23,13 +23,16 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <gromox/atomic.hpp>
 #include <gromox/config_file.hpp>
 #include <gromox/defs.h>
 #include <gromox/double_list.hpp>
+#include <gromox/endian.hpp>
 #include <gromox/fileio.h>
 #include <gromox/list_file.hpp>
 #include <gromox/mem_file.hpp>
+#include <gromox/midb.hpp>
 #include <gromox/msg_unit.hpp>
 #include <gromox/scope.hpp>
 #include <gromox/socket.h>
@@ -38,9 +41,17 @@
 #include <gromox/xarray2.hpp>
 #include "midb_agent.hpp"
 
+#define MIDB_PIPELINE_DEPTH 32
+
 using namespace gromox;
+using LLU = unsigned long long;
 using AGENT_MITEM = MITEM;
 
+/* framed records carry the FLAG_* bits as-is */
+static_assert(+FLAG_RECENT == +MIDB_RF_RECENT && +FLAG_ANSWERED == +MIDB_RF_ANSWERED &&
+              +FLAG_FLAGGED == +MIDB_RF_FLAGGED && +FLAG_DELETED == +MIDB_RF_DELETED &&
+              +FLAG_SEEN == +MIDB_RF_SEEN && +FLAG_DRAFT == +MIDB_RF_DRAFT);
+
 namespace {
 
 struct SEQUENCE_NODE {
@@ -54,6 +65,8 @@ struct BACK_CONN {
 	int sockd = -1;
 	time_t last_time = 0;
 	BACK_SVR *psvr = nullptr;
+	bool framed = false; /* midb accepted the FRAME verb */
+	uint32_t reqid = 0;
 };
 
 struct BACK_CONN_floating {
@@ -81,14 +94,14 @@ struct BACK_SVR {
 static void free_result(XARRAY *);
 static void *midbag_scanwork(void *);
 static ssize_t read_line(int sockd, char *buff, size_t length);
-static int connect_midb(const char *host, uint16_t port);
+static int connect_midb(const char *host, uint16_t port, bool *framed);
 static BOOL get_digest_string(const char *src, int length, const char *tag, char *buff, int buff_len);
 static BOOL get_digest_integer(const char *src, int length, const char *tag, int *pinteger);
 static int list_mail(const char *path, const char *folder, std::vector<MSG_UNIT> &, int *num, uint64_t *size);
 static int delete_mail(const char *path, const char *folder, const std::vector<MSG_UNIT *> &);
 static int get_mail_id(const char *path, const char *folder, const char *mid_string, unsigned int *id);
 static int get_mail_uid(const char *path, const char *folder, const char *mid_string, unsigned int *uid);
-static int summary_folder(const char *path, const char *folder, int *exists, int *recent, int *unseen, unsigned long *uidvalid, unsigned int *uidnext, int *first_seen, int *perrno);
+static int summary_folder(const char *path, const char *folder, int *exists, int *recent, int *unseen, unsigned long *uidvalid, unsigned int *uidnext, int *first_seen, uint64_t *highestmodseq, int *perrno);
 static int make_folder(const char *path, const char *folder, int *perrno);
 static int remove_folder(const char *path, const char *folder, int *perrno);
 static int ping_mailbox(const char *path, int *perrno);
@@ -106,10 +119,14 @@ static void free_result(XARRAY *pxarray);
 static int fetch_simple(const char *path, const char *folder, const DOUBLE_LIST *, XARRAY *, int *perrno);
 static int fetch_detail(const char *path, const char *folder, const DOUBLE_LIST *, XARRAY *, int *perrno);
 static int fetch_simple_uid(const char *path, const char *folder, const DOUBLE_LIST *, XARRAY *, int *perrno);
+static int fetch_changed_uid(const char *path, const char *folder, const DOUBLE_LIST *, uint64_t changedsince, XARRAY *, int *perrno);
+static int fetch_changed(const char *path, const char *folder, const DOUBLE_LIST *, uint64_t changedsince, XARRAY *, int *perrno);
+static int fetch_changed_common(const char *path, const char *folder, const DOUBLE_LIST *, uint64_t changedsince, bool b_uid, XARRAY *, int *perrno);
+static int list_vanished(const char *path, const char *folder, uint64_t modseq, std::string &ret_buff, int *perrno);
 static int fetch_detail_uid(const char *path, const char *folder, const DOUBLE_LIST *, XARRAY *, int *perrno);
 static int set_mail_flags(const char *path, const char *folder, const char *mid_string, int flag_bits, int *perrno);
 static int unset_mail_flags(const char *path, const char *folder, const char *mid_string, int flag_bits, int *perrno);
-static int get_mail_flags(const char *path, const char *folder, const char *mid_string, int *pflag_bits, int *perrno);
+static int get_mail_flags(const char *path, const char *folder, const char *mid_string, int *pflag_bits, uint64_t *pmodseq, int *perrno);
 static int copy_mail(const char *path, const char *src_folder, const char *mid_string, const char *dst_folder, char *dst_mid, int *perrno);
 static int imap_search(const char *path, const char *folder, const char *charset, int argc, char **argv, std::string &ret_buff, int *perrno);
 static int imap_search_uid(const char *path, const char *folder, const char *charset, int argc, char **argv, std::string &ret_buff, int *perrno);
@@ -248,6 +265,8 @@ static BOOL svc_midb_agent(int reason, void **ppdata)
 		    !E(remove_mail) || !E(list_simple) || !E(list_deleted) ||
 		    !E(list_detail) || !E(fetch_simple) || !E(fetch_detail) ||
 		    !E(fetch_simple_uid) || !E(fetch_detail_uid) ||
+		    !E(fetch_changed_uid) || !E(fetch_changed) ||
+		    !E(list_vanished) ||
 		    !E(free_result) || !E(set_mail_flags) ||
 		    !E(unset_mail_flags) || !E(get_mail_flags) ||
 		    !E(copy_mail) || !E(imap_search) || !E(imap_search_uid) ||
@@ -336,7 +355,7 @@ static void *midbag_scanwork(void *param)
 		while (temp_list.size() > 0) {
 			auto pback = &temp_list.front();
 			pback->sockd = connect_midb(pback->psvr->ip_addr,
-							pback->psvr->port);
+			               pback->psvr->port, &pback->framed);
 			if (-1 != pback->sockd) {
 				time(&pback->last_time);
 				sv_hold.lock();
@@ -664,6 +683,37 @@ static int imap_search(const char *path, const char *folder,
 	return MIDB_LOCAL_ENOMEM;
 }
 
+/**
+ * Obtain the UIDs expunged from @folder after @modseq, as an IMAP
+ * sequence set (for QRESYNC's VANISHED responses).
+ */
+static int list_vanished(const char *path, const char *folder,
+    uint64_t modseq, std::string &ret_buff, int *perrno) try
+{
+	auto pback = get_connection(path);
+	if (pback == nullptr)
+		return MIDB_NO_SERVER;
+	auto cbufsize = g_midb_command_buffer_size.load();
+	auto buff = std::make_unique<char[]>(cbufsize);
+	auto length = gx_snprintf(buff.get(), cbufsize, "P-VNSH %s %s %llu\r\n",
+	              path, folder, LLU{modseq});
+	auto ret = rw_command(pback->sockd, buff.get(), length, cbufsize);
+	if (ret != 0)
+		return ret;
+	if (strncmp(buff.get(), "TRUE", 4) == 0) {
+		pback.reset();
+		ret_buff.assign(buff[4] == ' ' ? &buff[5] : &buff[4]);
+		return MIDB_RESULT_OK;
+	} else if (strncmp(buff.get(), "FALSE ", 6) == 0) {
+		pback.reset();
+		*perrno = strtol(&buff[6], nullptr, 0);
+		return MIDB_RESULT_ERROR;
+	}
+	return MIDB_RDWR_ERROR;
+} catch (const std::bad_alloc &) {
+	return MIDB_LOCAL_ENOMEM;
+}
+
 static int imap_search_uid(const char *path, const char *folder,
    const char *charset, int argc, char **argv, std::string &ret_buff,
    int *perrno) try
@@ -770,13 +820,15 @@ static int get_mail_uid(const char *path, const char *folder,
 
 static int summary_folder(const char *path, const char *folder, int *pexists,
 	int *precent, int *punseen, unsigned long *puidvalid,
-	unsigned int *puidnext, int *pfirst_unseen, int *perrno)
+	unsigned int *puidnext, int *pfirst_unseen, uint64_t *phighestmodseq,
+	int *perrno)
 {
 	char buff[1024];
 	int exists, recent;
 	int unseen, first_unseen;
 	unsigned long uidvalid;
 	unsigned int uidnext;
+	unsigned long long highestmodseq = 0;
 
 	auto pback = get_connection(path);
 	if (pback == nullptr)
@@ -786,8 +838,10 @@ static int summary_folder(const char *path, const char *folder, int *pexists,
 	if (ret != 0)
 		return ret;
 	if (0 == strncmp(buff, "TRUE", 4)) {
-		if (6 != sscanf(buff, "TRUE %d %d %d %lu %u %d", &exists,
-		    &recent, &unseen, &uidvalid, &uidnext, &first_unseen)) {
+		/* highestmodseq is absent with older midb */
+		if (sscanf(buff, "TRUE %d %d %d %lu %u %d %llu", &exists,
+		    &recent, &unseen, &uidvalid, &uidnext, &first_unseen,
+		    &highestmodseq) < 6) {
 			*perrno = -1;
 			pback.reset();
 			return MIDB_RESULT_ERROR;
@@ -810,6 +864,8 @@ static int summary_folder(const char *path, const char *folder, int *pexists,
 		if (NULL != pfirst_unseen) {
 			*pfirst_unseen = first_unseen + 1;
 		}
+		if (phighestmodseq != nullptr)
+			*phighestmodseq = highestmodseq;
 		pback.reset();
 		return MIDB_RESULT_OK;
 	} else if (0 == strncmp(buff, "FALSE ", 6)) {
@@ -1262,6 +1318,21 @@ static unsigned int s_to_flagbits(const char *s)
 	return fl;
 }
 
+/* modseq trails the "(flags)" column; absent with older midb */
+static uint64_t s_to_modseq(const char *s)
+{
+	auto p = strchr(s, ')');
+	return p != nullptr ? strtoull(p + 1, nullptr, 0) : 0;
+}
+
+static uint64_t di_to_modseq(const char *ln, int pos)
+{
+	char num_buff[32];
+	if (!get_digest_string(ln, pos, "modseq", num_buff, std::size(num_buff)))
+		return 0;
+	return strtoull(num_buff, nullptr, 0);
+}
+
 static unsigned int di_to_flagbits(const char *ln, int pos)
 {
 	unsigned int fl = 0;
@@ -1281,6 +1352,133 @@ static unsigned int di_to_flagbits(const char *ln, int pos)
 	return fl;
 }
 
+static int read_full(int fd, void *vbuf, size_t z)
+{
+	auto buf = static_cast<char *>(vbuf);
+	while (z > 0) {
+		struct pollfd pfd = {fd};
+		pfd.events = POLLIN_SET;
+		if (poll(&pfd, 1, SOCKET_TIMEOUT * 1000) <= 0)
+			return -1;
+		auto ret = read(fd, buf, z);
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		z -= ret;
+	}
+	return 0;
+}
+
+static bool frame_send(int fd, uint32_t reqid, const std::string &cmd)
+{
+	char hdr[MIDB_FRAME_HDRLEN]{};
+	hdr[0] = static_cast<char>(MIDB_FRAME_MAGIC);
+	cpu_to_le32p(&hdr[4], reqid);
+	cpu_to_le32p(&hdr[8], cmd.size());
+	struct iovec iov[] = {
+		{hdr, sizeof(hdr)},
+		{const_cast<char *>(cmd.data()), cmd.size()},
+	};
+	return writev(fd, iov, std::size(iov)) ==
+	       static_cast<ssize_t>(sizeof(hdr) + cmd.size());
+}
+
+static int frame_recv(int fd, uint32_t *reqid, std::string &out)
+{
+	char hdr[MIDB_FRAME_HDRLEN];
+	if (read_full(fd, hdr, sizeof(hdr)) != 0 ||
+	    static_cast<uint8_t>(hdr[0]) != MIDB_FRAME_MAGIC)
+		return MIDB_RDWR_ERROR;
+	*reqid = le32p_to_cpu(&hdr[4]);
+	out.resize(le32p_to_cpu(&hdr[8]));
+	return read_full(fd, out.data(), out.size()) == 0 ?
+	       MIDB_RESULT_OK : MIDB_RDWR_ERROR;
+}
+
+/* Decode a framed P-SIML/P-SIMU response (see midb.hpp) into @pxarray */
+static int simrec_parse(const std::string &rsp, XARRAY *pxarray, int *perrno)
+{
+	auto eol = rsp.find("\r\n");
+	if (eol == rsp.npos)
+		return MIDB_RDWR_ERROR;
+	if (strncmp(rsp.c_str(), "FALSE ", 6) == 0) {
+		*perrno = strtol(rsp.c_str() + 6, nullptr, 0);
+		return MIDB_RESULT_ERROR;
+	}
+	if (strncmp(rsp.c_str(), "TRUE ", 5) != 0)
+		return MIDB_RDWR_ERROR;
+	auto count = strtol(rsp.c_str() + 5, nullptr, 0);
+	if (count < 0)
+		return MIDB_RDWR_ERROR;
+	size_t pos = eol + 2;
+	for (long i = 0; i < count; ++i) {
+		if (rsp.size() - pos < MIDB_SIMREC_LEN) {
+			*perrno = -1;
+			return MIDB_RESULT_ERROR;
+		}
+		auto rec = &rsp[pos];
+		size_t midlen = le16p_to_cpu(&rec[18]);
+		if (rsp.size() - pos - MIDB_SIMREC_LEN < midlen) {
+			*perrno = -1;
+			return MIDB_RESULT_ERROR;
+		}
+		MITEM mitem;
+		mitem.id = le32p_to_cpu(&rec[0]) + 1;
+		mitem.uid = le32p_to_cpu(&rec[4]);
+		mitem.modseq = le64p_to_cpu(&rec[8]);
+		mitem.flag_bits = le16p_to_cpu(&rec[16]) & ~MIDB_RF_FORWARDED;
+		memcpy(mitem.mid, &rec[MIDB_SIMREC_LEN],
+		       std::min(midlen, sizeof(mitem.mid) - 1));
+		auto mitem_uid = mitem.uid;
+		pxarray->append(std::move(mitem), mitem_uid);
+		pos += MIDB_SIMREC_LEN + midlen;
+	}
+	return MIDB_RESULT_OK;
+}
+
+/*
+ * Issue P-SIML/P-SIMU commands on a framed connection. Up to
+ * MIDB_PIPELINE_DEPTH requests are outstanding at any time; responses are
+ * matched to their request by reqid and decoded in request order.
+ */
+static int simrec_query(BACK_CONN_floating &pback,
+    const std::vector<std::string> &cmds, XARRAY *pxarray, int *perrno) try
+{
+	auto fd = pback->sockd;
+	auto base = pback->reqid;
+	pback->reqid += cmds.size();
+	std::vector<std::string> rsp(cmds.size());
+	size_t sent = 0, recvd = 0;
+	while (recvd < cmds.size()) {
+		while (sent < cmds.size() && sent - recvd < MIDB_PIPELINE_DEPTH) {
+			if (!frame_send(fd, base + sent, cmds[sent]))
+				return MIDB_RDWR_ERROR;
+			++sent;
+		}
+		uint32_t reqid = 0;
+		std::string out;
+		auto ret = frame_recv(fd, &reqid, out);
+		if (ret != MIDB_RESULT_OK)
+			return ret;
+		size_t slot = reqid - base;
+		if (slot >= sent || out.empty() || !rsp[slot].empty())
+			return MIDB_RDWR_ERROR;
+		rsp[slot] = std::move(out);
+		++recvd;
+	}
+	time(&pback->last_time);
+	pback.reset();
+	for (const auto &r : rsp) {
+		auto ret = simrec_parse(r, pxarray, perrno);
+		if (ret != MIDB_RESULT_OK)
+			return ret;
+	}
+	return MIDB_RESULT_OK;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2821: ENOMEM");
+	return MIDB_LOCAL_ENOMEM;
+}
+
 static int list_simple(const char *path, const char *folder, XARRAY *pxarray,
 	int *perrno)
 {
@@ -1303,6 +1501,13 @@ static int list_simple(const char *path, const char *folder, XARRAY *pxarray,
 	if (pback == nullptr)
 		return MIDB_NO_SERVER;
 	auto EH = make_scope_exit([=]() { pxarray->clear(); });
+	if (pback->framed) {
+		gx_snprintf(buff, std::size(buff), "P-SIML %s %s UID ASC", path, folder);
+		auto ret = simrec_query(pback, {buff}, pxarray, perrno);
+		if (ret == MIDB_RESULT_OK)
+			EH.release();
+		return ret;
+	}
 	auto length = gx_snprintf(buff, arsizeof(buff), "P-SIML %s %s UID ASC\r\n", path, folder);
 	if (length != write(pback->sockd, buff, length)) {
 		return MIDB_RDWR_ERROR;
@@ -1372,6 +1577,7 @@ static int list_simple(const char *path, const char *folder, XARRAY *pxarray,
 						mitem.id = count;
 						mitem.uid = strtol(pspace, nullptr, 0);
 						mitem.flag_bits = s_to_flagbits(pspace1);
+						mitem.modseq = s_to_modseq(pspace1);
 						auto mitem_uid = mitem.uid;
 						pxarray->append(std::move(mitem), mitem_uid);
 					} else {
@@ -1632,6 +1838,7 @@ static int list_detail(const char *path, const char *folder, XARRAY *pxarray,
 				    "uid", &mitem.uid)) {
 					mitem.id = count;
 					mitem.flag_bits = FLAG_LOADED | di_to_flagbits(temp_line, line_pos);
+					mitem.modseq = di_to_modseq(temp_line, line_pos);
 					mem_file_init(&mitem.f_digest, &g_file_allocator);
 					mitem.f_digest.write(temp_line, line_pos);
 					auto mitem_uid = mitem.uid;
@@ -1703,7 +1910,33 @@ static int fetch_simple(const char *path, const char *folder,
 	auto pback = get_connection(path);
 	if (pback == nullptr)
 		return MIDB_NO_SERVER;
-	
+	auto EH = make_scope_exit([=]() { pxarray->clear(); });
+	if (pback->framed) try {
+		std::vector<std::string> cmds;
+		for (auto pnode = double_list_get_head(plist); pnode != nullptr;
+		     pnode = double_list_get_after(plist, pnode)) {
+			auto pseq = static_cast<const SEQUENCE_NODE *>(pnode->pdata);
+			if (pseq->max == -1 && pseq->min == -1)
+				gx_snprintf(buff, std::size(buff), "P-SIML %s %s UID ASC -1 1",
+				            path, folder);
+			else if (pseq->max == -1)
+				gx_snprintf(buff, std::size(buff), "P-SIML %s %s UID ASC %d 1000000000",
+				            path, folder, pseq->min - 1);
+			else
+				gx_snprintf(buff, std::size(buff), "P-SIML %s %s UID ASC %d %d",
+				            path, folder, pseq->min - 1,
+				            pseq->max - pseq->min + 1);
+			cmds.emplace_back(buff);
+		}
+		auto ret = simrec_query(pback, cmds, pxarray, perrno);
+		if (ret == MIDB_RESULT_OK)
+			EH.release();
+		return ret;
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-2822: ENOMEM");
+		return MIDB_LOCAL_ENOMEM;
+	}
+
 	for (auto pnode = double_list_get_head(plist); pnode != nullptr;
 		pnode=double_list_get_after(plist, pnode)) {
 		auto pseq = static_cast<const SEQUENCE_NODE *>(pnode->pdata);
@@ -1791,6 +2024,7 @@ static int fetch_simple(const char *path, const char *folder,
 								pitem->id = pseq->min + count - 1;
 								gx_strlcpy(pitem->mid, temp_line, arsizeof(pitem->mid));
 								pitem->flag_bits = s_to_flagbits(pspace1);
+								pitem->modseq = s_to_modseq(pspace1);
 							}
 						} else {
 							b_format_error = TRUE;
@@ -1829,6 +2063,7 @@ static int fetch_simple(const char *path, const char *folder,
 	}
 	
 	pback.reset();
+	EH.release();
 	return MIDB_RESULT_OK;
 }
 
@@ -1941,6 +2176,7 @@ static int fetch_detail(const char *path, const char *folder,
 							auto pitem = pxarray->get_item(num - 1);
 							pitem->id = pseq->min + count - 1;
 							pitem->flag_bits = FLAG_LOADED | di_to_flagbits(temp_line, line_pos);
+							pitem->modseq = di_to_modseq(temp_line, line_pos);
 							mem_file_init(&pitem->f_digest, &g_file_allocator);
 							pitem->f_digest.write(temp_line, line_pos);
 						}
@@ -1988,6 +2224,57 @@ static int fetch_detail(const char *path, const char *folder,
 
 static int fetch_simple_uid(const char *path, const char *folder,
     const DOUBLE_LIST *plist, XARRAY *pxarray, int *perrno)
+{
+	return fetch_changed_uid(path, folder, plist, 0, pxarray, perrno);
+}
+
+/*
+ * Build the P-SIMU (by UID) or P-SIML (by sequence number) request for one
+ * range. P-SIML always gets the changedsince argument so that its text
+ * response carries the sequence index like P-SIMU does.
+ */
+static int changed_cmd(char *buff, size_t z, const char *path,
+    const char *folder, const SEQUENCE_NODE *pseq, uint64_t changedsince,
+    bool b_uid)
+{
+	if (b_uid)
+		return changedsince == 0 ?
+		       gx_snprintf(buff, z, "P-SIMU %s %s UID ASC %d %d",
+		       path, folder, pseq->min, pseq->max) :
+		       gx_snprintf(buff, z, "P-SIMU %s %s UID ASC %d %d %llu",
+		       path, folder, pseq->min, pseq->max, LLU{changedsince});
+	if (pseq->max == -1 && pseq->min == -1)
+		return gx_snprintf(buff, z, "P-SIML %s %s UID ASC -1 1 %llu",
+		       path, folder, LLU{changedsince});
+	else if (pseq->max == -1)
+		return gx_snprintf(buff, z, "P-SIML %s %s UID ASC %d 1000000000 %llu",
+		       path, folder, pseq->min - 1, LLU{changedsince});
+	return gx_snprintf(buff, z, "P-SIML %s %s UID ASC %d %d %llu",
+	       path, folder, pseq->min - 1, pseq->max - pseq->min + 1,
+	       LLU{changedsince});
+}
+
+/* Like fetch_simple_uid, but only for messages with modseq > changedsince */
+static int fetch_changed_uid(const char *path, const char *folder,
+    const DOUBLE_LIST *plist, uint64_t changedsince, XARRAY *pxarray,
+    int *perrno)
+{
+	return fetch_changed_common(path, folder, plist, changedsince, true,
+	       pxarray, perrno);
+}
+
+/* Like fetch_simple, but only for messages with modseq > changedsince */
+static int fetch_changed(const char *path, const char *folder,
+    const DOUBLE_LIST *plist, uint64_t changedsince, XARRAY *pxarray,
+    int *perrno)
+{
+	return fetch_changed_common(path, folder, plist, changedsince, false,
+	       pxarray, perrno);
+}
+
+static int fetch_changed_common(const char *path, const char *folder,
+    const DOUBLE_LIST *plist, uint64_t changedsince, bool b_uid,
+    XARRAY *pxarray, int *perrno)
 {
 	int lines;
 	int count;
@@ -2007,12 +2294,32 @@ static int fetch_simple_uid(const char *path, const char *folder,
 	auto pback = get_connection(path);
 	if (pback == nullptr)
 		return MIDB_NO_SERVER;
-	
+	auto EH = make_scope_exit([=]() { pxarray->clear(); });
+	if (pback->framed) try {
+		std::vector<std::string> cmds;
+		for (auto pnode = double_list_get_head(plist); pnode != nullptr;
+		     pnode = double_list_get_after(plist, pnode)) {
+			auto pseq = static_cast<const SEQUENCE_NODE *>(pnode->pdata);
+			changed_cmd(buff, std::size(buff), path, folder, pseq,
+				changedsince, b_uid);
+			cmds.emplace_back(buff);
+		}
+		auto ret = simrec_query(pback, cmds, pxarray, perrno);
+		if (ret == MIDB_RESULT_OK)
+			EH.release();
+		return ret;
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-2823: ENOMEM");
+		return MIDB_LOCAL_ENOMEM;
+	}
+
 	for (auto pnode = double_list_get_head(plist); pnode != nullptr;
 		pnode=double_list_get_after(plist, pnode)) {
 		auto pseq = static_cast<const SEQUENCE_NODE *>(pnode->pdata);
-		auto length = gx_snprintf(buff, arsizeof(buff), "P-SIMU %s %s UID ASC %d %d\r\n", path, folder,
-					pseq->min, pseq->max);
+		auto length = changed_cmd(buff, std::size(buff) - 2, path,
+		              folder, pseq, changedsince, b_uid);
+		buff[length++] = '\r';
+		buff[length++] = '\n';
 		if (length != write(pback->sockd, buff, length)) {
 			return MIDB_RDWR_ERROR;
 		}
@@ -2088,6 +2395,7 @@ static int fetch_simple_uid(const char *path, const char *folder,
 									pitem->id = strtol(temp_line, nullptr, 0) + 1;
 									gx_strlcpy(pitem->mid, pspace, arsizeof(pitem->mid));
 									pitem->flag_bits = s_to_flagbits(pspace2);
+									pitem->modseq = s_to_modseq(pspace2);
 								}
 							} else {
 								b_format_error = TRUE;
@@ -2129,6 +2437,7 @@ static int fetch_simple_uid(const char *path, const char *folder,
 	}
 
 	pback.reset();
+	EH.release();
 	return MIDB_RESULT_OK;
 }
 
@@ -2235,6 +2544,7 @@ static int fetch_detail_uid(const char *path, const char *folder,
 							auto pitem = pxarray->get_item(num - 1);
 							pitem->id = strtol(temp_line, nullptr, 0) + 1;
 							pitem->flag_bits = FLAG_LOADED | di_to_flagbits(pspace, temp_len);
+							pitem->modseq = di_to_modseq(pspace, temp_len);
 							mem_file_init(&pitem->f_digest, &g_file_allocator);
 							pitem->f_digest.write(pspace, temp_len);
 						}
@@ -2400,7 +2710,7 @@ static int unset_mail_flags(const char *path, const char *folder,
 }
 	
 static int get_mail_flags(const char *path, const char *folder,
-    const char *mid_string, int *pflag_bits, int *perrno)
+    const char *mid_string, int *pflag_bits, uint64_t *pmodseq, int *perrno)
 {
 	char buff[1024];
 
@@ -2417,6 +2727,8 @@ static int get_mail_flags(const char *path, const char *folder,
 		*pflag_bits = 0;
 		if (buff[4] == ' ')
 			*pflag_bits = s_to_flagbits(buff + 5);
+		if (pmodseq != nullptr)
+			*pmodseq = buff[4] == ' ' ? s_to_modseq(buff + 5) : 0;
 		return MIDB_RESULT_OK;
 	} else if (0 == strncmp(buff, "FALSE ", 6)) {
 		pback.reset();
@@ -2535,7 +2847,7 @@ static BOOL check_full(const char *path)
 	}
 }
 
-static int connect_midb(const char *ip_addr, uint16_t port)
+static int connect_midb(const char *ip_addr, uint16_t port, bool *framed)
 {
 	int tv_msec;
     char temp_buff[1024];
@@ -2569,6 +2881,13 @@ static int connect_midb(const char *ip_addr, uint16_t port)
 		close(sockd);
 		return -1;
 	}
+	/* Older midb answer FALSE and the connection stays text-only. */
+	if (write(sockd, "FRAME\r\n", 7) != 7 ||
+	    read_line(sockd, temp_buff, std::size(temp_buff)) <= 0) {
+		close(sockd);
+		return -1;
+	}
+	*framed = strcmp(temp_buff, "TRUE") == 0;
 	return sockd;
 }
 
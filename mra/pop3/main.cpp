@@ -55,6 +55,7 @@ static constexpr cfg_directive pop3_cfg_defaults[] = {
 	{"context_average_units", "5000", CFG_SIZE, "1"},
 	{"context_max_mem", "2M", CFG_SIZE},
 	{"context_num", "400", CFG_SIZE, "1"},
+	{"context_poll_shards", "0", CFG_SIZE, "0", "64"},
 	{"data_file_path", PKGDATADIR "/pop3:" PKGDATADIR},
 	{"listen_port", "pop3_listen_port", CFG_ALIAS},
 	{"listen_ssl_port", "pop3_listen_tls_port", CFG_ALIAS},
@@ -63,6 +64,7 @@ static constexpr cfg_directive pop3_cfg_defaults[] = {
 	{"pop3_conn_timeout", "3min", CFG_TIME, "1s"},
 	{"pop3_force_stls", "pop3_force_stls", CFG_ALIAS},
 	{"pop3_force_tls", "false", CFG_BOOL},
+	{"pop3_listen_acceptors", "1", CFG_SIZE, "1", "64"},
 	{"pop3_listen_addr", "::"},
 	{"pop3_listen_port", "110"},
 	{"pop3_listen_tls_port", "0"},
@@ -237,7 +239,8 @@ int main(int argc, const char **argv) try
 	auto cleanup_2 = make_scope_exit(resource_stop);
 	uint16_t listen_port = g_config_file->get_ll("pop3_listen_port");
 	listener_init(g_config_file->get_value("pop3_listen_addr"),
-		listen_port, listen_tls_port);
+		listen_port, listen_tls_port,
+		g_config_file->get_ll("pop3_listen_acceptors"));
 	if (0 != listener_run()) {
 		printf("[system]: fail to start listener\n");
 		return EXIT_FAILURE;
@@ -297,7 +300,8 @@ int main(int argc, const char **argv) try
 	contexts_pool_init(pop3_parser_get_contexts_list(), context_num,
 		pop3_parser_get_context_socket,
 		pop3_parser_get_context_timestamp,
-		thread_charge_num, pop3_conn_timeout); 
+		thread_charge_num, pop3_conn_timeout,
+		g_config_file->get_ll("context_poll_shards"));
  
 	if (0 != contexts_pool_run()) { 
 		printf("[system]: failed to run contexts pool\n");
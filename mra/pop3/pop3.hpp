@@ -65,7 +65,7 @@ struct pop3_context final : public schedule_context {
 };
 using POP3_CONTEXT = pop3_context;
 
-extern void listener_init(const char *addr, uint16_t port, uint16_t port_ssl);
+extern void listener_init(const char *addr, uint16_t port, uint16_t port_ssl, unsigned int acceptors);
 extern int listener_run();
 extern int listener_trigger_accept();
 extern void listener_stop_accept();
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * get/put throughput of LIB_BUFFER from many threads, without and with
+ * the per-thread magazines that alloc_limiter uses.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <gromox/util.hpp>
+
+using clk = std::chrono::steady_clock;
+
+namespace {
+struct item {
+	char buf[256];
+};
+}
+
+static std::atomic<bool> g_failed;
+
+static item *get_item(LIB_BUFFER &pool) { return pool.get<item>(); }
+static item *get_item(alloc_limiter<item> &pool) { return pool.get(); }
+
+template<typename P> static void hammer(P &pool, size_t rounds)
+{
+	item *held[8];
+	for (size_t r = 0; r < rounds; ++r) {
+		/* a connection's worth of objects, then give them back */
+		for (auto &p : held) {
+			p = get_item(pool);
+			if (p == nullptr) {
+				g_failed = true;
+				return;
+			}
+			p->buf[0] = 1;
+		}
+		for (auto p : held)
+			pool.put(p);
+	}
+}
+
+template<typename P> static long long run(P &pool, unsigned int nthr, size_t rounds)
+{
+	std::vector<std::thread> thr;
+	auto t0 = clk::now();
+	for (unsigned int i = 0; i < nthr; ++i)
+		thr.emplace_back(hammer<P>, std::ref(pool), rounds);
+	for (auto &t : thr)
+		t.join();
+	return std::chrono::duration_cast<std::chrono::milliseconds>(clk::now() - t0).count();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nthr = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 64;
+	size_t rounds = argc >= 3 ? strtoull(argv[2], nullptr, 0) : 200000;
+	/* exactly what the threads hold at peak: idle magazines must not starve */
+	size_t max = nthr * 8;
+	LIB_BUFFER plain(sizeof(item), max, "plain");
+	alloc_limiter<item> mag(max, "magazine");
+	auto t_plain = run(plain, nthr, rounds);
+	auto t_mag = run(mag, nthr, rounds);
+	printf("%u threads x %zu rounds x 8 objects\n", nthr, rounds);
+	printf("shared counter: %6lld ms\n", t_plain);
+	printf("magazines:      %6lld ms\n", t_mag);
+	auto &in = mag.internals();
+	if (g_failed || plain.allocated_num != 0 || in.allocated_num > in.max_items) {
+		fprintf(stderr, "accounting mismatch\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Pull a message with a multi-megabyte attachment through the FastTransfer
+ * producer in GetBuffer-sized pieces and compare against the expected
+ * encoding.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <memory>
+#include <string>
+#include <gromox/element_data.hpp>
+#include <gromox/endian.hpp>
+#include <gromox/fileio.h>
+#include <gromox/mapidefs.h>
+#include <gromox/paths.h>
+#include <gromox/util.hpp>
+#include "../exch/emsmdb/common_util.h"
+#include "../exch/emsmdb/emsmdb_interface.h"
+#include "../exch/emsmdb/ftstream_producer.h"
+#include "../exch/emsmdb/logon_object.h"
+
+using namespace gromox;
+
+/* The producer only needs these for named properties and string conversion. */
+void *common_util_alloc(size_t size) { return malloc(size); }
+ssize_t common_util_convert_string(bool, const char *, char *, size_t) { return -1; }
+BINARY *common_util_guid_to_binary(GUID) { return nullptr; }
+EMSMDB_INFO *emsmdb_interface_get_emsmdb_info() { return nullptr; }
+BOOL logon_object::get_named_propname(uint16_t, PROPERTY_NAME *) { return false; }
+
+static size_t count_entries(const char *path)
+{
+	std::unique_ptr<DIR, file_deleter> dh(opendir(path));
+	if (dh == nullptr)
+		return 0;
+	size_t n = 0;
+	while (readdir(dh.get()) != nullptr)
+		++n;
+	return n;
+}
+
+static void put32(std::string &s, uint32_t v)
+{
+	v = cpu_to_le32(v);
+	s.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static void put_long(std::string &s, uint32_t tag, uint32_t v)
+{
+	put32(s, tag);
+	put32(s, v);
+}
+
+static void put_bin(std::string &s, uint32_t tag, const BINARY &bin)
+{
+	put32(s, tag);
+	put32(s, bin.cb);
+	s.append(bin.pc, bin.cb);
+}
+
+static int t_bigmsg()
+{
+	static constexpr size_t big_size = 5U << 20;
+	auto big = std::make_unique<char[]>(big_size);
+	for (size_t i = 0; i < big_size; ++i)
+		big[i] = i * 7 + (i >> 13);
+	BINARY bin_big{}, bin_small{};
+	bin_big.cb = big_size;
+	bin_big.pc = big.get();
+	bin_small.cb = 100;
+	bin_small.pc = big.get() + 12345;
+	uint32_t flags = MSGFLAG_READ, num0 = 0, num1 = 1;
+
+	std::unique_ptr<MESSAGE_CONTENT, mc_delete> msg(message_content_init());
+	auto atl = attachment_list_init();
+	if (msg == nullptr || atl == nullptr)
+		return EXIT_FAILURE;
+	message_content_set_attachments_internal(msg.get(), atl);
+	if (msg->proplist.set(PR_MESSAGE_FLAGS, &flags) != 0)
+		return EXIT_FAILURE;
+	for (auto [num, bin] : {std::pair{&num0, &bin_big}, std::pair{&num1, &bin_small}}) {
+		auto at = attachment_content_init();
+		if (at == nullptr)
+			return EXIT_FAILURE;
+		if (!attachment_list_append_internal(atl, at)) {
+			attachment_content_free(at);
+			return EXIT_FAILURE;
+		}
+		if (at->proplist.set(PR_ATTACH_NUM, num) != 0 ||
+		    at->proplist.set(PR_ATTACH_DATA_BIN, bin) != 0)
+			return EXIT_FAILURE;
+	}
+
+	std::string exp;
+	put32(exp, STARTMESSAGE);
+	put_long(exp, PR_MESSAGE_FLAGS, flags);
+	put32(exp, NEWATTACH);
+	put_long(exp, PR_ATTACH_NUM, num0);
+	put_bin(exp, PR_ATTACH_DATA_BIN, bin_big);
+	put32(exp, ENDATTACH);
+	put32(exp, NEWATTACH);
+	put_long(exp, PR_ATTACH_NUM, num1);
+	put_bin(exp, PR_ATTACH_DATA_BIN, bin_small);
+	put32(exp, ENDATTACH);
+	put32(exp, ENDMESSAGE);
+
+	auto files = count_entries(LOCAL_DISK_TMPDIR);
+	auto fds = count_entries("/proc/self/fd");
+	auto ps = fxstream_producer::create(nullptr, STRING_OPTION_UNICODE);
+	if (ps == nullptr || !ps->write_message(msg.get()))
+		return EXIT_FAILURE;
+	/* The producer must not depend on the caller's copy. */
+	msg.reset();
+	if (ps->total_length() < static_cast<int>(big_size)) {
+		fprintf(stderr, "total_length %d too small\n", ps->total_length());
+		return EXIT_FAILURE;
+	}
+
+	std::string got;
+	BOOL b_last = false;
+	for (unsigned int i = 0; !b_last; ++i) {
+		char buf[0x8000];
+		uint16_t req = i % 2 == 0 ? 0x7c00 : 0x1fff, len = req;
+		if (!ps->read_buffer(buf, &len, &b_last) || len > req) {
+			fprintf(stderr, "read_buffer failed at %zu\n", got.size());
+			return EXIT_FAILURE;
+		}
+		got.append(buf, len);
+		size_t chunks = 0;
+		for (const auto &seg : ps->segs)
+			chunks += seg.buf != nullptr;
+		if (chunks > 2) {
+			fprintf(stderr, "%zu chunks encoded ahead at %zu\n",
+			        chunks, got.size());
+			return EXIT_FAILURE;
+		}
+		if (got.size() > exp.size() || (len == 0 && !b_last)) {
+			fprintf(stderr, "stream does not end\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if (got != exp) {
+		fprintf(stderr, "stream differs (%zu/%zu bytes)\n",
+		        got.size(), exp.size());
+		return EXIT_FAILURE;
+	}
+	if (count_entries(LOCAL_DISK_TMPDIR) != files ||
+	    count_entries("/proc/self/fd") != fds) {
+		fprintf(stderr, "producer created a file\n");
+		return EXIT_FAILURE;
+	}
+	if (ps->total_length() != 0 || ps->segs.size() != 0)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	return t_bigmsg();
+}
@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Cold content sync of a large folder: runs exmdb_server::get_content_sync
+ * on a generated private store and checks its output against the former
+ * scratch-SQLite diffing, which is timed alongside for comparison. (The
+ * latter is handed the rows directly, the former also scans the store.)
+ */
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <gromox/database.h>
+#include <gromox/dbop.h>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mapi_types.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/rop_util.hpp>
+#include <gromox/svc_common.h>
+#include <gromox/util.hpp>
+#include "../exch/exmdb_provider/db_engine.h"
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+namespace {
+struct row {
+	uint64_t mid, cn, size, dtime, mtime;
+	bool fai;
+};
+
+struct sync_result {
+	uint32_t fai_count = 0, normal_count = 0;
+	uint64_t fai_total = 0, normal_total = 0, last_cn = 0;
+	std::vector<uint64_t> chg, given, updated;
+};
+}
+
+static constexpr uint64_t bench_fid = PRIVATE_FID_INBOX;
+
+static std::vector<row> make_folder(size_t count)
+{
+	std::mt19937_64 rng(count);
+	std::vector<row> v;
+	v.reserve(count);
+	/* small time range, so that the ordered sync has to break ties */
+	for (size_t i = 0; i < count; ++i)
+		v.push_back(row{0x100000 + i, 0x200000 + i, rng() % 65536,
+		            rng() % 1000, rng() % 1000, i % 16 == 0});
+	/* change numbers are not in message_id order either */
+	std::shuffle(v.begin(), v.end(), rng);
+	for (size_t i = 0; i < count; ++i)
+		v[i].cn = 0x200000 + i;
+	return v;
+}
+
+static bool make_store(const std::string &dir, const std::vector<row> &folder)
+{
+	auto path = dir + "/exmdb";
+	if (mkdir(path.c_str(), 0777) != 0)
+		return false;
+	path += "/exchange.sqlite3";
+	sqlite3 *db = nullptr;
+	if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE |
+	    SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
+		return false;
+	auto ok = dbop_sqlite_create(db, sqlite_kind::pvt, 0) == 0;
+	if (ok) {
+		auto xa = gx_sql_begin_trans(db);
+		auto ins_msg = gx_sql_prep(db, "INSERT INTO messages (message_id,"
+		               " parent_fid, is_associated, change_number, message_size)"
+		               " VALUES (?, ?, ?, ?, ?)");
+		auto ins_prop = gx_sql_prep(db, "INSERT INTO message_properties"
+		                " (message_id, proptag, propval) VALUES (?, ?, ?)");
+		ok = ins_msg != nullptr && ins_prop != nullptr;
+		/* insert in message_id order; the scan must not rely on it */
+		auto sorted = folder;
+		std::sort(sorted.begin(), sorted.end(),
+			[](const row &a, const row &b) { return a.mid < b.mid; });
+		for (const auto &r : sorted) {
+			if (!ok)
+				break;
+			ins_msg.reset();
+			ins_msg.bind_int64(1, r.mid);
+			ins_msg.bind_int64(2, bench_fid);
+			ins_msg.bind_int64(3, r.fai);
+			ins_msg.bind_int64(4, r.cn);
+			ins_msg.bind_int64(5, r.size);
+			ok = ins_msg.step() == SQLITE_DONE;
+			for (auto [tag, val] : {std::pair{PR_MESSAGE_DELIVERY_TIME, r.dtime},
+			     std::pair{PR_LAST_MODIFICATION_TIME, r.mtime}}) {
+				ins_prop.reset();
+				ins_prop.bind_int64(1, r.mid);
+				ins_prop.bind_int64(2, tag);
+				ins_prop.bind_int64(3, val);
+				ok = ok && ins_prop.step() == SQLITE_DONE;
+			}
+		}
+		ins_msg.finalize();
+		ins_prop.finalize();
+		if (ok)
+			xa.commit();
+	}
+	sqlite3_close(db);
+	return ok;
+}
+
+/* The diffing as get_content_sync did it before, in a scratch database. */
+static bool run_sqlite(const std::vector<row> &folder, bool ordered,
+    sync_result &res)
+{
+	sqlite3 *db = nullptr;
+	if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
+		return false;
+	auto ok = gx_sql_exec(db, "CREATE TABLE existence (message_id INTEGER PRIMARY KEY)") == SQLITE_OK;
+	if (ok && ordered)
+		ok = gx_sql_exec(db, "CREATE TABLE changes (message_id INTEGER PRIMARY KEY, delivery_time INTEGER, mod_time INTEGER)") == SQLITE_OK &&
+		     gx_sql_exec(db, "CREATE INDEX idx_dtime ON changes (delivery_time)") == SQLITE_OK &&
+		     gx_sql_exec(db, "CREATE INDEX idx_mtime ON changes (mod_time)") == SQLITE_OK;
+	else if (ok)
+		ok = gx_sql_exec(db, "CREATE TABLE changes (message_id INTEGER PRIMARY KEY)") == SQLITE_OK;
+	if (ok) {
+		auto xa = gx_sql_begin_trans(db);
+		auto ins_ex = gx_sql_prep(db, "INSERT INTO existence VALUES (?)");
+		auto ins_chg = gx_sql_prep(db, ordered ?
+		               "INSERT INTO changes VALUES (?, ?, ?)" :
+		               "INSERT INTO changes VALUES (?)");
+		for (const auto &r : folder) {
+			sqlite3_reset(ins_ex);
+			sqlite3_bind_int64(ins_ex, 1, r.mid);
+			sqlite3_step(ins_ex);
+			sqlite3_reset(ins_chg);
+			sqlite3_bind_int64(ins_chg, 1, r.mid);
+			if (ordered) {
+				sqlite3_bind_int64(ins_chg, 2, r.dtime);
+				sqlite3_bind_int64(ins_chg, 3, r.mtime);
+			}
+			sqlite3_step(ins_chg);
+			if (r.fai) {
+				++res.fai_count;
+				res.fai_total += r.size;
+			} else {
+				++res.normal_count;
+				res.normal_total += r.size;
+			}
+			res.last_cn = std::max(res.last_cn, r.cn);
+		}
+		ins_ex.finalize();
+		ins_chg.finalize();
+		xa.commit();
+		/*
+		 * The old query left the order of equal times to SQLite; the
+		 * vector code defines it as ascending message_id.
+		 */
+		auto sel = gx_sql_prep(db, ordered ?
+		           "SELECT message_id FROM changes ORDER BY delivery_time DESC, mod_time DESC, message_id ASC" :
+		           "SELECT message_id FROM changes");
+		while (sqlite3_step(sel) == SQLITE_ROW)
+			res.chg.push_back(rop_util_make_eid_ex(1, sqlite3_column_int64(sel, 0)));
+		sel = gx_sql_prep(db, "SELECT message_id FROM existence ORDER BY message_id DESC");
+		while (sqlite3_step(sel) == SQLITE_ROW)
+			res.given.push_back(rop_util_make_eid_ex(1, sqlite3_column_int64(sel, 0)));
+	}
+	sqlite3_close(db);
+	res.last_cn = rop_util_make_eid_ex(1, res.last_cn);
+	return ok;
+}
+
+static bool run_exmdb(const char *dir, bool ordered, sync_result &res)
+{
+	idset given(false, REPL_TYPE_ID), seen(false, REPL_TYPE_ID), seen_fai(false, REPL_TYPE_ID);
+	EID_ARRAY updated{}, chg{}, given_mids{}, deleted{}, nolonger{}, read{}, unread{};
+	uint64_t last_readcn = 0;
+	exmdb_server::build_env(EM_PRIVATE, dir);
+	auto ok = exmdb_server::get_content_sync(dir, rop_util_make_eid_ex(1, bench_fid),
+	          nullptr, &given, &seen, &seen_fai, nullptr, CP_UTF8, nullptr,
+	          ordered, &res.fai_count, &res.fai_total, &res.normal_count,
+	          &res.normal_total, &updated, &chg, &res.last_cn, &given_mids,
+	          &deleted, &nolonger, &read, &unread, &last_readcn);
+	if (ok) {
+		res.chg.assign(chg.pids, chg.pids + chg.count);
+		res.given.assign(given_mids.pids, given_mids.pids + given_mids.count);
+		res.updated.assign(updated.pids, updated.pids + updated.count);
+		ok = deleted.count == 0 && nolonger.count == 0 &&
+		     read.count == 0 && unread.count == 0;
+	}
+	exmdb_server::free_env();
+	return ok;
+}
+
+static unsigned int bench_context_num() { return 1; }
+
+int main(int argc, char **argv)
+{
+	size_t count = argc >= 2 ? strtoull(argv[1], nullptr, 0) : 200000;
+	char dir[] = "/tmp/icsbench-XXXXXX";
+	if (mkdtemp(dir) == nullptr) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	auto folder = make_folder(count);
+	auto ret = EXIT_FAILURE;
+	setup_sigalrm();
+	get_context_num = bench_context_num;
+	db_engine_init(1, INT_MAX, false, false, 0, 0);
+	if (exmdb_server::run() != 0 || db_engine_run() != 0) {
+		fprintf(stderr, "exmdb setup failed\n");
+	} else if (!make_store(dir, folder)) {
+		fprintf(stderr, "store setup failed\n");
+	} else {
+		printf("%zu messages, cold sync\n", count);
+		ret = EXIT_SUCCESS;
+		for (bool ordered : {false, true}) {
+			sync_result r1, r2;
+			auto t0 = clk::now();
+			if (!run_sqlite(folder, ordered, r1)) {
+				fprintf(stderr, "sqlite diffing failed\n");
+				ret = EXIT_FAILURE;
+				break;
+			}
+			auto t1 = clk::now();
+			if (!run_exmdb(dir, ordered, r2)) {
+				fprintf(stderr, "get_content_sync failed\n");
+				ret = EXIT_FAILURE;
+				break;
+			}
+			auto t2 = clk::now();
+			printf("%-9s scratch sqlite: %6lld ms   get_content_sync: %6lld ms\n",
+			       ordered ? "ordered" : "unordered",
+			       static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count()),
+			       static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count()));
+			if (r1.chg != r2.chg || r1.given != r2.given ||
+			    !r2.updated.empty() || r1.last_cn != r2.last_cn ||
+			    r1.fai_count != r2.fai_count || r1.fai_total != r2.fai_total ||
+			    r1.normal_count != r2.normal_count ||
+			    r1.normal_total != r2.normal_total) {
+				fprintf(stderr, "%s result mismatch\n",
+				        ordered ? "ordered" : "unordered");
+				ret = EXIT_FAILURE;
+				break;
+			}
+		}
+	}
+	db_engine_stop();
+	auto path = std::string(dir) + "/exmdb/exchange.sqlite3";
+	unlink(path.c_str());
+	rmdir((std::string(dir) + "/exmdb").c_str());
+	rmdir(dir);
+	return ret;
+}
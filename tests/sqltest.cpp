@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Transaction nesting as used by the exmdb batch RPC: handlers open their
+ * own transactions inside the batch transaction, and rolling back the
+ * batch has to take their changes along.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <sqlite3.h>
+#include <gromox/database.h>
+#include <gromox/dbop.h>
+
+using namespace gromox;
+
+static int count_msgs(sqlite3 *db)
+{
+	auto stm = gx_sql_prep(db, "SELECT COUNT(*) FROM messages");
+	return stm != nullptr && stm.step() == SQLITE_ROW ? stm.col_int64(0) : -1;
+}
+
+/* what a create-message handler does, with its own transaction */
+static bool create_msg(sqlite3 *db, uint64_t mid)
+{
+	auto xact = gx_sql_begin_trans(db);
+	char q[192];
+	snprintf(q, sizeof(q), "INSERT INTO messages (message_id, parent_fid,"
+	         " is_associated, change_number, message_size)"
+	         " VALUES (%llu, 9, 0, %llu, 0)", static_cast<unsigned long long>(mid),
+	         static_cast<unsigned long long>(mid));
+	if (gx_sql_exec(db, q) != SQLITE_OK)
+		return false;
+	xact.commit();
+	return true;
+}
+
+static int t_batch_rollback(sqlite3 *db)
+{
+	/* what exmdb_parser_dispatch_batch does via db_engine_enter_batch */
+	gx_sql_set_batch_db(db);
+	{
+		auto batch = gx_sql_begin_trans(db);
+		if (!create_msg(db, 0x100) || count_msgs(db) != 1)
+			return printf("TB-1 failed\n");
+		if (sqlite3_get_autocommit(db))
+			return printf("TB-2 failed: inner commit ended the batch\n");
+		/* batch fails at a later sub-call: no commit */
+	}
+	if (count_msgs(db) != 0 || !sqlite3_get_autocommit(db))
+		return printf("TB-3 failed: batch rollback left the message\n");
+
+	{
+		auto batch = gx_sql_begin_trans(db);
+		if (!create_msg(db, 0x101))
+			return printf("TB-4 failed\n");
+		{
+			/* a handler which bails out rolls back only its own part */
+			auto xact = gx_sql_begin_trans(db);
+			gx_sql_exec(db, "DELETE FROM messages");
+		}
+		batch.commit();
+	}
+	if (count_msgs(db) != 1)
+		return printf("TB-5 failed\n");
+	gx_sql_set_batch_db(nullptr);
+
+	/* outside a batch, gx_sql_begin_trans keeps its plain BEGIN/COMMIT */
+	{
+		auto outer = gx_sql_begin_trans(db);
+		if (!create_msg(db, 0x102))
+			return printf("TB-6 failed\n");
+		if (!sqlite3_get_autocommit(db))
+			return printf("TB-7 failed: savepoint used outside a batch\n");
+	}
+	if (count_msgs(db) != 2)
+		return printf("TB-8 failed\n");
+	return 0;
+}
+
+int main()
+{
+	sqlite3 *db = nullptr;
+	if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE |
+	    SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
+		return EXIT_FAILURE;
+	int ret = dbop_sqlite_create(db, sqlite_kind::pvt, 0) == 0 ?
+	          t_batch_rollback(db) : printf("schema creation failed\n");
+	sqlite3_close(db);
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,8 +1,14 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2021–2022 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <latch>
+#include <thread>
+#include <vector>
 #include <libHX/string.h>
 #include <gromox/ext_buffer.hpp>
 #include <gromox/ical.hpp>
@@ -207,6 +213,46 @@ static void t_respool()
 	printf("%d\n", mt->zz);
 }
 
+/*
+ * Items idling in the magazines of other (still running) threads count
+ * against the limit, but must not make a get fail while they sit there.
+ */
+static int t_alloc_limiter()
+{
+	static constexpr unsigned int nthr = 64, max = 4096;
+	alloc_limiter<uint64_t> pool(max, "t_alloc_limiter");
+	std::latch parked(nthr), done(1);
+	std::vector<std::thread> thr;
+	for (unsigned int t = 0; t < nthr; ++t)
+		thr.emplace_back([&]() {
+			uint64_t *p[8];
+			for (auto &e : p)
+				e = pool.get();
+			for (auto e : p)
+				if (e != nullptr)
+					pool.put(e);
+			parked.count_down();
+			done.wait();
+		});
+	parked.wait();
+	std::vector<uint64_t *> all;
+	for (unsigned int i = 0; i < max; ++i)
+		all.push_back(pool.get());
+	bool failed = std::find(all.begin(), all.end(), nullptr) != all.end();
+	bool over = pool.get() != nullptr;
+	for (auto e : all)
+		if (e != nullptr)
+			pool.put(e);
+	done.count_down();
+	for (auto &t : thr)
+		t.join();
+	if (failed)
+		return printf("TA-1 failed: spurious nullptr from alloc_limiter\n");
+	if (over || pool.internals().allocated_num > max)
+		return printf("TA-2 failed: limit exceeded\n");
+	return 0;
+}
+
 static int t_cmp_binary()
 {
 	uint8_t x[] = "X", xy[] = "XY";
@@ -320,6 +366,79 @@ static int t_cmp_icaltime()
 	return 0;
 }
 
+/*
+ * skip_before must land where plain iteration does; after the target, both
+ * must also go on (and, for COUNT/UNTIL, end) in lockstep.
+ */
+static int t_rrule_skip()
+{
+	static constexpr const char *rules[][3][3] = {
+		{{"FREQ", "DAILY"}, {"INTERVAL", "3"}},
+		{{"FREQ", "WEEKLY"}, {"BYDAY", "TU", "TH"}},
+		{{"FREQ", "MONTHLY"}, {"BYMONTHDAY", "1", "20"}},
+		{{"FREQ", "YEARLY"}, {"BYMONTH", "3", "9"}},
+		{{"FREQ", "WEEKLY"}, {"BYDAY", "TU", "TH"}, {"COUNT", "500"}},
+		{{"FREQ", "YEARLY"}, {"BYMONTH", "1", "12"}, {"COUNT", "30"}},
+		{{"FREQ", "YEARLY"}, {"INTERVAL", "2"}, {"BYMONTH", "1", "12"}},
+		{{"FREQ", "MONTHLY"}, {"BYMONTHDAY", "3"}, {"UNTIL", "20200101T000000Z"}},
+	};
+	/* same, with COUNT=30 and UNTIL appended by the loop below */
+	static constexpr const char *limits[][2] = {
+		{nullptr, nullptr}, {"COUNT", "30"}, {"UNTIL", "20310101T000000Z"},
+	};
+	static constexpr int targets[] = {2016, 2024, 2040};
+	ICAL_TIME st{};
+	st.year = 2011; st.month = 1; st.day = 1; st.hour = 9;
+	time_t start;
+	ical_itime_to_utc(nullptr, st, &start);
+	for (const auto &rule : rules) {
+		for (const auto &lim : limits) {
+			ical_line line("RRULE");
+			bool limited = false;
+			for (const auto &r : rule) {
+				if (r[0] == nullptr)
+					continue;
+				limited |= strcmp(r[0], "COUNT") == 0 || strcmp(r[0], "UNTIL") == 0;
+				auto &v = line.append_value(r[0]);
+				for (size_t k = 1; k < 3 && r[k] != nullptr; ++k)
+					v.append_subval(r[k]);
+			}
+			if (lim[0] != nullptr) {
+				if (limited)
+					continue;
+				line.append_value(lim[0]).append_subval(lim[1]);
+			}
+			for (auto year : targets) {
+				ICAL_TIME target{};
+				target.year = year; target.month = 6; target.day = 15;
+				ICAL_RRULE a, b;
+				if (!ical_parse_rrule(nullptr, start, &line.value_list, &a) ||
+				    !ical_parse_rrule(nullptr, start, &line.value_list, &b))
+					return printf("TR-1 failed\n");
+				bool ma = true, mb = true;
+				while (a.instance_itime < target && (ma = a.iterate()))
+					/* */;
+				b.skip_before(target);
+				while (b.instance_itime < target && (mb = b.iterate()))
+					/* */;
+				for (unsigned int n = 0; n < 8; ++n) {
+					if (ma != mb ||
+					    a.instance_itime.twcompare(b.instance_itime) != 0 ||
+					    a.sequence() != b.sequence())
+						return printf("TR-2 failed (%s/%s/%s, %s, %d)\n",
+						       rule[0][1], rule[1][0], rule[1][1],
+						       znul(lim[0]), year);
+					if (!ma)
+						break;
+					ma = a.iterate();
+					mb = b.iterate();
+				}
+			}
+		}
+	}
+	return 0;
+}
+
 int main()
 {
 	char buf[2];
@@ -342,7 +461,10 @@ int main()
 			return ret;
 	}
 	t_respool();
-	auto ret = t_cmp_binary();
+	auto ret = t_alloc_limiter();
+	if (ret != 0)
+		return ret;
+	ret = t_cmp_binary();
 	if (ret != 0)
 		return ret;
 	ret = t_cmp_guid();
@@ -352,6 +474,9 @@ int main()
 	if (ret != 0)
 		return ret;
 	ret = t_cmp_icaltime();
+	if (ret != 0)
+		return ret;
+	ret = t_rrule_skip();
 	if (ret != 0)
 		return ret;
 	t_convert();
@@ -51,33 +51,20 @@ static bool discover_ids(sqlite3 *db, const std::string &query,
 	return true;
 }
 
-static bool discover_cids(const char *dir, std::vector<std::string> &used)
+static bool discover_cids(sqlite3 *db, std::vector<std::string> &used)
 {
 	used.clear();
-	std::unique_ptr<sqlite3, sql_del> db;
-	auto dbpath = dir + "/exmdb/exchange.sqlite3"s;
-	auto ret = sqlite3_open_v2(dbpath.c_str(), &unique_tie(db),
-	           SQLITE_OPEN_READWRITE, nullptr);
-	if (ret != SQLITE_OK) {
-		/*
-		 * Absence of this file could be seen as used={}. But the
-		 * absence would indicate a bigger issue elsewhere... Abort.
-		 */
-		fprintf(stderr, "Cannot open %s: %s\n", dbpath.c_str(), sqlite3_errstr(ret));
-		return false;
-	}
-
 	auto query = fmt::format("SELECT propval FROM message_properties "
 	             "WHERE proptag IN ({},{},{},{},{},{})",
 	             PR_TRANSPORT_MESSAGE_HEADERS,
 	             PR_TRANSPORT_MESSAGE_HEADERS_A,
 	             PR_BODY, PR_BODY_A, PR_HTML, PR_RTF_COMPRESSED);
-	if (!discover_ids(db.get(), query, used))
+	if (!discover_ids(db, query, used))
 		return false;
 	query = fmt::format("SELECT propval FROM attachment_properties "
 	        "WHERE proptag IN ({},{})",
 	        PR_ATTACH_DATA_BIN, PR_ATTACH_DATA_OBJ);
-	if (!discover_ids(db.get(), query, used))
+	if (!discover_ids(db, query, used))
 		return false;
 	return true;
 }
@@ -100,20 +87,31 @@ static bool discover_mids(const char *dir, std::vector<std::string> &used)
 	return discover_ids(db.get(), "SELECT mid_string FROM messages", used);
 }
 
-static uint64_t delete_unused_files(const std::string &cid_dir,
-    const std::vector<std::string> &used_ids, time_t upper_bound_ts)
+namespace {
+struct unused_file {
+	std::string name, id;
+	uint64_t size = 0;
+};
+}
+
+/*
+ * Collect the files of @dir that are neither in @used_ids nor modified after
+ * @upper_bound_ts.
+ */
+static bool find_unused_files(const std::string &dir,
+    const std::vector<std::string> &used_ids, time_t upper_bound_ts,
+    std::vector<unused_file> &out)
 {
-	std::unique_ptr<DIR, file_deleter> dh(opendir(cid_dir.c_str()));
+	out.clear();
+	std::unique_ptr<DIR, file_deleter> dh(opendir(dir.c_str()));
 	if (dh == nullptr) {
-		fprintf(stderr, "Cannot open %s: %s\n", cid_dir.c_str(), strerror(errno));
-		return UINT64_MAX;
+		fprintf(stderr, "Cannot open %s: %s\n", dir.c_str(), strerror(errno));
+		return false;
 	}
 
-	printf("Processing %s...\n", cid_dir.c_str());
+	printf("Processing %s...\n", dir.c_str());
 	struct dirent *de;
 	auto dfd = dirfd(dh.get());
-	uint64_t bytes = 0;
-	size_t filecount = 0;
 	while ((de = readdir(dh.get())) != nullptr) {
 		if (*de->d_name == '.')
 			continue;
@@ -136,41 +134,130 @@ static uint64_t delete_unused_files(const std::string &cid_dir,
 				printf("%s: too new to be considered in this run\n", de->d_name);
 			continue;
 		}
+		out.push_back({de->d_name, std::move(defix), static_cast<uint64_t>(sb.st_size)});
+	}
+	return true;
+}
+
+/*
+ * Remove the @files found in @dir, except those which have become referenced
+ * in the meantime according to @used_ids (nullptr: no recheck).
+ */
+static uint64_t remove_files(const std::string &dir,
+    const std::vector<unused_file> &files,
+    const std::vector<std::string> *used_ids = nullptr)
+{
+	uint64_t bytes = 0;
+	size_t filecount = 0;
+	for (const auto &f : files) {
+		if (used_ids != nullptr &&
+		    std::binary_search(used_ids->begin(), used_ids->end(), f.id)) {
+			if (g_verbose)
+				printf("%s: referenced again, keeping\n", f.name.c_str());
+			continue;
+		}
 		if (g_verbose) {
 			char buf[32];
-			HX_unit_size_cu(buf, arsizeof(buf), sb.st_size, 0);
-			printf("%s: removing... (%sB)\n", de->d_name, buf);
+			HX_unit_size_cu(buf, arsizeof(buf), f.size, 0);
+			printf("%s: removing... (%sB)\n", f.name.c_str(), buf);
 		}
+		auto path = dir + "/" + f.name;
 		if (g_dry_run) {
-			bytes += sb.st_size;
+			bytes += f.size;
 			++filecount;
-		} else if (unlinkat(dfd, de->d_name, 0) != 0) {
-			fprintf(stderr, "unlink(%s): %s\n", de->d_name, strerror(errno));
+		} else if (unlink(path.c_str()) != 0) {
+			fprintf(stderr, "unlink(%s): %s\n", path.c_str(), strerror(errno));
 		} else {
-			bytes += sb.st_size;
+			bytes += f.size;
 			++filecount;
 		}
 	}
 	char buf[32];
 	HX_unit_size(buf, arsizeof(buf), bytes, 0, 0);
-	printf("Purged %zu files (%sB) from %s\n", filecount, buf, cid_dir.c_str());
+	printf("Purged %zu files (%sB) from %s\n", filecount, buf, dir.c_str());
 	return bytes;
 }
 
+static uint64_t delete_unused_files(const std::string &dir,
+    const std::vector<std::string> &used_ids, time_t upper_bound_ts)
+{
+	std::vector<unused_file> files;
+	if (!find_unused_files(dir, used_ids, upper_bound_ts, files))
+		return UINT64_MAX;
+	return remove_files(dir, files);
+}
+
 static void sort_unique(std::vector<std::string> &c)
 {
 	std::sort(c.begin(), c.end());
 	c.erase(std::unique(c.begin(), c.end()), c.end());
 }
 
+/*
+ * The scan runs without holding any lock on the mailbox. A file that is
+ * unreferenced at that point can only gain a new reference through a
+ * single-instance lookup of its digest, so the candidates' digest rows are
+ * dropped in one short write transaction; exmdb performs the lookup and the
+ * reference write in one transaction, which fails on its stale snapshot if
+ * it raced with this. After the commit, no new reference to a candidate can
+ * come about, and reading the references once more gives the final answer.
+ */
 static bool clean_cid(const char *maildir, time_t upper_bound_ts)
 {
+	std::unique_ptr<sqlite3, sql_del> db;
+	auto dbpath = maildir + "/exmdb/exchange.sqlite3"s;
+	auto ret = sqlite3_open_v2(dbpath.c_str(), &unique_tie(db),
+	           SQLITE_OPEN_READWRITE, nullptr);
+	if (ret != SQLITE_OK) {
+		/*
+		 * Absence of this file could be seen as used={}. But the
+		 * absence would indicate a bigger issue elsewhere... Abort.
+		 */
+		fprintf(stderr, "Cannot open %s: %s\n", dbpath.c_str(), sqlite3_errstr(ret));
+		return false;
+	}
 	std::vector<std::string> used;
-	if (!discover_cids(maildir, used))
+	if (!discover_cids(db.get(), used))
+		return false;
+	sort_unique(used);
+	auto cid_dir = maildir + "/cid"s;
+	std::vector<unused_file> files;
+	if (!find_unused_files(cid_dir, used, upper_bound_ts, files))
+		return false;
+	/* mailboxes older than schema EV-8/EB-7 have no digest table */
+	if (g_dry_run || files.empty() ||
+	    sqlite3_table_column_metadata(db.get(), nullptr, "cid_hashes",
+	    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr) != SQLITE_OK)
+		return remove_files(cid_dir, files) != UINT64_MAX;
+
+	/* wait for exmdb's writers rather than give up */
+	sqlite3_busy_timeout(db.get(), 60000);
+	if (gx_sql_exec(db.get(), "BEGIN IMMEDIATE") != SQLITE_OK)
+		return false;
+	xtransaction xact(db.get());
+	auto forget = gx_sql_prep(db.get(), "DELETE FROM cid_hashes WHERE cid=?");
+	if (forget == nullptr)
+		return false;
+	for (const auto &f : files) {
+		sqlite3_reset(forget);
+		sqlite3_bind_text(forget, 1, f.id.c_str(), -1, SQLITE_STATIC);
+		if (sqlite3_step(forget) != SQLITE_DONE) {
+			fprintf(stderr, "%s: cannot drop digest entries\n", dbpath.c_str());
+			return false;
+		}
+	}
+	forget.finalize();
+	xact.commit();
+	if (!sqlite3_get_autocommit(db.get())) {
+		fprintf(stderr, "%s: cannot commit: %s\n", dbpath.c_str(),
+		        sqlite3_errmsg(db.get()));
+		gx_sql_exec(db.get(), "ROLLBACK");
+		return false;
+	}
+	if (!discover_cids(db.get(), used))
 		return false;
 	sort_unique(used);
-	return delete_unused_files(maildir + "/cid"s,
-	       std::move(used), upper_bound_ts) < UINT64_MAX;
+	return remove_files(cid_dir, files, &used) != UINT64_MAX;
 }
 
 static bool clean_mid(const char *maildir, time_t upper_bound_ts)
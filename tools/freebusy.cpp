@@ -319,6 +319,9 @@ static BOOL find_recurrence_times(ical_component &tzcom,
 	    apr, &irrule))
 		return FALSE;	
 	plist.clear();
+	ICAL_TIME itime_start;
+	if (ical_utc_to_datetime(&tzcom, start_time, &itime_start))
+		irrule.skip_before(itime_start);
 	do {
 		auto itime = irrule.instance_itime;
 		ical_itime_to_utc(&tzcom, itime, &tmp_time);
@@ -8,12 +8,16 @@
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <functional>
 #include <list>
 #include <mutex>
 #include <netdb.h>
 #include <pthread.h>
+#include <queue>
 #include <string>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <libHX/io.h>
@@ -79,7 +83,14 @@ static int g_list_fd = -1;
 static std::string g_list_path;
 static std::vector<std::string> g_acl_list;
 static std::list<CONNECTION_NODE> g_connection_list, g_connection_list1;
-static std::list<TIMER> g_exec_list;
+/*
+ * Pending timers are owned by g_exec_map (keyed by id, for CANCEL); g_exec_heap
+ * orders them by execution time. Cancelled timers leave a stale heap entry
+ * behind, which is skipped when it surfaces (or dropped by a rebuild).
+ */
+using heap_entry = std::pair<time_t, int>;
+static std::unordered_map<int, TIMER> g_exec_map;
+static std::priority_queue<heap_entry, std::vector<heap_entry>, std::greater<heap_entry>> g_exec_heap;
 static std::mutex g_list_lock, g_connection_lock, g_cond_mutex;
 static std::condition_variable g_waken_cond;
 static char *opt_config_file;
@@ -141,6 +152,27 @@ ssize_t CONNECTION_NODE::sk_write(const char *s, size_t z)
 	return ret;
 }
 
+/**
+ * Lines with exectime 0 record a timer that was run or cancelled. Clear the
+ * exectime of the original ADD line of such timers as well, so that only the
+ * pending ones are left with a non-zero exectime.
+ */
+static void drop_finished(srcitem *pitem, size_t item_num)
+{
+	std::unordered_set<int> done;
+	try {
+		for (size_t i = 0; i < item_num; ++i)
+			if (pitem[i].exectime == 0)
+				done.insert(pitem[i].tid);
+	} catch (const std::bad_alloc &) {
+		fprintf(stderr, "E-2816: ENOMEM\n");
+		return;
+	}
+	for (size_t i = 0; i < item_num; ++i)
+		if (pitem[i].exectime != 0 && done.count(pitem[i].tid) > 0)
+			pitem[i].exectime = 0;
+}
+
 static void save_timers(time_t &last_cltime, const time_t &cur_time)
 {
 	close(g_list_fd);
@@ -153,18 +185,7 @@ static void save_timers(time_t &last_cltime, const time_t &cur_time)
 	}
 	auto item_num = pfile->get_size();
 	auto pitem = static_cast<srcitem *>(pfile->get_list());
-	for (size_t i = 0; i < item_num; ++i) {
-		if (pitem[i].exectime != 0)
-			continue;
-		for (size_t j = 0; j < item_num; ++j) {
-			if (i == j)
-				continue;
-			if (pitem[i].tid == pitem[j].tid) {
-				pitem[j].exectime = 0;
-				break;
-			}
-		}
-	}
+	drop_finished(pitem, item_num);
 	auto temp_path = g_list_path + ".tmp";
 	auto temp_fd = open(temp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, DEF_MODE);
 	if (temp_fd >= 0) {
@@ -195,18 +216,54 @@ static void save_timers(time_t &last_cltime, const time_t &cur_time)
 		fprintf(stderr, "open %s: %s\n", g_list_path.c_str(), strerror(errno));
 }
 
+/* Throws std::bad_alloc */
 static TIMER *put_timer(TIMER &&ptimer)
 {
-	for (auto pos = g_exec_list.begin(); pos != g_exec_list.end(); ++pos) {
-		if (pos->exec_time <= ptimer.exec_time)
-			continue;
-		std::list<TIMER> stash;
-		stash.push_back(std::move(ptimer));
-		g_exec_list.splice(pos, stash, stash.begin());
-		return &*pos;
+	auto t_id = ptimer.t_id;
+	auto exec_time = ptimer.exec_time;
+	auto it = g_exec_map.insert_or_assign(t_id, std::move(ptimer)).first;
+	try {
+		g_exec_heap.emplace(exec_time, t_id);
+	} catch (const std::bad_alloc &) {
+		g_exec_map.erase(it);
+		throw;
+	}
+	return &it->second;
+}
+
+static bool cancel_timer(int t_id)
+{
+	if (g_exec_map.erase(t_id) == 0)
+		return false;
+	/* Rebuild the heap once stale entries make up the majority of it */
+	if (g_exec_heap.size() > 2 * g_exec_map.size() + 1024) try {
+		std::vector<heap_entry> v;
+		v.reserve(g_exec_map.size());
+		for (const auto &[id, tmr] : g_exec_map)
+			v.emplace_back(tmr.exec_time, id);
+		g_exec_heap = decltype(g_exec_heap)(std::greater<heap_entry>(), std::move(v));
+	} catch (const std::bad_alloc &) {
+		/* keep the stale entries for now */
 	}
-	g_exec_list.push_back(std::move(ptimer));
-	return &g_exec_list.back();
+	return true;
+}
+
+/* Remove and return the earliest timer that is due, if any */
+static bool pop_due_timer(time_t cur_time, TIMER &out)
+{
+	while (!g_exec_heap.empty()) {
+		auto [exec_time, t_id] = g_exec_heap.top();
+		if (exec_time > cur_time)
+			return false;
+		g_exec_heap.pop();
+		auto it = g_exec_map.find(t_id);
+		if (it == g_exec_map.end() || it->second.exec_time != exec_time)
+			continue; /* cancelled */
+		out = std::move(it->second);
+		g_exec_map.erase(it);
+		return true;
+	}
+	return false;
 }
 
 int main(int argc, const char **argv) try
@@ -265,18 +322,7 @@ int main(int argc, const char **argv) try
 
 	auto item_num = pfile->get_size();
 	auto pitem = static_cast<srcitem *>(pfile->get_list());
-	for (size_t i = 0; i < item_num; ++i) {
-		if (pitem[i].exectime != 0)
-			continue;
-		for (size_t j = 0; j < item_num; ++j) {
-			if (i == j)
-				continue;
-			if (pitem[i].tid == pitem[j].tid) {
-				pitem[j].exectime = 0;
-				break;
-			}
-		}
-	}
+	drop_finished(pitem, item_num);
 
 	time(&cur_time);
 
@@ -362,13 +408,9 @@ int main(int argc, const char **argv) try
 	while (!g_notify_stop) {
 		std::unique_lock li_hold(g_list_lock);
 		time(&cur_time);
-		for (auto ptimer = g_exec_list.begin(); ptimer != g_exec_list.end(); ) {
-			if (ptimer->exec_time > cur_time)
-				break;
-			std::list<TIMER> stash;
-			stash.splice(stash.end(), g_exec_list, ptimer++);
-			execute_timer(&stash.front());
-		}
+		TIMER tmr;
+		while (pop_due_timer(cur_time, tmr))
+			execute_timer(&tmr);
 
 		if (cur_time - last_cltime > 7 * 86400)
 			save_timers(last_cltime, cur_time);
@@ -505,19 +547,12 @@ static void *tmr_thrwork(void *param)
 				pconnection->sk_write("FALSE 1\r\n");
 				continue;
 			}
-			bool removed_timer = false;
 			std::unique_lock li_hold(g_list_lock);
-			for (auto pos = g_exec_list.begin(); pos != g_exec_list.end(); ++pos) {
-				auto ptimer = &*pos;
-				if (t_id == ptimer->t_id) {
-					temp_len = sprintf(temp_line, "%d\t0\tCANCEL\n",
-								ptimer->t_id);
-					g_exec_list.erase(pos);
-					removed_timer = true;
-					if (HXio_fullwrite(g_list_fd, temp_line, temp_len) != temp_len)
-						fprintf(stderr, "write to timerlist: %s\n", strerror(errno));
-					break;
-				}
+			bool removed_timer = cancel_timer(t_id);
+			if (removed_timer) {
+				temp_len = sprintf(temp_line, "%d\t0\tCANCEL\n", t_id);
+				if (HXio_fullwrite(g_list_fd, temp_line, temp_len) != temp_len)
+					fprintf(stderr, "write to timerlist: %s\n", strerror(errno));
 			}
 			li_hold.unlock();
 			pconnection->sk_write(removed_timer ? "TRUE\r\n" : "FALSE\r\n");
@@ -547,7 +582,15 @@ static void *tmr_thrwork(void *param)
 			}
 
 			std::unique_lock li_hold(g_list_lock);
-			auto ptimer = put_timer(std::move(tmr));
+			auto t_id = tmr.t_id;
+			TIMER *ptimer;
+			try {
+				ptimer = put_timer(std::move(tmr));
+			} catch (const std::bad_alloc &) {
+				li_hold.unlock();
+				pconnection->sk_write("FALSE 3\r\n");
+				continue;
+			}
 
 			temp_len = sprintf(temp_line, "%d\t%lld\t", ptimer->t_id,
 			           static_cast<long long>(ptimer->exec_time));
@@ -558,7 +601,7 @@ static void *tmr_thrwork(void *param)
 			if (HXio_fullwrite(g_list_fd, temp_line, temp_len) != temp_len)
 				fprintf(stderr, "write to timerlist: %s\n", strerror(errno));
 			li_hold.unlock();
-			temp_len = sprintf(temp_line, "TRUE %d\r\n", ptimer->t_id);
+			temp_len = sprintf(temp_line, "TRUE %d\r\n", t_id);
 			pconnection->sk_write(temp_line, temp_len);
 		} else if (0 == strcasecmp(pconnection->line, "QUIT")) {
 			pconnection->sk_write("BYE\r\n");